@@ -0,0 +1,173 @@
+/**
+ *
+ * @file    chash_bench
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-07-12 10:31:46
+ *
+ * Benchmark of chash_t shared by threads, which look up random keys and put
+ * some of them. It runs with 1 to max threads, doubling each time, for each of:
+ *  one lock: a single shard with a reader-writer lock, as a hash_t guarded by
+ *      one lock would be.
+ *  rwlock: CHASH_DEFAULT_SHARDS shards with reader-writer locks.
+ *  read mostly: CHASH_DEFAULT_SHARDS shards of CHASH_MODE_READ_MOSTLY.
+ *
+ * Usage: ./chash_bench [-n keys] [-r percent of gets] [-d ms per run]
+ *      [-t max threads]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "chash.h"
+#include "common.h"
+
+#define DEFAULT_KEYS        100000
+#define DEFAULT_GET_PERCENT 95
+#define DEFAULT_MS          1000
+#define DEFAULT_MAX_THREADS 32
+#define KEY_LEN             24
+
+typedef struct {
+    pthread_t   tid;
+    chash_t     *m;
+    int         id;
+    long long   ops;
+    long long   misses;
+} __attribute__((aligned(64))) bench_thread_t;
+
+static char     *keys;
+static int      key_count = DEFAULT_KEYS;
+static int      get_percent = DEFAULT_GET_PERCENT;
+static int      running;
+
+static long long now_us() {
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// xorshift, so threads don't share the state of rand()
+static inline unsigned int next_rand(unsigned int *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 17;
+    *x ^= *x << 5;
+
+    return *x;
+}
+
+static void* bench_run(void *arg) {
+    bench_thread_t  *t;
+    unsigned int    x;
+    const char      *k;
+    long long       ops, misses;
+
+    t = (bench_thread_t *)arg;
+    x = t->id * 2654435761u + 1;
+    ops = misses = 0;
+    while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+        k = keys + (size_t)(next_rand(&x) % key_count) * KEY_LEN;
+        if ((int)(next_rand(&x) % 100) < get_percent) {
+            misses += !chash_get(t->m, k, NULL, NULL);
+        } else {
+            chash_put(t->m, k, k);
+        }
+        ops++;
+    }
+    t->ops = ops;
+    t->misses = misses;
+
+    return NULL;
+}
+
+static double bench(chash_t *m, int threads, int ms) {
+    bench_thread_t  *ts;
+    long long       start, ops, misses;
+
+    ts = calloc(threads, sizeof(bench_thread_t));
+    running = 1;
+    start = now_us();
+    for (int i = 0; i < threads; i++) {
+        ts[i].m = m;
+        ts[i].id = i;
+        pthread_create(&ts[i].tid, NULL, bench_run, &ts[i]);
+    }
+
+    usleep(ms * 1000);
+    __atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+
+    ops = misses = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(ts[i].tid, NULL);
+        ops += ts[i].ops;
+        misses += ts[i].misses;
+    }
+    start = now_us() - start;
+    free(ts);
+
+    if (misses != 0) {
+        fprintf(stderr, "%lld lookups missed keys put\n", misses);
+    }
+
+    return (double)ops / start;
+}
+
+int main(int argc, char *argv[]) {
+    chash_t     *m;
+    int         opt, ms, max_threads;
+    const char  *names[] = {"one lock", "rwlock", "read mostly"};
+    int         shards[] = {1, CHASH_DEFAULT_SHARDS, CHASH_DEFAULT_SHARDS};
+    int         modes[] = {CHASH_MODE_RWLOCK, CHASH_MODE_RWLOCK, CHASH_MODE_READ_MOSTLY};
+
+    ms = DEFAULT_MS;
+    max_threads = DEFAULT_MAX_THREADS;
+    while ((opt = getopt(argc, argv, "n:r:d:t:")) != -1) {
+        switch (opt) {
+        case 'n': key_count = atoi(optarg); break;
+        case 'r': get_percent = atoi(optarg); break;
+        case 'd': ms = atoi(optarg); break;
+        case 't': max_threads = atoi(optarg); break;
+        default:
+            fprintf(stderr, "USAGE: %s [-n keys] [-r percent of gets] [-d ms per run] "
+                    "[-t max threads]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    keys = malloc((size_t)key_count * KEY_LEN);
+    for (int i = 0; i < key_count; i++) {
+        snprintf(keys + (size_t)i * KEY_LEN, KEY_LEN, "user:%d:session", i);
+    }
+
+    printf("keys: %d, gets: %d%%, cpus: %ld, Mops/s by threads\n", key_count, get_percent,
+            sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-12s", "threads");
+    for (int t = 1; t <= max_threads; t *= 2) {
+        printf("%8d", t);
+    }
+    printf("\n");
+
+    for (int i = 0; i < 3; i++) {
+        m = chash_str_key_create(NULL, NULL, shards[i], modes[i]);
+        for (int k = 0; k < key_count; k++) {
+            chash_put(m, keys + (size_t)k * KEY_LEN, keys + (size_t)k * KEY_LEN);
+        }
+
+        printf("%-12s", names[i]);
+        for (int t = 1; t <= max_threads; t *= 2) {
+            printf("%8.2f", bench(m, t, ms));
+            fflush(stdout);
+        }
+        printf("\n");
+
+        chash_destroy(m);
+    }
+
+    free(keys);
+
+    return 0;
+}
@@ -0,0 +1,312 @@
+/**
+ *
+ * @file    churn
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-07-05 14:12:27
+ *
+ * Benchmark of connection churn, which compares allocators chosen by MALLOC at
+ * build time. An echo server of length-prefixed frames runs in a child process,
+ * and client threads connect, send a few requests, and disconnect, over and
+ * over. Each connection creates and destroys a client with its buffers, so the
+ * allocator is stressed by large blocks coming and going, besides the small
+ * objects of requests.
+ *
+ * Throughput is reported with the peak RSS of the server, and the RSS a while
+ * after the churn stops, which shows the memory the allocator keeps.
+ *
+ * Usage: ./churn [-p port] [-t ioworkers] [-c client threads] [-d seconds]
+ *      [-n requests per connection] [-s payload bytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "octopus.h"
+#include "logging.h"
+#include "common.h"
+
+#define DEFAULT_PORT        "18090"
+#define DEFAULT_IOWORKERS   2
+#define DEFAULT_CLIENTS     8
+#define DEFAULT_SECONDS     5
+#define DEFAULT_REQUESTS    8
+#define DEFAULT_PAYLOAD     128
+// the server is given the time to release memory after the churn
+#define SETTLE_MS           1000
+
+typedef struct {
+    pthread_t   tid;
+    long long   connections;
+    long long   requests;
+    int         failed;
+} churner_t;
+
+static const char   *port = DEFAULT_PORT;
+static int          requests_per_conn = DEFAULT_REQUESTS;
+static int          payload_len = DEFAULT_PAYLOAD;
+static long long    deadline_ms;
+
+static long long now_ms() {
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static object_t* echo_process(processor_t *processor, object_t *cmd_obj) {
+    OCTOPUS_NOT_USED(processor);
+
+    cmd_obj->incr(cmd_obj);
+
+    return cmd_obj;
+}
+
+static void echo_processor_destroy(processor_t *processor) {
+    free(processor);
+}
+
+static processor_t* echo_processor_create() {
+    processor_t     *p;
+
+    if ((p = calloc(1, sizeof(processor_t))) == NULL) {
+        return NULL;
+    }
+    p->process = echo_process;
+    p->destroy = echo_processor_destroy;
+
+    return p;
+}
+
+static void serve(int ioworkers) {
+    octopus_t   *oct;
+
+    octopus_set_log_level(OCTOPUS_LOGGING_LEVEL_WARNING);
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((oct = octopus_create()) == NULL) {
+        exit(1);
+    }
+    octopus_set_ioworker_count(oct, ioworkers);
+    if (octopus_register_processor_factory_with_scope(oct, OCTOPUS_PROTOCOL_LENPREFIX,
+                echo_processor_create, OCTOPUS_PROCESSOR_SCOPE_IOWORKER) == OCTOPUS_ERR) {
+        exit(1);
+    }
+    octopus_add_listening_socket(oct, "127.0.0.1", port, OCTOPUS_PROTOCOL_LENPREFIX);
+    octopus_srv_start(oct);
+
+    exit(1);
+}
+
+// Ports in TIME_WAIT are reused by connect(2) on loopback, as tcp_tw_reuse is
+// 2 by default, so the client side doesn't run out of ports.
+static int churn_connect(struct addrinfo *addr) {
+    int     fd, on;
+
+    if ((fd = socket(addr->ai_family, SOCK_STREAM, 0)) == -1) {
+        return -1;
+    }
+
+    on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int read_full(int fd, char *buf, int len) {
+    int     n;
+
+    for (; len > 0; buf += n, len -= n) {
+        if ((n = read(fd, buf, len)) <= 0) {
+            return OCTOPUS_ERR;
+        }
+    }
+
+    return OCTOPUS_OK;
+}
+
+static void* churn(void *arg) {
+    churner_t       *c;
+    struct addrinfo hints, *addr;
+    char            *frame, *reply;
+    int             fd, frame_len;
+
+    c = (churner_t *)arg;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo("127.0.0.1", port, &hints, &addr) != 0) {
+        c->failed = 1;
+        return NULL;
+    }
+
+    frame_len = LENPREFIX_HEADER_LEN + payload_len;
+    frame = malloc(frame_len);
+    reply = malloc(frame_len);
+    frame[0] = payload_len & 0xff;
+    frame[1] = (payload_len >> 8) & 0xff;
+    frame[2] = (payload_len >> 16) & 0xff;
+    frame[3] = (payload_len >> 24) & 0xff;
+    memset(frame + LENPREFIX_HEADER_LEN, 'x', payload_len);
+
+    while (now_ms() < deadline_ms) {
+        if ((fd = churn_connect(addr)) == -1) {
+            c->failed = 1;
+            break;
+        }
+
+        for (int i = 0; i < requests_per_conn; i++) {
+            if (write(fd, frame, frame_len) != frame_len ||
+                    read_full(fd, reply, frame_len) == OCTOPUS_ERR) {
+                c->failed = 1;
+                break;
+            }
+            c->requests++;
+        }
+        close(fd);
+
+        if (c->failed) {
+            break;
+        }
+        c->connections++;
+    }
+
+    free(frame);
+    free(reply);
+    freeaddrinfo(addr);
+
+    return NULL;
+}
+
+/**
+ * Read a field of /proc/<pid>/status in kilobytes, e.g. VmRSS or VmHWM.
+ */
+static long long proc_status_kb(pid_t pid, const char *field) {
+    char        path[64], line[256];
+    FILE        *fp;
+    long long   kb;
+    int         len;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return -1;
+    }
+
+    kb = -1;
+    len = strlen(field);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            kb = atoll(line + len + 1);
+            break;
+        }
+    }
+    fclose(fp);
+
+    return kb;
+}
+
+static int server_wait_ready() {
+    struct addrinfo hints, *addr;
+    int             fd;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo("127.0.0.1", port, &hints, &addr) != 0) {
+        return OCTOPUS_ERR;
+    }
+
+    for (int i = 0; i < 100; i++) {
+        if ((fd = churn_connect(addr)) != -1) {
+            close(fd);
+            freeaddrinfo(addr);
+            return OCTOPUS_OK;
+        }
+        usleep(20 * 1000);
+    }
+    freeaddrinfo(addr);
+
+    return OCTOPUS_ERR;
+}
+
+int main(int argc, char *argv[]) {
+    churner_t   *churners;
+    long long   start_ms, elapsed_ms, connections, requests, rss_idle_kb;
+    int         opt, ioworkers, clients, seconds, failed, status;
+    pid_t       server;
+
+    ioworkers = DEFAULT_IOWORKERS;
+    clients = DEFAULT_CLIENTS;
+    seconds = DEFAULT_SECONDS;
+    while ((opt = getopt(argc, argv, "p:t:c:d:n:s:")) != -1) {
+        switch (opt) {
+        case 'p': port = optarg; break;
+        case 't': ioworkers = atoi(optarg); break;
+        case 'c': clients = atoi(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 'n': requests_per_conn = atoi(optarg); break;
+        case 's': payload_len = atoi(optarg); break;
+        default:
+            fprintf(stderr, "USAGE: %s [-p port] [-t ioworkers] [-c client threads] "
+                    "[-d seconds] [-n requests per connection] [-s payload bytes]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if ((server = fork()) == 0) {
+        serve(ioworkers);
+    }
+
+    if (server_wait_ready() == OCTOPUS_ERR) {
+        fprintf(stderr, "server isn't ready on port %s\n", port);
+        kill(server, SIGKILL);
+        return 1;
+    }
+
+    churners = calloc(clients, sizeof(churner_t));
+    start_ms = now_ms();
+    deadline_ms = start_ms + seconds * 1000LL;
+    for (int i = 0; i < clients; i++) {
+        pthread_create(&churners[i].tid, NULL, churn, &churners[i]);
+    }
+
+    connections = requests = 0;
+    failed = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(churners[i].tid, NULL);
+        connections += churners[i].connections;
+        requests += churners[i].requests;
+        failed |= churners[i].failed;
+    }
+    elapsed_ms = now_ms() - start_ms;
+
+    usleep(SETTLE_MS * 1000);
+    rss_idle_kb = proc_status_kb(server, "VmRSS");
+
+    printf("malloc: %s, ioworkers: %d, clients: %d, requests per connection: %d, "
+            "payload: %d\n", octopus_malloc_name(), ioworkers, clients, requests_per_conn,
+            payload_len);
+    printf("%.0f connections/s, %.0f requests/s, peak rss: %lld KB, rss after churn: %lld KB%s\n",
+            connections * 1000.0 / elapsed_ms, requests * 1000.0 / elapsed_ms,
+            proc_status_kb(server, "VmHWM"), rss_idle_kb, failed ? ", some requests failed" : "");
+
+    kill(server, SIGKILL);
+    waitpid(server, &status, 0);
+    free(churners);
+
+    return failed;
+}
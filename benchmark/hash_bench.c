@@ -0,0 +1,97 @@
+/**
+ *
+ * @file    hash_bench
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-07-09 10:42:51
+ *
+ * Benchmark of hash_t with string keys, as the keyspace and registries use it.
+ * For each size, keys are put into an empty hash, then looked up, looked up
+ * with keys absent, and removed. The slowest single put is reported besides
+ * the average, since a resize pauses the put which triggers it.
+ *
+ * Usage: ./hash_bench [max keys]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hash.h"
+#include "common.h"
+
+#define DEFAULT_MAX_KEYS    1000000
+#define KEY_LEN             24
+
+static long long now_ns() {
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void bench(char *keys, char *absent, int n) {
+    hash_t      *h;
+    long long   start, t, put_max, put_ns, hit_ns, miss_ns, remove_ns;
+    int         found;
+
+    h = hash_str_key_create(NULL, NULL);
+
+    put_max = 0;
+    start = now_ns();
+    for (int i = 0; i < n; i++) {
+        t = now_ns();
+        hash_put(h, keys + i * KEY_LEN, keys + i * KEY_LEN);
+        t = now_ns() - t;
+        put_max = t > put_max ? t : put_max;
+    }
+    put_ns = now_ns() - start;
+
+    found = 0;
+    start = now_ns();
+    for (int i = 0; i < n; i++) {
+        found += hash_get(h, keys + (long long)i * 7919 % n * KEY_LEN) != NULL;
+    }
+    hit_ns = now_ns() - start;
+
+    start = now_ns();
+    for (int i = 0; i < n; i++) {
+        found -= hash_get(h, absent + i * KEY_LEN) != NULL;
+    }
+    miss_ns = now_ns() - start;
+
+    start = now_ns();
+    for (int i = 0; i < n; i++) {
+        hash_remove(h, keys + i * KEY_LEN);
+    }
+    remove_ns = now_ns() - start;
+
+    printf("%8d keys: put %6.1f ns (max %8.1f us), get hit %6.1f ns, get miss %6.1f ns, "
+            "remove %6.1f ns%s\n", n, (double)put_ns / n, put_max / 1000.0, (double)hit_ns / n,
+            (double)miss_ns / n, (double)remove_ns / n,
+            found != n || hash_size(h) != 0 ? ", WRONG RESULTS" : "");
+
+    hash_destroy(h);
+}
+
+int main(int argc, char *argv[]) {
+    char    *keys, *absent;
+    int     max_keys;
+
+    max_keys = argc > 1 ? atoi(argv[1]) : DEFAULT_MAX_KEYS;
+
+    keys = malloc((size_t)max_keys * KEY_LEN);
+    absent = malloc((size_t)max_keys * KEY_LEN);
+    for (int i = 0; i < max_keys; i++) {
+        snprintf(keys + (size_t)i * KEY_LEN, KEY_LEN, "user:%d:session", i);
+        snprintf(absent + (size_t)i * KEY_LEN, KEY_LEN, "user:%d:profile", i);
+    }
+
+    for (int n = 1000; n <= max_keys; n *= 10) {
+        bench(keys, absent, n);
+    }
+
+    free(keys);
+    free(absent);
+
+    return 0;
+}
@@ -10,13 +10,33 @@
 #include <string.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 
 #include "common.h"
 #include "buffer.h"
 #include "logging.h"
+#include "memory.h"
 
-#define buffer_produce(b, nbytes)       (b)->end = ((b)->end + nbytes) % (b)->size
-#define buffer_consume(b, nbytes)       (b)->start = ((b)->start + nbytes) % (b)->size
+#define buffer_produce(b, nbytes)   \
+    ((b)->produced += (nbytes), (b)->end = ((b)->end + (nbytes)) % (b)->size)
+#define buffer_consume(b, nbytes)   \
+    ((b)->consumed += (nbytes), (b)->start = ((b)->start + (nbytes)) % (b)->size)
+
+// max count of iovec passed to writev at a time
+#define BUFFER_IOV_MAX  64
+
+/**
+ * A ref attached to the buffer. It will be emitted after the inline bytes before
+ * 'mark' have been written.
+ */
+typedef struct {
+    long long   mark;
+    int         sent;
+    bufref_t    *ref;
+} buffer_seg_t;
 
 typedef struct buffer_iterator_s {
     void* (*next)(void *iter);
@@ -30,18 +50,19 @@ typedef struct buffer_iterator_s {
 buffer_t* buffer_create(int size) {
     buffer_t    *buf;
 
-    buf = malloc(sizeof(buffer_t));
+    buf = octopus_malloc(sizeof(buffer_t), OCTOPUS_MEM_BUFFER);
     if (buf == NULL) {
         OCTOPUS_ERROR_LOG("failed to alloc mem for buffer_t");
         return NULL;
     }
     bzero(buf, sizeof(buffer_t));
     buf->size = size;
+    buf->max_size = size;
 
-    buf->buf = malloc(size);
+    buf->buf = octopus_malloc(size, OCTOPUS_MEM_BUFFER);
     if (buf->buf == NULL) {
         OCTOPUS_ERROR_LOG("failed to alloc mem for buffer");
-        free(buf);
+        octopus_free(buf);
         return NULL;
     }
 
@@ -56,6 +77,74 @@ static inline bool space_is_continuous(buffer_t *buf, int size) {
     return buf->start - buf->end > size;
 }
 
+static inline bool content_is_continuous(buffer_t *buf, int size) {
+    return buf->start + size <= buf->size;
+}
+
+void buffer_set_max_size(buffer_t *buf, int max_size) {
+    buf->max_size = max_size > buf->size ? max_size : buf->size;
+}
+
+/**
+ * Move the content to new memory of 'size' bytes, which must hold it. Absolute
+ * positions are kept, so refs attached stay in place.
+ */
+static int buffer_resize(buffer_t *buf, int size) {
+    char    *b;
+    int     content_len, first_part_len;
+
+    if ((b = octopus_malloc(size, OCTOPUS_MEM_BUFFER)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem to resize buffer, size: %d", size);
+        return OCTOPUS_ERR;
+    }
+
+    // content is moved to the front
+    content_len = buffer_content_len(buf);
+    if (content_is_continuous(buf, content_len)) {
+        memcpy(b, buf->buf + buf->start, content_len);
+    } else {
+        first_part_len = buf->size - buf->start;
+        memcpy(b, buf->buf + buf->start, first_part_len);
+        memcpy(b + first_part_len, buf->buf, content_len - first_part_len);
+    }
+
+    octopus_free(buf->buf);
+    buf->buf = b;
+    buf->size = size;
+    buf->start = 0;
+    buf->end = content_len;
+
+    return OCTOPUS_OK;
+}
+
+int buffer_reserve(buffer_t *buf, int len) {
+    int     size, content_len;
+
+    if (buffer_space_remaining(buf) >= len) {
+        return OCTOPUS_OK;
+    }
+
+    content_len = buffer_content_len(buf);
+    size = buf->size;
+    while (size - 1 - content_len < len && size < buf->max_size) {
+        size = size > buf->max_size / 2 ? buf->max_size : size * 2;
+    }
+
+    if (size - 1 - content_len < len) {
+        return OCTOPUS_ERR;
+    }
+
+    return buffer_resize(buf, size);
+}
+
+int buffer_shrink(buffer_t *buf, int size) {
+    if (size >= buf->size || buffer_content_len(buf) >= size) {
+        return OCTOPUS_AGAIN;
+    }
+
+    return buffer_resize(buf, size);
+}
+
 int buffer_write_from(buffer_t *buf, void *src, int wsize) {
     char    *b;
     int     first_part_len;
@@ -82,9 +171,13 @@ int buffer_write_from(buffer_t *buf, void *src, int wsize) {
     return OCTOPUS_OK;
 }
 
-int buffer_write_from_fd(buffer_t *buf, int fd, int wsize) {
-    char    *b;
-    int     ret, left, rsize;
+/**
+ * Read from fd by aeReadv if 'el' isn't NULL, otherwise by readv.
+ */
+static int write_from_fd(buffer_t *buf, aeEventLoop *el, int fd, int wsize) {
+    struct iovec    iov[2];
+    int             iovcnt, first_part_len;
+    ssize_t         ret;
 
     if (buffer_space_remaining(buf) < wsize) {
         OCTOPUS_ERROR_LOG("no space for the write, remaining: %d, write: %d",
@@ -92,76 +185,50 @@ int buffer_write_from_fd(buffer_t *buf, int fd, int wsize) {
         return OCTOPUS_ERR;
     }
 
-    b = buf->buf + buf->end;
+    // If buffer isn't continuous, both parts are read by one readv.
+    iov[0].iov_base = buf->buf + buf->end;
     if (space_is_continuous(buf, wsize)) {
-        if ((ret = read(fd, b, wsize)) == -1 && errno != EAGAIN) {
-            OCTOPUS_ERROR_LOG_BY_ERRNO("failed to write buffer from fd, read error, fd: %d", fd);
-            return OCTOPUS_ERR;
-        } else if (ret == 0) {
-            OCTOPUS_DEBUG_LOG("EOF when read fd to write to buffer");
-            return OCTOPUS_EOF;
-        } else if (ret > 0) {
-            // It's allowed that content read is less than 'wsize'.
-            buffer_produce(buf, ret);
-            return ret;
-        } else if (errno == EAGAIN) {
-            return 0;
-        }
+        iov[0].iov_len = wsize;
+        iovcnt = 1;
+    } else {
+        first_part_len = buf->size - buf->end;
+        iov[0].iov_len = first_part_len;
+        iov[1].iov_base = buf->buf;
+        iov[1].iov_len = wsize - first_part_len;
+        iovcnt = 2;
     }
 
-    // If buffer isn't continuous, two read operations will be tried.
-    left = wsize;
-    while (left > 0) {
-        if (left == wsize) {
-            rsize = buf->size - buf->end;   // the first part
-        } else {
-            rsize = wsize - left;     // the second part
-        }
+    while ((ret = el != NULL ? aeReadv(el, fd, iov, iovcnt) : readv(fd, iov, iovcnt)) == -1
+            && errno == EINTR);
 
-        if ((ret = read(fd, b, rsize)) == -1 && errno != EAGAIN) {
-            OCTOPUS_ERROR_LOG_BY_ERRNO("failed to write buffer from fd, read error");
-            return OCTOPUS_ERR;
-        } else if (ret == 0) {
-            OCTOPUS_WARNING_LOG("EOF when read fd to write to buffer");
-            return OCTOPUS_EOF;
-        } else if (errno == EAGAIN) {
+    if (ret == -1) {
+        if (errno == EAGAIN) {
             return 0;
         }
 
-        buffer_produce(buf, ret);
-        left -= ret;
-
-        if (ret < rsize) {
-            // No more data can be read from fd, just return.
-            return wsize - left;
-        }
+        OCTOPUS_ERROR_LOG_BY_ERRNO("failed to write buffer from fd, read error, fd: %d", fd);
+        return OCTOPUS_ERR;
+    } else if (ret == 0) {
+        OCTOPUS_DEBUG_LOG("EOF when read fd to write to buffer");
+        return OCTOPUS_EOF;
     }
 
-    return wsize;
-}
-
-int buffer_write_from_sds(buffer_t *buf, sds s) {
-    int     len, first_part_len;
+    // It's allowed that content read is less than 'wsize'.
+    buffer_produce(buf, ret);
 
-    len = sdslen(s);
-    if (buffer_space_remaining(buf) < len) {
-        OCTOPUS_ERROR_LOG("no space for the write, remaining: %d, write: %d",
-                buffer_space_remaining(buf), len);
-        return OCTOPUS_ERR;
-    }
+    return ret;
+}
 
-    if (space_is_continuous(buf, len)) {
-        memmove(buf->buf + buf->start, s, len);
-        buf->end += len;
-        return OCTOPUS_OK;
-    }
+int buffer_write_from_fd(buffer_t *buf, int fd, int wsize) {
+    return write_from_fd(buf, NULL, fd, wsize);
+}
 
-    first_part_len = buf->size - buf->end;
-    memmove(buf->buf + buf->start, s, first_part_len);
-    memmove(buf->buf, s + first_part_len, len - first_part_len);
-    buf->end += len;
+int buffer_write_from_event_loop(buffer_t *buf, aeEventLoop *el, int fd, int wsize) {
+    return write_from_fd(buf, el, fd, wsize);
+}
 
-    return OCTOPUS_OK;
+int buffer_write_from_sds(buffer_t *buf, sds s) {
+    return buffer_write_from(buf, s, sdslen(s));
 }
 
 int buffer_index_of(buffer_t *buf, char *s) {
@@ -210,8 +277,32 @@ int buffer_index_of_char(buffer_t *buf, char c) {
 /*}*/
 
 void buffer_destroy(buffer_t *buf) {
-    free(buf->buf);
-    free(buf);
+    failed_destroy(buf->refs_iter, list_iter);
+    failed_destroy(buf->refs, list);
+    octopus_free(buf->buf);
+    octopus_free(buf);
+}
+
+static inline int write_to_fd(int fd, const char *b, int wsize) {
+    int     ret;
+
+    // If the socket buffer is full, will 'write' block?
+    // No. If the socket is in nonblock mode, 'write' will return error when the buffer
+    // is full, and the error is EAGAIN.
+    if ((ret = write(fd, b, wsize)) >= 0) {
+        return ret;
+    }
+
+    if (errno == EAGAIN) {
+        // buffer is full, retry later
+        return 0;
+    } else if (errno == ECONNRESET || errno == EPIPE) {
+        OCTOPUS_ERROR_LOG_BY_ERRNO("failed to write socket, fd: %d", fd);
+        return OCTOPUS_RESET;
+    }
+
+    OCTOPUS_ERROR_LOG_BY_ERRNO("failed to write socket, fd: %d", fd);
+    return OCTOPUS_ERR;
 }
 
 int buffer_read_to_fd(buffer_t *buf, int fd, int rsize) {
@@ -223,51 +314,304 @@ int buffer_read_to_fd(buffer_t *buf, int fd, int rsize) {
         return OCTOPUS_ERR;
     }
 
-    if (space_is_continuous(buf, rsize)) {
-        // If the socket buffer is full, will 'write' block?
-        // No. If the socket is in nonblock mode, 'write' will return error when the buffer
-        // is full, and the error is EAGAIN.
-        if ((ret = write(fd, buf->buf + buf->start, rsize)) == -1 && errno == EAGAIN) {
-            // buffer is full, retry later
+    // If content isn't continuous, two write operations will be tried.
+    w = rsize;
+    while (w > 0) {
+        wsize = content_is_continuous(buf, w) ? w : buf->size - buf->start;
+
+        if ((ret = write_to_fd(fd, buf->buf + buf->start, wsize)) < 0) {
             return ret;
-        } else if (errno == ECONNRESET) {
-            OCTOPUS_ERROR_LOG_BY_ERRNO("failed to write socket, fd: %d", fd);
-            return OCTOPUS_RESET;
-        } else if (ret == -1) {
-            OCTOPUS_ERROR_LOG("failed to write socket, fd: %d", fd);
-            return OCTOPUS_ERR;
         }
 
+        w -= ret;
         buffer_consume(buf, ret);
 
+        if (ret < wsize) {
+            // send buffer is full
+            break;
+        }
+    }
+
+    return rsize - w;
+}
+
+static void seg_deallocator(void *p) {
+    buffer_seg_t    *seg;
+
+    seg = (buffer_seg_t *)p;
+    bufref_decr(seg->ref);
+    octopus_free(seg);
+}
+
+int buffer_attach_ref(buffer_t *buf, bufref_t *ref) {
+    buffer_seg_t    *seg;
+
+    TWO_PTRS_NULL_CHECK(buf, ref);
+
+    // A segment is released once all of it has been sent, which never happens
+    // to an empty one sent by sendfile.
+    if (ref->len <= 0) {
+        return OCTOPUS_OK;
+    }
+
+    if (buf->refs == NULL) {
+        if ((buf->refs = list_create(seg_deallocator)) == NULL) {
+            OCTOPUS_ERROR_LOG("failed to create ref list for buffer");
+            return OCTOPUS_ERR;
+        }
+
+        if ((buf->refs_iter = list_iter(buf->refs)) == NULL) {
+            OCTOPUS_ERROR_LOG("failed to create ref list iterator for buffer");
+            list_destroy(buf->refs);
+            buf->refs = NULL;
+            return OCTOPUS_ERR;
+        }
+    }
+
+    if ((seg = octopus_malloc(sizeof(buffer_seg_t), OCTOPUS_MEM_BUFFER)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for buffer seg");
+        return OCTOPUS_ERR;
+    }
+
+    bufref_incr(ref);
+    seg->mark = buf->produced;
+    seg->sent = 0;
+    seg->ref = ref;
+
+    if (list_push(buf->refs, seg) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("failed to attach ref to buffer");
+        seg_deallocator(seg);
+        return OCTOPUS_ERR;
+    }
+
+    return OCTOPUS_OK;
+}
+
+/**
+ * Append inline bytes in range [pos, pos + len) of the byte stream to sds.
+ */
+static int copy_inline(buffer_t *buf, long long pos, int len, sds *s) {
+    int     idx, first_part_len;
+
+    if (len <= 0) {
+        return OCTOPUS_OK;
+    }
+
+    idx = (buf->start + (int)(pos - buf->consumed)) % buf->size;
+    first_part_len = buf->size - idx;
+    if (first_part_len >= len) {
+        *s = sdscatlen(*s, buf->buf + idx, len);
+    } else if ((*s = sdscatlen(*s, buf->buf + idx, first_part_len)) != NULL) {
+        *s = sdscatlen(*s, buf->buf, len - first_part_len);
+    }
+
+    return *s != NULL ? OCTOPUS_OK : OCTOPUS_ERR;
+}
+
+int buffer_copy_produced(buffer_t *buf, long long from, int refs_from, sds *s) {
+    buffer_seg_t    *seg;
+    iterator_t      *iter;
+    long long       pos;
+    int             idx;
+
+    TWO_PTRS_NULL_CHECK(buf, s);
+
+    if (from < buf->consumed || from > buf->produced) {
+        OCTOPUS_ERROR_LOG("invalid position to copy, from: %lld, consumed: %lld, produced: %lld",
+                from, buf->consumed, buf->produced);
+        return OCTOPUS_ERR;
+    }
+
+    pos = from;
+    if (buffer_ref_count(buf) > refs_from) {
+        idx = 0;
+        iter = buf->refs_iter;
+        for (list_iter_init(buf->refs, iter); iter->has_next(iter); idx++) {
+            seg = (buffer_seg_t *)iter->next(iter);
+            if (idx < refs_from) {
+                continue;
+            }
+
+            if (seg->ref->fd != -1) {
+                return OCTOPUS_ERR;
+            }
+
+            if (copy_inline(buf, pos, (int)(seg->mark - pos), s) == OCTOPUS_ERR ||
+                    (*s = sdscatlen(*s, seg->ref->data, seg->ref->len)) == NULL) {
+                return OCTOPUS_ERR;
+            }
+            pos = seg->mark;
+        }
+    }
+
+    return copy_inline(buf, pos, (int)(buf->produced - pos), s);
+}
+
+/**
+ * Append inline bytes in range [pos, pos + len) of the byte stream to iov.
+ */
+static inline int fill_inline_iov(buffer_t *buf, long long pos, int len,
+        struct iovec *iov, int iovcnt) {
+    int     idx, first_part_len;
+
+    if (len <= 0) {
+        return iovcnt;
+    }
+
+    idx = (buf->start + (int)(pos - buf->consumed)) % buf->size;
+    first_part_len = buf->size - idx;
+    if (first_part_len >= len) {
+        iov[iovcnt].iov_base = buf->buf + idx;
+        iov[iovcnt].iov_len = len;
+        return iovcnt + 1;
+    }
+
+    iov[iovcnt].iov_base = buf->buf + idx;
+    iov[iovcnt].iov_len = first_part_len;
+    iov[iovcnt + 1].iov_base = buf->buf;
+    iov[iovcnt + 1].iov_len = len - first_part_len;
+
+    return iovcnt + 2;
+}
+
+static int sendfile_to_fd(buffer_seg_t *seg, int fd) {
+#ifdef __linux__
+    off_t   off;
+    ssize_t ret;
+
+    off = seg->ref->offset + seg->sent;
+    if ((ret = sendfile(fd, seg->ref->fd, &off, seg->ref->len - seg->sent)) > 0) {
         return ret;
+    } else if (ret == 0) {
+        // the file ends before the range, e.g. it has been truncated, so the
+        // bytes owed can never be sent
+        OCTOPUS_ERROR_LOG("file of ref ends before the range, fd: %d, offset: %lld, len: %d",
+                seg->ref->fd, (long long)off, seg->ref->len - seg->sent);
+        return OCTOPUS_ERR;
     }
 
-    // If buffer isn't continuous, two write operations will be tried.
-    w = rsize;
-    while (w > 0) {
-        if (w == rsize) {   // The first write
-            wsize = buf->size - buf->start;
-        } else {            // The second write
-            wsize = rsize - w;
+    if (errno == EAGAIN) {
+        return 0;
+    } else if (errno == ECONNRESET || errno == EPIPE) {
+        OCTOPUS_ERROR_LOG_BY_ERRNO("failed to sendfile to socket, fd: %d", fd);
+        return OCTOPUS_RESET;
+    }
+
+    OCTOPUS_ERROR_LOG_BY_ERRNO("failed to sendfile to socket, fd: %d", fd);
+    return OCTOPUS_ERR;
+#else
+    OCTOPUS_NOT_USED(seg);
+    OCTOPUS_ERROR_LOG("fd backed ref isn't supported on this platform, fd: %d", fd);
+    return OCTOPUS_ERR;
+#endif
+}
+
+int buffer_writev_to_fd(buffer_t *buf, int fd) {
+    struct iovec    iov[BUFFER_IOV_MAX];
+    int             iovcnt, len, written, total, stopped;
+    long long       pos;
+    ssize_t         ret;
+    buffer_seg_t    *seg;
+    iterator_t      *iter;
+
+    if (buf->refs == NULL || list_size(buf->refs) == 0) {
+        return buffer_read_to_fd(buf, fd, buffer_content_len(buf));
+    }
+
+    // A fd backed ref at the head is sent by sendfile alone.
+    seg = (buffer_seg_t *)list_head(buf->refs);
+    if (seg->ref->fd != -1 && seg->mark == buf->consumed) {
+        if (seg->sent == seg->ref->len) {
+            list_pop(buf->refs);
+            return buffer_writev_to_fd(buf, fd);
+        }
+
+        if ((ret = sendfile_to_fd(seg, fd)) <= 0) {
+            return ret;
         }
 
-        if ((ret = write(fd, buf->buf + buf->start, wsize)) == -1 && errno == EAGAIN) {
-            // buffer is full, retry later
-            return rsize - w + ret;
-        } else if (errno == ECONNRESET) {
-            OCTOPUS_ERROR_LOG_BY_ERRNO("failed to write socket, fd: %d", fd);
+        seg->sent += ret;
+        if (seg->sent == seg->ref->len) {
+            list_pop(buf->refs);
+        }
+
+        return ret;
+    }
+
+    // Collect inline bytes and memory refs in order, until a fd backed ref.
+    iovcnt = 0;
+    stopped = OCTOPUS_FALSE;
+    pos = buf->consumed;
+    iter = buf->refs_iter;
+    for (list_iter_init(buf->refs, iter); iter->has_next(iter);) {
+        seg = (buffer_seg_t *)iter->next(iter);
+        // keep room for the inline bytes before and after the ref
+        if (iovcnt + 5 > BUFFER_IOV_MAX) {
+            stopped = OCTOPUS_TRUE;
+            break;
+        }
+
+        iovcnt = fill_inline_iov(buf, pos, (int)(seg->mark - pos), iov, iovcnt);
+        pos = seg->mark;
+        if (seg->ref->fd != -1) {
+            stopped = OCTOPUS_TRUE;
+            break;
+        }
+
+        iov[iovcnt].iov_base = (char *)seg->ref->data + seg->sent;
+        iov[iovcnt].iov_len = seg->ref->len - seg->sent;
+        iovcnt++;
+    }
+
+    if (!stopped) {
+        iovcnt = fill_inline_iov(buf, pos, (int)(buf->produced - pos), iov, iovcnt);
+    }
+
+    if ((ret = writev(fd, iov, iovcnt)) == -1) {
+        if (errno == EAGAIN) {
+            return 0;
+        } else if (errno == ECONNRESET || errno == EPIPE) {
+            OCTOPUS_ERROR_LOG_BY_ERRNO("failed to writev socket, fd: %d", fd);
             return OCTOPUS_RESET;
-        } else if (ret == -1) {
-            OCTOPUS_ERROR_LOG("failed to write socket, fd: %d", fd);
-            return OCTOPUS_ERR;
         }
 
-        w -= ret;
-        buffer_consume(buf, ret);
+        OCTOPUS_ERROR_LOG_BY_ERRNO("failed to writev socket, fd: %d", fd);
+        return OCTOPUS_ERR;
     }
 
-    return rsize;
+    // Advance inline bytes and refs which have been written.
+    total = written = ret;
+    while (written > 0) {
+        seg = list_size(buf->refs) > 0 ? (buffer_seg_t *)list_head(buf->refs) : NULL;
+
+        len = seg == NULL ? buffer_content_len(buf) : (int)(seg->mark - buf->consumed);
+        len = len < written ? len : written;
+        buffer_consume(buf, len);
+        written -= len;
+
+        if (seg == NULL || written == 0) {
+            break;
+        }
+
+        len = seg->ref->len - seg->sent;
+        len = len < written ? len : written;
+        seg->sent += len;
+        written -= len;
+        if (seg->sent == seg->ref->len) {
+            list_pop(buf->refs);
+        }
+    }
+
+    // Release empty refs at the head which are ready to be emitted.
+    while (list_size(buf->refs) > 0) {
+        seg = (buffer_seg_t *)list_head(buf->refs);
+        if (seg->mark != buf->consumed || seg->sent != seg->ref->len) {
+            break;
+        }
+        list_pop(buf->refs);
+    }
+
+    return total;
 }
 
 int buffer_read_to(buffer_t *buf, char *cbuf, int rsize) {
@@ -277,7 +621,7 @@ int buffer_read_to(buffer_t *buf, char *cbuf, int rsize) {
         rsize = buffer_content_len(buf);
     }
 
-    if (space_is_continuous(buf, rsize)) {
+    if (content_is_continuous(buf, rsize)) {
         memmove(cbuf, buf->buf + buf->start, rsize);
         buffer_consume(buf, rsize);
 
@@ -300,7 +644,7 @@ int buffer_read_to(buffer_t *buf, char *cbuf, int rsize) {
 int buffer_read_to_sds(buffer_t *buf, sds *s, int rsize) {
     int     first_part_len;
 
-    if (space_is_continuous(buf, rsize)) {
+    if (content_is_continuous(buf, rsize)) {
         *s = sdscatlen(*s, buf->buf + buf->start, rsize);
         buffer_consume(buf, rsize);
         return rsize;
@@ -323,7 +667,7 @@ void* buffer_iter_next(void *iter) {
     buf_iter = (buffer_iterator_t *)iter;
     buf = buf_iter->buf;
     c = buf->buf + buf->start;
-    buf->start = (buf->start + 1) % buf->size;
+    buffer_consume(buf, 1);
     buf_iter->idx++;
 
     return (void *)c;
@@ -350,7 +694,7 @@ int buffer_iter_index(void *iter) {
 iterator_t* buffer_iter(buffer_t *buf) {
     buffer_iterator_t   *buf_iter;
 
-    buf_iter = calloc(1, sizeof(buffer_iterator_t));
+    buf_iter = octopus_calloc(1, sizeof(buffer_iterator_t), OCTOPUS_MEM_BUFFER);
     if (buf_iter == NULL) {
         OCTOPUS_ERROR_LOG("failed to alloc mem for buffer iterator");
         return NULL;
@@ -365,5 +709,132 @@ iterator_t* buffer_iter(buffer_t *buf) {
 }
 
 void buffer_iter_destroy(iterator_t *iter) {
-    free(iter);
+    octopus_free(iter);
+}
+
+#ifdef OCTOPUS_TEST_BUFFER
+
+#include <stdlib.h>
+#include <fcntl.h>
+
+static int  released;
+
+static void test_release(void *owner) {
+    free(owner);
+    released++;
+}
+
+/**
+ * Write the buffer to a nonblocking pipe of 'capacity', and drain it into 's'
+ * whenever it's full, so refs are written partially.
+ */
+static int test_drain(buffer_t *buf, sds *s, int capacity) {
+    int     fds[2], n;
+    char    tmp[4096];
+
+    if (pipe(fds) == -1) {
+        return OCTOPUS_ERR;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+#ifdef F_SETPIPE_SZ
+    fcntl(fds[1], F_SETPIPE_SZ, capacity);
+#endif
+
+    while (buffer_has_pending(buf)) {
+        if (buffer_writev_to_fd(buf, fds[1]) < 0) {
+            break;
+        }
+        while ((n = read(fds[0], tmp, sizeof(tmp))) > 0) {
+            *s = sdscatlen(*s, tmp, n);
+        }
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    return buffer_has_pending(buf) ? OCTOPUS_ERR : OCTOPUS_OK;
 }
+
+int main(int argc, char *argv[])
+{
+    buffer_t    *buf;
+    bufref_t    *ref, *empty;
+    char        *value, path[] = "/tmp/octopus_buffer_test_XXXXXX";
+    sds         s, expected;
+    int         fd, len, ret;
+
+    OCTOPUS_NOT_USED(argc);
+    OCTOPUS_NOT_USED(argv);
+
+    // The producer drops its reference once the ref is attached, and the value
+    // is released after it has been written, across many partial writes.
+    len = 100000;
+    value = malloc(len);
+    for (int i = 0; i < len; i++) {
+        value[i] = 'a' + i % 26;
+    }
+    expected = sdscatlen(sdsnew("head "), value, len);
+    expected = sdscat(expected, " tail");
+
+    buf = buffer_create(64);
+    buffer_write_from(buf, "head ", 5);
+    ref = bufref_create(value, len, test_release, value);
+    buffer_attach_ref(buf, ref);
+    bufref_decr(ref);
+    buffer_write_from(buf, " tail", 5);
+    printf("released before written: %d\n", released);
+
+    s = sdsempty();
+    test_drain(buf, &s, 4096);
+    printf("written: %d, released after written: %d\n", sdscmp(s, expected) == 0, released);
+    sdsfree(s);
+
+    // a fd backed ref, and an empty one which isn't attached at all
+    fd = mkstemp(path);
+    unlink(path);
+    if (write(fd, "file content", 12) != 12) {
+        printf("failed to write %s\n", path);
+    }
+    ref = bufref_create_fd(fd, 5, 7, NULL, NULL);
+    empty = bufref_create_fd(fd, 0, 0, test_release, malloc(1));
+    buffer_write_from(buf, "[", 1);
+    buffer_attach_ref(buf, ref);
+    buffer_attach_ref(buf, empty);
+    bufref_decr(ref);
+    bufref_decr(empty);
+    buffer_write_from(buf, "]", 1);
+    printf("empty ref released: %d, refs attached: %d\n", released == 2, buffer_ref_count(buf));
+
+    s = sdsempty();
+    test_drain(buf, &s, 4096);
+    printf("fd ref written: %d\n", strcmp(s, "[content]") == 0);
+    sdsfree(s);
+
+    // the file is truncated before the range has been sent, which fails
+    // instead of waiting for the socket forever
+    if (ftruncate(fd, 8) == -1) {
+        printf("failed to truncate %s\n", path);
+    }
+    ref = bufref_create_fd(fd, 5, 7, NULL, NULL);
+    buffer_attach_ref(buf, ref);
+    bufref_decr(ref);
+    s = sdsempty();
+    ret = test_drain(buf, &s, 4096);
+    printf("truncated fd ref failed: %d, written: %s\n", ret == OCTOPUS_ERR, s);
+    sdsfree(s);
+    close(fd);
+
+    // the value is released if the buffer is destroyed before written
+    value = malloc(len);
+    ref = bufref_create(value, len, test_release, value);
+    buffer_attach_ref(buf, ref);
+    bufref_decr(ref);
+    buffer_destroy(buf);
+    printf("released after destroyed: %d\n", released == 3);
+
+    sdsfree(expected);
+
+    return 0;
+}
+
+#endif
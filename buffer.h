@@ -10,8 +10,12 @@
 
 #include "sds.h"
 #include "common.h"
+#include "list.h"
+#include "bufref.h"
+#include "libae/ae.h"
 
-#define buffer_space_remaining(b)   ((b)->size - ((b)->end - (b)->start) % (b)->size)
+// One byte is always kept free, so 'start == end' means the buffer is empty.
+#define buffer_space_remaining(b)   ((b)->size - 1 - buffer_content_len(b))
 // idx is a relative index of buffer
 // 0 <= idx < buffer_content_len(b)
 #define buffer_at(b, idx)           (b)->buf[((b)->start + idx) % (b)->size]
@@ -20,27 +24,96 @@
 /**
  * @brief Make 'start' of buffer to advance 'step's
  */
-#define buffer_advance_step(b, step)     (b)->start = ((b)->start + (step)) % (b)->size
+#define buffer_advance_step(b, step)    \
+    ((b)->consumed += (step), (b)->start = ((b)->start + (step)) % (b)->size)
 
 // idx is a relative index of buffer
 // 0 <= idx < buffer_content_len(b)
 #define buffer_subbuf_len(b, idx)   ((idx) + 1) % (b)->size
-#define buffer_content_len(b)       ((b)->end - (b)->start) % (b)->size
+#define buffer_content_len(b)       (((b)->end - (b)->start + (b)->size) % (b)->size)
+
+// Inline bytes or attached refs are waiting to be written.
+#define buffer_has_pending(b)   \
+    (buffer_content_len(b) > 0 || buffer_ref_count(b) > 0)
+
+#define buffer_ref_count(b)     ((b)->refs != NULL ? list_size((b)->refs) : 0)
 
 typedef struct {
     char    *buf;
     int     size;
+    // buffer_reserve grows the buffer up to it, it's 'size' if it can't grow
+    int     max_size;
     int     start;
     int     end;    // index to the position of next byte
+
+    // Absolute count of bytes produced and consumed, which are used to locate
+    // the position of attached refs in the byte stream.
+    long long   produced;
+    long long   consumed;
+
+    // Refs attached by encoders, created lazily. Element type is buffer_seg_t*.
+    list_t      *refs;
+    iterator_t  *refs_iter;
 } buffer_t;
 
 buffer_t* buffer_create(int size);
+
+/**
+ * @brief Let the buffer grow up to 'max_size'. Buffers which others point into
+ *      mustn't grow, since the memory is moved.
+ */
+void buffer_set_max_size(buffer_t *buf, int max_size);
+
+/**
+ * @brief Make sure there is space for 'len' more bytes, the buffer grows if
+ *      needed and allowed.
+ * @return OCTOPUS_ERR if there can't be enough space.
+ */
+int buffer_reserve(buffer_t *buf, int len);
+
+/**
+ * @brief Release memory by moving the content to 'size' bytes, it can grow
+ *      again up to 'max_size'.
+ * @return OCTOPUS_AGAIN if the content doesn't fit or it isn't smaller.
+ */
+int buffer_shrink(buffer_t *buf, int size);
+
 int buffer_write_from(buffer_t *buf, void *src, int wsize);
 int buffer_write_from_fd(buffer_t *buf, int fd, int wsize);
+
+/**
+ * @brief Read from fd by aeReadv, so the bytes the event loop has received for
+ *      a fd registered with AE_RECV are taken without a syscall.
+ */
+int buffer_write_from_event_loop(buffer_t *buf, aeEventLoop *el, int fd, int wsize);
 int buffer_write_from_sds(buffer_t *buf, sds s);
 int buffer_read_to(buffer_t *buf, char *cbuf, int rsize);
 int buffer_read_to_fd(buffer_t *buf, int fd, int rsize);
 
+/**
+ * @brief Attach an external byte range at the current end of the buffer, the
+ *      bytes written to the buffer after the call will be emitted after it.
+ *      The buffer holds a reference of 'ref' until it has been fully written.
+ *      An empty range has nothing to emit, so it isn't attached.
+ */
+int buffer_attach_ref(buffer_t *buf, bufref_t *ref);
+
+/**
+ * @brief Copy the bytes produced since the absolute position 'from' to the sds,
+ *      including memory refs attached after the first 'refs_from' ones. It's
+ *      used to capture the bytes just encoded, which must not have been consumed.
+ * @return OCTOPUS_ERR if a fd ref is in the range or failed to alloc.
+ */
+int buffer_copy_produced(buffer_t *buf, long long from, int refs_from, sds *s);
+
+/**
+ * @brief Write inline bytes and attached refs to fd in order, by writev(2) for
+ *      memory ranges and sendfile(2) for fd ranges.
+ * @return bytes written, 0 if the socket isn't writable, OCTOPUS_RESET if the
+ *      connection has been reset or OCTOPUS_ERR.
+ */
+int buffer_writev_to_fd(buffer_t *buf, int fd);
+
 // read data from buffer and write to sds.
 // sds must be expand memory when data is written to it, so here sds * is passed.
 int buffer_read_to_sds(buffer_t *buf, sds *s, int rsize);
@@ -0,0 +1,81 @@
+/**
+ *
+ * @file    bufref
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-05-20 14:30:41
+ */
+
+#include <stdlib.h>
+
+#include "bufref.h"
+#include "memory.h"
+#include "logging.h"
+
+bufref_t* bufref_create(const char *data, int len, deallocator_t dealloc, void *owner) {
+    bufref_t    *ref;
+
+    if (data == NULL || len < 0) {
+        OCTOPUS_ERROR_LOG("invalid param for bufref, len: %d", len);
+        return NULL;
+    }
+
+    if ((ref = octopus_calloc(1, sizeof(bufref_t), OCTOPUS_MEM_BUFFER)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for bufref");
+        return NULL;
+    }
+
+    ref->refcnt = 1;
+    ref->data = data;
+    ref->len = len;
+    ref->fd = -1;
+    ref->dealloc = dealloc;
+    ref->owner = owner;
+
+    return ref;
+}
+
+bufref_t* bufref_create_fd(int fd, off_t offset, int len, deallocator_t dealloc, void *owner) {
+    bufref_t    *ref;
+
+    if (fd < 0 || len < 0) {
+        OCTOPUS_ERROR_LOG("invalid param for bufref, fd: %d, len: %d", fd, len);
+        return NULL;
+    }
+
+    if ((ref = octopus_calloc(1, sizeof(bufref_t), OCTOPUS_MEM_BUFFER)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for bufref");
+        return NULL;
+    }
+
+    ref->refcnt = 1;
+    ref->len = len;
+    ref->fd = fd;
+    ref->offset = offset;
+    ref->dealloc = dealloc;
+    ref->owner = owner;
+
+    return ref;
+}
+
+void bufref_incr(bufref_t *ref) {
+    __sync_add_and_fetch(&ref->refcnt, 1);
+}
+
+void bufref_decr(bufref_t *ref) {
+    int     refcnt;
+
+    refcnt = __sync_sub_and_fetch(&ref->refcnt, 1);
+    if (refcnt > 0) {
+        return;
+    }
+
+    if (refcnt < 0) {
+        OCTOPUS_ERROR_LOG("fatal error: bufref->refcnt < 0");
+        return;
+    }
+
+    if (ref->dealloc != NULL) {
+        ref->dealloc(ref->owner);
+    }
+    octopus_free(ref);
+}
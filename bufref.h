@@ -0,0 +1,44 @@
+/**
+ *
+ * @file    bufref
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-05-20 14:12:05
+ */
+
+#ifndef OCTOPUS_BUFREF_H
+#define OCTOPUS_BUFREF_H
+
+#include <sys/types.h>
+
+#include "common.h"
+
+/**
+ * A reference counted byte range which is owned by someone else, such as a
+ * cached value of a processor or a region of a file. Encoders can attach it to
+ * the output buffer instead of copying the bytes, and it will be released after
+ * it has been written to the socket completely.
+ *
+ * The refcnt is changed atomically, so a bufref can be shared by clients on
+ * different ioworkers.
+ */
+typedef struct bufref_s {
+    int         refcnt;
+
+    const char  *data;
+    int         len;
+
+    // fd backed range, which is sent by sendfile. fd is -1 for memory range.
+    int         fd;
+    off_t       offset;
+
+    // called with 'owner' when the last reference has gone
+    deallocator_t   dealloc;
+    void            *owner;
+} bufref_t;
+
+bufref_t* bufref_create(const char *data, int len, deallocator_t dealloc, void *owner);
+bufref_t* bufref_create_fd(int fd, off_t offset, int len, deallocator_t dealloc, void *owner);
+void bufref_incr(bufref_t *ref);
+void bufref_decr(bufref_t *ref);
+
+#endif /* ifndef OCTOPUS_BUFREF_H */
@@ -0,0 +1,576 @@
+/**
+ *
+ * @file    cache
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-19 11:02:45
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "cache.h"
+#include "bufref.h"
+#include "memory.h"
+#include "logging.h"
+#include "common.h"
+
+// Invalidations are tracked by slots of tag hash, so a fill is only dropped if
+// a tag in the same slot has been invalidated while it's in flight.
+#define CACHE_EPOCH_SLOTS   256
+
+#define bucket_of(s, hash_val)  ((hash_val) & ((s)->bucket_count - 1))
+
+typedef struct cache_entry_s {
+    unsigned int    hash_val;
+    unsigned int    tag_hash;
+    processor_t     *processor;
+    sds             key;
+    sds             tag;
+
+    bufref_t        *value;
+    long long       expire_ms;
+    long long       bytes;
+    // set by hits, and cleared by the hand of CLOCK
+    int             referenced;
+
+    struct cache_entry_s    *next;
+    struct cache_entry_s    *next_tag;
+    struct cache_entry_s    *clock_prev;
+    struct cache_entry_s    *clock_next;
+} cache_entry_t;
+
+typedef struct cache_shard_s {
+    cache_entry_t   **buckets;
+    // entries having a tag, indexed by hash of the tag
+    cache_entry_t   **tag_buckets;
+    int             bucket_count;
+    int             count;
+
+    // Entries form a ring, new entries are inserted right behind the hand, so
+    // they are checked last.
+    cache_entry_t   *hand;
+    long long       bytes;
+
+    long long       epochs[CACHE_EPOCH_SLOTS];
+    mailbox_t       *mailbox;
+
+    struct cache_shard_s    *next;
+} cache_shard_t;
+
+/**
+ * An invalidation posted to the thread of a shard.
+ */
+typedef struct {
+    mailbox_msg_t   msg;
+
+    cache_shard_t   *shard;
+    sds             tag;
+} invalidation_t;
+
+static long long    max_bytes = CACHE_DEFAULT_MAX_BYTES;
+
+static __thread cache_shard_t   *current_shard;
+
+// shards of all threads, which receive invalidations
+static cache_shard_t    *shards;
+static pthread_mutex_t  shards_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static cache_stats_t    stats;
+
+static inline unsigned int cache_hash(const char *p, int len) {
+    unsigned int    h;
+
+    // FNV-1a
+    h = 2166136261u;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)p[i]) * 16777619u;
+    }
+
+    return h;
+}
+
+// time of the current iteration of the event loop owning the shard
+static inline long long cache_mstime(cache_shard_t *s) {
+    return aeGetMonotonicUs(s->mailbox->event_loop) / 1000;
+}
+
+static inline int sds_equal(sds a, const char *b, int len) {
+    return (int)sdslen(a) == len && memcmp(a, b, len) == 0;
+}
+
+void octopus_cache_set_max_bytes(long long bytes) {
+    max_bytes = bytes;
+}
+
+static cache_shard_t* shard_get(mailbox_t *mailbox) {
+    cache_shard_t   *s;
+
+    if (current_shard != NULL) {
+        return current_shard;
+    }
+
+    if ((s = octopus_calloc(1, sizeof(cache_shard_t), OCTOPUS_MEM_CACHE)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for cache shard");
+        return NULL;
+    }
+
+    s->bucket_count = CACHE_INIT_BUCKETS;
+    if ((s->buckets = octopus_calloc(s->bucket_count, sizeof(cache_entry_t *),
+                    OCTOPUS_MEM_CACHE)) == NULL ||
+            (s->tag_buckets = octopus_calloc(s->bucket_count, sizeof(cache_entry_t *),
+                    OCTOPUS_MEM_CACHE)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for buckets of cache shard");
+        octopus_free(s->buckets);
+        octopus_free(s);
+        return NULL;
+    }
+    s->mailbox = mailbox;
+
+    pthread_mutex_lock(&shards_mu);
+    s->next = shards;
+    shards = s;
+    pthread_mutex_unlock(&shards_mu);
+
+    current_shard = s;
+
+    return s;
+}
+
+/**
+ * Double the buckets, which is done when entries are more than buckets.
+ */
+static void shard_expand(cache_shard_t *s) {
+    cache_entry_t   **buckets, **tag_buckets, *e, *next;
+    int             old_count;
+
+    old_count = s->bucket_count;
+    buckets = octopus_calloc(old_count * 2, sizeof(cache_entry_t *), OCTOPUS_MEM_CACHE);
+    tag_buckets = octopus_calloc(old_count * 2, sizeof(cache_entry_t *), OCTOPUS_MEM_CACHE);
+    if (buckets == NULL || tag_buckets == NULL) {
+        // the chains just get longer
+        octopus_free(buckets);
+        octopus_free(tag_buckets);
+        return;
+    }
+
+    s->bucket_count = old_count * 2;
+    for (int i = 0; i < old_count; i++) {
+        for (e = s->buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            e->next = buckets[bucket_of(s, e->hash_val)];
+            buckets[bucket_of(s, e->hash_val)] = e;
+        }
+
+        for (e = s->tag_buckets[i]; e != NULL; e = next) {
+            next = e->next_tag;
+            e->next_tag = tag_buckets[bucket_of(s, e->tag_hash)];
+            tag_buckets[bucket_of(s, e->tag_hash)] = e;
+        }
+    }
+
+    octopus_free(s->buckets);
+    octopus_free(s->tag_buckets);
+    s->buckets = buckets;
+    s->tag_buckets = tag_buckets;
+}
+
+static void entry_remove(cache_shard_t *s, cache_entry_t *e) {
+    cache_entry_t   **pe;
+
+    for (pe = &s->buckets[bucket_of(s, e->hash_val)]; *pe != e; pe = &(*pe)->next);
+    *pe = e->next;
+
+    if (e->tag != NULL) {
+        for (pe = &s->tag_buckets[bucket_of(s, e->tag_hash)]; *pe != e; pe = &(*pe)->next_tag);
+        *pe = e->next_tag;
+    }
+
+    if (e->clock_next == e) {
+        s->hand = NULL;
+    } else {
+        e->clock_prev->clock_next = e->clock_next;
+        e->clock_next->clock_prev = e->clock_prev;
+        if (s->hand == e) {
+            s->hand = e->clock_next;
+        }
+    }
+
+    s->count--;
+    s->bytes -= e->bytes;
+    __sync_fetch_and_sub(&stats.entries, 1);
+    __sync_fetch_and_sub(&stats.bytes, e->bytes);
+
+    // the bytes live until the outputs referring to them have been sent
+    bufref_decr(e->value);
+    sdsfree(e->key);
+    if (e->tag != NULL) {
+        sdsfree(e->tag);
+    }
+    octopus_free(e);
+}
+
+static cache_entry_t* entry_find(cache_shard_t *s, processor_t *processor, sds key,
+        unsigned int hash_val) {
+
+    cache_entry_t   *e;
+
+    for (e = s->buckets[bucket_of(s, hash_val)]; e != NULL; e = e->next) {
+        if (e->hash_val == hash_val && e->processor == processor &&
+                sds_equal(e->key, key, sdslen(key))) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Evict entries by CLOCK until 'need' bytes can be added. Expired entries are
+ * evicted regardless of the reference bit.
+ */
+static void shard_evict(cache_shard_t *s, long long need, long long now) {
+    cache_entry_t   *e;
+
+    while (s->hand != NULL && s->bytes + need > max_bytes) {
+        e = s->hand;
+        if (e->referenced && e->expire_ms > now) {
+            e->referenced = OCTOPUS_FALSE;
+            s->hand = e->clock_next;
+            continue;
+        }
+
+        entry_remove(s, e);
+        __sync_fetch_and_add(&stats.evictions, 1);
+    }
+}
+
+object_t* cache_lookup(mailbox_t *mailbox, processor_t *processor, sds key) {
+    cache_shard_t   *s;
+    cache_entry_t   *e;
+    object_t        *obj;
+
+    if ((s = shard_get(mailbox)) == NULL) {
+        return NULL;
+    }
+
+    e = entry_find(s, processor, key, cache_hash(key, sdslen(key)));
+    if (e != NULL && e->expire_ms <= cache_mstime(s)) {
+        entry_remove(s, e);
+        e = NULL;
+    }
+
+    if (e == NULL) {
+        __sync_fetch_and_add(&stats.misses, 1);
+        return NULL;
+    }
+
+    e->referenced = OCTOPUS_TRUE;
+    bufref_incr(e->value);
+    if ((obj = object_create_bytes(e->value)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create object for cached response");
+        bufref_decr(e->value);
+        return NULL;
+    }
+    __sync_fetch_and_add(&stats.hits, 1);
+
+    return obj;
+}
+
+cache_fill_t* cache_fill_create(long long seq, processor_t *processor, sds key, sds tag,
+        long long ttl_ms) {
+
+    cache_fill_t    *fill;
+
+    if ((fill = octopus_malloc(sizeof(cache_fill_t), OCTOPUS_MEM_CACHE)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for cache fill");
+        sdsfree(key);
+        if (tag != NULL) {
+            sdsfree(tag);
+        }
+        return NULL;
+    }
+
+    fill->seq = seq;
+    fill->processor = processor;
+    fill->key = key;
+    fill->tag = tag;
+    fill->ttl_ms = ttl_ms;
+    fill->epoch = 0;
+    if (tag != NULL && current_shard != NULL) {
+        fill->epoch = current_shard->epochs[cache_hash(tag, sdslen(tag)) % CACHE_EPOCH_SLOTS];
+    }
+
+    return fill;
+}
+
+void cache_fill(cache_fill_t *fill, sds value) {
+    cache_shard_t   *s;
+    cache_entry_t   *e, *old;
+    long long       now, bytes;
+    int             idx;
+    char            *data;
+
+    if ((s = current_shard) == NULL) {
+        sdsfree(value);
+        return;
+    }
+
+    bytes = sizeof(cache_entry_t) + sizeof(bufref_t) + sdslen(fill->key) + sdslen(value) +
+        (fill->tag != NULL ? sdslen(fill->tag) : 0);
+    if (bytes > max_bytes) {
+        sdsfree(value);
+        return;
+    }
+
+    if ((e = octopus_calloc(1, sizeof(cache_entry_t), OCTOPUS_MEM_CACHE)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for cache entry");
+        sdsfree(value);
+        return;
+    }
+
+    e->hash_val = cache_hash(fill->key, sdslen(fill->key));
+    if (fill->tag != NULL) {
+        e->tag_hash = cache_hash(fill->tag, sdslen(fill->tag));
+        // the tag has been invalidated since the command was processed, so the
+        // response may be stale
+        if (s->epochs[e->tag_hash % CACHE_EPOCH_SLOTS] != fill->epoch) {
+            octopus_free(e);
+            sdsfree(value);
+            return;
+        }
+    }
+
+    // the response is copied, so it's accounted to the cache while it's shared
+    if ((data = octopus_malloc(sdslen(value), OCTOPUS_MEM_CACHE)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for cached response");
+        octopus_free(e);
+        sdsfree(value);
+        return;
+    }
+    memcpy(data, value, sdslen(value));
+    if ((e->value = bufref_create(data, sdslen(value), octopus_free, data)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create ref of cached response");
+        octopus_free(data);
+        octopus_free(e);
+        sdsfree(value);
+        return;
+    }
+    sdsfree(value);
+
+    now = cache_mstime(s);
+    e->processor = fill->processor;
+    e->expire_ms = now + fill->ttl_ms;
+    e->bytes = bytes;
+    // the key and tag are taken from the fill
+    e->key = fill->key;
+    e->tag = fill->tag;
+    fill->key = NULL;
+    fill->tag = NULL;
+
+    // filled by another miss of the same key
+    if ((old = entry_find(s, e->processor, e->key, e->hash_val)) != NULL) {
+        entry_remove(s, old);
+    }
+
+    shard_evict(s, bytes, now);
+    if (s->count >= s->bucket_count) {
+        shard_expand(s);
+    }
+
+    idx = bucket_of(s, e->hash_val);
+    e->next = s->buckets[idx];
+    s->buckets[idx] = e;
+    if (e->tag != NULL) {
+        idx = bucket_of(s, e->tag_hash);
+        e->next_tag = s->tag_buckets[idx];
+        s->tag_buckets[idx] = e;
+    }
+
+    if (s->hand == NULL) {
+        e->clock_prev = e->clock_next = e;
+        s->hand = e;
+    } else {
+        e->clock_next = s->hand;
+        e->clock_prev = s->hand->clock_prev;
+        e->clock_prev->clock_next = e;
+        s->hand->clock_prev = e;
+    }
+
+    s->count++;
+    s->bytes += bytes;
+    __sync_fetch_and_add(&stats.entries, 1);
+    __sync_fetch_and_add(&stats.bytes, bytes);
+}
+
+void cache_fill_destroy(void *p) {
+    cache_fill_t    *fill;
+
+    fill = (cache_fill_t *)p;
+    if (fill->key != NULL) {
+        sdsfree(fill->key);
+    }
+    if (fill->tag != NULL) {
+        sdsfree(fill->tag);
+    }
+    octopus_free(fill);
+}
+
+/**
+ * Remove the entries tagged with 'tag', and drop the fills in flight of it. It
+ * must be called in the thread owning the shard.
+ */
+static void shard_invalidate(cache_shard_t *s, const char *tag, int len) {
+    cache_entry_t   *e, *next;
+    unsigned int    tag_hash;
+
+    tag_hash = cache_hash(tag, len);
+    s->epochs[tag_hash % CACHE_EPOCH_SLOTS]++;
+
+    for (e = s->tag_buckets[bucket_of(s, tag_hash)]; e != NULL; e = next) {
+        next = e->next_tag;
+        if (e->tag_hash == tag_hash && sds_equal(e->tag, tag, len)) {
+            entry_remove(s, e);
+            __sync_fetch_and_add(&stats.invalidations, 1);
+        }
+    }
+}
+
+static void invalidation_handle(void *ctx) {
+    invalidation_t  *inv;
+
+    inv = (invalidation_t *)ctx;
+    shard_invalidate(inv->shard, inv->tag, sdslen(inv->tag));
+
+    sdsfree(inv->tag);
+    octopus_free(inv);
+}
+
+void octopus_cache_invalidate(const char *tag, int len) {
+    cache_shard_t   *s;
+    invalidation_t  *inv;
+
+    // the shard of current thread is invalidated at once, so the commands after
+    // the write in the same iteration don't hit the stale entries
+    if (current_shard != NULL) {
+        shard_invalidate(current_shard, tag, len);
+    }
+
+    pthread_mutex_lock(&shards_mu);
+    for (s = shards; s != NULL; s = s->next) {
+        if (s == current_shard) {
+            continue;
+        }
+
+        if ((inv = octopus_malloc(sizeof(invalidation_t), OCTOPUS_MEM_CACHE)) == NULL ||
+                (inv->tag = sdsnewlen(tag, len)) == NULL) {
+            OCTOPUS_ERROR_LOG("failed to alloc mem for cache invalidation");
+            octopus_free(inv);
+            continue;
+        }
+        inv->msg.ctx = inv;
+        inv->msg.handler = invalidation_handle;
+        inv->shard = s;
+
+        mailbox_post(s->mailbox, &inv->msg);
+    }
+    pthread_mutex_unlock(&shards_mu);
+}
+
+void octopus_cache_stats(cache_stats_t *st) {
+    st->hits = __sync_fetch_and_add(&stats.hits, 0);
+    st->misses = __sync_fetch_and_add(&stats.misses, 0);
+    st->evictions = __sync_fetch_and_add(&stats.evictions, 0);
+    st->invalidations = __sync_fetch_and_add(&stats.invalidations, 0);
+    st->entries = __sync_fetch_and_add(&stats.entries, 0);
+    st->bytes = __sync_fetch_and_add(&stats.bytes, 0);
+}
+
+#ifdef OCTOPUS_TEST_CACHE
+
+#include <stdio.h>
+
+static processor_t  test_processor;
+
+static void test_fill(const char *key, const char *tag, long long ttl_ms, int value_len) {
+    cache_fill_t    *fill;
+    sds             value;
+
+    fill = cache_fill_create(0, &test_processor, sdsnew(key),
+            tag != NULL ? sdsnew(tag) : NULL, ttl_ms);
+    value = sdsgrowzero(sdsempty(), value_len);
+    cache_fill(fill, value);
+    cache_fill_destroy(fill);
+}
+
+static int test_hit(mailbox_t *mb, const char *key) {
+    object_t    *obj;
+    sds         k;
+
+    k = sdsnew(key);
+    obj = cache_lookup(mb, &test_processor, k);
+    sdsfree(k);
+    if (obj == NULL) {
+        return OCTOPUS_FALSE;
+    }
+    obj->decr(obj);
+
+    return OCTOPUS_TRUE;
+}
+
+int main(int argc, char *argv[])
+{
+    aeEventLoop     *el;
+    mailbox_t       *mb;
+    cache_fill_t    *fill;
+    cache_stats_t   st;
+    char            key[32];
+    int             hits;
+
+    OCTOPUS_NOT_USED(argc);
+    OCTOPUS_NOT_USED(argv);
+
+    el = aeCreateEventLoop(64);
+    mb = mailbox_create(el);
+    octopus_cache_set_max_bytes(16 * 1024);
+
+    // the shard is created by the first lookup
+    printf("empty: %d\n", test_hit(mb, "k1"));
+
+    // TTL, the clock of the shard is the one of the event loop
+    test_fill("k1", NULL, 100, 10);
+    printf("before ttl: %d\n", test_hit(mb, "k1"));
+    el->monotonicUs += 150 * 1000;
+    printf("after ttl: %d\n", test_hit(mb, "k1"));
+
+    // invalidation takes effect before it returns in the thread of the shard
+    test_fill("k2", "a", 1000, 10);
+    test_fill("k3", "b", 1000, 10);
+    octopus_cache_invalidate("a", 1);
+    printf("invalidated: %d, other tag: %d\n", test_hit(mb, "k2"), test_hit(mb, "k3"));
+
+    // a miss processed before the invalidation isn't filled after it
+    fill = cache_fill_create(0, &test_processor, sdsnew("k4"), sdsnew("b"), 1000);
+    octopus_cache_invalidate("b", 1);
+    cache_fill(fill, sdsnew("stale"));
+    cache_fill_destroy(fill);
+    printf("stale fill: %d, same tag: %d\n", test_hit(mb, "k4"), test_hit(mb, "k3"));
+
+    // eviction keeps the bytes in the budget, and the recent entries are kept
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "e%d", i);
+        test_fill(key, NULL, 1000, 1024);
+    }
+    hits = 0;
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "e%d", i);
+        hits += test_hit(mb, key);
+    }
+    octopus_cache_stats(&st);
+    printf("hits: %d, last: %d, evictions: %lld, invalidations: %lld, bytes in budget: %d\n",
+            hits, test_hit(mb, "e99"), st.evictions, st.invalidations, st.bytes <= 16 * 1024);
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,92 @@
+/**
+ *
+ * @file    cache
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-19 10:24:13
+ */
+
+#ifndef OCTOPUS_CACHE_H
+#define OCTOPUS_CACHE_H
+
+#include "sds.h"
+#include "common.h"
+#include "object.h"
+#include "processor.h"
+#include "mailbox.h"
+#include "ilist.h"
+
+// default byte budget of the cache of each thread
+#define CACHE_DEFAULT_MAX_BYTES     (64 * 1024 * 1024)
+#define CACHE_INIT_BUCKETS          1024
+
+/**
+ * Response cache of encoded bytes. Each thread(ioworker) has its own shard, so
+ * no lock is taken on lookup and fill. Entries are evicted by CLOCK when the
+ * bytes exceed the budget, and expire after their TTL.
+ */
+
+typedef struct {
+    long long   hits;
+    long long   misses;
+    long long   evictions;
+    long long   invalidations;
+    long long   entries;
+    long long   bytes;
+} cache_stats_t;
+
+/**
+ * A miss waiting for its response to be encoded, which is then filled into
+ * the cache of the thread.
+ */
+typedef struct {
+    long long   seq;
+    processor_t *processor;
+    sds         key;
+    sds         tag;
+    long long   ttl_ms;
+    // invalidation epoch of the shard when the command was processed
+    long long   epoch;
+
+    // links the fill into the fills of its client
+    ilist_node_t    node;
+} cache_fill_t;
+
+/**
+ * @brief Set the byte budget of the cache of each thread, which must be called
+ *      before the server starts.
+ */
+void octopus_cache_set_max_bytes(long long bytes);
+
+/**
+ * @brief Look up the response of 'key' in the cache of current thread, which is
+ *      created at the first call. 'mailbox' is the mailbox of current thread,
+ *      which receives invalidations.
+ * @return object of OBJECT_TYPE_BYTES, or NULL if missed.
+ */
+object_t* cache_lookup(mailbox_t *mailbox, processor_t *processor, sds key);
+
+/**
+ * @brief Create a fill for a missed command. 'key' and 'tag' are owned by the
+ *      fill after the call.
+ */
+cache_fill_t* cache_fill_create(long long seq, processor_t *processor, sds key, sds tag,
+        long long ttl_ms);
+
+/**
+ * @brief Add the encoded response to the cache of current thread. It's dropped
+ *      if the tag may have been invalidated since the command was processed.
+ */
+void cache_fill(cache_fill_t *fill, sds value);
+
+void cache_fill_destroy(void *fill);
+
+/**
+ * @brief Remove entries tagged with 'tag' from caches of all threads. It can be
+ *      called in any thread. The cache of current thread is invalidated before
+ *      it returns, and the others asynchronously by the threads owning them.
+ */
+void octopus_cache_invalidate(const char *tag, int len);
+
+void octopus_cache_stats(cache_stats_t *stats);
+
+#endif /* ifndef OCTOPUS_CACHE_H */
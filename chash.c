@@ -0,0 +1,481 @@
+/**
+ *
+ * @file    chash
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-07-11 16:52:04
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "chash.h"
+#include "logging.h"
+#include "memory.h"
+
+#define CACHE_LINE_SIZE     64
+
+/**
+ * A shard takes its own cache lines, so threads working on different shards
+ * don't share lines.
+ */
+typedef struct {
+    // RWLOCK: the hash, which is guarded by 'rwlock'
+    pthread_rwlock_t    rwlock;
+    // READ_MOSTLY: the hash published to readers, which is replaced by writers
+    // holding 'write_mu'
+    pthread_mutex_t     write_mu;
+    hash_t              *hash;
+} __attribute__((aligned(CACHE_LINE_SIZE))) chash_shard_t;
+
+struct chash_s {
+    chash_shard_t   *shards;
+    int             shard_count;
+    int             shard_bits;
+    int             mode;
+
+    hash_func_t     hash_func;
+    equal_func_t    equal_func;
+    deallocator_t   key_dealloc;
+    deallocator_t   val_dealloc;
+};
+
+/**
+ * Readers of READ_MOSTLY hashes announce the epoch when they started, and 0 when
+ * they are done. A writer bumps the epoch after publishing a copy, and the old
+ * hash is freed once no reader is left from an epoch before it. Each thread has
+ * a reader, which is shared by all hashes.
+ */
+typedef struct reader_s {
+    unsigned long long  epoch;
+    struct reader_s     *next;
+} __attribute__((aligned(CACHE_LINE_SIZE))) reader_t;
+
+static unsigned long long   epoch = 1;
+
+static __thread reader_t    *current_reader;
+
+// readers of all threads, which are kept until the process exits
+static reader_t         *readers;
+static pthread_mutex_t  readers_mu = PTHREAD_MUTEX_INITIALIZER;
+
+static int str_hash_func(const void *k) {
+    return hash_bytes(k, strlen(k));
+}
+
+static int str_equal_func(const void *a, const void *b) {
+    return strcmp(a, b) == 0;
+}
+
+static reader_t* reader_get() {
+    reader_t    *r;
+
+    if (current_reader != NULL) {
+        return current_reader;
+    }
+
+    if (posix_memalign((void **)&r, CACHE_LINE_SIZE, sizeof(reader_t)) != 0) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for reader of chash");
+        return NULL;
+    }
+    memset(r, 0, sizeof(reader_t));
+
+    pthread_mutex_lock(&readers_mu);
+    r->next = readers;
+    __atomic_store_n(&readers, r, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&readers_mu);
+
+    current_reader = r;
+
+    return r;
+}
+
+/**
+ * The epoch is announced before the hash is loaded, and a writer publishes the
+ * copy before it checks readers, so either the writer waits for the reader or
+ * the reader sees the copy.
+ */
+static inline void read_lock(reader_t *r) {
+    __atomic_store_n(&r->epoch, __atomic_load_n(&epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    __sync_synchronize();
+}
+
+static inline void read_unlock(reader_t *r) {
+    __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Wait until readers which may have loaded a hash replaced before the call are
+ * done.
+ */
+static void synchronize() {
+    unsigned long long  target, e;
+
+    target = __sync_add_and_fetch(&epoch, 1);
+    for (reader_t *r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        while ((e = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE)) != 0 && e < target) {
+            sched_yield();
+        }
+    }
+}
+
+static inline chash_shard_t* shard_of(chash_t *m, const void *k) {
+    // The hash is spread by a multiplication, and its high bits pick the
+    // shard, so hashes in a shard still differ in the bits used by hash_t.
+    if (m->shard_bits == 0) {
+        return m->shards;
+    }
+
+    return &m->shards[((unsigned int)m->hash_func(k) * 0x9e3779b1u) >> (32 - m->shard_bits)];
+}
+
+chash_t* chash_create(hash_func_t hf, equal_func_t ef, deallocator_t kd, deallocator_t vd,
+        int shards, int mode) {
+    chash_t     *m;
+    int         inited;
+
+    if (hf == NULL || ef == NULL || shards < 0 ||
+            (mode != CHASH_MODE_RWLOCK && mode != CHASH_MODE_READ_MOSTLY)) {
+        OCTOPUS_ERROR_LOG("invalid param");
+        return NULL;
+    }
+
+    if ((m = octopus_calloc(1, sizeof(chash_t), OCTOPUS_MEM_TABLE)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for chash");
+        return NULL;
+    }
+
+    shards = shards == 0 ? CHASH_DEFAULT_SHARDS : shards;
+    while ((1 << m->shard_bits) < shards) {
+        m->shard_bits++;
+    }
+    m->shard_count = 1 << m->shard_bits;
+    m->mode = mode;
+    m->hash_func = hf;
+    m->equal_func = ef;
+    m->key_dealloc = kd;
+    m->val_dealloc = vd;
+
+    if (posix_memalign((void **)&m->shards, CACHE_LINE_SIZE,
+                sizeof(chash_shard_t) * m->shard_count) != 0) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for shards of chash, count: %d", m->shard_count);
+        octopus_free(m);
+        return NULL;
+    }
+    memset(m->shards, 0, sizeof(chash_shard_t) * m->shard_count);
+
+    // Hashes of READ_MOSTLY are shared by copies, so the entries are
+    // deallocated by the chash when they are removed.
+    for (inited = 0; inited < m->shard_count; inited++) {
+        if ((m->shards[inited].hash = hash_create(hf, ef, mode == CHASH_MODE_RWLOCK ? kd : NULL,
+                        mode == CHASH_MODE_RWLOCK ? vd : NULL)) == NULL) {
+            goto failed;
+        }
+        pthread_rwlock_init(&m->shards[inited].rwlock, NULL);
+        pthread_mutex_init(&m->shards[inited].write_mu, NULL);
+    }
+
+    return m;
+
+failed:
+    for (int i = 0; i < inited; i++) {
+        hash_destroy(m->shards[i].hash);
+        pthread_rwlock_destroy(&m->shards[i].rwlock);
+        pthread_mutex_destroy(&m->shards[i].write_mu);
+    }
+    free(m->shards);
+    octopus_free(m);
+
+    return NULL;
+}
+
+chash_t* chash_str_key_create(deallocator_t kd, deallocator_t vd, int shards, int mode) {
+    return chash_create(str_hash_func, str_equal_func, kd, vd, shards, mode);
+}
+
+/**
+ * Apply a put, or a remove if 'put' is false, to a copy of the hash of the
+ * shard, and replace the hash with it.
+ */
+static int read_mostly_write(chash_t *m, chash_shard_t *s, const void *k, const void *v,
+        int put) {
+    hash_t      *old, *copy;
+    pair_t      entry;
+    int         found;
+
+    pthread_mutex_lock(&s->write_mu);
+
+    old = s->hash;
+    found = hash_get_entry(old, k, &entry);
+    if (!put && !found) {
+        pthread_mutex_unlock(&s->write_mu);
+        return OCTOPUS_OK;
+    }
+
+    if ((copy = hash_dup(old)) == NULL) {
+        pthread_mutex_unlock(&s->write_mu);
+        return OCTOPUS_ERR;
+    }
+
+    if (put && hash_put(copy, k, v) == OCTOPUS_ERR) {
+        pthread_mutex_unlock(&s->write_mu);
+        hash_destroy(copy);
+        return OCTOPUS_ERR;
+    }
+    if (!put) {
+        hash_remove(copy, k);
+    }
+
+    __atomic_store_n(&s->hash, copy, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&s->write_mu);
+
+    synchronize();
+    hash_destroy(old);
+
+    // the key is kept by a put on an existing key, and its value is replaced
+    if (found && !put && m->key_dealloc != NULL) {
+        m->key_dealloc(entry.first);
+    }
+    if (found && entry.second != v && m->val_dealloc != NULL) {
+        m->val_dealloc(entry.second);
+    }
+
+    return OCTOPUS_OK;
+}
+
+int chash_put(chash_t *m, const void *k, const void *v) {
+    chash_shard_t   *s;
+    int             ret;
+
+    if (m == NULL) {
+        OCTOPUS_ERROR_LOG("invalid param");
+        return OCTOPUS_ERR;
+    }
+
+    s = shard_of(m, k);
+    if (m->mode == CHASH_MODE_READ_MOSTLY) {
+        return read_mostly_write(m, s, k, v, OCTOPUS_TRUE);
+    }
+
+    pthread_rwlock_wrlock(&s->rwlock);
+    ret = hash_put(s->hash, k, v);
+    pthread_rwlock_unlock(&s->rwlock);
+
+    return ret;
+}
+
+int chash_get(chash_t *m, const void *k, chash_visitor_t visit, void *arg) {
+    chash_shard_t   *s;
+    reader_t        *r;
+    pair_t          entry;
+    int             found;
+
+    if (m == NULL) {
+        OCTOPUS_ERROR_LOG("invalid param");
+        return OCTOPUS_FALSE;
+    }
+
+    s = shard_of(m, k);
+    if (m->mode == CHASH_MODE_READ_MOSTLY) {
+        if ((r = reader_get()) == NULL) {
+            return OCTOPUS_FALSE;
+        }
+
+        read_lock(r);
+        found = hash_get_entry(__atomic_load_n(&s->hash, __ATOMIC_ACQUIRE), k, &entry);
+        if (found && visit != NULL) {
+            visit(entry.first, entry.second, arg);
+        }
+        read_unlock(r);
+
+        return found;
+    }
+
+    pthread_rwlock_rdlock(&s->rwlock);
+    found = hash_get_entry(s->hash, k, &entry);
+    if (found && visit != NULL) {
+        visit(entry.first, entry.second, arg);
+    }
+    pthread_rwlock_unlock(&s->rwlock);
+
+    return found;
+}
+
+void chash_remove(chash_t *m, const void *k) {
+    chash_shard_t   *s;
+
+    if (m == NULL) {
+        OCTOPUS_ERROR_LOG("invalid param");
+        return;
+    }
+
+    s = shard_of(m, k);
+    if (m->mode == CHASH_MODE_READ_MOSTLY) {
+        read_mostly_write(m, s, k, NULL, OCTOPUS_FALSE);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&s->rwlock);
+    hash_remove(s->hash, k);
+    pthread_rwlock_unlock(&s->rwlock);
+}
+
+int chash_size(chash_t *m) {
+    chash_shard_t   *s;
+    reader_t        *r;
+    int             size;
+
+    r = NULL;
+    if (m->mode == CHASH_MODE_READ_MOSTLY && (r = reader_get()) == NULL) {
+        return 0;
+    }
+
+    size = 0;
+    for (int i = 0; i < m->shard_count; i++) {
+        s = &m->shards[i];
+        if (m->mode == CHASH_MODE_READ_MOSTLY) {
+            read_lock(r);
+            size += hash_size(__atomic_load_n(&s->hash, __ATOMIC_ACQUIRE));
+            read_unlock(r);
+        } else {
+            pthread_rwlock_rdlock(&s->rwlock);
+            size += hash_size(s->hash);
+            pthread_rwlock_unlock(&s->rwlock);
+        }
+    }
+
+    return size;
+}
+
+void chash_destroy(chash_t *m) {
+    chash_shard_t   *s;
+    iterator_t      *iter;
+    pair_t          *p;
+
+    if (m == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < m->shard_count; i++) {
+        s = &m->shards[i];
+        if (m->mode == CHASH_MODE_READ_MOSTLY &&
+                (m->key_dealloc != NULL || m->val_dealloc != NULL)) {
+            for (iter = hash_iter(s->hash); iter->has_next(iter);) {
+                p = (pair_t *)iter->next(iter);
+                if (m->key_dealloc != NULL) {
+                    m->key_dealloc(p->first);
+                }
+                if (m->val_dealloc != NULL) {
+                    m->val_dealloc(p->second);
+                }
+            }
+            hash_iter_destroy(iter);
+        }
+        hash_destroy(s->hash);
+        pthread_rwlock_destroy(&s->rwlock);
+        pthread_mutex_destroy(&s->write_mu);
+    }
+    free(m->shards);
+    octopus_free(m);
+}
+
+#ifdef OCTOPUS_TEST_CHASH
+
+#include <stdio.h>
+
+#define TEST_KEYS       10000
+#define TEST_THREADS    4
+#define TEST_ROUNDS     20000
+
+typedef struct {
+    chash_t     *m;
+    char        (*keys)[16];
+    int         id;
+    int         errors;
+} test_thread_t;
+
+// values are the keys themselves, so a visitor can tell a torn entry
+static void check_visit(const void *key, void *val, void *arg) {
+    if (strcmp(key, val) != 0) {
+        (*(int *)arg)++;
+    }
+}
+
+static void* test_run(void *arg) {
+    test_thread_t   *t;
+    unsigned int    seed;
+    int             idx;
+
+    t = (test_thread_t *)arg;
+    seed = t->id;
+    for (int i = 0; i < TEST_ROUNDS; i++) {
+        idx = rand_r(&seed) % TEST_KEYS;
+        if (t->id == 0 && i % 4 == 0) {
+            chash_put(t->m, t->keys[idx], t->keys[idx]);
+        } else if (t->id == 0 && i % 4 == 1) {
+            chash_remove(t->m, t->keys[idx]);
+        } else {
+            chash_get(t->m, t->keys[idx], check_visit, &t->errors);
+        }
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    test_thread_t   threads[TEST_THREADS];
+    pthread_t       tids[TEST_THREADS];
+    chash_t         *m;
+    char            (*keys)[16];
+    int             errors, missing;
+    const char      *mode_names[] = {"rwlock", "read mostly"};
+
+    OCTOPUS_NOT_USED(argc);
+    OCTOPUS_NOT_USED(argv);
+
+    keys = malloc(sizeof(*keys) * TEST_KEYS);
+    for (int i = 0; i < TEST_KEYS; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "k%d", i);
+    }
+
+    for (int mode = CHASH_MODE_RWLOCK; mode <= CHASH_MODE_READ_MOSTLY; mode++) {
+        m = chash_str_key_create(NULL, NULL, 0, mode);
+        for (int i = 0; i < TEST_KEYS; i++) {
+            chash_put(m, keys[i], keys[i]);
+        }
+
+        missing = 0;
+        for (int i = 0; i < TEST_KEYS; i++) {
+            missing += !chash_get(m, keys[i], NULL, NULL);
+        }
+        chash_remove(m, keys[0]);
+        printf("%s: size: %d, missing: %d, removed exists: %d\n", mode_names[mode],
+                chash_size(m), missing, chash_get(m, keys[0], NULL, NULL));
+
+        // one writer and readers checking entries they see
+        for (int i = 0; i < TEST_THREADS; i++) {
+            threads[i].m = m;
+            threads[i].keys = keys;
+            threads[i].id = i;
+            threads[i].errors = 0;
+            pthread_create(&tids[i], NULL, test_run, &threads[i]);
+        }
+
+        errors = 0;
+        for (int i = 0; i < TEST_THREADS; i++) {
+            pthread_join(tids[i], NULL);
+            errors += threads[i].errors;
+        }
+        printf("%s: concurrent errors: %d\n", mode_names[mode], errors);
+
+        chash_destroy(m);
+    }
+
+    free(keys);
+
+    return 0;
+}
+
+#endif
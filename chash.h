@@ -0,0 +1,67 @@
+/**
+ *
+ * @file    chash
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-07-11 16:20:37
+ */
+
+#ifndef OCTOPUS_CHASH_H
+#define OCTOPUS_CHASH_H
+
+#include "hash.h"
+#include "common.h"
+
+#define CHASH_DEFAULT_SHARDS    64
+
+/**
+ * How readers are synchronized with writers.
+ * RWLOCK: each shard has a reader-writer lock.
+ * READ_MOSTLY: readers take no lock and write nothing shared. Each write copies
+ *      the hash of its shard and publishes the copy, then waits until readers
+ *      of the old one are done before freeing it, so writes are expensive.
+ */
+#define CHASH_MODE_RWLOCK       0
+#define CHASH_MODE_READ_MOSTLY  1
+
+/**
+ * Concurrent hash, which can be shared by ioworkers and workers. Keys are
+ * spread over shards, each of which is a hash_t with its own lock.
+ */
+typedef struct chash_s chash_t;
+
+/**
+ * Called with the entry found by chash_get, while the entry can't be removed
+ * or replaced. It must not call functions of the chash.
+ */
+typedef void (*chash_visitor_t)(const void *key, void *val, void *arg);
+
+/**
+ * @brief Create a concurrent hash. 'shards' is rounded up to a power of 2, and
+ *      CHASH_DEFAULT_SHARDS is used if it's 0. 'mode' is CHASH_MODE_*.
+ */
+chash_t* chash_create(hash_func_t h, equal_func_t e, deallocator_t kdealloc,
+        deallocator_t vdealloc, int shards, int mode);
+chash_t* chash_str_key_create(deallocator_t kdealloc, deallocator_t vdealloc, int shards,
+        int mode);
+
+/**
+ * @brief Put the entry, which replaces the value of an existing key like
+ *      hash_put.
+ */
+int chash_put(chash_t *m, const void *k, const void *v);
+
+/**
+ * @brief Look up 'k', and call 'visit' with the entry if it's found. 'visit'
+ *      can be NULL to test the existence only.
+ * @return OCTOPUS_TRUE if the key exists.
+ */
+int chash_get(chash_t *m, const void *k, chash_visitor_t visit, void *arg);
+void chash_remove(chash_t *m, const void *k);
+int chash_size(chash_t *m);
+
+/**
+ * @brief Destroy the hash, which mustn't be used by other threads any more.
+ */
+void chash_destroy(chash_t *m);
+
+#endif /* ifndef OCTOPUS_CHASH_H */
@@ -10,9 +10,16 @@
 #include "client.h"
 #include "buffer.h"
 #include "logging.h"
+#include "cache.h"
+#include "memory.h"
 
 #define DEFAULT_INPUT_BUF_LEN   1024 * 1024
 #define DEFAULT_OUTPUT_BUF_LEN  1024 * 1024
+// Output buffers grow for responses encoded before reading is paused by the
+// watermarks, e.g. of pending requests, but no more than it.
+#define MAX_OUTPUT_BUF_LEN      64 * 1024 * 1024
+// the deque grows for longer pipelines
+#define INPUT_CMD_OBJS_CAPACITY 16
 
 static void inbuf_list_deallocator(void *p) {
     buffer_destroy((buffer_t *)p);
@@ -32,7 +39,7 @@ static void cmd_obj_deallocator(void *p) {
 client_t* client_create() {
     client_t    *cli;
 
-    cli = calloc(1, sizeof(client_t));
+    cli = octopus_calloc(1, sizeof(client_t), OCTOPUS_MEM_CLIENT);
     if (cli == NULL) {
         OCTOPUS_ERROR_LOG("failed to alloc mem for client");
         return NULL;
@@ -55,21 +62,17 @@ client_t* client_create() {
         OCTOPUS_ERROR_LOG("failed to create output buf");
         goto failed;
     }
+    buffer_set_max_size(cli->outbuf, MAX_OUTPUT_BUF_LEN);
 
-    // TODO: need to deallocate the output commands
-    cli->input_cmd_objs = list_create(cmd_obj_deallocator);
+    cli->input_cmd_objs = deque_create(INPUT_CMD_OBJS_CAPACITY, cmd_obj_deallocator);
     if (cli->input_cmd_objs == NULL) {
-        OCTOPUS_ERROR_LOG("failed to create output commands list");
-        goto failed;
-    }
-
-    cli->input_cmd_objs_iter = list_iter(cli->input_cmd_objs);
-    if (cli->input_cmd_objs_iter == NULL) {
-        OCTOPUS_ERROR_LOG("failed to create output commands iterator");
+        OCTOPUS_ERROR_LOG("failed to create input commands deque");
         goto failed;
     }
 
     cli->fd = -1;
+    cli->read_start_ms = -1;
+    cli->commands_budget = -1;
 
     return cli;
 
@@ -78,19 +81,34 @@ failed:
     failed_destroy(cli->inbuf, buffer);
     failed_destroy(cli->inbuf_list, list);
     failed_destroy(cli->outbuf, buffer);
-    failed_destroy(cli->input_cmd_objs, list);
-    failed_destroy(cli->input_cmd_objs_iter, list_iter);
-    free(cli);
+    failed_destroy(cli->input_cmd_objs, deque);
+    octopus_free(cli);
 
     return NULL;
 }
 
 void client_destroy(client_t *cli) {
+    ilist_node_t    *node;
+
+    timewheel_cancel(&cli->timer);
+
     buffer_destroy(cli->inbuf);
     list_destroy(cli->inbuf_list);
     buffer_destroy(cli->outbuf);
-    list_destroy(cli->input_cmd_objs);
-    list_iter_destroy(cli->input_cmd_objs_iter);
+    deque_destroy(cli->input_cmd_objs);
+
+    if (cli->slots != NULL) {
+        for (long long seq = cli->sent_seq; seq < cli->next_seq; seq++) {
+            if (cli->slots[seq & (CLIENT_MAX_INFLIGHT - 1)] != CLIENT_SLOT_NO_REPLY) {
+                cmd_obj_deallocator(cli->slots[seq & (CLIENT_MAX_INFLIGHT - 1)]);
+            }
+        }
+        octopus_free(cli->slots);
+    }
+
+    while ((node = ilist_pop(&cli->cache_fills)) != NULL) {
+        cache_fill_destroy(ilist_entry(node, cache_fill_t, node));
+    }
 
     if (cli->protocol_obj != NULL) {
         cli->protocol_obj->decr(cli->protocol_obj);
@@ -103,5 +121,5 @@ void client_destroy(client_t *cli) {
         close(cli->fd);
     }
 
-    free(cli);
+    octopus_free(cli);
 }
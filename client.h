@@ -14,11 +14,22 @@
 #include "common.h"
 #include "object.h"
 #include "list.h"
+#include "ilist.h"
+#include "deque.h"
+#include "mailbox.h"
+#include "timewheel.h"
 
-typedef struct {
+// max number of requests whose responses haven't been encoded, a power of 2
+#define CLIENT_MAX_INFLIGHT     1024
+// a slot whose request has completed without response
+#define CLIENT_SLOT_NO_REPLY    ((object_t *)-1)
+
+struct client_s {
     int     fd;
 
     octopus_t   *oct;
+    // context of the listening socket accepting the client
+    struct srv_ctx_s    *srv_ctx;
 
     // object holder of protocol
     object_t    *protocol_obj;
@@ -31,11 +42,63 @@ typedef struct {
     buffer_t    *inbuf;
     list_t      *inbuf_list;
 
-    list_t      *input_cmd_objs;
-    iterator_t  *input_cmd_objs_iter;
+    // objects of commands decoded, in the order of requests
+    deque_t     *input_cmd_objs;
 
     buffer_t    *outbuf;
-} client_t;
+
+    // set when the protocol asks to close the connection after the output is
+    // sent, no more input is processed after that
+    int         close_after_reply;
+
+    // event loop and mailbox of the thread which the client belongs to
+    aeEventLoop     *event_loop;
+    mailbox_t       *mailbox;
+
+    // Reorder slots of responses indexed by sequence of requests, so pipelined
+    // responses are encoded in the order of requests. A slot is NULL if the
+    // response is pending. It's allocated when a request is pending first time.
+    object_t    **slots;
+    long long   next_seq;       // sequence of next request to process
+    long long   sent_seq;       // sequence of next response to encode
+    int         pending;        // requests which haven't been completed
+    int         read_paused;    // reading is paused since the slots are full
+    int         output_paused;  // paused by the high watermark of the output
+    // average length of recent responses encoded, by which responses not
+    // encoded yet are counted toward the high watermark
+    long long   reply_len_avg;
+    // Events are registered once for both directions, edge-triggered. Then
+    // reading is paused by ignoring the events, and 'writable' is cleared
+    // when the socket is full, until it's reported writable.
+    int         edge_triggered;
+    int         writable;
+    int         coroutines;     // commands suspended on coroutines
+    // cache misses whose responses will be filled into the cache after being
+    // encoded, in the order of requests
+    ilist_t     cache_fills;
+    // the connection is closed, and the client is destroyed once all pending
+    // requests complete
+    int         closing;
+
+    // Timestamps for timeouts, on the monotonic clock of the event loop. They
+    // are only stored on activity, and the deadline in the time wheel of the
+    // thread is checked against them lazily.
+    long long           active_ms;      // last bytes read or response sent
+    long long           read_start_ms;  // first byte of a partial request, or -1
+    long long           write_ms;       // output pending or progressed last
+    timewheel_node_t    timer;
+
+    // linked while the output waits to be written before the loop sleeps
+    ilist_node_t        write_node;
+    // Commands the client can still run in this turn of reading, -1 if it's
+    // unlimited. Once it's spent, the rest of commands are left in the list.
+    int                 commands_budget;
+    // linked while reading continues in the next iteration, since the client
+    // has spent its budget
+    ilist_node_t        read_node;
+    // linked into the clients of the thread while it's watched
+    ilist_node_t        thread_node;
+};
 
 client_t* client_create();
 void client_destroy(client_t *cli);
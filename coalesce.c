@@ -0,0 +1,326 @@
+/**
+ *
+ * @file    coalesce
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-18 11:42:09
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "coalesce.h"
+#include "ilist.h"
+#include "memory.h"
+#include "logging.h"
+#include "common.h"
+
+#define bucket_of(hash_val)     ((hash_val) & (COALESCE_BUCKETS - 1))
+
+/**
+ * A pending command, which is linked into both tables: by the command for
+ * joining, and by the leading request for finishing. It's open for joining
+ * until it's forgotten, while it's kept for finishing.
+ */
+typedef struct flight_s {
+    unsigned int    hash_val;
+    processor_t     *processor;
+    cmd_equal_t     cmd_equal;
+    // copy of the command leading the flight
+    object_t        *cmd_obj;
+    // set by coalescable of the processor, NULL if it may read anything
+    sds             tag;
+    int             open;
+    ilist_node_t    node;
+
+    client_t        *cli;
+    long long       token;
+
+    coalesce_waiter_t   *waiters;
+    coalesce_waiter_t   **waiters_tail;
+
+    struct flight_s     *next;
+    struct flight_s     *next_leader;
+} flight_t;
+
+static __thread flight_t    *flights[COALESCE_BUCKETS];
+static __thread flight_t    *leaders[COALESCE_BUCKETS];
+static __thread int         flight_count;
+// flights which can be joined, in the order of leading
+static __thread ilist_t     open_flights;
+
+static inline unsigned int leader_hash(client_t *cli, long long token) {
+    return (unsigned int)((uintptr_t)cli >> 4) ^ (unsigned int)token;
+}
+
+static int supported(protocol_t *protocol) {
+    return protocol->cmd_hash != NULL && protocol->cmd_equal != NULL &&
+        protocol->cmd_dup != NULL;
+}
+
+int coalesce_join(protocol_t *protocol, processor_t *processor, object_t *cmd_obj,
+        client_t *cli, long long token) {
+
+    flight_t            *f;
+    coalesce_waiter_t   *w;
+    unsigned int        hash_val;
+
+    if (ilist_empty(&open_flights) || !supported(protocol)) {
+        return OCTOPUS_ERR;
+    }
+
+    hash_val = protocol->cmd_hash(cmd_obj);
+    for (f = flights[bucket_of(hash_val)]; f != NULL; f = f->next) {
+        if (f->hash_val == hash_val && f->processor == processor &&
+                f->cmd_equal == protocol->cmd_equal && f->cmd_equal(f->cmd_obj, cmd_obj)) {
+            break;
+        }
+    }
+
+    if (f == NULL) {
+        return OCTOPUS_ERR;
+    }
+
+    if ((w = octopus_malloc(sizeof(coalesce_waiter_t), OCTOPUS_MEM_COMMAND)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for waiter of coalesced command");
+        return OCTOPUS_ERR;
+    }
+    w->cli = cli;
+    w->token = token;
+    w->next = NULL;
+
+    *f->waiters_tail = w;
+    f->waiters_tail = &w->next;
+
+    return OCTOPUS_OK;
+}
+
+int coalesce_lead(protocol_t *protocol, processor_t *processor, object_t *cmd_obj,
+        sds tag, client_t *cli, long long token) {
+
+    flight_t        *f;
+    unsigned int    idx;
+
+    if (!supported(protocol)) {
+        goto failed;
+    }
+
+    if ((f = octopus_malloc(sizeof(flight_t), OCTOPUS_MEM_COMMAND)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for coalesced command");
+        goto failed;
+    }
+
+    if ((f->cmd_obj = protocol->cmd_dup(cmd_obj)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to copy command for coalescing");
+        octopus_free(f);
+        goto failed;
+    }
+    f->hash_val = protocol->cmd_hash(cmd_obj);
+    f->processor = processor;
+    f->cmd_equal = protocol->cmd_equal;
+    f->tag = tag;
+    f->open = OCTOPUS_TRUE;
+    f->cli = cli;
+    f->token = token;
+    f->waiters = NULL;
+    f->waiters_tail = &f->waiters;
+
+    idx = bucket_of(f->hash_val);
+    f->next = flights[idx];
+    flights[idx] = f;
+
+    idx = bucket_of(leader_hash(cli, token));
+    f->next_leader = leaders[idx];
+    leaders[idx] = f;
+
+    ilist_push(&open_flights, &f->node);
+    flight_count++;
+
+    return OCTOPUS_OK;
+
+failed:
+    if (tag != NULL) {
+        sdsfree(tag);
+    }
+
+    return OCTOPUS_ERR;
+}
+
+/**
+ * Unlink the flight from the table by commands, so no one joins it.
+ */
+static void flight_close(flight_t *f) {
+    flight_t    **pf;
+
+    for (pf = &flights[bucket_of(f->hash_val)]; *pf != f; pf = &(*pf)->next);
+    *pf = f->next;
+
+    ilist_remove(&open_flights, &f->node);
+    f->open = OCTOPUS_FALSE;
+}
+
+void octopus_coalesce_forget(const char *tag, int len) {
+    ilist_node_t    *node, *nxt;
+    flight_t        *f;
+
+    ilist_foreach(&open_flights, node, nxt) {
+        f = ilist_entry(node, flight_t, node);
+        if (f->tag == NULL ||
+                ((int)sdslen(f->tag) == len && memcmp(f->tag, tag, len) == 0)) {
+            flight_close(f);
+        }
+    }
+}
+
+coalesce_waiter_t* coalesce_finish(client_t *cli, long long token) {
+    flight_t            **pf, *f;
+    coalesce_waiter_t   *waiters;
+
+    if (flight_count == 0) {
+        return NULL;
+    }
+
+    for (pf = &leaders[bucket_of(leader_hash(cli, token))]; *pf != NULL;
+            pf = &(*pf)->next_leader) {
+        if ((*pf)->cli == cli && (*pf)->token == token) {
+            break;
+        }
+    }
+
+    if ((f = *pf) == NULL) {
+        return NULL;
+    }
+    *pf = f->next_leader;
+
+    if (f->open) {
+        flight_close(f);
+    }
+
+    flight_count--;
+
+    waiters = f->waiters;
+    f->cmd_obj->decr(f->cmd_obj);
+    if (f->tag != NULL) {
+        sdsfree(f->tag);
+    }
+    octopus_free(f);
+
+    return waiters;
+}
+
+#ifdef OCTOPUS_TEST_COALESCE
+
+#include <stdio.h>
+
+typedef struct {
+    command_t_implement;
+    char    name[8];
+    char    key[8];
+} test_cmd_t;
+
+static void test_cmd_destroy(command_t *cmd) {
+    free(cmd);
+}
+
+static object_t* test_cmd(const char *name, const char *key) {
+    test_cmd_t  *cmd;
+
+    cmd = calloc(1, sizeof(test_cmd_t));
+    cmd->destroy = test_cmd_destroy;
+    strcpy(cmd->name, name);
+    strcpy(cmd->key, key);
+
+    return object_create_cmd((command_t *)cmd);
+}
+
+static unsigned int test_cmd_hash(object_t *cmd_obj) {
+    return (unsigned char)((test_cmd_t *)cmd_obj->obj.cmd)->key[0];
+}
+
+static int test_cmd_equal(object_t *a, object_t *b) {
+    test_cmd_t  *x, *y;
+
+    x = (test_cmd_t *)a->obj.cmd;
+    y = (test_cmd_t *)b->obj.cmd;
+
+    return strcmp(x->name, y->name) == 0 && strcmp(x->key, y->key) == 0;
+}
+
+static object_t* test_cmd_dup(object_t *cmd_obj) {
+    test_cmd_t  *cmd;
+
+    cmd = (test_cmd_t *)cmd_obj->obj.cmd;
+
+    return test_cmd(cmd->name, cmd->key);
+}
+
+static int waiters_free(coalesce_waiter_t *w) {
+    coalesce_waiter_t   *next;
+    int                 n;
+
+    for (n = 0; w != NULL; w = next, n++) {
+        next = w->next;
+        octopus_free(w);
+    }
+
+    return n;
+}
+
+/**
+ * Requests on a client are pipelined as: GET a, GET a, INCR a, GET a, GET a,
+ * where the reads are pending. The write closes the flight of 'a', so the reads
+ * after it share a new flight instead of the response read before it.
+ */
+int main(int argc, char *argv[])
+{
+    protocol_t  protocol;
+    processor_t processor;
+    client_t    *cli;
+    object_t    *get_a, *mget;
+    int         first, second, after;
+
+    OCTOPUS_NOT_USED(argc);
+    OCTOPUS_NOT_USED(argv);
+
+    memset(&protocol, 0, sizeof(protocol));
+    protocol.cmd_hash = test_cmd_hash;
+    protocol.cmd_equal = test_cmd_equal;
+    protocol.cmd_dup = test_cmd_dup;
+    memset(&processor, 0, sizeof(processor));
+    cli = (client_t *)&processor;
+
+    get_a = test_cmd("GET", "a");
+    mget = test_cmd("MGET", "b");
+
+    // GET a leads, and the identical one joins it
+    printf("join before lead: %d\n", coalesce_join(&protocol, &processor, get_a, cli, 1));
+    coalesce_lead(&protocol, &processor, get_a, sdsnew("a"), cli, 1);
+    printf("join before write: %d\n", coalesce_join(&protocol, &processor, get_a, cli, 2));
+
+    // a write to another key keeps it open, but the untagged MGET is closed
+    coalesce_lead(&protocol, &processor, mget, NULL, cli, 3);
+    octopus_coalesce_forget("b", 1);
+    printf("join after write to b: %d, mget: %d\n",
+            coalesce_join(&protocol, &processor, get_a, cli, 4),
+            coalesce_join(&protocol, &processor, mget, cli, 5));
+
+    // INCR a, the reads after it lead a new flight
+    octopus_coalesce_forget("a", 1);
+    printf("join after write to a: %d\n", coalesce_join(&protocol, &processor, get_a, cli, 6));
+    coalesce_lead(&protocol, &processor, get_a, sdsnew("a"), cli, 6);
+    printf("join new flight: %d\n", coalesce_join(&protocol, &processor, get_a, cli, 7));
+
+    // the closed flight still completes its waiters
+    first = waiters_free(coalesce_finish(cli, 1));
+    second = waiters_free(coalesce_finish(cli, 6));
+    after = waiters_free(coalesce_finish(cli, 3));
+    printf("waiters, first: %d, second: %d, mget: %d, flights left: %d\n",
+            first, second, after, flight_count);
+
+    get_a->decr(get_a);
+    mget->decr(mget);
+
+    return 0;
+}
+
+#endif
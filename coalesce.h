@@ -0,0 +1,67 @@
+/**
+ *
+ * @file    coalesce
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-18 11:05:37
+ */
+
+#ifndef OCTOPUS_COALESCE_H
+#define OCTOPUS_COALESCE_H
+
+#include "common.h"
+#include "object.h"
+#include "protocol.h"
+#include "processor.h"
+
+// buckets of the in-flight table of each thread, a power of 2
+#define COALESCE_BUCKETS    1024
+
+/**
+ * A request waiting for the response of an identical one.
+ */
+typedef struct coalesce_waiter_s {
+    client_t    *cli;
+    long long   token;
+
+    struct coalesce_waiter_s    *next;
+} coalesce_waiter_t;
+
+/**
+ * Each thread has its own in-flight table, so only the clients of the same
+ * ioworker are coalesced, and no lock is needed.
+ */
+
+/**
+ * @brief Attach the request(cli, token) to an in-flight command identical to
+ *      'cmd_obj', which is processed by the same processor.
+ * @return OCTOPUS_OK if attached, and the request is completed with the response
+ *      of that command. OCTOPUS_ERR if there isn't one.
+ */
+int coalesce_join(protocol_t *protocol, processor_t *processor, object_t *cmd_obj,
+        client_t *cli, long long token);
+
+/**
+ * @brief Make the pending request(cli, token) in flight, so identical commands
+ *      can join it. The command is copied by cmd_dup of the protocol, and 'tag'
+ *      set by coalescable of the processor is taken, even if it fails.
+ */
+int coalesce_lead(protocol_t *protocol, processor_t *processor, object_t *cmd_obj,
+        sds tag, client_t *cli, long long token);
+
+/**
+ * @brief Called when the request(cli, token) completes. If it's in flight, it's
+ *      removed from the table.
+ * @return requests waiting for the response, which are freed by the caller with
+ *      octopus_free.
+ */
+coalesce_waiter_t* coalesce_finish(client_t *cli, long long token);
+
+/**
+ * @brief Close the flights of current thread tagged with 'tag', and the ones
+ *      without a tag, so the identical commands after it are processed instead
+ *      of sharing the responses. It's called before a write to the key the tag
+ *      stands for, and the flights keep their waiters.
+ */
+void octopus_coalesce_forget(const char *tag, int len);
+
+#endif /* ifndef OCTOPUS_COALESCE_H */
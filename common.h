@@ -71,6 +71,8 @@ typedef struct {
 
 typedef struct object_s object_t;
 
+typedef struct client_s client_t;
+
 /**
  * A function pointer used to deallocate resource.
  */
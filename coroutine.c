@@ -0,0 +1,242 @@
+/**
+ *
+ * @file    coroutine
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-17 14:58:20
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include "coroutine.h"
+#include "logging.h"
+#include "common.h"
+#include "memory.h"
+
+#ifndef MAP_STACK
+#define MAP_STACK   0
+#endif
+
+struct coroutine_s {
+    ucontext_t          ctx;
+    aeEventLoop         *event_loop;
+
+    coroutine_func_t    *func;
+    void                *arg;
+    int                 finished;
+
+    // the lowest page of the stack is a guard page
+    char                *stack;
+    size_t              stack_size;
+
+    // next coroutine in the free list
+    coroutine_t         *next;
+};
+
+// Each thread has its own free list and scheduler context, since a coroutine
+// is always resumed by the thread creating it.
+static __thread coroutine_t     *free_list;
+static __thread int             free_count;
+static __thread coroutine_t     *current;
+static __thread ucontext_t      caller_ctx;
+
+static size_t page_size() {
+    static size_t   size;
+
+    if (size == 0) {
+        size = sysconf(_SC_PAGESIZE);
+    }
+
+    return size;
+}
+
+static coroutine_t* coroutine_alloc() {
+    coroutine_t *co;
+    size_t      guard;
+
+    if (free_list != NULL) {
+        co = free_list;
+        free_list = co->next;
+        free_count--;
+        return co;
+    }
+
+    if ((co = octopus_calloc(1, sizeof(coroutine_t), OCTOPUS_MEM_COMMAND)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for coroutine");
+        return NULL;
+    }
+
+    guard = page_size();
+    co->stack_size = COROUTINE_STACK_SIZE + guard;
+    co->stack = mmap(NULL, co->stack_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (co->stack == MAP_FAILED) {
+        OCTOPUS_ERROR_LOG_BY_ERRNO("failed to mmap stack of coroutine");
+        octopus_free(co);
+        return NULL;
+    }
+
+    // overflow hits the guard page instead of the memory below the stack
+    if (mprotect(co->stack, guard, PROT_NONE) == -1) {
+        OCTOPUS_ERROR_LOG_BY_ERRNO("failed to protect guard page of coroutine");
+        munmap(co->stack, co->stack_size);
+        octopus_free(co);
+        return NULL;
+    }
+
+    return co;
+}
+
+static void coroutine_recycle(coroutine_t *co) {
+    if (free_count >= COROUTINE_POOL_MAX) {
+        munmap(co->stack, co->stack_size);
+        octopus_free(co);
+        return;
+    }
+
+    co->next = free_list;
+    free_list = co;
+    free_count++;
+}
+
+static void coroutine_entry() {
+    coroutine_t     *co;
+
+    co = current;
+    co->func(co->arg);
+    co->finished = OCTOPUS_TRUE;
+    // back to uc_link, which is the caller of coroutine_resume
+}
+
+static int coroutine_init_ctx(coroutine_t *co) {
+    size_t  guard;
+
+    if (getcontext(&co->ctx) == -1) {
+        OCTOPUS_ERROR_LOG_BY_ERRNO("failed to get context for coroutine");
+        return OCTOPUS_ERR;
+    }
+
+    guard = page_size();
+    co->ctx.uc_stack.ss_sp = co->stack + guard;
+    co->ctx.uc_stack.ss_size = co->stack_size - guard;
+    co->ctx.uc_link = &caller_ctx;
+    makecontext(&co->ctx, coroutine_entry, 0);
+
+    return OCTOPUS_OK;
+}
+
+coroutine_t* coroutine_create(aeEventLoop *event_loop, coroutine_func_t *func, void *arg) {
+    coroutine_t     *co;
+
+    if ((co = coroutine_alloc()) == NULL) {
+        return NULL;
+    }
+
+    if (coroutine_init_ctx(co) == OCTOPUS_ERR) {
+        coroutine_recycle(co);
+        return NULL;
+    }
+
+    co->event_loop = event_loop;
+    co->func = func;
+    co->arg = arg;
+    co->finished = OCTOPUS_FALSE;
+    co->next = NULL;
+
+    return co;
+}
+
+int coroutine_resume(coroutine_t *co) {
+    coroutine_t     *prev;
+
+    // Nested resumption isn't supported, a coroutine can only be resumed by
+    // the scheduler of the thread.
+    if (current != NULL) {
+        OCTOPUS_ERROR_LOG("can't resume a coroutine in another coroutine");
+        return OCTOPUS_ERR;
+    }
+
+    prev = current;
+    current = co;
+    if (swapcontext(&caller_ctx, &co->ctx) == -1) {
+        OCTOPUS_ERROR_LOG_BY_ERRNO("failed to switch to coroutine");
+        current = prev;
+        return OCTOPUS_ERR;
+    }
+    current = prev;
+
+    if (co->finished) {
+        coroutine_recycle(co);
+        return OCTOPUS_OK;
+    }
+
+    return OCTOPUS_AGAIN;
+}
+
+coroutine_t* coroutine_current() {
+    return current;
+}
+
+static void coroutine_yield(coroutine_t *co) {
+    swapcontext(&co->ctx, &caller_ctx);
+}
+
+static void fd_ready(struct aeEventLoop *event_loop, int fd, void *data, int mask) {
+    aeDeleteFileEvent(event_loop, fd, mask);
+    coroutine_resume((coroutine_t *)data);
+}
+
+static int yield_until(int fd, int mask) {
+    coroutine_t     *co;
+
+    if ((co = current) == NULL) {
+        OCTOPUS_ERROR_LOG("not in a coroutine, fd: %d", fd);
+        return OCTOPUS_ERR;
+    }
+
+    if (aeCreateFileEvent(co->event_loop, fd, mask, fd_ready, co) == AE_ERR) {
+        OCTOPUS_ERROR_LOG("failed to watch fd for coroutine, fd: %d", fd);
+        return OCTOPUS_ERR;
+    }
+
+    coroutine_yield(co);
+
+    return OCTOPUS_OK;
+}
+
+int octopus_yield_until_readable(int fd) {
+    return yield_until(fd, AE_READABLE);
+}
+
+int octopus_yield_until_writable(int fd) {
+    return yield_until(fd, AE_WRITABLE);
+}
+
+static int timer_fired(struct aeEventLoop *event_loop, long long id, void *data) {
+    OCTOPUS_NOT_USED(event_loop);
+    OCTOPUS_NOT_USED(id);
+
+    coroutine_resume((coroutine_t *)data);
+
+    return AE_NOMORE;
+}
+
+int octopus_sleep(long long ms) {
+    coroutine_t     *co;
+
+    if ((co = current) == NULL) {
+        OCTOPUS_ERROR_LOG("not in a coroutine");
+        return OCTOPUS_ERR;
+    }
+
+    if (aeCreateTimeEvent(co->event_loop, ms, timer_fired, co, NULL) == AE_ERR) {
+        OCTOPUS_ERROR_LOG("failed to add timer for coroutine, ms: %lld", ms);
+        return OCTOPUS_ERR;
+    }
+
+    coroutine_yield(co);
+
+    return OCTOPUS_OK;
+}
@@ -0,0 +1,58 @@
+/**
+ *
+ * @file    coroutine
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-17 14:26:51
+ */
+
+#ifndef OCTOPUS_COROUTINE_H
+#define OCTOPUS_COROUTINE_H
+
+#include "libae/ae.h"
+#include "common.h"
+
+#define COROUTINE_STACK_SIZE    (128 * 1024)
+// max count of stacks kept by the free list of each thread
+#define COROUTINE_POOL_MAX      256
+
+typedef struct coroutine_s coroutine_t;
+
+typedef void (coroutine_func_t)(void *arg);
+
+/**
+ * @brief Create a coroutine running on 'event_loop', whose stack is taken from
+ *      the free list of current thread. It must be resumed by the same thread.
+ */
+coroutine_t* coroutine_create(aeEventLoop *event_loop, coroutine_func_t *func, void *arg);
+
+/**
+ * @brief Run the coroutine until it yields or finishes. A finished coroutine is
+ *      recycled, and can't be used any more.
+ * @return OCTOPUS_OK if the coroutine has finished, or OCTOPUS_AGAIN if it yields.
+ */
+int coroutine_resume(coroutine_t *co);
+
+/**
+ * @brief Coroutine running in current thread, or NULL if it's not in a coroutine.
+ */
+coroutine_t* coroutine_current();
+
+/**
+ * @brief Yield the current coroutine until the fd is readable. It's resumed by
+ *      the event loop of the coroutine.
+ * @return OCTOPUS_OK if readable, OCTOPUS_ERR if not in a coroutine or failed to
+ *      watch the fd.
+ */
+int octopus_yield_until_readable(int fd);
+
+/**
+ * @brief Same as octopus_yield_until_readable, but waits for writable.
+ */
+int octopus_yield_until_writable(int fd);
+
+/**
+ * @brief Yield the current coroutine for 'ms' milliseconds.
+ */
+int octopus_sleep(long long ms);
+
+#endif /* ifndef OCTOPUS_COROUTINE_H */
@@ -49,13 +49,17 @@
 #ifdef HAVE_EVPORT
 #include "ae_evport.c"
 #else
-    #ifdef HAVE_EPOLL
-    #include "ae_epoll.c"
+    #ifdef HAVE_IOURING
+    #include "ae_iouring.c"
     #else
-        #ifdef HAVE_KQUEUE
-        #include "ae_kqueue.c"
+        #ifdef HAVE_EPOLL
+        #include "ae_epoll.c"
         #else
-        #include "ae_select.c"
+            #ifdef HAVE_KQUEUE
+            #include "ae_kqueue.c"
+            #else
+            #include "ae_select.c"
+            #endif
         #endif
     #endif
 #endif
@@ -69,10 +73,17 @@ aeEventLoop *aeCreateEventLoop(int setsize) {
     eventLoop->fired = zmalloc(sizeof(aeFiredEvent)*setsize);
     if (eventLoop->events == NULL || eventLoop->fired == NULL) goto err;
     eventLoop->setsize = setsize;
-    eventLoop->lastTime = time(NULL);
-    eventLoop->timeEventHead = NULL;
+    aeUpdateTime(eventLoop);
+    eventLoop->timeEventHeap = NULL;
+    eventLoop->timeEventCount = 0;
+    eventLoop->timeEventHeapSize = 0;
+    eventLoop->timeEventBuckets = NULL;
+    eventLoop->timeEventBucketCount = 0;
+    eventLoop->timeEventRegistered = 0;
+    eventLoop->timeEventDeleted = NULL;
     eventLoop->timeEventNextId = 0;
     eventLoop->stop = 0;
+    eventLoop->flags = 0;
     eventLoop->maxfd = -1;
     eventLoop->beforesleep = NULL;
     eventLoop->aftersleep = NULL;
@@ -123,6 +134,23 @@ int aeResizeSetSize(aeEventLoop *eventLoop, int setsize) {
 }
 
 void aeDeleteEventLoop(aeEventLoop *eventLoop) {
+    aeTimeEvent *te, *next;
+    int j;
+
+    /* Every live event is in the id buckets, deleted ones are in the list. */
+    for (j = 0; j < eventLoop->timeEventBucketCount; j++) {
+        for (te = eventLoop->timeEventBuckets[j]; te; te = next) {
+            next = te->next;
+            zfree(te);
+        }
+    }
+    for (te = eventLoop->timeEventDeleted; te; te = next) {
+        next = te->next;
+        zfree(te);
+    }
+    zfree(eventLoop->timeEventBuckets);
+    zfree(eventLoop->timeEventHeap);
+
     aeApiFree(eventLoop);
     zfree(eventLoop->events);
     zfree(eventLoop->fired);
@@ -142,6 +170,15 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
     }
     aeFileEvent *fe = &eventLoop->events[fd];
 
+#ifndef AE_API_EDGE
+    if (mask & AE_EDGE) {
+        errno = EINVAL;
+        return AE_ERR;
+    }
+#endif
+#ifndef AE_API_RECV
+    mask &= ~AE_RECV;
+#endif
     if (aeApiAddEvent(eventLoop, fd, mask) == -1)
         return AE_ERR;
     fe->mask |= mask;
@@ -162,6 +199,8 @@ void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask)
     /* We want to always remove AE_BARRIER if set when AE_WRITABLE
      * is removed. */
     if (mask & AE_WRITABLE) mask |= AE_BARRIER;
+    /* AE_EDGE goes with the last event. */
+    if ((fe->mask & ~mask & (AE_READABLE|AE_WRITABLE)) == 0) mask |= AE_EDGE;
 
     aeApiDelEvent(eventLoop, fd, mask);
     fe->mask = fe->mask & (~mask);
@@ -182,27 +221,155 @@ int aeGetFileEvents(aeEventLoop *eventLoop, int fd) {
     return fe->mask;
 }
 
-static void aeGetTime(long *seconds, long *milliseconds)
-{
-    struct timeval tv;
+/* Read from fd like readv(2). With AE_RECV, the data the multiplexing layer
+ * has received is taken first. */
+ssize_t aeReadv(aeEventLoop *eventLoop, int fd, const struct iovec *iov, int iovcnt) {
+#ifdef AE_API_RECV
+    return aeApiReadv(eventLoop,fd,iov,iovcnt);
+#else
+    AE_NOTUSED(eventLoop);
+    return readv(fd,iov,iovcnt);
+#endif
+}
+
+static long long aeMonotonicUs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* Sample the clock into the cached time. It's done once per iteration, so
+ * timers, timeouts and latency measurement of callbacks needn't read the clock.
+ * CLOCK_MONOTONIC isn't affected by changes of the system clock. */
+void aeUpdateTime(aeEventLoop *eventLoop) {
+    eventLoop->monotonicUs = aeMonotonicUs();
+}
 
-    gettimeofday(&tv, NULL);
-    *seconds = tv.tv_sec;
-    *milliseconds = tv.tv_usec/1000;
+/* Time of the current iteration in microseconds, which is only meaningful to
+ * compare with other values of it. */
+long long aeGetMonotonicUs(aeEventLoop *eventLoop) {
+    return eventLoop->monotonicUs;
 }
 
-static void aeAddMillisecondsToNow(long long milliseconds, long *sec, long *ms) {
-    long cur_sec, cur_ms, when_sec, when_ms;
+/* Time events are kept in a binary min-heap ordered by fire time, so the
+ * nearest timer is found in O(1), and insertion and deletion are O(log(N)).
+ * Events are also indexed by id in a hash table, so aeDeleteTimeEvent() needn't
+ * search for them. */
+
+static inline int aeTimeEventBefore(aeTimeEvent *a, aeTimeEvent *b) {
+    return a->when < b->when;
+}
 
-    aeGetTime(&cur_sec, &cur_ms);
-    when_sec = cur_sec + milliseconds/1000;
-    when_ms = cur_ms + milliseconds%1000;
-    if (when_ms >= 1000) {
-        when_sec ++;
-        when_ms -= 1000;
+static inline void aeHeapSet(aeEventLoop *eventLoop, int idx, aeTimeEvent *te) {
+    eventLoop->timeEventHeap[idx] = te;
+    te->heapIndex = idx;
+}
+
+static void aeHeapSiftUp(aeEventLoop *eventLoop, int idx) {
+    aeTimeEvent *te = eventLoop->timeEventHeap[idx];
+
+    while (idx > 0) {
+        int parent = (idx-1)/2;
+        if (!aeTimeEventBefore(te,eventLoop->timeEventHeap[parent])) break;
+        aeHeapSet(eventLoop,idx,eventLoop->timeEventHeap[parent]);
+        idx = parent;
+    }
+    aeHeapSet(eventLoop,idx,te);
+}
+
+static void aeHeapSiftDown(aeEventLoop *eventLoop, int idx) {
+    aeTimeEvent *te = eventLoop->timeEventHeap[idx];
+    int count = eventLoop->timeEventCount;
+
+    while (1) {
+        int child = idx*2+1;
+        if (child >= count) break;
+        if (child+1 < count &&
+            aeTimeEventBefore(eventLoop->timeEventHeap[child+1],
+                              eventLoop->timeEventHeap[child]))
+            child++;
+        if (!aeTimeEventBefore(eventLoop->timeEventHeap[child],te)) break;
+        aeHeapSet(eventLoop,idx,eventLoop->timeEventHeap[child]);
+        idx = child;
+    }
+    aeHeapSet(eventLoop,idx,te);
+}
+
+static int aeHeapPush(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (eventLoop->timeEventCount == eventLoop->timeEventHeapSize) {
+        int size = eventLoop->timeEventHeapSize ? eventLoop->timeEventHeapSize*2 : 64;
+        aeTimeEvent **heap = zrealloc(eventLoop->timeEventHeap,sizeof(aeTimeEvent*)*size);
+
+        if (heap == NULL) return AE_ERR;
+        eventLoop->timeEventHeap = heap;
+        eventLoop->timeEventHeapSize = size;
     }
-    *sec = when_sec;
-    *ms = when_ms;
+    aeHeapSet(eventLoop,eventLoop->timeEventCount++,te);
+    aeHeapSiftUp(eventLoop,te->heapIndex);
+    return AE_OK;
+}
+
+static void aeHeapRemove(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    int idx = te->heapIndex;
+    aeTimeEvent *last = eventLoop->timeEventHeap[--eventLoop->timeEventCount];
+
+    te->heapIndex = -1;
+    if (last == te) return;
+    aeHeapSet(eventLoop,idx,last);
+    aeHeapSiftUp(eventLoop,idx);
+    aeHeapSiftDown(eventLoop,last->heapIndex);
+}
+
+/* Ids are sequential, so they are spread evenly by the low bits. */
+static aeTimeEvent **aeTimeEventBucket(aeEventLoop *eventLoop, long long id) {
+    return &eventLoop->timeEventBuckets[id & (eventLoop->timeEventBucketCount-1)];
+}
+
+static int aeTimeEventIndex(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    aeTimeEvent **bucket;
+
+    if (eventLoop->timeEventRegistered >= eventLoop->timeEventBucketCount) {
+        int count = eventLoop->timeEventBucketCount ? eventLoop->timeEventBucketCount*2 : 64;
+        aeTimeEvent **buckets = zmalloc(sizeof(aeTimeEvent*)*count);
+        aeTimeEvent *e, *next;
+        int j;
+
+        if (buckets == NULL) return AE_ERR;
+        memset(buckets,0,sizeof(aeTimeEvent*)*count);
+        for (j = 0; j < eventLoop->timeEventBucketCount; j++) {
+            for (e = eventLoop->timeEventBuckets[j]; e; e = next) {
+                next = e->next;
+                e->next = buckets[e->id & (count-1)];
+                buckets[e->id & (count-1)] = e;
+            }
+        }
+        zfree(eventLoop->timeEventBuckets);
+        eventLoop->timeEventBuckets = buckets;
+        eventLoop->timeEventBucketCount = count;
+    }
+
+    bucket = aeTimeEventBucket(eventLoop,te->id);
+    te->next = *bucket;
+    *bucket = te;
+    eventLoop->timeEventRegistered++;
+    return AE_OK;
+}
+
+static aeTimeEvent *aeTimeEventUnindex(aeEventLoop *eventLoop, long long id) {
+    aeTimeEvent **pte, *te;
+
+    if (eventLoop->timeEventBucketCount == 0 || id < 0) return NULL;
+    for (pte = aeTimeEventBucket(eventLoop,id); *pte; pte = &(*pte)->next) {
+        if ((*pte)->id == id) {
+            te = *pte;
+            *pte = te->next;
+            te->next = NULL;
+            eventLoop->timeEventRegistered--;
+            return te;
+        }
+    }
+    return NULL;
 }
 
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
@@ -215,29 +382,40 @@ long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
     te = zmalloc(sizeof(*te));
     if (te == NULL) return AE_ERR;
     te->id = id;
-    aeAddMillisecondsToNow(milliseconds,&te->when_sec,&te->when_ms);
+    te->when = eventLoop->monotonicUs/1000 + milliseconds;
     te->timeProc = proc;
     te->finalizerProc = finalizerProc;
     te->clientData = clientData;
-    te->prev = NULL;
-    te->next = eventLoop->timeEventHead;
-    if (te->next)
-        te->next->prev = te;
-    eventLoop->timeEventHead = te;
+    te->heapIndex = -1;
+    te->next = NULL;
+    te->fireNext = NULL;
+    if (aeTimeEventIndex(eventLoop,te) == AE_ERR) {
+        zfree(te);
+        return AE_ERR;
+    }
+    if (aeHeapPush(eventLoop,te) == AE_ERR) {
+        aeTimeEventUnindex(eventLoop,id);
+        zfree(te);
+        return AE_ERR;
+    }
     return id;
 }
 
+/* The event is removed at once, and the finalizer is called by the next
+ * processTimeEvents(). An event being fired isn't in the heap, and it's
+ * released by processTimeEvents() after its proc returns. */
 int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    while(te) {
-        if (te->id == id) {
-            te->id = AE_DELETED_EVENT_ID;
-            return AE_OK;
-        }
-        te = te->next;
+    aeTimeEvent *te = aeTimeEventUnindex(eventLoop,id);
+
+    if (te == NULL) return AE_ERR; /* NO event with the specified ID found */
+    te->id = AE_DELETED_EVENT_ID;
+    if (te->heapIndex != -1) {
+        aeHeapRemove(eventLoop,te);
+        te->next = eventLoop->timeEventDeleted;
+        eventLoop->timeEventDeleted = te;
     }
-    return AE_ERR; /* NO event with the specified ID found */
+    return AE_OK;
 }
 
 /* Search the first timer to fire.
@@ -245,98 +423,66 @@ int aeDeleteTimeEvent(aeEventLoop *eventLoop, long long id)
  * put in sleep without to delay any event.
  * If there are no timers NULL is returned.
  *
- * Note that's O(N) since time events are unsorted.
- * Possible optimizations (not needed by Redis so far, but...):
- * 1) Insert the event in order, so that the nearest is just the head.
- *    Much better but still insertion or deletion of timers is O(N).
- * 2) Use a skiplist to have this operation as O(1) and insertion as O(log(N)).
- */
+ * It's the top of the heap, so it's O(1). */
 static aeTimeEvent *aeSearchNearestTimer(aeEventLoop *eventLoop)
 {
-    aeTimeEvent *te = eventLoop->timeEventHead;
-    aeTimeEvent *nearest = NULL;
-
-    while(te) {
-        if (!nearest || te->when_sec < nearest->when_sec ||
-                (te->when_sec == nearest->when_sec &&
-                 te->when_ms < nearest->when_ms))
-            nearest = te;
-        te = te->next;
-    }
-    return nearest;
+    return eventLoop->timeEventCount ? eventLoop->timeEventHeap[0] : NULL;
+}
+
+static void aeFreeTimeEvent(aeEventLoop *eventLoop, aeTimeEvent *te) {
+    if (te->finalizerProc)
+        te->finalizerProc(eventLoop, te->clientData);
+    zfree(te);
 }
 
 /* Process time events */
 static int processTimeEvents(aeEventLoop *eventLoop) {
     int processed = 0;
-    aeTimeEvent *te;
-    long long maxId;
-    time_t now = time(NULL);
-
-    /* If the system clock is moved to the future, and then set back to the
-     * right value, time events may be delayed in a random way. Often this
-     * means that scheduled operations will not be performed soon enough.
-     *
-     * Here we try to detect system clock skews, and force all the time
-     * events to be processed ASAP when this happens: the idea is that
-     * processing events earlier is less dangerous than delaying them
-     * indefinitely, and practice suggests it is. */
-    if (now < eventLoop->lastTime) {
-        te = eventLoop->timeEventHead;
-        while(te) {
-            te->when_sec = 0;
-            te = te->next;
-        }
+    aeTimeEvent *te, *fired, **tail;
+    long long now = eventLoop->monotonicUs/1000;
+
+    /* Finalize events deleted since the last call. */
+    while ((te = eventLoop->timeEventDeleted) != NULL) {
+        eventLoop->timeEventDeleted = te->next;
+        aeFreeTimeEvent(eventLoop,te);
+    }
+
+    /* Take the events to fire out of the heap first, so events created or
+     * rescheduled by the procs aren't processed in this iteration. */
+    fired = NULL;
+    tail = &fired;
+    while ((te = aeSearchNearestTimer(eventLoop)) != NULL && te->when <= now) {
+        aeHeapRemove(eventLoop,te);
+        te->fireNext = NULL;
+        *tail = te;
+        tail = &te->fireNext;
     }
-    eventLoop->lastTime = now;
 
-    te = eventLoop->timeEventHead;
-    maxId = eventLoop->timeEventNextId-1;
-    while(te) {
-        long now_sec, now_ms;
-        long long id;
+    while ((te = fired) != NULL) {
+        int retval;
 
-        /* Remove events scheduled for deletion. */
+        fired = te->fireNext;
+        /* Deleted by a proc fired before it. */
         if (te->id == AE_DELETED_EVENT_ID) {
-            aeTimeEvent *next = te->next;
-            if (te->prev)
-                te->prev->next = te->next;
-            else
-                eventLoop->timeEventHead = te->next;
-            if (te->next)
-                te->next->prev = te->prev;
-            if (te->finalizerProc)
-                te->finalizerProc(eventLoop, te->clientData);
-            zfree(te);
-            te = next;
+            aeFreeTimeEvent(eventLoop,te);
             continue;
         }
 
-        /* Make sure we don't process time events created by time events in
-         * this iteration. Note that this check is currently useless: we always
-         * add new timers on the head, however if we change the implementation
-         * detail, this check may be useful again: we keep it here for future
-         * defense. */
-        if (te->id > maxId) {
-            te = te->next;
-            continue;
-        }
-        aeGetTime(&now_sec, &now_ms);
-        if (now_sec > te->when_sec ||
-            (now_sec == te->when_sec && now_ms >= te->when_ms))
-        {
-            int retval;
-
-            id = te->id;
-            retval = te->timeProc(eventLoop, id, te->clientData);
-            processed++;
-            if (retval != AE_NOMORE) {
-                aeAddMillisecondsToNow(retval,&te->when_sec,&te->when_ms);
-            } else {
-                te->id = AE_DELETED_EVENT_ID;
+        retval = te->timeProc(eventLoop, te->id, te->clientData);
+        processed++;
+        if (te->id == AE_DELETED_EVENT_ID) {
+            /* Deleted by its own proc. */
+            aeFreeTimeEvent(eventLoop,te);
+        } else if (retval != AE_NOMORE) {
+            te->when = eventLoop->monotonicUs/1000 + retval;
+            if (aeHeapPush(eventLoop,te) == AE_ERR) {
+                aeTimeEventUnindex(eventLoop,te->id);
+                aeFreeTimeEvent(eventLoop,te);
             }
+        } else {
+            aeTimeEventUnindex(eventLoop,te->id);
+            aeFreeTimeEvent(eventLoop,te);
         }
-        te = te->next;
     }
     return processed;
 }
@@ -362,6 +508,8 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
     /* Nothing to do? return ASAP */
     if (!(flags & AE_TIME_EVENTS) && !(flags & AE_FILE_EVENTS)) return 0;
 
+    aeUpdateTime(eventLoop);
+
     /* Note that we want call select() even if there are no
      * file events to process as long as we want to process time
      * events, in order to sleep until the next time event is ready
@@ -375,16 +523,11 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
         if (flags & AE_TIME_EVENTS && !(flags & AE_DONT_WAIT))
             shortest = aeSearchNearestTimer(eventLoop);
         if (shortest) {
-            long now_sec, now_ms;
-
-            aeGetTime(&now_sec, &now_ms);
             tvp = &tv;
 
             /* How many milliseconds we need to wait for the next
              * time event to fire? */
-            long long ms =
-                (shortest->when_sec - now_sec)*1000 +
-                shortest->when_ms - now_ms;
+            long long ms = shortest->when - eventLoop->monotonicUs/1000;
 
             if (ms > 0) {
                 tvp->tv_sec = ms/1000;
@@ -406,9 +549,16 @@ int aeProcessEvents(aeEventLoop *eventLoop, int flags)
             }
         }
 
+        /* Work is left for the next iteration, just collect what fired. */
+        if (eventLoop->flags & AE_DONT_WAIT) {
+            tv.tv_sec = tv.tv_usec = 0;
+            tvp = &tv;
+        }
+
         /* Call the multiplexing API, will return only on timeout or when
          * some event fires. */
         numevents = aeApiPoll(eventLoop, tvp);
+        aeUpdateTime(eventLoop);
 
         /* After sleep callback. */
         if (eventLoop->aftersleep != NULL && flags & AE_CALL_AFTER_SLEEP)
@@ -510,6 +660,13 @@ void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep
     eventLoop->beforesleep = beforesleep;
 }
 
+void aeSetDontWait(aeEventLoop *eventLoop, int noWait) {
+    if (noWait)
+        eventLoop->flags |= AE_DONT_WAIT;
+    else
+        eventLoop->flags &= ~AE_DONT_WAIT;
+}
+
 void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep) {
     eventLoop->aftersleep = aftersleep;
 }
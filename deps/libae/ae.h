@@ -34,6 +34,8 @@
 #define __AE_H__
 
 #include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define AE_OK 0
 #define AE_ERR -1
@@ -46,6 +48,16 @@
                            loop iteration. Useful when you want to persist
                            things to disk before sending replies, and want
                            to do that in a group fashion. */
+#define AE_EDGE 8       /* Edge triggered, fire only when the descriptor
+                           becomes ready, so handlers must drain it until
+                           EAGAIN. Registering it fails with EINVAL if the
+                           multiplexing layer doesn't support it. */
+#define AE_RECV 16      /* With READABLE, the handler reads by aeReadv(), so
+                           the multiplexing layer may receive the data itself.
+                           It stays when READABLE is deleted, and deleting it
+                           drops the data received and not read yet, which
+                           must be done before the fd is closed. Ignored if the
+                           multiplexing layer doesn't support it. */
 
 #define AE_FILE_EVENTS 1
 #define AE_TIME_EVENTS 2
@@ -78,13 +90,14 @@ typedef struct aeFileEvent {
 /* Time event structure */
 typedef struct aeTimeEvent {
     long long id; /* time event identifier. */
-    long when_sec; /* seconds */
-    long when_ms; /* milliseconds */
+    long long when; /* monotonic time to fire, in milliseconds */
     aeTimeProc *timeProc;
     aeEventFinalizerProc *finalizerProc;
     void *clientData;
-    struct aeTimeEvent *prev;
-    struct aeTimeEvent *next;
+    int heapIndex; /* position in the timer heap, -1 if not in the heap */
+    struct aeTimeEvent *next; /* next event in the same id bucket, or in the
+                                 list of deleted events */
+    struct aeTimeEvent *fireNext; /* next event to fire in this iteration */
 } aeTimeEvent;
 
 /* A fired event */
@@ -98,11 +111,18 @@ typedef struct aeEventLoop {
     int maxfd;   /* highest file descriptor currently registered */
     int setsize; /* max number of file descriptors tracked */
     long long timeEventNextId;
-    time_t lastTime;     /* Used to detect system clock skew */
+    long long monotonicUs; /* CLOCK_MONOTONIC sampled once per iteration */
     aeFileEvent *events; /* Registered events */
     aeFiredEvent *fired; /* Fired events */
-    aeTimeEvent *timeEventHead;
+    aeTimeEvent **timeEventHeap; /* binary min-heap ordered by fire time */
+    int timeEventCount;          /* events in the heap */
+    int timeEventHeapSize;
+    aeTimeEvent **timeEventBuckets; /* id -> event, for aeDeleteTimeEvent */
+    int timeEventBucketCount;    /* power of two */
+    int timeEventRegistered;     /* events in the buckets */
+    aeTimeEvent *timeEventDeleted; /* finalized by the next processTimeEvents */
     int stop;
+    int flags; /* AE_DONT_WAIT: don't block in the next poll */
     void *apidata; /* This is used for polling API specific data */
     aeBeforeSleepProc *beforesleep;
     aeBeforeSleepProc *aftersleep;
@@ -116,6 +136,7 @@ int aeCreateFileEvent(aeEventLoop *eventLoop, int fd, int mask,
         aeFileProc *proc, void *clientData);
 void aeDeleteFileEvent(aeEventLoop *eventLoop, int fd, int mask);
 int aeGetFileEvents(aeEventLoop *eventLoop, int fd);
+ssize_t aeReadv(aeEventLoop *eventLoop, int fd, const struct iovec *iov, int iovcnt);
 long long aeCreateTimeEvent(aeEventLoop *eventLoop, long long milliseconds,
         aeTimeProc *proc, void *clientData,
         aeEventFinalizerProc *finalizerProc);
@@ -126,7 +147,10 @@ void aeMain(aeEventLoop *eventLoop);
 char *aeGetApiName(void);
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep);
 void aeSetAfterSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *aftersleep);
+void aeSetDontWait(aeEventLoop *eventLoop, int noWait);
 int aeGetSetSize(aeEventLoop *eventLoop);
+long long aeGetMonotonicUs(aeEventLoop *eventLoop);
+void aeUpdateTime(aeEventLoop *eventLoop);
 int aeResizeSetSize(aeEventLoop *eventLoop, int setsize);
 
 #endif
@@ -0,0 +1,718 @@
+/* Linux io_uring based ae.c module
+ *
+ * io_uring is used for readiness here, so file events keep the semantics of
+ * the other modules: each fd is watched by a one-shot IORING_OP_POLL_ADD
+ * request, which is armed again after it fires. Changes of the interest set
+ * are only queued in the submission ring, and submitted together with the wait
+ * by a single io_uring_enter(2) per iteration, instead of one epoll_ctl(2) per
+ * change. One-shot requests are used since multishot ones can't be updated
+ * without becoming edge triggered, except for AE_EDGE events, which are
+ * watched by multishot requests.
+ *
+ * Readability of AE_RECV events is watched by a multishot IORING_OP_RECV
+ * request instead, which receives into a ring of buffers provided to the
+ * kernel. So the data comes with the completion, and aeReadv() copies it out
+ * without a syscall. The request lives until AE_RECV is deleted, even while
+ * READABLE isn't watched, and data is queued per fd until it's read. Level
+ * triggered events fire while data is queued, AE_EDGE ones as data comes. If
+ * the buffers run out, the fd is polled and read by readv(2) until it's
+ * drained, and then it's received again.
+ *
+ * The kernel interface is used directly by syscall(2), no liburing is needed.
+ * If io_uring isn't available, or AE_NO_IOURING is set in the environment,
+ * the epoll module is used instead.
+ */
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* The epoll module is compiled in too as the fallback, with its functions
+ * renamed. */
+#define aeApiState aeEpollState
+#define aeApiCreate aeEpollCreate
+#define aeApiResize aeEpollResize
+#define aeApiFree aeEpollFree
+#define aeApiAddEvent aeEpollAddEvent
+#define aeApiDelEvent aeEpollDelEvent
+#define aeApiPoll aeEpollPoll
+#define aeApiName aeEpollName
+#include "ae_epoll.c"
+#undef aeApiState
+#undef aeApiCreate
+#undef aeApiResize
+#undef aeApiFree
+#undef aeApiAddEvent
+#undef aeApiDelEvent
+#undef aeApiPoll
+#undef aeApiName
+
+#define AE_URING_ENTRIES 1024 /* submission ring, changes beyond it are
+                                 submitted early */
+#define AE_URING_MAX_CQ 65536
+#define AE_URING_REMOVE (1ULL << 63) /* tags user_data of remove requests,
+                                        which carry the request removed */
+#define AE_URING_RECV (1ULL << 62) /* tags user_data of recv requests */
+#define AE_URING_GEN_MASK 0x3fffffff
+#define AE_URING_BUFS 256 /* provided buffers, a power of 2 */
+#define AE_URING_BUF_SIZE 8192
+#define AE_URING_BGID 0
+
+#define AE_API_RECV 1
+
+/* Receiving state of a fd */
+typedef struct aeUringRecv {
+    int head, tail; /* buffers received and not read yet, -1 if none */
+    int off; /* bytes of the head buffer read */
+    int armed; /* a recv request is in the kernel */
+    unsigned gen;
+    int end; /* 1 after EOF, -errno after an error */
+    int nobufs; /* the buffers ran out, read by readv(2) until drained */
+    int notify; /* data has come since the event fired */
+    int ready; /* in the ready list */
+} aeUringRecv;
+
+typedef struct aeApiState {
+    /* First, so the epoll functions can work on the state after falling
+     * back. */
+    aeEpollState epoll;
+    int ringfd; /* -1 if falling back to epoll */
+
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize, sqesSize;
+    unsigned *sqHead, *sqTail, *sqArray, sqMask, sqEntries;
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead, *cqTail, cqMask;
+    struct io_uring_cqe *cqes;
+
+    /* Per fd: mask of the poll request in the kernel, or 0 if there isn't
+     * one, and its generation, which tells completions of stale requests. */
+    int *armed;
+    unsigned *gen;
+    /* fds whose requests have fired, they are armed again before the next
+     * wait if still watched */
+    int *rearm;
+    int rearmCount;
+
+    /* Buffers provided to the kernel, set up by the first AE_RECV event.
+     * Buffers received are linked per fd by bufNext until they are read. */
+    struct io_uring_buf_ring *bufRing;
+    char *bufs;
+    unsigned short bufTail;
+    int bufNext[AE_URING_BUFS];
+    int bufLen[AE_URING_BUFS];
+    int recvUnsupported;
+    aeUringRecv *recv;
+    /* fds with data queued or come, which may fire */
+    int *ready;
+    int readyCount;
+} aeApiState;
+
+static int aeUringUnavailable = 0;
+
+static void aeUringRecvInit(aeApiState *state, int from, int to) {
+    int j;
+
+    memset(state->recv+from,0,sizeof(aeUringRecv)*(to-from));
+    for (j = from; j < to; j++) state->recv[j].head = state->recv[j].tail = -1;
+}
+
+static int aeUringSetup(aeApiState *state, int setsize) {
+    struct io_uring_params p;
+    unsigned cqEntries = 2*AE_URING_ENTRIES;
+    int fd;
+
+    while (cqEntries < (unsigned)setsize && cqEntries < AE_URING_MAX_CQ)
+        cqEntries <<= 1;
+
+    memset(&p,0,sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = cqEntries;
+    fd = syscall(__NR_io_uring_setup,AE_URING_ENTRIES,&p);
+    if (fd == -1) return -1;
+    state->ringfd = fd;
+
+    /* Completions must never be dropped, and the wait needs a timeout.
+     * Multishot poll comes with IORING_FEAT_RSRC_TAGS in the same release. */
+    if (!(p.features & IORING_FEAT_NODROP) ||
+        !(p.features & IORING_FEAT_EXT_ARG) ||
+        !(p.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(p.features & IORING_FEAT_RSRC_TAGS)) return -1;
+
+    state->sqRingSize = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    state->cqRingSize = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if (state->cqRingSize > state->sqRingSize)
+        state->sqRingSize = state->cqRingSize;
+    state->sqRing = mmap(NULL,state->sqRingSize,PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+    if (state->sqRing == MAP_FAILED) {
+        state->sqRing = NULL;
+        return -1;
+    }
+    state->cqRing = state->sqRing;
+
+    state->sqesSize = p.sq_entries*sizeof(struct io_uring_sqe);
+    state->sqes = mmap(NULL,state->sqesSize,PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+    if (state->sqes == MAP_FAILED) {
+        state->sqes = NULL;
+        return -1;
+    }
+
+    state->sqHead = (unsigned*)((char*)state->sqRing + p.sq_off.head);
+    state->sqTail = (unsigned*)((char*)state->sqRing + p.sq_off.tail);
+    state->sqArray = (unsigned*)((char*)state->sqRing + p.sq_off.array);
+    state->sqMask = *(unsigned*)((char*)state->sqRing + p.sq_off.ring_mask);
+    state->sqEntries = p.sq_entries;
+    state->cqHead = (unsigned*)((char*)state->cqRing + p.cq_off.head);
+    state->cqTail = (unsigned*)((char*)state->cqRing + p.cq_off.tail);
+    state->cqMask = *(unsigned*)((char*)state->cqRing + p.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe*)((char*)state->cqRing + p.cq_off.cqes);
+
+    state->armed = zmalloc(sizeof(int)*setsize);
+    state->gen = zmalloc(sizeof(unsigned)*setsize);
+    /* A fd ends at most one poll and one recv request per iteration. */
+    state->rearm = zmalloc(sizeof(int)*setsize*2);
+    state->recv = zmalloc(sizeof(aeUringRecv)*setsize);
+    state->ready = zmalloc(sizeof(int)*setsize);
+    if (!state->armed || !state->gen || !state->rearm || !state->recv ||
+        !state->ready) return -1;
+    memset(state->armed,0,sizeof(int)*setsize);
+    memset(state->gen,0,sizeof(unsigned)*setsize);
+    aeUringRecvInit(state,0,setsize);
+    return 0;
+}
+
+static void aeUringRelease(aeApiState *state) {
+    if (state->sqes) munmap(state->sqes,state->sqesSize);
+    if (state->sqRing) munmap(state->sqRing,state->sqRingSize);
+    if (state->ringfd != -1) close(state->ringfd);
+    if (state->bufRing)
+        munmap(state->bufRing,AE_URING_BUFS*sizeof(struct io_uring_buf));
+    zfree(state->bufs);
+    zfree(state->armed);
+    zfree(state->gen);
+    zfree(state->rearm);
+    zfree(state->recv);
+    zfree(state->ready);
+    state->sqes = NULL;
+    state->sqRing = NULL;
+    state->ringfd = -1;
+    state->bufRing = NULL;
+    state->bufs = NULL;
+    state->armed = NULL;
+    state->gen = NULL;
+    state->rearm = NULL;
+    state->recv = NULL;
+    state->ready = NULL;
+}
+
+/* Give the buffer back to the kernel. */
+static void aeUringBufPut(aeApiState *state, int bid) {
+    struct io_uring_buf *buf = &state->bufRing->bufs[state->bufTail & (AE_URING_BUFS-1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(state->bufs + (size_t)bid*AE_URING_BUF_SIZE);
+    buf->len = AE_URING_BUF_SIZE;
+    buf->bid = bid;
+    state->bufTail++;
+    __atomic_store_n(&state->bufRing->tail,state->bufTail,__ATOMIC_RELEASE);
+}
+
+/* Provide the buffers to the kernel, which needs Linux 5.19, and multishot
+ * recv needs 6.0. Without them, AE_RECV events are polled. */
+static int aeUringRecvAvailable(aeApiState *state) {
+    struct io_uring_buf_reg reg;
+    int j;
+
+    if (state->recvUnsupported) return 0;
+    if (state->bufRing) return 1;
+
+    state->recvUnsupported = 1;
+    state->bufRing = mmap(NULL,AE_URING_BUFS*sizeof(struct io_uring_buf),
+            PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if (state->bufRing == MAP_FAILED) {
+        state->bufRing = NULL;
+        return 0;
+    }
+    memset(&reg,0,sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)state->bufRing;
+    reg.ring_entries = AE_URING_BUFS;
+    reg.bgid = AE_URING_BGID;
+    state->bufs = zmalloc((size_t)AE_URING_BUFS*AE_URING_BUF_SIZE);
+    if (!state->bufs || syscall(__NR_io_uring_register,state->ringfd,
+            IORING_REGISTER_PBUF_RING,&reg,1) == -1) {
+        munmap(state->bufRing,AE_URING_BUFS*sizeof(struct io_uring_buf));
+        zfree(state->bufs);
+        state->bufRing = NULL;
+        state->bufs = NULL;
+        return 0;
+    }
+    for (j = 0; j < AE_URING_BUFS; j++) aeUringBufPut(state,j);
+    state->recvUnsupported = 0;
+    return 1;
+}
+
+/* Submit the queued requests, and wait for a completion if 'wait' is set,
+ * 'tvp' limits the wait if not NULL. */
+static int aeUringEnter(aeApiState *state, int wait, struct timeval *tvp) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    unsigned queued = *state->sqTail - __atomic_load_n(state->sqHead,__ATOMIC_ACQUIRE);
+    int retval;
+
+    memset(&arg,0,sizeof(arg));
+    if (wait) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (tvp) {
+            ts.tv_sec = tvp->tv_sec;
+            ts.tv_nsec = tvp->tv_usec*1000;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+    if (!wait && queued == 0) return 0;
+
+    retval = syscall(__NR_io_uring_enter,state->ringfd,queued,wait ? 1 : 0,flags,
+            &arg,sizeof(arg));
+    if (retval == -1 && errno != EINTR && errno != ETIME && errno != EBUSY)
+        return -1;
+    return 0;
+}
+
+static struct io_uring_sqe *aeUringGetSqe(aeApiState *state) {
+    unsigned tail = *state->sqTail;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(state->sqHead,__ATOMIC_ACQUIRE) == state->sqEntries) {
+        /* The ring is full of changes, submit them without waiting. */
+        if (aeUringEnter(state,0,NULL) == -1) return NULL;
+        if (tail - __atomic_load_n(state->sqHead,__ATOMIC_ACQUIRE) == state->sqEntries)
+            return NULL;
+    }
+    sqe = &state->sqes[tail & state->sqMask];
+    memset(sqe,0,sizeof(*sqe));
+    return sqe;
+}
+
+static void aeUringPublish(aeApiState *state) {
+    unsigned tail = *state->sqTail;
+
+    state->sqArray[tail & state->sqMask] = tail & state->sqMask;
+    __atomic_store_n(state->sqTail,tail+1,__ATOMIC_RELEASE);
+}
+
+static int aeUringArm(aeApiState *state, int fd, int mask) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+
+    if (!sqe) return -1;
+    state->gen[fd] = (state->gen[fd]+1) & AE_URING_GEN_MASK;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    if (mask & AE_READABLE) sqe->poll32_events |= POLLIN;
+    if (mask & AE_WRITABLE) sqe->poll32_events |= POLLOUT;
+    if (mask & AE_EDGE) sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = ((uint64_t)state->gen[fd] << 32) | (uint32_t)fd;
+    aeUringPublish(state);
+    state->armed[fd] = mask;
+    return 0;
+}
+
+static int aeUringRecvArm(aeApiState *state, int fd) {
+    struct io_uring_sqe *sqe = aeUringGetSqe(state);
+    aeUringRecv *r = &state->recv[fd];
+
+    if (!sqe) return -1;
+    r->gen = (r->gen+1) & AE_URING_GEN_MASK;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = AE_URING_BGID;
+    sqe->user_data = AE_URING_RECV | ((uint64_t)r->gen << 32) | (uint32_t)fd;
+    aeUringPublish(state);
+    r->armed = 1;
+    return 0;
+}
+
+static int aeUringRemove(aeApiState *state, uint64_t target) {
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = aeUringGetSqe(state)) == NULL) return -1;
+    sqe->opcode = (target & AE_URING_RECV) ? IORING_OP_ASYNC_CANCEL : IORING_OP_POLL_REMOVE;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = AE_URING_REMOVE | target;
+    aeUringPublish(state);
+    return 0;
+}
+
+static int aeUringDisarm(aeApiState *state, int fd) {
+    if (!state->armed[fd]) return 0;
+    if (aeUringRemove(state,((uint64_t)state->gen[fd] << 32) | (uint32_t)fd) == -1)
+        return -1;
+    state->armed[fd] = 0;
+    return 0;
+}
+
+/* Make the requests of fd watch 'mask'. Requests are replaced instead of
+ * updated, since they may refer to a file closed with the fd. */
+static int aeUringWatch(aeApiState *state, int fd, int mask) {
+    aeUringRecv *r = &state->recv[fd];
+    int recv = (mask & AE_RECV) && !r->end && !r->nobufs && aeUringRecvAvailable(state);
+
+    if (recv && !r->armed) {
+        if (aeUringRecvArm(state,fd) == -1) return -1;
+    } else if (!recv && r->armed) {
+        if (aeUringRemove(state,AE_URING_RECV | ((uint64_t)r->gen << 32) |
+                (uint32_t)fd) == -1) return -1;
+        r->armed = 0;
+    }
+    if (recv) mask &= ~AE_READABLE;
+
+    mask &= (mask & (AE_READABLE|AE_WRITABLE)) ? AE_READABLE|AE_WRITABLE|AE_EDGE : 0;
+    if (state->armed[fd] == mask) return 0;
+    if (aeUringDisarm(state,fd) == -1) return -1;
+    return mask ? aeUringArm(state,fd,mask) : 0;
+}
+
+/* Drop the data received and not read, the fd is going to be closed. */
+static void aeUringRecvDrop(aeApiState *state, int fd) {
+    aeUringRecv *r = &state->recv[fd];
+    int bid;
+
+    while ((bid = r->head) != -1) {
+        r->head = state->bufNext[bid];
+        aeUringBufPut(state,bid);
+    }
+    r->tail = -1;
+    r->off = 0;
+    r->end = 0;
+    r->nobufs = 0;
+    r->notify = 0;
+}
+
+static void aeUringRecvComplete(aeEventLoop *eventLoop, aeApiState *state,
+        struct io_uring_cqe *cqe) {
+    uint64_t ud = cqe->user_data;
+    int fd = (int)(uint32_t)ud;
+    int bid = (cqe->flags & IORING_CQE_F_BUFFER) ?
+        (int)(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    aeUringRecv *r;
+
+    if (fd >= eventLoop->setsize || !state->recv[fd].armed ||
+        ((unsigned)(ud >> 32) & AE_URING_GEN_MASK) != state->recv[fd].gen) {
+        if (bid != -1) aeUringBufPut(state,bid); /* stale */
+        return;
+    }
+    r = &state->recv[fd];
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        r->armed = 0;
+        state->rearm[state->rearmCount++] = fd;
+    }
+
+    if (cqe->res > 0 && bid != -1) {
+        state->bufLen[bid] = cqe->res;
+        state->bufNext[bid] = -1;
+        if (r->tail == -1) r->head = bid;
+        else state->bufNext[r->tail] = bid;
+        r->tail = bid;
+    } else {
+        if (bid != -1) aeUringBufPut(state,bid);
+        if (cqe->res == 0) {
+            r->end = 1;
+        } else if (cqe->res == -EINVAL) {
+            /* multishot recv isn't supported by the kernel */
+            state->recvUnsupported = 1;
+        } else if (cqe->res == -ENOBUFS) {
+            r->nobufs = 1;
+        } else if (cqe->res != -ECANCELED) {
+            r->end = cqe->res;
+        }
+    }
+    r->notify = 1;
+    if (!r->ready) {
+        r->ready = 1;
+        state->ready[state->readyCount++] = fd;
+    }
+}
+
+/* Whether the READABLE event of a fd in the ready list fires, which is when
+ * data comes for AE_EDGE events, and while data is queued otherwise. */
+static int aeUringRecvFires(aeEventLoop *eventLoop, aeUringRecv *r, int fd) {
+    int mask = eventLoop->events[fd].mask;
+
+    if (!(mask & AE_READABLE) || !(mask & AE_RECV)) return 0;
+    return r->notify || (!(mask & AE_EDGE) && r->head != -1);
+}
+
+static int aeUringRecvPending(aeEventLoop *eventLoop, aeApiState *state) {
+    int j;
+
+    for (j = 0; j < state->readyCount; j++) {
+        int fd = state->ready[j];
+
+        if (aeUringRecvFires(eventLoop,&state->recv[fd],fd)) return 1;
+    }
+    return 0;
+}
+
+/* Fire the fds in the ready list, and leave the ones without data queued. */
+static int aeUringRecvFire(aeEventLoop *eventLoop, aeApiState *state, int numevents) {
+    int j, kept = 0;
+
+    for (j = 0; j < state->readyCount; j++) {
+        int fd = state->ready[j];
+        aeUringRecv *r = &state->recv[fd];
+
+        if (numevents < eventLoop->setsize && aeUringRecvFires(eventLoop,r,fd)) {
+            eventLoop->fired[numevents].fd = fd;
+            eventLoop->fired[numevents].mask = AE_READABLE;
+            numevents++;
+            r->notify = 0;
+        }
+        if (r->head == -1 && !r->notify) {
+            r->ready = 0;
+            continue;
+        }
+        state->ready[kept++] = fd;
+    }
+    state->readyCount = kept;
+    return numevents;
+}
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    aeApiState *state = zmalloc(sizeof(aeApiState));
+    aeEpollState *epoll;
+
+    if (!state) return -1;
+    memset(state,0,sizeof(*state));
+    state->ringfd = -1;
+    if (!aeUringUnavailable && getenv("AE_NO_IOURING") == NULL) {
+        if (aeUringSetup(state,eventLoop->setsize) == 0) {
+            eventLoop->apidata = state;
+            return 0;
+        }
+        aeUringRelease(state);
+    }
+    aeUringUnavailable = 1;
+
+    if (aeEpollCreate(eventLoop) == -1) {
+        zfree(state);
+        return -1;
+    }
+    epoll = eventLoop->apidata;
+    state->epoll = *epoll;
+    zfree(epoll);
+    eventLoop->apidata = state;
+    return 0;
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    aeApiState *state = eventLoop->apidata;
+    int *armed, *rearm, *ready, j, kept = 0;
+    unsigned *gen;
+    aeUringRecv *recv;
+
+    if (state->ringfd == -1) return aeEpollResize(eventLoop,setsize);
+
+    /* fds beyond are closed, and their data has been dropped */
+    for (j = 0; j < state->readyCount; j++)
+        if (state->ready[j] < setsize) state->ready[kept++] = state->ready[j];
+    state->readyCount = kept;
+
+    armed = zrealloc(state->armed,sizeof(int)*setsize);
+    if (!armed) return -1;
+    state->armed = armed;
+    gen = zrealloc(state->gen,sizeof(unsigned)*setsize);
+    if (!gen) return -1;
+    state->gen = gen;
+    rearm = zrealloc(state->rearm,sizeof(int)*setsize*2);
+    if (!rearm) return -1;
+    state->rearm = rearm;
+    recv = zrealloc(state->recv,sizeof(aeUringRecv)*setsize);
+    if (!recv) return -1;
+    state->recv = recv;
+    ready = zrealloc(state->ready,sizeof(int)*setsize);
+    if (!ready) return -1;
+    state->ready = ready;
+    if (setsize > eventLoop->setsize) {
+        memset(armed+eventLoop->setsize,0,sizeof(int)*(setsize-eventLoop->setsize));
+        memset(gen+eventLoop->setsize,0,sizeof(unsigned)*(setsize-eventLoop->setsize));
+        aeUringRecvInit(state,eventLoop->setsize,setsize);
+    }
+    return 0;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (state->ringfd == -1) {
+        aeEpollFree(eventLoop);
+        return;
+    }
+    aeUringRelease(state);
+    zfree(state);
+}
+
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (state->ringfd == -1) return aeEpollAddEvent(eventLoop,fd,mask);
+    return aeUringWatch(state,fd,mask | eventLoop->events[fd].mask);
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (state->ringfd == -1) {
+        aeEpollDelEvent(eventLoop,fd,delmask);
+        return;
+    }
+    aeUringWatch(state,fd,eventLoop->events[fd].mask & (~delmask));
+    if (delmask & AE_RECV) aeUringRecvDrop(state,fd);
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    aeApiState *state = eventLoop->apidata;
+    unsigned head, tail;
+    int j, numevents = 0;
+
+    if (state->ringfd == -1) return aeEpollPoll(eventLoop,tvp);
+
+    /* Arm the fired requests again, so a fd still ready fires again, as
+     * level triggered. Ended recv requests are armed again too. */
+    for (j = 0; j < state->rearmCount; j++)
+        aeUringWatch(state,state->rearm[j],eventLoop->events[state->rearm[j]].mask);
+    state->rearmCount = 0;
+
+    head = *state->cqHead;
+    if (head != __atomic_load_n(state->cqTail,__ATOMIC_ACQUIRE) ||
+        aeUringRecvPending(eventLoop,state)) {
+        aeUringEnter(state,0,NULL);
+    } else {
+        int wait = !tvp || tvp->tv_sec != 0 || tvp->tv_usec != 0;
+
+        aeUringEnter(state,wait,tvp);
+    }
+
+    tail = __atomic_load_n(state->cqTail,__ATOMIC_ACQUIRE);
+    while (head != tail && numevents < eventLoop->setsize) {
+        struct io_uring_cqe *cqe = &state->cqes[head & state->cqMask];
+        uint64_t ud = cqe->user_data;
+        int fd = (int)(uint32_t)ud, mask = 0;
+
+        head++;
+        if (ud & AE_URING_REMOVE) {
+            /* The request was firing, so it's still armed. A multishot one
+             * would keep the file open after the fd is closed. */
+            if (cqe->res == -EALREADY) aeUringRemove(state,ud & ~AE_URING_REMOVE);
+            continue;
+        }
+        if (ud & AE_URING_RECV) {
+            aeUringRecvComplete(eventLoop,state,cqe);
+            continue;
+        }
+        if (fd >= eventLoop->setsize || !state->armed[fd] ||
+            (unsigned)(ud >> 32) != state->gen[fd]) continue; /* stale */
+
+        if (cqe->res < 0) {
+            /* Let the handlers find the error. */
+            mask = state->armed[fd] & (AE_READABLE|AE_WRITABLE);
+        } else {
+            if (cqe->res & POLLIN) mask |= AE_READABLE;
+            if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+            if (cqe->res & POLLERR) mask |= AE_WRITABLE;
+            if (cqe->res & POLLHUP) mask |= AE_WRITABLE;
+        }
+        /* A multishot request stays armed unless the kernel has ended it. */
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            state->armed[fd] = 0;
+            state->rearm[state->rearmCount++] = fd;
+        }
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    __atomic_store_n(state->cqHead,head,__ATOMIC_RELEASE);
+    return aeUringRecvFire(eventLoop,state,numevents);
+}
+
+/* Read from the socket itself, since it's not received, or the buffers have
+ * run out. Once it's drained, it's received again. */
+static ssize_t aeUringReadvSocket(aeEventLoop *eventLoop, int fd, const struct iovec *iov,
+        int iovcnt) {
+    aeApiState *state = eventLoop->apidata;
+    aeUringRecv *r = &state->recv[fd];
+    ssize_t n = readv(fd,iov,iovcnt);
+
+    if (n == -1 && errno == EAGAIN && r->nobufs) {
+        r->nobufs = 0;
+        aeUringWatch(state,fd,eventLoop->events[fd].mask);
+        errno = EAGAIN;
+    }
+    return n;
+}
+
+static ssize_t aeApiReadv(aeEventLoop *eventLoop, int fd, const struct iovec *iov,
+        int iovcnt) {
+    aeApiState *state = eventLoop->apidata;
+    aeUringRecv *r;
+    size_t off = 0, len;
+    ssize_t n = 0, m;
+    int j = 0, bid;
+
+    if (state->ringfd == -1 || fd >= eventLoop->setsize) return readv(fd,iov,iovcnt);
+
+    r = &state->recv[fd];
+    if (r->head == -1) {
+        if (r->end > 0) return 0;
+        if (r->end < 0) {
+            errno = -r->end;
+            return -1;
+        }
+        if (r->armed) {
+            errno = EAGAIN;
+            return -1;
+        }
+        return aeUringReadvSocket(eventLoop,fd,iov,iovcnt);
+    }
+
+    while ((bid = r->head) != -1 && j < iovcnt) {
+        len = state->bufLen[bid] - r->off;
+        if (len > iov[j].iov_len - off) len = iov[j].iov_len - off;
+        memcpy((char*)iov[j].iov_base + off,
+                state->bufs + (size_t)bid*AE_URING_BUF_SIZE + r->off,len);
+        n += len;
+        off += len;
+        r->off += len;
+        if (off == iov[j].iov_len) {
+            j++;
+            off = 0;
+        }
+        if (r->off == state->bufLen[bid]) {
+            r->head = state->bufNext[bid];
+            if (r->head == -1) r->tail = -1;
+            r->off = 0;
+            aeUringBufPut(state,bid);
+        }
+    }
+
+    /* The rest waits in the socket if nothing is receiving it, so a short
+     * read still means the fd has been drained, as edge triggered handlers
+     * expect. An error or EOF is left to the next read. */
+    if (r->head == -1 && !r->armed && !r->end && j < iovcnt) {
+        struct iovec rest[iovcnt];
+        int k;
+
+        for (k = 0; j + k < iovcnt; k++) rest[k] = iov[j+k];
+        rest[0].iov_base = (char*)rest[0].iov_base + off;
+        rest[0].iov_len -= off;
+        if ((m = aeUringReadvSocket(eventLoop,fd,rest,k)) > 0) n += m;
+    }
+    return n;
+}
+
+static char *aeApiName(void) {
+    return aeUringUnavailable ? aeEpollName() : "io_uring";
+}
@@ -39,6 +39,18 @@
 #define HAVE_EPOLL 1
 #endif
 
+/* io_uring falls back to epoll at runtime, so it's only a matter of headers.
+ * Define AE_NO_IOURING to leave it out. */
+#if defined(__linux__) && !defined(AE_NO_IOURING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#if defined(IORING_FEAT_EXT_ARG) && defined(IORING_FEAT_RSRC_TAGS) && \
+    defined(IORING_RECV_MULTISHOT)
+#define HAVE_IOURING 1
+#endif
+#endif
+#endif
+
 #if (defined(__APPLE__) && defined(MAC_OS_X_VERSION_10_6)) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined (__NetBSD__)
 #define HAVE_KQUEUE 1
 #endif
@@ -0,0 +1,267 @@
+/* Benchmark of the multiplexing layer with request/response traffic. A server
+ * process serves connections the way octopus does: reads until EAGAIN, and
+ * watches writability until the response is sent. A client process sends one
+ * small request on each connection and then waits for all responses, round
+ * after round.
+ *
+ * With -s, the server is traced by ptrace(2) to count its syscalls per
+ * request, which makes it much slower, so timing and counting are separate
+ * runs. Set AE_NO_IOURING in the environment to compare with epoll.
+ *
+ * With -e, connections are registered once for both directions with AE_EDGE,
+ * and the response is written at once, the interest set is never changed.
+ * With -w, the response is written before the loop sleeps, and writability
+ * is only watched if the socket is full.
+ * With -r, requests are read by aeReadv() with AE_RECV, so the io_uring
+ * backend receives them along with the completions.
+ *
+ * Usage: ./pingpong [-s] [-e|-w] [-r] [connections] [rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/ptrace.h>
+#include <linux/ptrace.h>
+
+#include "../ae.h"
+
+#define DEFAULT_CONNS 50
+#define DEFAULT_ROUNDS 20000
+#define REQUEST_LEN 32
+#define READ_UNIT 1024
+
+typedef struct conn {
+    char buf[READ_UNIT];
+    int pending; /* response bytes not written */
+} conn;
+
+static conn *conns;
+static int openConns;
+static int edge;
+static int writeThrough;
+static int recvMask; /* AE_RECV with -r */
+static conn **toWrite; /* connections to write before sleeping */
+static int *toWriteFds;
+static int toWriteCount;
+
+static long long ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+static void onWritable(aeEventLoop *eventLoop, int fd, void *clientData, int mask) {
+    conn *c = clientData;
+    ssize_t n;
+
+    AE_NOTUSED(mask);
+    while (c->pending > 0) {
+        n = write(fd, c->buf, c->pending > READ_UNIT ? READ_UNIT : c->pending);
+        if (n <= 0) break;
+        c->pending -= n;
+    }
+    if (c->pending == 0 && !edge) aeDeleteFileEvent(eventLoop, fd, AE_WRITABLE);
+}
+
+static void onReadable(aeEventLoop *eventLoop, int fd, void *clientData, int mask) {
+    conn *c = clientData;
+    ssize_t n;
+
+    AE_NOTUSED(mask);
+    for (;;) {
+        struct iovec iov = {c->buf, READ_UNIT};
+
+        n = aeReadv(eventLoop, fd, &iov, 1);
+        if (n > 0) {
+            c->pending += n;
+            continue;
+        }
+        if (n == -1 && errno == EAGAIN) break;
+
+        aeDeleteFileEvent(eventLoop, fd, AE_READABLE|AE_WRITABLE|AE_RECV);
+        close(fd);
+        if (--openConns == 0) aeStop(eventLoop);
+        return;
+    }
+    if (c->pending == 0) return;
+    /* In edge mode the socket is assumed writable, a short write is finished
+     * by the next edge. */
+    if (edge) {
+        onWritable(eventLoop, fd, c, AE_WRITABLE);
+    } else if (writeThrough) {
+        if (!(aeGetFileEvents(eventLoop, fd) & AE_WRITABLE)) {
+            toWrite[toWriteCount] = c;
+            toWriteFds[toWriteCount++] = fd;
+        }
+    } else
+        aeCreateFileEvent(eventLoop, fd, AE_WRITABLE, onWritable, c);
+}
+
+static void beforeSleep(aeEventLoop *eventLoop) {
+    int j;
+
+    for (j = 0; j < toWriteCount; j++) {
+        onWritable(eventLoop, toWriteFds[j], toWrite[j], AE_WRITABLE);
+        if (toWrite[j]->pending > 0)
+            aeCreateFileEvent(eventLoop, toWriteFds[j], AE_WRITABLE, onWritable, toWrite[j]);
+    }
+    toWriteCount = 0;
+}
+
+static void serve(int *fds, int count, int traced) {
+    aeEventLoop *eventLoop = aeCreateEventLoop(count + 64);
+    int j;
+
+    if (traced) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+    }
+
+    conns = calloc(count, sizeof(conn));
+    if (writeThrough) {
+        toWrite = malloc(sizeof(conn*)*count);
+        toWriteFds = malloc(sizeof(int)*count);
+        aeSetBeforeSleepProc(eventLoop, beforeSleep);
+    }
+    for (j = 0; j < count; j++) {
+        fcntl(fds[j], F_SETFL, fcntl(fds[j], F_GETFL) | O_NONBLOCK);
+        if (edge) {
+            if (aeCreateFileEvent(eventLoop, fds[j], AE_READABLE|AE_EDGE|recvMask, onReadable,
+                    &conns[j]) == AE_ERR ||
+                aeCreateFileEvent(eventLoop, fds[j], AE_WRITABLE|AE_EDGE, onWritable,
+                    &conns[j]) == AE_ERR) {
+                perror("aeCreateFileEvent");
+                exit(1);
+            }
+        } else {
+            aeCreateFileEvent(eventLoop, fds[j], AE_READABLE|recvMask, onReadable, &conns[j]);
+        }
+    }
+    openConns = count;
+
+    /* Syscalls are counted between the two markers. */
+    getppid();
+    aeMain(eventLoop);
+    getppid();
+
+    aeDeleteEventLoop(eventLoop);
+    exit(0);
+}
+
+static void request(int *fds, int count, int rounds) {
+    char buf[REQUEST_LEN];
+    int r, j, n, got;
+
+    memset(buf, 'x', sizeof(buf));
+    for (r = 0; r < rounds; r++) {
+        for (j = 0; j < count; j++)
+            if (write(fds[j], buf, REQUEST_LEN) != REQUEST_LEN) exit(1);
+        for (j = 0; j < count; j++) {
+            for (got = 0; got < REQUEST_LEN; got += n)
+                if ((n = read(fds[j], buf, REQUEST_LEN - got)) <= 0) exit(1);
+        }
+    }
+    for (j = 0; j < count; j++) close(fds[j]);
+    exit(0);
+}
+
+/* Count syscalls entered by the server between the markers. */
+static long long countSyscalls(pid_t server) {
+    struct ptrace_syscall_info info;
+    long long count = 0;
+    int status, counting = 0, markers = 0;
+
+    waitpid(server, &status, 0);
+    ptrace(PTRACE_SETOPTIONS, server, NULL,
+            (void*)(long)(PTRACE_O_TRACESYSGOOD|PTRACE_O_EXITKILL));
+    for (;;) {
+        if (ptrace(PTRACE_SYSCALL, server, NULL, NULL) == -1) break;
+        if (waitpid(server, &status, 0) == -1 || WIFEXITED(status)) break;
+        if (!WIFSTOPPED(status) || WSTOPSIG(status) != (SIGTRAP|0x80)) continue;
+        if (ptrace(PTRACE_GET_SYSCALL_INFO, server, (void*)sizeof(info), &info) <= 0 ||
+            info.op != PTRACE_SYSCALL_INFO_ENTRY) continue;
+
+        if (info.entry.nr == __NR_getppid) {
+            counting = ++markers == 1;
+            continue;
+        }
+        if (counting) count++;
+    }
+    return count;
+}
+
+int main(int argc, char **argv) {
+    int traced = 0, count, rounds, j, status, sv[2];
+    int *serverFds, *clientFds;
+    long long start, elapsed, syscalls = 0;
+    pid_t server, client;
+    aeEventLoop *probe;
+
+    while (argc > 1 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-s") == 0) traced = 1;
+        else if (strcmp(argv[1], "-e") == 0) edge = 1;
+        else if (strcmp(argv[1], "-w") == 0) writeThrough = 1;
+        else if (strcmp(argv[1], "-r") == 0) recvMask = AE_RECV;
+        argc--;
+        argv++;
+    }
+    count = argc > 1 ? atoi(argv[1]) : DEFAULT_CONNS;
+    rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+
+    serverFds = malloc(sizeof(int)*count);
+    clientFds = malloc(sizeof(int)*count);
+    for (j = 0; j < count; j++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+            perror("socketpair");
+            return 1;
+        }
+        serverFds[j] = sv[0];
+        clientFds[j] = sv[1];
+    }
+
+    /* the backend is chosen at the creation of the loop */
+    probe = aeCreateEventLoop(64);
+    printf("backend: %s%s%s, connections: %d, requests: %lld\n", aeGetApiName(),
+            edge ? " (edge triggered)" : writeThrough ? " (write through)" : "",
+            recvMask ? " (recv)" : "", count, (long long)count*rounds);
+    aeDeleteEventLoop(probe);
+    fflush(stdout);
+
+    start = ustime();
+    if ((server = fork()) == 0) {
+        for (j = 0; j < count; j++) close(clientFds[j]);
+        serve(serverFds, count, traced);
+    }
+    if ((client = fork()) == 0) {
+        for (j = 0; j < count; j++) close(serverFds[j]);
+        request(clientFds, count, rounds);
+    }
+    for (j = 0; j < count; j++) {
+        close(serverFds[j]);
+        close(clientFds[j]);
+    }
+
+    if (traced) syscalls = countSyscalls(server);
+    waitpid(server, &status, 0);
+    waitpid(client, &status, 0);
+    elapsed = ustime() - start;
+
+    if (traced) {
+        printf("server syscalls: %lld, %.2f per request\n", syscalls,
+                (double)syscalls/((long long)count*rounds));
+    } else {
+        printf("%lld us in total, %.0f requests/s\n", elapsed,
+                (double)count*rounds*1000000/elapsed);
+    }
+    return 0;
+}
@@ -0,0 +1,96 @@
+/* Benchmark of time events: create, delete, idle iterations of the loop
+ * and firing, with 100k timers by default.
+ *
+ * Usage: ./timer [count]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "../ae.h"
+
+#define DEFAULT_TIMERS 100000
+#define IDLE_LOOPS 10000
+
+static long fired;
+
+static long long ustime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long)tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+static int onTimer(struct aeEventLoop *eventLoop, long long id, void *clientData) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(id);
+    AE_NOTUSED(clientData);
+
+    fired++;
+    return AE_NOMORE;
+}
+
+static int neverFire(struct aeEventLoop *eventLoop, long long id, void *clientData) {
+    AE_NOTUSED(eventLoop);
+    AE_NOTUSED(id);
+    AE_NOTUSED(clientData);
+
+    return AE_NOMORE;
+}
+
+int main(int argc, char **argv) {
+    aeEventLoop *el;
+    long long *ids, start, elapsed;
+    int count, j;
+
+    count = argc > 1 ? atoi(argv[1]) : DEFAULT_TIMERS;
+    if ((el = aeCreateEventLoop(1024)) == NULL ||
+        (ids = malloc(sizeof(long long)*count)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    srand(1);
+
+    /* Far timers, like idle timeouts of connections. */
+    start = ustime();
+    for (j = 0; j < count; j++)
+        ids[j] = aeCreateTimeEvent(el, 3600*1000 + rand()%1000, neverFire, NULL, NULL);
+    elapsed = ustime()-start;
+    printf("create %d timers: %lld us, %.1f ns/op\n", count, elapsed,
+        (double)elapsed*1000/count);
+
+    /* Half of them are cancelled, like timeouts of finished requests. */
+    start = ustime();
+    for (j = 0; j < count; j += 2)
+        aeDeleteTimeEvent(el, ids[j]);
+    elapsed = ustime()-start;
+    printf("delete %d timers: %lld us, %.1f ns/op\n", count/2, elapsed,
+        (double)elapsed*1000/(count/2));
+
+    /* Iterations without any timer due, the cost paid by every iteration of
+     * a busy loop. */
+    start = ustime();
+    for (j = 0; j < IDLE_LOOPS; j++)
+        aeProcessEvents(el, AE_TIME_EVENTS|AE_DONT_WAIT);
+    elapsed = ustime()-start;
+    printf("%d idle iterations: %lld us, %.1f ns/iteration\n", IDLE_LOOPS, elapsed,
+        (double)elapsed*1000/IDLE_LOOPS);
+
+    for (j = 1; j < count; j += 2)
+        aeDeleteTimeEvent(el, ids[j]);
+
+    /* Timers firing within 100ms, the time spent beyond 100ms is the cost of
+     * processing them. */
+    for (j = 0; j < count; j++)
+        aeCreateTimeEvent(el, rand()%100, onTimer, NULL, NULL);
+    start = ustime();
+    while (fired < count)
+        aeProcessEvents(el, AE_TIME_EVENTS);
+    elapsed = ustime()-start;
+    printf("fire %ld timers due in 100ms: %lld us in total\n", fired, elapsed);
+
+    aeDeleteEventLoop(el);
+    free(ids);
+    return 0;
+}
@@ -0,0 +1,372 @@
+/**
+ *
+ * @file    deque
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-07-17 15:03:12
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "deque.h"
+#include "logging.h"
+#include "memory.h"
+
+#define DEQUE_MIN_CAPACITY  8
+// elements ahead of the one visited whose objects are prefetched
+#define DEQUE_PREFETCH_AHEAD    4
+
+#define slot_of(d, idx)     ((d)->vals[((d)->head + (idx)) & ((d)->capacity - 1)])
+
+struct deque_s {
+    void    **vals;
+    int     capacity;   // a power of 2
+    int     head;       // slot of the front element
+    int     size;
+
+    deallocator_t   dealloc;
+};
+
+typedef struct {
+    iterator_t_implement;
+
+    deque_t     *deque;
+    int         idx;
+} deque_iterator_t;
+
+/**
+ * Move the elements to a ring of 'capacity', where the front element takes the
+ * first slot.
+ */
+static int deque_resize(deque_t *d, int capacity) {
+    void    **vals;
+    int     first;
+
+    if ((vals = octopus_malloc(sizeof(void *) * capacity, OCTOPUS_MEM_COMMAND)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for deque, capacity: %d", capacity);
+        return OCTOPUS_ERR;
+    }
+
+    // the elements wrap around the end at most once
+    first = d->size < d->capacity - d->head ? d->size : d->capacity - d->head;
+    memcpy(vals, d->vals + d->head, sizeof(void *) * first);
+    memcpy(vals + first, d->vals, sizeof(void *) * (d->size - first));
+
+    octopus_free(d->vals);
+    d->vals = vals;
+    d->capacity = capacity;
+    d->head = 0;
+
+    return OCTOPUS_OK;
+}
+
+static inline int deque_reserve(deque_t *d, int n) {
+    int     capacity;
+
+    if (d->size + n <= d->capacity) {
+        return OCTOPUS_OK;
+    }
+
+    for (capacity = d->capacity * 2; capacity < d->size + n; capacity *= 2);
+
+    return deque_resize(d, capacity);
+}
+
+deque_t* deque_create(int capacity, deallocator_t dealloc) {
+    deque_t     *d;
+    int         cap;
+
+    if ((d = octopus_calloc(1, sizeof(deque_t), OCTOPUS_MEM_COMMAND)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for deque");
+        return NULL;
+    }
+
+    for (cap = DEQUE_MIN_CAPACITY; cap < capacity; cap *= 2);
+    if ((d->vals = octopus_malloc(sizeof(void *) * cap, OCTOPUS_MEM_COMMAND)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for deque, capacity: %d", cap);
+        octopus_free(d);
+        return NULL;
+    }
+    d->capacity = cap;
+    d->dealloc = dealloc;
+
+    return d;
+}
+
+int deque_push_back(deque_t *d, void *val) {
+    if (deque_reserve(d, 1) == OCTOPUS_ERR) {
+        return OCTOPUS_ERR;
+    }
+
+    slot_of(d, d->size) = val;
+    d->size++;
+
+    return OCTOPUS_OK;
+}
+
+int deque_push_front(deque_t *d, void *val) {
+    if (deque_reserve(d, 1) == OCTOPUS_ERR) {
+        return OCTOPUS_ERR;
+    }
+
+    d->head = (d->head - 1) & (d->capacity - 1);
+    d->vals[d->head] = val;
+    d->size++;
+
+    return OCTOPUS_OK;
+}
+
+int deque_push_back_batch(deque_t *d, void **vals, int n) {
+    int     tail, first;
+
+    if (n <= 0) {
+        return OCTOPUS_OK;
+    }
+
+    if (deque_reserve(d, n) == OCTOPUS_ERR) {
+        return OCTOPUS_ERR;
+    }
+
+    // copied in two runs, before and after the end of the ring
+    tail = (d->head + d->size) & (d->capacity - 1);
+    first = n < d->capacity - tail ? n : d->capacity - tail;
+    memcpy(d->vals + tail, vals, sizeof(void *) * first);
+    memcpy(d->vals, vals + first, sizeof(void *) * (n - first));
+    d->size += n;
+
+    return OCTOPUS_OK;
+}
+
+void* deque_pop_front(deque_t *d) {
+    void    *val;
+
+    if (d->size == 0) {
+        return NULL;
+    }
+
+    val = d->vals[d->head];
+    d->head = (d->head + 1) & (d->capacity - 1);
+    d->size--;
+
+    return val;
+}
+
+void* deque_pop_back(deque_t *d) {
+    if (d->size == 0) {
+        return NULL;
+    }
+
+    d->size--;
+
+    return slot_of(d, d->size);
+}
+
+int deque_pop_front_batch(deque_t *d, void **vals, int n) {
+    int     first;
+
+    n = n < d->size ? n : d->size;
+    if (n <= 0) {
+        return 0;
+    }
+
+    first = n < d->capacity - d->head ? n : d->capacity - d->head;
+    memcpy(vals, d->vals + d->head, sizeof(void *) * first);
+    memcpy(vals + first, d->vals, sizeof(void *) * (n - first));
+    d->head = (d->head + n) & (d->capacity - 1);
+    d->size -= n;
+
+    return n;
+}
+
+void* deque_get(deque_t *d, int idx) {
+    if (idx < 0 || idx >= d->size) {
+        return NULL;
+    }
+
+    return slot_of(d, idx);
+}
+
+void* deque_front(deque_t *d) {
+    return deque_get(d, 0);
+}
+
+void* deque_back(deque_t *d) {
+    return deque_get(d, d->size - 1);
+}
+
+int deque_size(deque_t *d) {
+    return d->size;
+}
+
+void deque_clear(deque_t *d) {
+    if (d->dealloc != NULL) {
+        for (int i = 0; i < d->size; i++) {
+            d->dealloc(slot_of(d, i));
+        }
+    }
+    d->head = 0;
+    d->size = 0;
+}
+
+static void* deque_iter_next(void *it) {
+    deque_iterator_t    *iter;
+    deque_t             *d;
+
+    iter = (deque_iterator_t *)it;
+    d = iter->deque;
+    if (iter->idx >= d->size) {
+        return NULL;
+    }
+
+    // prefetching doesn't fault, even if the element isn't a valid pointer
+    if (iter->idx + DEQUE_PREFETCH_AHEAD < d->size) {
+        __builtin_prefetch(slot_of(d, iter->idx + DEQUE_PREFETCH_AHEAD));
+    }
+
+    return slot_of(d, iter->idx++);
+}
+
+static int deque_iter_has_next(void *it) {
+    deque_iterator_t    *iter;
+
+    iter = (deque_iterator_t *)it;
+
+    return iter->idx < iter->deque->size;
+}
+
+static int deque_iter_index(void *it) {
+    return ((deque_iterator_t *)it)->idx;
+}
+
+iterator_t* deque_iter(deque_t *d) {
+    deque_iterator_t    *iter;
+
+    if ((iter = octopus_malloc(sizeof(deque_iterator_t), OCTOPUS_MEM_COMMAND)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for deque iter");
+        return NULL;
+    }
+    deque_iter_init(d, (iterator_t *)iter);
+
+    return (iterator_t *)iter;
+}
+
+int deque_iter_init(deque_t *d, iterator_t *it) {
+    deque_iterator_t    *iter;
+
+    ONE_PTR_NULL_CHECK(it);
+
+    iter = (deque_iterator_t *)it;
+    iter->next = deque_iter_next;
+    iter->has_next = deque_iter_has_next;
+    iter->remove = NULL;
+    iter->index = deque_iter_index;
+    iter->deque = d;
+    iter->idx = 0;
+
+    // the first elements are prefetched before they are visited
+    for (int i = 0; i < DEQUE_PREFETCH_AHEAD && i < d->size; i++) {
+        __builtin_prefetch(slot_of(d, i));
+    }
+
+    return OCTOPUS_OK;
+}
+
+void deque_iter_destroy(iterator_t *iter) {
+    octopus_free(iter);
+}
+
+void deque_destroy(deque_t *d) {
+    if (d == NULL) {
+        return;
+    }
+
+    deque_clear(d);
+    octopus_free(d->vals);
+    octopus_free(d);
+}
+
+#ifdef OCTOPUS_TEST_DEQUE
+
+#include <stdio.h>
+#include <stdint.h>
+
+int main(int argc, char *argv[])
+{
+    deque_t     *d;
+    iterator_t  *iter;
+    void        *batch[16];
+    int         n, wrong, pushed, popped;
+
+    OCTOPUS_NOT_USED(argc);
+    OCTOPUS_NOT_USED(argv);
+
+    d = deque_create(4, NULL);
+    for (intptr_t i = 1; i <= 5; i++) {
+        deque_push_back(d, (void *)i);
+    }
+    deque_push_front(d, (void *)0);
+    printf("size: %d, front: %d, back: %d\n", deque_size(d), (int)(intptr_t)deque_front(d),
+            (int)(intptr_t)deque_back(d));
+
+    for (iter = deque_iter(d); iter->has_next(iter);) {
+        printf("%d: %d\n", iter->index(iter), (int)(intptr_t)iter->next(iter));
+    }
+    deque_iter_destroy(iter);
+
+    printf("pop front: %d, pop back: %d\n", (int)(intptr_t)deque_pop_front(d),
+            (int)(intptr_t)deque_pop_back(d));
+
+    deque_destroy(d);
+
+    // elements keep their order while the ring wraps around and grows
+    d = deque_create(8, NULL);
+    pushed = popped = wrong = 0;
+    for (int round = 0; round < 50; round++) {
+        for (int i = 0; i < 7; i++) {
+            deque_push_back(d, (void *)(intptr_t)pushed++);
+        }
+        for (int i = 0; i < 5; i++) {
+            wrong += deque_pop_front(d) != (void *)(intptr_t)popped++;
+        }
+    }
+    for (int i = 0; i < deque_size(d); i++) {
+        wrong += deque_get(d, i) != (void *)(intptr_t)(popped + i);
+    }
+    printf("size: %d, out of order: %d\n", deque_size(d), wrong);
+
+    deque_destroy(d);
+
+    // batches are copied in two runs when they cross the end of the ring
+    d = deque_create(8, NULL);
+    pushed = popped = wrong = 0;
+    for (int round = 0; round < 50; round++) {
+        for (int i = 0; i < 7; i++) {
+            batch[i] = (void *)(intptr_t)pushed++;
+        }
+        if (deque_push_back_batch(d, batch, 7) == OCTOPUS_ERR) {
+            wrong++;
+        }
+        n = deque_pop_front_batch(d, batch, 5);
+        for (int i = 0; i < n; i++) {
+            wrong += batch[i] != (void *)(intptr_t)popped++;
+        }
+    }
+    for (int i = 0; i < deque_size(d); i++) {
+        wrong += deque_get(d, i) != (void *)(intptr_t)(popped + i);
+    }
+    printf("batch size: %d, out of order: %d\n", deque_size(d), wrong);
+
+    // a batch pop stops at the elements left
+    while ((n = deque_pop_front_batch(d, batch, 16)) > 0) {
+        for (int i = 0; i < n; i++) {
+            wrong += batch[i] != (void *)(intptr_t)popped++;
+        }
+    }
+    printf("drained: %d, empty: %d, out of order: %d\n", popped, deque_empty(d), wrong);
+
+    deque_destroy(d);
+
+    return 0;
+}
+
+#endif
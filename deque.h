@@ -0,0 +1,66 @@
+/**
+ *
+ * @file    deque
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-07-17 14:26:51
+ */
+
+#ifndef OCTOPUS_DEQUE_H
+#define OCTOPUS_DEQUE_H
+
+#include "common.h"
+
+#define deque_empty(d)  (deque_size(d) == 0)
+
+/**
+ * Double-ended queue of pointers in a ring, whose capacity is a power of 2 and
+ * doubles when it's full. Elements are contiguous in memory, so walking them
+ * doesn't chase nodes as list_t does.
+ */
+typedef struct deque_s deque_t;
+
+/**
+ * @brief Create a deque, 'capacity' is rounded up to a power of 2. 'dealloc' is
+ *      called on the elements left when the deque is destroyed or cleared, but
+ *      not on the elements popped.
+ */
+deque_t* deque_create(int capacity, deallocator_t dealloc);
+int deque_push_back(deque_t *d, void *val);
+int deque_push_front(deque_t *d, void *val);
+
+/**
+ * @brief Push 'n' elements in order, with the ring grown once at most.
+ */
+int deque_push_back_batch(deque_t *d, void **vals, int n);
+
+/**
+ * @return the element removed, or NULL if the deque is empty.
+ */
+void* deque_pop_front(deque_t *d);
+void* deque_pop_back(deque_t *d);
+
+/**
+ * @brief Pop up to 'n' elements from the front into 'vals'.
+ * @return the count of elements popped.
+ */
+int deque_pop_front_batch(deque_t *d, void **vals, int n);
+
+/**
+ * @brief Element 'idx' from the front, or NULL if it's out of range.
+ */
+void* deque_get(deque_t *d, int idx);
+void* deque_front(deque_t *d);
+void* deque_back(deque_t *d);
+int deque_size(deque_t *d);
+void deque_clear(deque_t *d);
+
+/**
+ * @brief Iterate from the front. The objects pointed by a few elements ahead
+ *      are prefetched, so they are likely in cache when they are visited.
+ */
+iterator_t* deque_iter(deque_t *d);
+int deque_iter_init(deque_t *d, iterator_t *iter);
+void deque_iter_destroy(iterator_t *iter);
+void deque_destroy(deque_t *d);
+
+#endif /* ifndef OCTOPUS_DEQUE_H */
@@ -0,0 +1,101 @@
+/**
+ *
+ * @file    echo_server
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-04 15:26:03
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "echo_server.h"
+#include "octopus.h"
+#include "object.h"
+#include "logging.h"
+#include "common.h"
+
+#define DEFAULT_PORT    "8080"
+
+// delay of each response, which runs the processor on coroutines if it's set
+static long long    delay_ms;
+
+static object_t* echo_process(processor_t *processor, object_t *cmd_obj) {
+    OCTOPUS_NOT_USED(processor);
+
+    // Reading is paused while the command is suspended, so the frame is still
+    // valid after sleep.
+    if (delay_ms > 0 && octopus_sleep(delay_ms) == OCTOPUS_ERR) {
+        return NULL;
+    }
+
+    // The frame is encoded before the input buffer is changed, so it can be
+    // responded directly.
+    cmd_obj->incr(cmd_obj);
+
+    return cmd_obj;
+}
+
+static void echo_processor_destroy(processor_t *processor) {
+    free(processor);
+}
+
+processor_t* echo_processor_create() {
+    processor_t     *p;
+
+    if ((p = calloc(1, sizeof(processor_t))) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for echo processor");
+        return NULL;
+    }
+
+    p->process = echo_process;
+    p->destroy = echo_processor_destroy;
+
+    return p;
+}
+
+int main(int argc, char *argv[]) {
+    octopus_t   *oct;
+    const char  *port;
+    int         ioworkers, flags;
+
+    port = argc > 1 ? argv[1] : DEFAULT_PORT;
+    ioworkers = argc > 2 ? atoi(argv[2]) : 0;
+    delay_ms = argc > 3 ? atoll(argv[3]) : 0;
+
+    octopus_set_log_level(OCTOPUS_LOGGING_LEVEL_INFO);
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((oct = octopus_create()) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create octopus");
+        return 1;
+    }
+
+    if (ioworkers > 0) {
+        octopus_set_ioworker_count(oct, ioworkers);
+    }
+
+    flags = OCTOPUS_PROCESSOR_SCOPE_IOWORKER;
+    if (delay_ms > 0) {
+        flags |= OCTOPUS_PROCESSOR_COROUTINE;
+    }
+
+    if (octopus_register_processor_factory_with_scope(oct, OCTOPUS_PROTOCOL_LENPREFIX,
+                echo_processor_create, flags) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("failed to register echo processor");
+        return 1;
+    }
+
+    octopus_add_listening_socket(oct, "0.0.0.0", port, OCTOPUS_PROTOCOL_LENPREFIX);
+
+    if (octopus_srv_start(oct) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("failed to start echo server");
+        octopus_destroy(oct);
+        return 1;
+    }
+
+    octopus_destroy(oct);
+
+    return 0;
+}
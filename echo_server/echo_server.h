@@ -0,0 +1,19 @@
+/**
+ *
+ * @file    echo_server
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-04 15:20:41
+ */
+
+#ifndef ECHO_SERVER_H
+#define ECHO_SERVER_H
+
+#include "processor.h"
+
+/**
+ * A processor which responds the frame received, used with the built-in
+ * lenprefix protocol(see cli.py).
+ */
+processor_t* echo_processor_create();
+
+#endif /* ifndef ECHO_SERVER_H */
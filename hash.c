@@ -6,27 +6,64 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
-#include <strings.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "hash.h"
 #include "logging.h"
+#include "memory.h"
 
-#define HASH_ENTRY_INIT_SIZE    8;
+// Slots are probed a group at a time, by comparing the control bytes of the
+// group at once.
+#define GROUP_WIDTH         16
+#define HASH_INIT_CAPACITY  GROUP_WIDTH
 
-typedef struct entry_s {
-    int     hash_val;
+// Control byte of a slot: EMPTY, DELETED, or the low 7 bits of the hash of a
+// full slot. Free slots have the sign bit set.
+#define CTRL_EMPTY      ((int8_t)-128)
+#define CTRL_DELETED    ((int8_t)-2)
 
-    const void  *val;
-    const void  *key;
+#define h1(hash_val)    ((hash_val) >> 7)
+#define h2(hash_val)    ((int8_t)((hash_val) & 0x7f))
 
-    struct entry_s     *next;
-} entry_t;
+// tables are at most 7/8 full
+#define max_load(capacity)  ((capacity) - (capacity) / 8)
 
-struct hash_s {
+// groups moved by a put or remove while rehashing, and empty ones visited
+#define REHASH_GROUPS           1
+#define REHASH_EMPTY_VISITS     10
+
+#define is_rehashing(h)     ((h)->rehash_idx != -1)
+
+typedef struct {
+    const void      *key;
+    const void      *val;
+    unsigned int    hash_val;
+} slot_t;
+
+typedef struct {
+    int8_t      *ctrl;
+    slot_t      *slots;
+    int         capacity;       // a power of 2, not less than GROUP_WIDTH
     int         size;
-    int         entry_count;
-    entry_t     **entries;
+    // slots which can still be taken from EMPTY, before the table is resized
+    int         growth_left;
+} table_t;
+
+/**
+ * Open addressing in the layout of swiss tables. While the hash is resized, it
+ * has two tables, and groups of the old one are moved to the new one by puts
+ * and removes a few at a time, so no single call pays for the whole resize.
+ */
+struct hash_s {
+    table_t     tables[2];
+    // next group of tables[0] to move into tables[1], or -1 if not rehashing
+    int         rehash_idx;
+    // rehashing is paused while iterators exist, so entries stay in place
+    int         iterators;
 
     hash_func_t     hash_func;
     equal_func_t    equal_func;
@@ -38,63 +75,362 @@ typedef struct {
     iterator_t_implement;
 
     hash_t      *hash;
-    entry_t     *cur_entry;
-    int         entry_index;
+    int         table;
+    int         slot;
     int         idx;
     pair_t      pair;
-    int         has_next_first;
 } hash_iterator_t;
 
-static inline int str_hash_func(const void *k) {
-    int     hash_val;
-    char    *s;
+/**
+ * Bitmasks of the slots in a group whose control byte is 'c', and which are
+ * free. The lowest bit stands for the first slot.
+ */
+#ifdef __SSE2__
+
+static inline unsigned int group_match(const int8_t *ctrl, int8_t c) {
+    __m128i     group;
+
+    group = _mm_loadu_si128((const __m128i *)ctrl);
+    return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(c)));
+}
+
+static inline unsigned int group_match_free(const int8_t *ctrl) {
+    return (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl));
+}
+
+#else
+
+static inline unsigned int group_match(const int8_t *ctrl, int8_t c) {
+    unsigned int    mask;
+
+    mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        mask |= (unsigned int)(ctrl[i] == c) << i;
+    }
+
+    return mask;
+}
+
+static inline unsigned int group_match_free(const int8_t *ctrl) {
+    unsigned int    mask;
 
-    hash_val = 13477;
-    s = (char *)k;
-    while (*s) {
-        hash_val = *s + 7 * hash_val;
-        s++;
+    mask = 0;
+    for (int i = 0; i < GROUP_WIDTH; i++) {
+        mask |= (unsigned int)(ctrl[i] < 0) << i;
+    }
+
+    return mask;
+}
+
+#endif
+
+/**
+ * Hash of bytes after wyhash, by Wang Yi. 128-bit products are folded into 64
+ * bits, which mixes 8 bytes in one multiplication.
+ */
+static const uint64_t wyp[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+static inline void wymum(uint64_t *a, uint64_t *b) {
+    __uint128_t     r;
+
+    r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+}
+
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+    wymum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t wyr8(const uint8_t *p) {
+    uint64_t    v;
+
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t wyr4(const uint8_t *p) {
+    uint32_t    v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t wyr3(const uint8_t *p, size_t k) {
+    return ((uint64_t)p[0] << 16) | ((uint64_t)p[k >> 1] << 8) | p[k - 1];
+}
+
+int hash_bytes(const void *key, int len) {
+    const uint8_t   *p;
+    uint64_t        seed, see1, see2, a, b;
+    size_t          i;
+
+    p = (const uint8_t *)key;
+    seed = wymix(wyp[0], wyp[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wyr4(p) << 32) | wyr4(p + ((len >> 3) << 2));
+            b = (wyr4(p + len - 4) << 32) | wyr4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = wyr3(p, len);
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        i = len;
+        if (i > 48) {
+            see1 = see2 = seed;
+            do {
+                seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+                see1 = wymix(wyr8(p + 16) ^ wyp[2], wyr8(p + 24) ^ see1);
+                see2 = wymix(wyr8(p + 32) ^ wyp[3], wyr8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wymix(wyr8(p) ^ wyp[1], wyr8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = wyr8(p + i - 16);
+        b = wyr8(p + i - 8);
     }
 
-    return hash_val;
+    a ^= wyp[1];
+    b ^= seed;
+    wymum(&a, &b);
+    a = wymix(a ^ wyp[0] ^ (uint64_t)len, b ^ wyp[1]);
+
+    return (int)(a ^ (a >> 32));
+}
+
+/**
+ * Finalizer of murmur3, so weak hash functions, e.g. of ints, still spread
+ * over groups and control bytes.
+ */
+static inline unsigned int hash_mix(int hash_val) {
+    unsigned int    h;
+
+    h = (unsigned int)hash_val;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+
+    return h;
+}
+
+static int str_hash_func(const void *k) {
+    return hash_bytes(k, strlen(k));
 }
 
-static inline int str_equal_func(const void *a, const void *b) {
+static int str_equal_func(const void *a, const void *b) {
     return strcmp(a, b) == 0;
 }
 
-static inline int int_hash_func(const void *k) {
-    return (int)k;
+static int int_hash_func(const void *k) {
+    return (int)(intptr_t)k;
 }
 
-static inline int int_equal_func(const void *a, const void *b) {
-    return (int)a == (int)b;
+static int int_equal_func(const void *a, const void *b) {
+    return a == b;
 }
 
-hash_t* hash_create(hash_func_t h, equal_func_t e, deallocator_t kd, deallocator_t vd) {
-    hash_t      *hash;
+static int table_init(table_t *t, int capacity) {
+    char    *mem;
+
+    // control bytes go first, so slots are aligned as well
+    if ((mem = octopus_malloc(capacity + sizeof(slot_t) * capacity, OCTOPUS_MEM_TABLE)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for hash table, capacity: %d", capacity);
+        return OCTOPUS_ERR;
+    }
+    memset(mem, CTRL_EMPTY, capacity);
+
+    t->ctrl = (int8_t *)mem;
+    t->slots = (slot_t *)(mem + capacity);
+    t->capacity = capacity;
+    t->size = 0;
+    t->growth_left = max_load(capacity);
+
+    return OCTOPUS_OK;
+}
+
+static void table_free(table_t *t) {
+    octopus_free(t->ctrl);
+    memset(t, 0, sizeof(table_t));
+}
+
+/**
+ * Groups are probed in triangular steps, which visit each group once when the
+ * count of groups is a power of 2. A probe stops at a group with an EMPTY slot.
+ */
+static int table_find(const hash_t *h, const table_t *t, const void *key, unsigned int hash_val) {
+    unsigned int    mask, group, match;
+    int             idx;
+
+    if (t->size == 0) {
+        return -1;
+    }
+
+    mask = t->capacity / GROUP_WIDTH - 1;
+    group = h1(hash_val) & mask;
+    for (unsigned int step = 1; step <= mask + 1; step++) {
+        match = group_match(t->ctrl + group * GROUP_WIDTH, h2(hash_val));
+        for (; match != 0; match &= match - 1) {
+            idx = group * GROUP_WIDTH + __builtin_ctz(match);
+            if (t->slots[idx].hash_val == hash_val && h->equal_func(t->slots[idx].key, key)) {
+                return idx;
+            }
+        }
+
+        if (group_match(t->ctrl + group * GROUP_WIDTH, CTRL_EMPTY) != 0) {
+            break;
+        }
+        group = (group + step) & mask;
+    }
+
+    return -1;
+}
+
+/**
+ * Take the first free slot on the probe sequence. The table must have one.
+ */
+static void table_insert(table_t *t, const void *key, const void *val, unsigned int hash_val) {
+    unsigned int    mask, group, match;
+    int             idx;
+
+    mask = t->capacity / GROUP_WIDTH - 1;
+    group = h1(hash_val) & mask;
+    for (unsigned int step = 1; ; step++) {
+        if ((match = group_match_free(t->ctrl + group * GROUP_WIDTH)) != 0) {
+            break;
+        }
+        group = (group + step) & mask;
+    }
+
+    idx = group * GROUP_WIDTH + __builtin_ctz(match);
+    if (t->ctrl[idx] == CTRL_EMPTY) {
+        t->growth_left--;
+    }
+    t->ctrl[idx] = h2(hash_val);
+    t->slots[idx].key = key;
+    t->slots[idx].val = val;
+    t->slots[idx].hash_val = hash_val;
+    t->size++;
+}
+
+/**
+ * Free the slot. A probe passes a group only if the group had no free slot, so
+ * the slot can become EMPTY if the group has an EMPTY one, otherwise probes
+ * passing it must go on, and it becomes DELETED.
+ */
+static void table_erase(table_t *t, int idx) {
+    if (group_match(t->ctrl + idx / GROUP_WIDTH * GROUP_WIDTH, CTRL_EMPTY) != 0) {
+        t->ctrl[idx] = CTRL_EMPTY;
+        t->growth_left++;
+    } else {
+        t->ctrl[idx] = CTRL_DELETED;
+    }
+    t->size--;
+}
+
+static void rehash_finish(hash_t *h) {
+    table_free(&h->tables[0]);
+    h->tables[0] = h->tables[1];
+    memset(&h->tables[1], 0, sizeof(table_t));
+    h->rehash_idx = -1;
+}
 
-    hash = (hash_t *)malloc(sizeof(hash_t));
-    if (hash == NULL) {
+/**
+ * Move up to 'groups' groups of the old table, which are left DELETED, so
+ * probes of the old table still pass them.
+ */
+static void rehash_move(hash_t *h, int groups) {
+    table_t         *from;
+    unsigned int    match;
+    long long       empty_visits;
+    int             idx, group_count;
+
+    from = &h->tables[0];
+    group_count = from->capacity / GROUP_WIDTH;
+    empty_visits = (long long)groups * REHASH_EMPTY_VISITS;
+    while (groups > 0 && h->rehash_idx < group_count) {
+        match = ~group_match_free(from->ctrl + h->rehash_idx * GROUP_WIDTH) & 0xffff;
+        if (match == 0) {
+            h->rehash_idx++;
+            if (--empty_visits == 0) {
+                break;
+            }
+            continue;
+        }
+
+        for (; match != 0; match &= match - 1) {
+            idx = h->rehash_idx * GROUP_WIDTH + __builtin_ctz(match);
+            table_insert(&h->tables[1], from->slots[idx].key, from->slots[idx].val,
+                    from->slots[idx].hash_val);
+            from->ctrl[idx] = CTRL_DELETED;
+            from->size--;
+        }
+        h->rehash_idx++;
+        groups--;
+    }
+
+    if (from->size == 0) {
+        rehash_finish(h);
+    }
+}
+
+static inline void rehash_step(hash_t *h) {
+    if (is_rehashing(h) && h->iterators == 0) {
+        rehash_move(h, REHASH_GROUPS);
+    }
+}
+
+/**
+ * Start moving entries to a new table, which doubles unless most of the slots
+ * taken are DELETED, then it just drops them.
+ */
+static int rehash_start(hash_t *h) {
+    table_t     *t;
+    int         capacity;
+
+    t = &h->tables[0];
+    capacity = t->size + 1 > max_load(t->capacity) / 2 ? t->capacity * 2 : t->capacity;
+    if (table_init(&h->tables[1], capacity) == OCTOPUS_ERR) {
+        return OCTOPUS_ERR;
+    }
+    h->rehash_idx = 0;
+
+    return OCTOPUS_OK;
+}
+
+hash_t* hash_create(hash_func_t hf, equal_func_t ef, deallocator_t kd, deallocator_t vd) {
+    hash_t      *h;
+
+    if ((h = octopus_calloc(1, sizeof(hash_t), OCTOPUS_MEM_TABLE)) == NULL) {
         OCTOPUS_ERROR_LOG("failed to alloc mem for hash");
         return NULL;
     }
-    bzero(hash, sizeof(hash_t));
-    hash->entry_count = HASH_ENTRY_INIT_SIZE;
 
-    hash->entries = (entry_t **)malloc(sizeof(entry_t *) * hash->entry_count);
-    if (hash->entries == NULL) {
-        OCTOPUS_ERROR_LOG("failed to alloc mem for entries of hash");
+    if (table_init(&h->tables[0], HASH_INIT_CAPACITY) == OCTOPUS_ERR) {
+        octopus_free(h);
         return NULL;
     }
-    bzero(hash->entries, sizeof(entry_t *) * hash->entry_count);
+    h->rehash_idx = -1;
 
-    hash->hash_func = h;
-    hash->equal_func = e;
-    hash->key_dealloc = kd;
-    hash->val_dealloc = vd;
+    h->hash_func = hf;
+    h->equal_func = ef;
+    h->key_dealloc = kd;
+    h->val_dealloc = vd;
 
-    return hash;
+    return h;
 }
 
 hash_t* hash_str_key_create(deallocator_t kd, deallocator_t vd) {
@@ -105,26 +441,27 @@ hash_t* hash_int_key_create(deallocator_t vd) {
     return hash_create(int_hash_func, int_equal_func, NULL, vd);
 }
 
-static inline entry_t* find_entry(const hash_t *h, const void *key) {
-    int         hash_val;
-    entry_t     *e;
+/**
+ * Find the slot of the key in either table while rehashing.
+ */
+static slot_t* hash_find(const hash_t *h, const void *key, unsigned int hash_val, int *table,
+        int *idx) {
 
-    hash_val = h->hash_func(key);
-    e = h->entries[hash_val % h->entry_count];
-    for (;e != NULL; e = e->next) {
-        if (e->hash_val != hash_val ||
-                !h->equal_func(e->key, key)) {
-            continue;
+    for (int i = 0; i < (is_rehashing(h) ? 2 : 1); i++) {
+        if ((*idx = table_find(h, &h->tables[i], key, hash_val)) != -1) {
+            *table = i;
+            return &h->tables[i].slots[*idx];
         }
-
-        return e;
     }
 
     return NULL;
 }
 
 int hash_put(hash_t *h, const void *key, const void *val) {
-    entry_t     *e, **e_bucket;
+    slot_t          *s;
+    table_t         *t;
+    unsigned int    hash_val;
+    int             table, idx;
 
     if (h == NULL) {
         OCTOPUS_ERROR_LOG("invalid param");
@@ -136,37 +473,38 @@ int hash_put(hash_t *h, const void *key, const void *val) {
         return OCTOPUS_ERR;
     }
 
-    e = find_entry(h, key);
-    if (e != NULL) {
+    rehash_step(h);
+
+    hash_val = hash_mix(h->hash_func(key));
+    if ((s = hash_find(h, key, hash_val, &table, &idx)) != NULL) {
         if (h->val_dealloc != NULL) {
-            h->val_dealloc((char *)e->val);
+            h->val_dealloc((char *)s->val);
         }
-        e->val = val;
+        s->val = val;
 
         return OCTOPUS_OK;
     }
 
-    e = calloc(1, sizeof(entry_t));
-    if (e == NULL) {
-        OCTOPUS_ERROR_LOG("failed to alloc mem for entry");
-        return OCTOPUS_ERR;
+    // The new table has room for the puts while the old one is moved, unless
+    // rehashing is paused by iterators, then it's finished at once, and the
+    // iterators may see entries again.
+    while (is_rehashing(h) && h->tables[1].growth_left == 0) {
+        rehash_move(h, h->tables[0].capacity / GROUP_WIDTH);
     }
 
-    e->hash_val = h->hash_func(key);
-    e->key = key;
-    e->val = val;
-
-    e_bucket = &h->entries[e->hash_val % h->entry_count];
-    e->next = *e_bucket;
-    *e_bucket = e;
+    if (!is_rehashing(h) && h->tables[0].growth_left == 0 && rehash_start(h) == OCTOPUS_ERR) {
+        return OCTOPUS_ERR;
+    }
 
-    h->size++;
+    t = is_rehashing(h) ? &h->tables[1] : &h->tables[0];
+    table_insert(t, key, val, hash_val);
 
     return OCTOPUS_OK;
 }
 
 void* hash_get(const hash_t *h, const void *key) {
-    entry_t     *e;
+    slot_t      *s;
+    int         table, idx;
 
     if (h == NULL) {
         OCTOPUS_ERROR_LOG("invalid param");
@@ -178,28 +516,39 @@ void* hash_get(const hash_t *h, const void *key) {
         return NULL;
     }
 
-    e = find_entry(h, key);
-    if (e == NULL) {
+    if ((s = hash_find(h, key, hash_mix(h->hash_func(key)), &table, &idx)) == NULL) {
         return NULL;
     }
 
-    return (void *)e->val;
+    return (void *)s->val;
 }
 
-static inline void entry_free(hash_t *h, entry_t *e) {
-    if (h->key_dealloc != NULL) {
-        h->key_dealloc((void *)e->key);
+int hash_get_entry(const hash_t *h, const void *key, pair_t *entry) {
+    slot_t      *s;
+    int         table, idx;
+
+    if (h == NULL || entry == NULL) {
+        OCTOPUS_ERROR_LOG("invalid param");
+        return OCTOPUS_FALSE;
     }
-    if (h->val_dealloc != NULL) {
-        h->val_dealloc((void *)e->val);
+
+    if (h->hash_func == NULL || h->equal_func == NULL) {
+        OCTOPUS_ERROR_LOG("hash func and equal func must be set for hash");
+        return OCTOPUS_FALSE;
+    }
+
+    if ((s = hash_find(h, key, hash_mix(h->hash_func(key)), &table, &idx)) == NULL) {
+        return OCTOPUS_FALSE;
     }
+    entry->first = (void *)s->key;
+    entry->second = (void *)s->val;
 
-    free(e);
+    return OCTOPUS_TRUE;
 }
 
 void hash_remove(hash_t *h, const void *key) {
-    int         hash_val;
-    entry_t     *e, *prev;
+    slot_t      *s;
+    int         table, idx;
 
     if (h == NULL) {
         OCTOPUS_ERROR_LOG("invalid param");
@@ -211,148 +560,153 @@ void hash_remove(hash_t *h, const void *key) {
         return;
     }
 
-    hash_val = h->hash_func(key);
-    e = h->entries[hash_val % h->entry_count];
-    // find the entry and the previous entry
-    for (prev = NULL; e != NULL; e = e->next, prev = e) {
-        if (e->hash_val != hash_val ||
-                !h->equal_func(e->key, key)) {
-            continue;
-        }
-
-        // Found the entry
-        if (prev == NULL) {
-            h->entries[hash_val % h->entry_count] = NULL;
-        } else {
-            prev->next = e->next;
-        }
-        entry_free(h, e);
-        h->size--;
+    rehash_step(h);
 
+    if ((s = hash_find(h, key, hash_mix(h->hash_func(key)), &table, &idx)) == NULL) {
         return;
     }
-}
 
-static inline int find_next_nonnull_entry(hash_iterator_t *hash_iter) {
-    hash_t              *h;
+    if (h->key_dealloc != NULL) {
+        h->key_dealloc((void *)s->key);
+    }
+    if (h->val_dealloc != NULL) {
+        h->val_dealloc((void *)s->val);
+    }
+    table_erase(&h->tables[table], idx);
 
-    h = hash_iter->hash;
-    // Find next non-null entry
-    do {
-        hash_iter->entry_index++;
-    } while (hash_iter->entry_index < h->entry_count &&
-            h->entries[hash_iter->entry_index] == NULL);
+    if (is_rehashing(h) && h->tables[0].size == 0 && h->iterators == 0) {
+        rehash_finish(h);
+    }
+}
 
-    if (hash_iter->entry_index >= h->entry_count) {
-        return 0;
+/**
+ * Move to the next full slot from the current position, in the old table and
+ * then in the new one.
+ */
+static int hash_iter_seek(hash_iterator_t *iter) {
+    table_t     *t;
+
+    for (; iter->table < 2; iter->table++, iter->slot = 0) {
+        t = &iter->hash->tables[iter->table];
+        for (; iter->slot < t->capacity; iter->slot++) {
+            if (t->ctrl[iter->slot] >= 0) {
+                return OCTOPUS_TRUE;
+            }
+        }
     }
 
-    return 1;
+    return OCTOPUS_FALSE;
 }
 
-void* hash_iter_next(void *iter) {
-    hash_iterator_t     *hash_iter;
-    entry_t             *e;
+static void* hash_iter_next(void *it) {
+    hash_iterator_t     *iter;
+    slot_t              *s;
 
-    hash_iter = (hash_iterator_t *)iter;
-
-    e = hash_iter->cur_entry;
-    if (e == NULL) {
+    iter = (hash_iterator_t *)it;
+    if (!hash_iter_seek(iter)) {
         return NULL;
     }
 
-    if (e->next != NULL) {
-        hash_iter->cur_entry = e->next;
-    } else {
-        // Move to next entry bucket
-        if (find_next_nonnull_entry(hash_iter)) {
-            hash_iter->cur_entry = hash_iter->hash->entries[hash_iter->entry_index];
-        } else {
-            hash_iter->cur_entry = NULL;
-        }
-    }
-
-    hash_iter->idx++;
-    hash_iter->pair.first = (void *)e->key;
-    hash_iter->pair.second = (void *)e->val;
+    s = &iter->hash->tables[iter->table].slots[iter->slot++];
+    iter->idx++;
+    iter->pair.first = (void *)s->key;
+    iter->pair.second = (void *)s->val;
 
-    return &hash_iter->pair;
+    return &iter->pair;
 }
 
-int hash_iter_has_next(void *iter) {
-    hash_iterator_t     *hash_iter;
-
-    hash_iter = (hash_iterator_t *)iter;
-
-    return hash_iter->cur_entry != NULL;
+static int hash_iter_has_next(void *it) {
+    return hash_iter_seek((hash_iterator_t *)it);
 }
 
-int hash_iter_index(void *iter) {
-    return ((hash_iterator_t *)iter)->idx;
+static int hash_iter_index(void *it) {
+    return ((hash_iterator_t *)it)->idx;
 }
 
 iterator_t* hash_iter(hash_t *h) {
-    hash_iterator_t     *hash_iter;
+    hash_iterator_t     *iter;
 
-    hash_iter = (hash_iterator_t *)calloc(1, sizeof(hash_iterator_t));
-    if (hash_iter == NULL) {
+    if ((iter = octopus_calloc(1, sizeof(hash_iterator_t), OCTOPUS_MEM_TABLE)) == NULL) {
         OCTOPUS_ERROR_LOG("failed to alloc mem for hash iterator");
         return NULL;
     }
 
-    hash_iter->next = hash_iter_next;
-    hash_iter->has_next = hash_iter_has_next;
-    hash_iter->index = hash_iter_index;
+    iter->next = hash_iter_next;
+    iter->has_next = hash_iter_has_next;
+    iter->index = hash_iter_index;
+    iter->hash = h;
+    h->iterators++;
 
-    hash_iter->hash = h;
-    // Set to -1, because entry_index will advance preferentially in find_next_nonnull_entry
-    hash_iter->entry_index = -1;
-    if (find_next_nonnull_entry(hash_iter)) {
-        hash_iter->cur_entry = h->entries[hash_iter->entry_index];
-    } else {
-        hash_iter->cur_entry = NULL;
-    }
-    hash_iter->idx = 0;
-    hash_iter->has_next_first = 1;
+    return (iterator_t *)iter;
+}
+
+void hash_iter_destroy(iterator_t *it) {
+    hash_iterator_t     *iter;
 
-    return (iterator_t *)hash_iter;
+    iter = (hash_iterator_t *)it;
+    if (iter->hash->iterators > 0) {
+        iter->hash->iterators--;
+    }
+    octopus_free(iter);
 }
 
-void hash_iter_destroy(iterator_t *iter) {
-    free(iter);
+hash_t* hash_dup(const hash_t *h) {
+    hash_t          *dup;
+    const table_t   *t;
+
+    if ((dup = octopus_malloc(sizeof(hash_t), OCTOPUS_MEM_TABLE)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for hash");
+        return NULL;
+    }
+    *dup = *h;
+    dup->iterators = 0;
+
+    // the tables are copied as they are, even in the middle of rehashing
+    for (int i = 0; i < (is_rehashing(h) ? 2 : 1); i++) {
+        t = &h->tables[i];
+        if (table_init(&dup->tables[i], t->capacity) == OCTOPUS_ERR) {
+            if (i == 1) {
+                table_free(&dup->tables[0]);
+            }
+            octopus_free(dup);
+            return NULL;
+        }
+        memcpy(dup->tables[i].ctrl, t->ctrl, t->capacity + sizeof(slot_t) * t->capacity);
+        dup->tables[i].size = t->size;
+        dup->tables[i].growth_left = t->growth_left;
+    }
+
+    return dup;
 }
 
 int hash_size(const hash_t *h) {
-    return h->size;
+    return h->tables[0].size + h->tables[1].size;
 }
 
 void hash_destroy(hash_t *h) {
-    entry_t     *e, *f;
+    table_t     *t;
 
     if (h == NULL) {
         return;
     }
 
-    for (int i = 0; i < h->entry_count; i++) {
-        e = h->entries[i];
-
-        while (e != NULL) {
-            f = e;
-            e = e->next;
+    for (int i = 0; i < 2; i++) {
+        t = &h->tables[i];
+        for (int j = 0; j < t->capacity; j++) {
+            if (t->ctrl[j] < 0) {
+                continue;
+            }
 
             if (h->key_dealloc != NULL) {
-                h->key_dealloc((void *)e->key);
+                h->key_dealloc((void *)t->slots[j].key);
             }
             if (h->val_dealloc != NULL) {
-                h->val_dealloc((void *)e->val);
+                h->val_dealloc((void *)t->slots[j].val);
             }
-
-            free(f);
         }
+        table_free(t);
     }
-
-    free(h->entries);
-    free(h);
+    octopus_free(h);
 }
 
 #ifdef OCTOPUS_TEST_HASH
@@ -366,6 +720,11 @@ int main(int argc, char *argv[])
     hash_t      *h, *int_hash;
     iterator_t  *iter;
     pair_t      *p;
+    char        (*keys)[16];
+    int         n, missing, *present;
+
+    OCTOPUS_NOT_USED(argc);
+    OCTOPUS_NOT_USED(argv);
 
     h = hash_str_key_create(NULL, NULL);
     hash_put(h, "abc", "dff");
@@ -386,20 +745,56 @@ int main(int argc, char *argv[])
     hash_iter_destroy(iter);
 
     int_hash = hash_int_key_create(NULL);
-    for (int i = 1000; i < 1010; i++) {
+    for (intptr_t i = 1000; i < 1010; i++) {
         hash_put(int_hash, (void *)i, (void *)(i - 888));
     }
 
-    printf("%d: %d\n", 1000, (int)hash_get(int_hash, 1000));
-    printf("%d: %d\n", 1001, (int)hash_get(int_hash, 1001));
+    printf("%d: %d\n", 1000, (int)(intptr_t)hash_get(int_hash, (void *)1000));
+    printf("%d: %d\n", 1001, (int)(intptr_t)hash_get(int_hash, (void *)1001));
 
     printf("size: %d\n", test_join(h, hash, size));
 
     for (iter = hash_iter(int_hash); iter->has_next(iter);) {
         p = (pair_t *)iter->next(iter);
-        printf("%d: %d->%d\n", iter->index(iter), (int)p->first, (int)p->second);
+        printf("%d: %d->%d\n", iter->index(iter), (int)(intptr_t)p->first,
+                (int)(intptr_t)p->second);
+    }
+    hash_iter_destroy(iter);
+
+    // keys survive resizes, and removes in the middle of them
+    n = 100000;
+    keys = malloc(sizeof(*keys) * n);
+    present = calloc(n, sizeof(int));
+    for (int i = 0; i < n; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "k%d", i);
+        hash_put(h, keys[i], keys[i]);
+        present[i] = 1;
+        if (i % 3 == 0) {
+            hash_remove(h, keys[i / 2]);
+            present[i / 2] = 0;
+        }
+    }
+
+    missing = 0;
+    for (int i = 0; i < n; i++) {
+        if ((hash_get(h, keys[i]) == keys[i]) != present[i]) {
+            missing++;
+        }
+    }
+    printf("size: %d, lookups differing from puts: %d\n", hash_size(h), missing);
+
+    // both tables are visited if it's being resized
+    n = 0;
+    for (iter = hash_iter(h); iter->has_next(iter); iter->next(iter)) {
+        n++;
     }
     hash_iter_destroy(iter);
+    printf("iterated: %d\n", n);
+
+    free(keys);
+    free(present);
+    hash_destroy(h);
+    hash_destroy(int_hash);
 
     return 0;
 }
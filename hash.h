@@ -18,15 +18,38 @@ typedef struct hash_s hash_t;
 typedef int (*hash_func_t)(const void *k);
 typedef int (*equal_func_t)(const void *a, const void *b);
 
+/**
+ * Open-addressing hash, which is resized incrementally by puts and removes.
+ * Rehashing is paused while iterators exist, so entries aren't moved under them.
+ * hash_get doesn't modify the hash, so it can be called by many threads at once
+ * if no thread modifies the hash meanwhile.
+ */
+
 hash_t* hash_create(hash_func_t h, equal_func_t e, deallocator_t kdealloc, deallocator_t vdealloc);
 hash_t* hash_str_key_create(deallocator_t kdealloc, deallocator_t vdealloc);
 hash_t* hash_int_key_create(deallocator_t vdealloc);
 int hash_put(hash_t *h, const void *k, const void *v);
 void* hash_get(const hash_t *h, const void *k);
+/**
+ * @brief Get the key stored and the value of 'k', into 'entry->first' and
+ *      'entry->second'.
+ * @return OCTOPUS_TRUE if the key exists.
+ */
+int hash_get_entry(const hash_t *h, const void *k, pair_t *entry);
 void hash_remove(hash_t *h, const void *k);
 iterator_t* hash_iter(hash_t *h);
 void hash_iter_destroy(iterator_t *iter);
+/**
+ * @brief Copy the hash with its functions. Keys and values are shared with 'h',
+ *      not copied, so at most one of the two should have deallocators.
+ */
+hash_t* hash_dup(const hash_t *h);
 int hash_size(const hash_t *h);
 void hash_destroy(hash_t *h);
 
+/**
+ * @brief Hash of bytes after wyhash, which can be used by hash functions of keys.
+ */
+int hash_bytes(const void *key, int len);
+
 #endif /* ifndef OCTOPUS_HASH_T */
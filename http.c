@@ -0,0 +1,950 @@
+/**
+ *
+ * @file    http
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-06 16:20:05
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "http.h"
+#include "object.h"
+#include "logging.h"
+#include "common.h"
+#include "scan.h"
+#include "memory.h"
+
+#define HTTP_CHUNK_SIZE     0
+#define HTTP_CHUNK_DATA     1
+#define HTTP_CHUNK_TRAILER  2
+
+// max length of a chunk size line, including chunk extensions
+#define HTTP_MAX_CHUNK_LINE_LEN     1024
+#define HTTP_NUMBER_MAX_LEN         21
+
+#define ring_offset(b, off)     (((b)->start + (off)) % (b)->size)
+
+#define STATUS_LINE(code, reason)   \
+    [code] = {"HTTP/1.1 " #code " " reason "\r\n", sizeof("HTTP/1.1 " #code " " reason "\r\n") - 1}
+
+#define HEADER_LITERAL(s)   s, sizeof(s) - 1
+
+typedef struct {
+    const char  *s;
+    int         len;
+} status_line_t;
+
+typedef struct {
+    protocol_t_implement;
+
+    // State of the request being parsed, which is kept across reads. The input
+    // buffer isn't advanced until the whole request has been parsed, so the
+    // request can point into it. Offsets are relative to input->start.
+    int     scan;           // position to continue searching the end of head
+    int     line_start;     // start of the header line being searched
+
+    // request whose head has been parsed, and is waiting for the body
+    http_request_t  *req;
+    int     pos;            // start of the body or the next chunk to parse
+    int     chunk_state;
+    long    chunk_len;
+} http_protocol_t;
+
+static const status_line_t status_lines[] = {
+    STATUS_LINE(100, "Continue"),
+    STATUS_LINE(101, "Switching Protocols"),
+    STATUS_LINE(200, "OK"),
+    STATUS_LINE(201, "Created"),
+    STATUS_LINE(202, "Accepted"),
+    STATUS_LINE(204, "No Content"),
+    STATUS_LINE(206, "Partial Content"),
+    STATUS_LINE(301, "Moved Permanently"),
+    STATUS_LINE(302, "Found"),
+    STATUS_LINE(304, "Not Modified"),
+    STATUS_LINE(400, "Bad Request"),
+    STATUS_LINE(401, "Unauthorized"),
+    STATUS_LINE(403, "Forbidden"),
+    STATUS_LINE(404, "Not Found"),
+    STATUS_LINE(405, "Method Not Allowed"),
+    STATUS_LINE(408, "Request Timeout"),
+    STATUS_LINE(411, "Length Required"),
+    STATUS_LINE(413, "Payload Too Large"),
+    STATUS_LINE(429, "Too Many Requests"),
+    STATUS_LINE(431, "Request Header Fields Too Large"),
+    STATUS_LINE(500, "Internal Server Error"),
+    STATUS_LINE(501, "Not Implemented"),
+    STATUS_LINE(502, "Bad Gateway"),
+    STATUS_LINE(503, "Service Unavailable"),
+    STATUS_LINE(504, "Gateway Timeout"),
+};
+
+static int max_body_size = HTTP_DEFAULT_MAX_BODY_SIZE;
+
+// Date header is formatted once a second by each thread.
+static __thread time_t  date_sec;
+static __thread char    date_line[64];
+static __thread int     date_line_len;
+
+void http_set_max_body_size(int size) {
+    if (size < 0) {
+        OCTOPUS_ERROR_LOG("invalid max body size: %d", size);
+        return;
+    }
+
+    max_body_size = size;
+}
+
+static int str_equal(const char *p, int len, const char *s) {
+    // 'p' may be NULL for an empty value, which strncasecmp mustn't be passed
+    return len == (int)strlen(s) && (len == 0 || strncasecmp(p, s, len) == 0);
+}
+
+/**
+ * Find 'c' in range [from, to) of the buffer, which are relative offsets.
+ * @return relative offset of 'c', or -1 if not found.
+ */
+static int find_char(buffer_t *input, int from, int to, char c) {
+    int     idx, first_part_len, ret;
+
+    if (from >= to) {
+        return -1;
+    }
+
+    idx = ring_offset(input, from);
+    first_part_len = input->size - idx;
+    if (first_part_len >= to - from) {
+        ret = scan_char(input->buf + idx, to - from, c);
+        return ret == -1 ? -1 : from + ret;
+    }
+
+    if ((ret = scan_char(input->buf + idx, first_part_len, c)) != -1) {
+        return from + ret;
+    }
+    ret = scan_char(input->buf, to - from - first_part_len, c);
+
+    return ret == -1 ? -1 : from + first_part_len + ret;
+}
+
+/**
+ * Range [off, off + len) of the buffer in place if it's continuous, otherwise
+ * it's appended to '*copy'.
+ */
+static const char* ring_range(buffer_t *input, int off, int len, sds *copy) {
+    int     idx, first_part_len;
+
+    idx = ring_offset(input, off);
+    first_part_len = input->size - idx;
+    if (first_part_len >= len) {
+        return input->buf + idx;
+    }
+
+    if (*copy == NULL && (*copy = sdsempty()) == NULL) {
+        return NULL;
+    }
+    if ((*copy = sdscatlen(*copy, input->buf + idx, first_part_len)) == NULL ||
+            (*copy = sdscatlen(*copy, input->buf, len - first_part_len)) == NULL) {
+        return NULL;
+    }
+
+    return *copy;
+}
+
+static void http_request_destroy(command_t *c) {
+    http_request_t  *req;
+
+    req = (http_request_t *)c;
+    if (req->head_copy != NULL) {
+        sdsfree(req->head_copy);
+    }
+    if (req->body_copy != NULL) {
+        sdsfree(req->body_copy);
+    }
+
+    octopus_free(req);
+}
+
+const http_header_t* http_request_header(const http_request_t *req, const char *name) {
+    for (int i = 0; i < req->header_count; i++) {
+        if (str_equal(req->headers[i].name, req->headers[i].name_len, name)) {
+            return &req->headers[i];
+        }
+    }
+
+    return NULL;
+}
+
+int http_request_method_is(const http_request_t *req, const char *method) {
+    return (int)strlen(method) == req->method_len &&
+        memcmp(req->method, method, req->method_len) == 0;
+}
+
+/**
+ * Check if a comma-separated header value contains 'token'.
+ */
+static int value_has_token(const char *v, int len, const char *token) {
+    int     start, end, s, e;
+
+    start = 0;
+    while (start < len) {
+        end = start;
+        while (end < len && v[end] != ',') {
+            end++;
+        }
+
+        // trim whitespaces around the token
+        s = start;
+        e = end;
+        while (s < e && (v[s] == ' ' || v[s] == '\t')) s++;
+        while (e > s && (v[e - 1] == ' ' || v[e - 1] == '\t')) e--;
+        if (str_equal(v + s, e - s, token)) {
+            return OCTOPUS_TRUE;
+        }
+
+        start = end + 1;
+    }
+
+    return OCTOPUS_FALSE;
+}
+
+static int parse_content_length(const char *v, int len, long *content_length) {
+    long    n;
+
+    if (len == 0 || len > HTTP_NUMBER_MAX_LEN) {
+        return OCTOPUS_ERR;
+    }
+
+    n = 0;
+    for (int i = 0; i < len; i++) {
+        if (v[i] < '0' || v[i] > '9') {
+            return OCTOPUS_ERR;
+        }
+        n = n * 10 + (v[i] - '0');
+    }
+
+    // duplicated Content-Length must be identical
+    if (*content_length != -1 && *content_length != n) {
+        return OCTOPUS_ERR;
+    }
+    *content_length = n;
+
+    return OCTOPUS_OK;
+}
+
+/**
+ * Parse the request line, such as "GET /path HTTP/1.1", 'len' excludes the CRLF.
+ */
+static int parse_request_line(http_request_t *req, const char *p, int len) {
+    int     idx;
+
+    if ((idx = scan_nonvisible(p, len)) <= 0 || p[idx] != ' ') {
+        return OCTOPUS_ERR;
+    }
+    req->method = p;
+    req->method_len = idx;
+    p += idx + 1;
+    len -= idx + 1;
+
+    if ((idx = scan_nonvisible(p, len)) <= 0 || p[idx] != ' ') {
+        return OCTOPUS_ERR;
+    }
+    req->target = p;
+    req->target_len = idx;
+    p += idx + 1;
+    len -= idx + 1;
+
+    if (len != 8 || memcmp(p, "HTTP/1.", 7) != 0 || (p[7] != '0' && p[7] != '1')) {
+        return OCTOPUS_ERR;
+    }
+    req->minor_version = p[7] - '0';
+
+    return OCTOPUS_OK;
+}
+
+/**
+ * Parse a header line, 'len' excludes the CRLF.
+ */
+static int parse_header_line(http_request_t *req, const char *p, int len) {
+    http_header_t   *h;
+    int     idx, vstart, vend;
+
+    if (req->header_count == HTTP_MAX_HEADERS) {
+        OCTOPUS_ERROR_LOG("too many headers, max: %d", HTTP_MAX_HEADERS);
+        return OCTOPUS_ERR;
+    }
+
+    // Field name is a token right before the colon, so whitespaces and
+    // obsolete line folding are rejected.
+    if ((idx = scan_nonvisible(p, len)) == -1) {
+        idx = len;
+    }
+    if ((idx = scan_char(p, idx, ':')) <= 0) {
+        return OCTOPUS_ERR;
+    }
+
+    vstart = idx + 1;
+    vend = len;
+    while (vstart < vend && (p[vstart] == ' ' || p[vstart] == '\t')) vstart++;
+    while (vend > vstart && (p[vend - 1] == ' ' || p[vend - 1] == '\t')) vend--;
+
+    h = &req->headers[req->header_count++];
+    h->name = p;
+    h->name_len = idx;
+    h->value = p + vstart;
+    h->value_len = vend - vstart;
+
+    if (str_equal(h->name, h->name_len, "Content-Length")) {
+        return parse_content_length(h->value, h->value_len, &req->content_length);
+    } else if (str_equal(h->name, h->name_len, "Transfer-Encoding")) {
+        // chunked must be the last coding, and other codings aren't supported
+        if (!str_equal(h->value, h->value_len, "chunked")) {
+            OCTOPUS_ERROR_LOG("transfer coding isn't supported: %.*s", h->value_len, h->value);
+            return OCTOPUS_ERR;
+        }
+        req->chunked = OCTOPUS_TRUE;
+    } else if (str_equal(h->name, h->name_len, "Connection")) {
+        if (value_has_token(h->value, h->value_len, "close")) {
+            req->keep_alive = OCTOPUS_FALSE;
+        } else if (value_has_token(h->value, h->value_len, "keep-alive")) {
+            req->keep_alive = OCTOPUS_TRUE;
+        }
+    }
+
+    return OCTOPUS_OK;
+}
+
+/**
+ * Parse the head in p[0, len), which ends with an empty line.
+ */
+static int parse_head(http_request_t *req, const char *p, int len) {
+    int     idx, line_len, first;
+
+    first = OCTOPUS_TRUE;
+    while (len > 0) {
+        idx = scan_char(p, len, '\n');
+        line_len = idx > 0 && p[idx - 1] == '\r' ? idx - 1 : idx;
+
+        if (first) {
+            if (parse_request_line(req, p, line_len) == OCTOPUS_ERR) {
+                OCTOPUS_ERROR_LOG("invalid request line: %.*s", line_len, p);
+                return OCTOPUS_ERR;
+            }
+            // keep-alive is the default of HTTP/1.1, can be changed by Connection
+            req->keep_alive = req->minor_version == 1;
+            first = OCTOPUS_FALSE;
+        } else if (line_len == 0) {
+            break;
+        } else if (parse_header_line(req, p, line_len) == OCTOPUS_ERR) {
+            OCTOPUS_ERROR_LOG("invalid header line: %.*s", line_len, p);
+            return OCTOPUS_ERR;
+        }
+
+        p += idx + 1;
+        len -= idx + 1;
+    }
+
+    if (req->chunked && req->content_length != -1) {
+        OCTOPUS_ERROR_LOG("both Content-Length and chunked are set");
+        return OCTOPUS_ERR;
+    }
+
+    if (req->content_length > max_body_size) {
+        OCTOPUS_ERROR_LOG("body is too large, len: %ld, max: %d", req->content_length,
+                max_body_size);
+        return OCTOPUS_ERR;
+    }
+
+    return OCTOPUS_OK;
+}
+
+static void request_reset(http_protocol_t *p) {
+    p->scan = 0;
+    p->line_start = 0;
+    p->req = NULL;
+    p->pos = 0;
+    p->chunk_state = HTTP_CHUNK_SIZE;
+    p->chunk_len = 0;
+}
+
+/**
+ * Search the end of head, and parse the head once it's complete.
+ * @return OCTOPUS_OK if the head is parsed, OCTOPUS_AGAIN if more data is needed.
+ */
+static int decode_head(http_protocol_t *p, buffer_t *input) {
+    http_request_t  *req;
+    const char      *head;
+    int     content_len, limit, idx, line_start, line_len;
+
+    content_len = buffer_content_len(input);
+    limit = content_len < HTTP_MAX_HEAD_LEN ? content_len : HTTP_MAX_HEAD_LEN;
+
+    for (;;) {
+        if ((idx = find_char(input, p->scan, limit, '\n')) == -1) {
+            if (limit == HTTP_MAX_HEAD_LEN) {
+                OCTOPUS_ERROR_LOG("head of request is too large, max: %d", HTTP_MAX_HEAD_LEN);
+                return OCTOPUS_ERR;
+            }
+            p->scan = limit;
+
+            return OCTOPUS_AGAIN;
+        }
+
+        line_start = p->line_start;
+        p->scan = p->line_start = idx + 1;
+        line_len = idx - line_start;
+        if (line_len == 0 || (line_len == 1 && buffer_at(input, line_start) == '\r')) {
+            if (line_start == 0) {
+                // empty lines before the request line are ignored
+                buffer_advance_step(input, idx + 1);
+                content_len -= idx + 1;
+                limit = content_len < HTTP_MAX_HEAD_LEN ? content_len : HTTP_MAX_HEAD_LEN;
+                p->scan = p->line_start = 0;
+                continue;
+            }
+            break;
+        }
+    }
+
+    if ((req = octopus_calloc(1, sizeof(http_request_t), OCTOPUS_MEM_COMMAND)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for http request");
+        return OCTOPUS_ERR;
+    }
+    req->destroy = http_request_destroy;
+    req->content_length = -1;
+
+    if ((head = ring_range(input, 0, p->scan, &req->head_copy)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for head of request, len: %d", p->scan);
+        http_request_destroy((command_t *)req);
+        return OCTOPUS_ERR;
+    }
+
+    if (parse_head(req, head, p->scan) == OCTOPUS_ERR) {
+        http_request_destroy((command_t *)req);
+        return OCTOPUS_ERR;
+    }
+
+    p->req = req;
+    p->pos = p->scan;
+
+    return OCTOPUS_OK;
+}
+
+static int decode_body(http_protocol_t *p, buffer_t *input) {
+    http_request_t  *req;
+    int     len;
+
+    req = p->req;
+    len = req->content_length == -1 ? 0 : (int)req->content_length;
+    if (buffer_content_len(input) - p->pos < len) {
+        return OCTOPUS_AGAIN;
+    }
+
+    if (len > 0 && (req->body = ring_range(input, p->pos, len, &req->body_copy)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for body of request, len: %d", len);
+        return OCTOPUS_ERR;
+    }
+    req->body_len = len;
+    p->pos += len;
+
+    return OCTOPUS_OK;
+}
+
+static int parse_chunk_size(buffer_t *input, int from, int to, long *size) {
+    long    n;
+    char    c;
+    int     digits;
+
+    n = 0;
+    digits = 0;
+    for (int i = from; i < to; i++) {
+        c = buffer_at(input, i);
+        if (c >= '0' && c <= '9') {
+            n = n * 16 + (c - '0');
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            n = n * 16 + ((c | 0x20) - 'a' + 10);
+        } else if (c == ';' || c == '\r' || c == ' ' || c == '\t') {
+            // chunk extensions are ignored
+            break;
+        } else {
+            return OCTOPUS_ERR;
+        }
+
+        if (++digits > 8) {
+            return OCTOPUS_ERR;
+        }
+    }
+
+    if (digits == 0) {
+        return OCTOPUS_ERR;
+    }
+    *size = n;
+
+    return OCTOPUS_OK;
+}
+
+/**
+ * Decode a chunked body, chunks are appended to the body of the request one by
+ * one, and the state is kept across reads.
+ */
+static int decode_chunked(http_protocol_t *p, buffer_t *input) {
+    http_request_t  *req;
+    int     content_len, idx, first_part_len, off;
+
+    req = p->req;
+    content_len = buffer_content_len(input);
+    if (req->body_copy == NULL && (req->body_copy = sdsempty()) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for chunked body");
+        return OCTOPUS_ERR;
+    }
+
+    for (;;) {
+        if (p->chunk_state == HTTP_CHUNK_DATA) {
+            if (content_len - p->pos < p->chunk_len + 2) {
+                return OCTOPUS_AGAIN;
+            }
+
+            if (buffer_at(input, p->pos + p->chunk_len) != '\r' ||
+                    buffer_at(input, p->pos + p->chunk_len + 1) != '\n') {
+                OCTOPUS_ERROR_LOG("chunk data isn't terminated by CRLF");
+                return OCTOPUS_ERR;
+            }
+
+            off = ring_offset(input, p->pos);
+            first_part_len = input->size - off;
+            if (first_part_len >= p->chunk_len) {
+                req->body_copy = sdscatlen(req->body_copy, input->buf + off, p->chunk_len);
+            } else {
+                req->body_copy = sdscatlen(req->body_copy, input->buf + off, first_part_len);
+                if (req->body_copy != NULL) {
+                    req->body_copy = sdscatlen(req->body_copy, input->buf,
+                            p->chunk_len - first_part_len);
+                }
+            }
+            if (req->body_copy == NULL) {
+                OCTOPUS_ERROR_LOG("failed to alloc mem for chunked body");
+                return OCTOPUS_ERR;
+            }
+
+            p->pos += p->chunk_len + 2;
+            p->chunk_state = HTTP_CHUNK_SIZE;
+            continue;
+        }
+
+        if ((idx = find_char(input, p->pos, content_len, '\n')) == -1) {
+            if (content_len - p->pos > HTTP_MAX_CHUNK_LINE_LEN) {
+                OCTOPUS_ERROR_LOG("line of chunked body is too large");
+                return OCTOPUS_ERR;
+            }
+            return OCTOPUS_AGAIN;
+        }
+
+        if (p->chunk_state == HTTP_CHUNK_TRAILER) {
+            // trailer fields are ignored, and an empty line ends the body
+            if (idx == p->pos || (idx == p->pos + 1 && buffer_at(input, p->pos) == '\r')) {
+                p->pos = idx + 1;
+                break;
+            }
+            p->pos = idx + 1;
+            continue;
+        }
+
+        if (parse_chunk_size(input, p->pos, idx, &p->chunk_len) == OCTOPUS_ERR) {
+            OCTOPUS_ERROR_LOG("invalid chunk size");
+            return OCTOPUS_ERR;
+        }
+        if ((long)sdslen(req->body_copy) + p->chunk_len > max_body_size) {
+            OCTOPUS_ERROR_LOG("body is too large, max: %d", max_body_size);
+            return OCTOPUS_ERR;
+        }
+
+        p->pos = idx + 1;
+        p->chunk_state = p->chunk_len == 0 ? HTTP_CHUNK_TRAILER : HTTP_CHUNK_DATA;
+    }
+
+    req->body = req->body_copy;
+    req->body_len = sdslen(req->body_copy);
+
+    return OCTOPUS_OK;
+}
+
+static int http_decode(void *state, buffer_t *input, deque_t *output_cmd_objs) {
+    http_protocol_t *p;
+    object_t        *obj;
+    int             ret;
+
+    p = (http_protocol_t *)state;
+
+    // pipelined requests are decoded one by one
+    for (;;) {
+        if (p->req == NULL && (ret = decode_head(p, input)) != OCTOPUS_OK) {
+            return ret == OCTOPUS_AGAIN ? OCTOPUS_OK : OCTOPUS_ERR;
+        }
+
+        ret = p->req->chunked ? decode_chunked(p, input) : decode_body(p, input);
+        if (ret == OCTOPUS_AGAIN) {
+            return OCTOPUS_OK;
+        } else if (ret == OCTOPUS_ERR) {
+            return OCTOPUS_ERR;
+        }
+
+        if ((obj = object_create_cmd((command_t *)p->req)) == NULL) {
+            OCTOPUS_ERROR_LOG("failed to create object for http request");
+            return OCTOPUS_ERR;
+        }
+
+        if (deque_push_back(output_cmd_objs, obj) == OCTOPUS_ERR) {
+            OCTOPUS_ERROR_LOG("failed to add http request to deque");
+            p->req = NULL;
+            obj->decr(obj);
+            return OCTOPUS_ERR;
+        }
+
+        buffer_advance_step(input, p->pos);
+        request_reset(p);
+    }
+}
+
+static void http_response_cmd_destroy(command_t *c) {
+    http_response_destroy((http_response_t *)c);
+}
+
+http_response_t* http_response_create(const http_request_t *req, int status) {
+    http_response_t *resp;
+
+    if ((resp = octopus_calloc(1, sizeof(http_response_t), OCTOPUS_MEM_COMMAND)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for http response");
+        return NULL;
+    }
+    resp->destroy = http_response_cmd_destroy;
+    resp->status = status;
+
+    if (req != NULL) {
+        resp->keep_alive = req->keep_alive;
+        resp->minor_version = req->minor_version;
+        resp->head = http_request_method_is(req, "HEAD");
+    } else {
+        resp->keep_alive = OCTOPUS_TRUE;
+        resp->minor_version = 1;
+    }
+
+    return resp;
+}
+
+int http_response_add_header(http_response_t *resp, const char *name, const char *value) {
+    THREE_PTRS_NULL_CHECK(resp, name, value);
+
+    if (resp->headers == NULL && (resp->headers = sdsempty()) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for headers of response");
+        return OCTOPUS_ERR;
+    }
+
+    if ((resp->headers = sdscatprintf(resp->headers, "%s: %s\r\n", name, value)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to add header to response, name: %s", name);
+        return OCTOPUS_ERR;
+    }
+
+    return OCTOPUS_OK;
+}
+
+int http_response_set_body(http_response_t *resp, const char *body, int len) {
+    sds     s;
+
+    ONE_PTR_NULL_CHECK(resp);
+
+    if ((s = sdsnewlen(body, len)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for body of response, len: %d", len);
+        return OCTOPUS_ERR;
+    }
+
+    if (resp->body != NULL) {
+        sdsfree(resp->body);
+    }
+    resp->body = s;
+
+    return OCTOPUS_OK;
+}
+
+int http_response_set_body_ref(http_response_t *resp, bufref_t *ref) {
+    TWO_PTRS_NULL_CHECK(resp, ref);
+
+    bufref_incr(ref);
+    if (resp->ref != NULL) {
+        bufref_decr(resp->ref);
+    }
+    resp->ref = ref;
+
+    return OCTOPUS_OK;
+}
+
+void http_response_destroy(http_response_t *resp) {
+    if (resp == NULL) {
+        return;
+    }
+
+    if (resp->headers != NULL) {
+        sdsfree(resp->headers);
+    }
+    if (resp->body != NULL) {
+        sdsfree(resp->body);
+    }
+    if (resp->ref != NULL) {
+        bufref_decr(resp->ref);
+    }
+
+    octopus_free(resp);
+}
+
+static void date_line_update() {
+    time_t      now;
+    struct tm   tm;
+
+    now = time(NULL);
+    if (now == date_sec && date_line_len > 0) {
+        return;
+    }
+
+    gmtime_r(&now, &tm);
+    date_line_len = strftime(date_line, sizeof(date_line),
+            "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+    date_sec = now;
+}
+
+static int http_encode(void *state, object_t *cmd_obj, buffer_t *output) {
+    http_response_t *resp;
+    char            line[64], len_line[48];
+    const char      *status_line;
+    int             status_line_len, len_line_len, inline_len;
+    long            body_len;
+
+    OCTOPUS_NOT_USED(state);
+
+    resp = (http_response_t *)cmd_obj->obj.cmd;
+
+    if (resp->status > 0 && resp->status < (int)(sizeof(status_lines) / sizeof(status_lines[0]))
+            && status_lines[resp->status].s != NULL) {
+        status_line = status_lines[resp->status].s;
+        status_line_len = status_lines[resp->status].len;
+    } else {
+        // reason phrase can be empty
+        status_line_len = snprintf(line, sizeof(line), "HTTP/1.1 %d \r\n", resp->status);
+        status_line = line;
+    }
+
+    date_line_update();
+
+    body_len = resp->ref != NULL ? resp->ref->len : (resp->body != NULL ? (long)sdslen(resp->body) : 0);
+    len_line_len = snprintf(len_line, sizeof(len_line), "Content-Length: %ld\r\n", body_len);
+
+    // Check the space first, so a response is never written partially.
+    inline_len = status_line_len + date_line_len + len_line_len +
+        (int)sizeof("Connection: keep-alive\r\n") +
+        (resp->headers != NULL ? (int)sdslen(resp->headers) : 0) + 2 +
+        (resp->body != NULL && !resp->head ? (int)sdslen(resp->body) : 0);
+    if (buffer_reserve(output, inline_len) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("no space to encode http response, remaining: %d, len: %d",
+                buffer_space_remaining(output), inline_len);
+        return OCTOPUS_ERR;
+    }
+
+    buffer_write_from(output, (void *)status_line, status_line_len);
+    buffer_write_from(output, date_line, date_line_len);
+    buffer_write_from(output, len_line, len_line_len);
+
+    if (!resp->keep_alive) {
+        buffer_write_from(output, HEADER_LITERAL("Connection: close\r\n"));
+    } else if (resp->minor_version == 0) {
+        buffer_write_from(output, HEADER_LITERAL("Connection: keep-alive\r\n"));
+    }
+
+    if (resp->headers != NULL) {
+        buffer_write_from_sds(output, resp->headers);
+    }
+    buffer_write_from(output, HEADER_LITERAL("\r\n"));
+
+    if (!resp->head) {
+        if (resp->ref != NULL) {
+            if (buffer_attach_ref(output, resp->ref) == OCTOPUS_ERR) {
+                return OCTOPUS_ERR;
+            }
+        } else if (resp->body != NULL) {
+            buffer_write_from_sds(output, resp->body);
+        }
+    }
+
+    return resp->keep_alive ? OCTOPUS_OK : OCTOPUS_EOF;
+}
+
+static void http_destroy(protocol_t *protocol) {
+    http_protocol_t *p;
+
+    p = (http_protocol_t *)protocol;
+    if (p->req != NULL) {
+        http_request_destroy((command_t *)p->req);
+    }
+
+    octopus_free(p);
+}
+
+protocol_t* http_protocol_create() {
+    http_protocol_t *p;
+
+    if ((p = octopus_calloc(1, sizeof(http_protocol_t), OCTOPUS_MEM_CLIENT)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for http protocol");
+        return NULL;
+    }
+
+    p->decode = http_decode;
+    p->encode = http_encode;
+    p->destroy = http_destroy;
+    request_reset(p);
+
+    return (protocol_t *)p;
+}
+
+#ifdef OCTOPUS_TEST_HTTP
+
+typedef struct {
+    const char  *method;
+    const char  *target;
+    const char  *body;
+    int         keep_alive;
+} test_request_t;
+
+/**
+ * Pop the requests decoded, and count the ones which differ from 'expected',
+ * which repeats every 'n' requests.
+ */
+static int test_check(deque_t *cmds, const test_request_t *expected, int n, int *next) {
+    object_t        *obj;
+    http_request_t  *req;
+    const test_request_t    *e;
+    int             wrong;
+
+    wrong = 0;
+    while ((obj = deque_pop_front(cmds)) != NULL) {
+        req = (http_request_t *)obj->obj.cmd;
+        e = &expected[*next % n];
+        if (!http_request_method_is(req, e->method)
+                || !str_equal(req->target, req->target_len, e->target)
+                || !str_equal(req->body, req->body_len, e->body)
+                || req->keep_alive != e->keep_alive) {
+            printf("request %d, expected: %s %s, got: %.*s %.*s, body: '%.*s', keep-alive: %d\n",
+                    *next, e->method, e->target, req->method_len, req->method, req->target_len,
+                    req->target, req->body_len, req->body, req->keep_alive);
+            wrong++;
+        }
+        (*next)++;
+        obj->decr(obj);
+    }
+
+    return wrong;
+}
+
+/**
+ * Encode the response of 'keep_alive', and check the return code and whether
+ * the connection header is written.
+ */
+static int test_encode(protocol_t *p, buffer_t *output, int keep_alive, int minor_version) {
+    http_request_t  req;
+    http_response_t *resp;
+    object_t        *obj;
+    sds             s;
+    int             ret, ok;
+
+    memset(&req, 0, sizeof(req));
+    req.method = "GET";
+    req.method_len = 3;
+    req.keep_alive = keep_alive;
+    req.minor_version = minor_version;
+    resp = http_response_create(&req, 200);
+    http_response_set_body(resp, "hello", 5);
+    obj = object_create_cmd((command_t *)resp);
+    ret = p->encode(p, obj, output);
+    obj->decr(obj);
+
+    s = sdsempty();
+    buffer_read_to_sds(output, &s, buffer_content_len(output));
+    ok = strncmp(s, "HTTP/1.1 200 OK\r\n", 17) == 0 && strstr(s, "Content-Length: 5\r\n") != NULL
+        && strcmp(s + sdslen(s) - 9, "\r\n\r\nhello") == 0;
+    if (!keep_alive) {
+        ok = ok && ret == OCTOPUS_EOF && strstr(s, "Connection: close\r\n") != NULL;
+    } else {
+        ok = ok && ret == OCTOPUS_OK && strstr(s, "Connection: close") == NULL
+            && (strstr(s, "Connection: keep-alive\r\n") != NULL) == (minor_version == 0);
+    }
+    sdsfree(s);
+
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    protocol_t  *p;
+    buffer_t    *input, *output;
+    deque_t     *cmds;
+    sds         stream;
+    int         off, chunk, next, wrong, len, count;
+    const test_request_t    expected[] = {
+        {"GET", "/a", "", 1},
+        {"POST", "/b", "hello", 1},
+        {"POST", "/c", "chunked body", 1},
+        {"HEAD", "/d", "", 0},
+        {"GET", "/e", "", 1},
+        {"GET", "/f", "", 0},
+    };
+
+    OCTOPUS_NOT_USED(argc);
+    OCTOPUS_NOT_USED(argv);
+
+    // keep-alive requests pipelined, and the ones closing the connection
+    stream = sdsempty();
+    count = 0;
+    for (int round = 0; round < 8; round++) {
+        stream = sdscat(stream,
+                "GET /a HTTP/1.1\r\nHost: x\r\n\r\n"
+                "POST /b HTTP/1.1\r\nContent-Length: 5\r\n\r\nhello"
+                "POST /c HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+                "7\r\nchunked\r\n5;ext=1\r\n body\r\n0\r\nTrailer: t\r\n\r\n"
+                "\r\nHEAD /d HTTP/1.0\r\n\r\n"
+                "GET /e HTTP/1.0\r\nConnection: Keep-Alive\r\n\r\n"
+                "GET /f HTTP/1.1\r\nConnection: close\r\n\n");
+        count += sizeof(expected) / sizeof(expected[0]);
+    }
+
+    // The requests arrive in reads of 1 to 7 bytes, and the ring wraps around
+    // its end many times.
+    p = http_protocol_create();
+    input = buffer_create(512);
+    cmds = deque_create(16, NULL);
+    next = wrong = 0;
+    len = sdslen(stream);
+    for (off = 0, chunk = 1; off < len; off += chunk, chunk = chunk % 7 + 1) {
+        chunk = chunk < len - off ? chunk : len - off;
+        buffer_write_from(input, stream + off, chunk);
+        if (p->decode(p, input, cmds) == OCTOPUS_ERR) {
+            printf("failed to decode at %d\n", off);
+            break;
+        }
+        wrong += test_check(cmds, expected, sizeof(expected) / sizeof(expected[0]), &next);
+    }
+    printf("pipelined requests, decoded: %d of %d, wrong: %d, left: %d\n", next, count,
+            wrong, buffer_content_len(input));
+
+    // responses keep the connection, or close it after being written
+    output = buffer_create(1024);
+    printf("keep-alive: %d, keep-alive of 1.0: %d, close: %d\n", test_encode(p, output, 1, 1),
+            test_encode(p, output, 1, 0), test_encode(p, output, 0, 1));
+
+    sdsfree(stream);
+    deque_destroy(cmds);
+    p->destroy(p);
+    buffer_destroy(input);
+    buffer_destroy(output);
+
+    return 0;
+}
+
+#endif
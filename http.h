@@ -0,0 +1,122 @@
+/**
+ *
+ * @file    http
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-06 15:21:40
+ */
+
+#ifndef OCTOPUS_HTTP_H
+#define OCTOPUS_HTTP_H
+
+#include "sds.h"
+#include "bufref.h"
+#include "command.h"
+#include "protocol.h"
+
+/**
+ * Name of the built-in HTTP/1.x protocol, which is registered by octopus_create.
+ * Keep-alive, pipelining and chunked request bodies are supported.
+ */
+#define OCTOPUS_PROTOCOL_HTTP   "http"
+
+#define HTTP_MAX_HEAD_LEN       (8 * 1024)
+#define HTTP_MAX_HEADERS        64
+#define HTTP_DEFAULT_MAX_BODY_SIZE  (512 * 1024)
+
+/**
+ * Strings of a request aren't null-terminated. They point into the input buffer
+ * if the request is continuous in it, otherwise they point to the copies held by
+ * the request. So they are only valid during the processing of the request.
+ */
+typedef struct {
+    const char  *name;
+    int         name_len;
+    const char  *value;
+    int         value_len;
+} http_header_t;
+
+typedef struct {
+    command_t_implement
+
+    const char  *method;
+    int         method_len;
+    const char  *target;
+    int         target_len;
+    // 0 for HTTP/1.0, 1 for HTTP/1.1
+    int         minor_version;
+
+    int             header_count;
+    http_header_t   headers[HTTP_MAX_HEADERS];
+
+    const char  *body;
+    int         body_len;
+
+    int         keep_alive;
+    int         chunked;
+    long        content_length;
+
+    sds         head_copy;
+    sds         body_copy;
+} http_request_t;
+
+/**
+ * Response of a request, which is returned by processors. Status line, Date,
+ * Content-Length and Connection headers are generated by the encoder.
+ */
+typedef struct {
+    command_t_implement
+
+    int         status;
+    // the connection is closed after the response if it's not set
+    int         keep_alive;
+    int         minor_version;
+    // response of HEAD, whose body isn't written
+    int         head;
+
+    // extra header lines, "Name: value\r\n" each
+    sds         headers;
+
+    sds         body;
+    // body owned by others, which is written without copy
+    bufref_t    *ref;
+} http_response_t;
+
+/**
+ * @brief Find a header of the request by name case-insensitively.
+ * @return the first header matched, or NULL if not found.
+ */
+const http_header_t* http_request_header(const http_request_t *req, const char *name);
+
+/**
+ * @brief Compare method of the request with 'method', such as "GET".
+ */
+int http_request_method_is(const http_request_t *req, const char *method);
+
+/**
+ * @brief Create a response of 'req', which inherits keep-alive of the request.
+ */
+http_response_t* http_response_create(const http_request_t *req, int status);
+
+int http_response_add_header(http_response_t *resp, const char *name, const char *value);
+
+/**
+ * @brief Set body of the response, and the body will be copied.
+ */
+int http_response_set_body(http_response_t *resp, const char *body, int len);
+
+/**
+ * @brief Set body owned by the ref, the response holds a reference of it.
+ */
+int http_response_set_body_ref(http_response_t *resp, bufref_t *ref);
+
+void http_response_destroy(http_response_t *resp);
+
+protocol_t* http_protocol_create();
+
+/**
+ * Requests whose body is larger than 'size' are treated as error, and the client
+ * will be closed. It should be less than the size of input buffer.
+ */
+void http_set_max_body_size(int size);
+
+#endif /* ifndef OCTOPUS_HTTP_H */
@@ -0,0 +1,95 @@
+/**
+ *
+ * @file    ilist
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-07-15 11:08:23
+ */
+
+#ifndef OCTOPUS_ILIST_H
+#define OCTOPUS_ILIST_H
+
+#include <stddef.h>
+
+/**
+ * Intrusive list. The node is embedded in the element, so pushing allocates
+ * nothing, and an element is removed in O(1) by its node. An element is in at
+ * most one list by a node. A zeroed ilist_t is empty.
+ */
+
+typedef struct ilist_node_s {
+    struct ilist_node_s     *prev, *next;
+} ilist_node_t;
+
+typedef struct {
+    ilist_node_t    *head, *tail;
+    int             size;
+} ilist_t;
+
+/**
+ * @brief The element containing 'node', which is the field 'member' of 'type'.
+ */
+#define ilist_entry(node, type, member) \
+    ((type *)((char *)(node) - offsetof(type, member)))
+
+#define ilist_head(l)   ((l)->head)
+#define ilist_tail(l)   ((l)->tail)
+#define ilist_size(l)   ((l)->size)
+#define ilist_empty(l)  ((l)->size == 0)
+
+/**
+ * @brief Visit nodes from the head. 'node' can be removed while visiting, since
+ *      'next' is taken before.
+ */
+#define ilist_foreach(l, node, nxt) \
+    for ((node) = (l)->head; (node) != NULL && ((nxt) = (node)->next, 1); (node) = (nxt))
+
+static inline void ilist_push(ilist_t *l, ilist_node_t *node) {
+    node->prev = l->tail;
+    node->next = NULL;
+    if (l->tail != NULL) {
+        l->tail->next = node;
+    } else {
+        l->head = node;
+    }
+    l->tail = node;
+    l->size++;
+}
+
+static inline void ilist_remove(ilist_t *l, ilist_node_t *node) {
+    if (node->prev != NULL) {
+        node->prev->next = node->next;
+    } else {
+        l->head = node->next;
+    }
+    if (node->next != NULL) {
+        node->next->prev = node->prev;
+    } else {
+        l->tail = node->prev;
+    }
+    node->prev = node->next = NULL;
+    l->size--;
+}
+
+/**
+ * @brief Whether 'node' is in 'l', which holds as long as the node is in no
+ *      other list, and it's zeroed or removed when it's in none.
+ */
+static inline int ilist_linked(const ilist_t *l, const ilist_node_t *node) {
+    return node->prev != NULL || l->head == node;
+}
+
+/**
+ * @brief Remove the head.
+ * @return the node removed, or NULL if the list is empty.
+ */
+static inline ilist_node_t* ilist_pop(ilist_t *l) {
+    ilist_node_t    *node;
+
+    if ((node = l->head) != NULL) {
+        ilist_remove(l, node);
+    }
+
+    return node;
+}
+
+#endif /* ifndef OCTOPUS_ILIST_H */
@@ -14,27 +14,43 @@
 #include "common.h"
 #include "networking.h"
 #include "client.h"
+#include "mailbox.h"
 
 #include "libae/ae.h"
 
 #define CLIENT_MAX_COUNT 100000
 
 struct ioworker_s {
+    int             id;
     aeEventLoop     *event_loop;
+    // messages to the ioworker, such as new clients and completions of requests
+    mailbox_t       *mailbox;
 
     pthread_t       thread;
 };
 
+/**
+ * A new client passed from the main thread.
+ */
+typedef struct {
+    mailbox_msg_t   msg;
+    ioworker_t      *w;
+    client_t        *cli;
+} client_msg_t;
+
+static __thread ioworker_t  *current_ioworker;
+
 void* ioworker_run(void *arg) {
     ioworker_t  *w;
 
     w = (ioworker_t *)arg;
+    current_ioworker = w;
     aeMain(w->event_loop);
 
     return NULL;
 }
 
-ioworker_t* ioworker_create() {
+ioworker_t* ioworker_create(int id) {
     ioworker_t  *w;
     int         err;
 
@@ -42,11 +58,19 @@ ioworker_t* ioworker_create() {
         OCTOPUS_ERROR_LOG("failed to alloc mem for ioworker");
         return NULL;
     }
+    w->id = id;
 
     if ((w->event_loop = aeCreateEventLoop(CLIENT_MAX_COUNT)) == NULL) {
         OCTOPUS_ERROR_LOG("failed to create event loop for ioworker");
         goto failed;
     }
+    aeSetBeforeSleepProc(w->event_loop, client_before_sleep);
+    aeSetAfterSleepProc(w->event_loop, client_after_sleep);
+
+    if ((w->mailbox = mailbox_create(w->event_loop)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create mailbox for ioworker");
+        goto failed;
+    }
 
     if ((err = pthread_create(&w->thread, NULL, ioworker_run, w)) != 0) {
         errno = err;
@@ -57,6 +81,7 @@ ioworker_t* ioworker_create() {
     return w;
 
 failed:
+    failed_destroy(w->mailbox, mailbox);
     if (w->event_loop != NULL) {
         aeDeleteEventLoop(w->event_loop);
     }
@@ -65,16 +90,57 @@ failed:
     return NULL;
 }
 
-int ioworker_add_client(ioworker_t *w, client_t *cli) {
-    ONE_PTR_NULL_CHECK(w);
+/**
+ * Run in the thread of ioworker, since the event loop isn't thread-safe.
+ */
+static void client_added(void *ctx) {
+    client_msg_t    *m;
+    client_t        *cli;
+    ioworker_t      *w;
+
+    m = (client_msg_t *)ctx;
+    cli = m->cli;
+    w = m->w;
+    free(m);
+
+    if (cli->processor_obj == NULL && client_init_processor(cli, w->id) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("failed to init processor for client, cli: %s:%u",
+                cli->host, cli->port);
+        client_destroy(cli);
+        return;
+    }
 
-    if (aeCreateFileEvent(w->event_loop, cli->fd, AE_READABLE, process_input_bytestream, cli)
-            == AE_ERR) {
+    if (client_watch(cli) == OCTOPUS_ERR) {
         OCTOPUS_ERROR_LOG("failed to add new client");
+        client_destroy(cli);
+    }
+}
+
+int ioworker_add_client(ioworker_t *w, client_t *cli) {
+    client_msg_t    *m;
+
+    TWO_PTRS_NULL_CHECK(w, cli);
+
+    if ((m = malloc(sizeof(client_msg_t))) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for client message");
         return OCTOPUS_ERR;
     }
+    m->msg.ctx = m;
+    m->msg.handler = client_added;
+    m->w = w;
+    m->cli = cli;
+
+    cli->event_loop = w->event_loop;
+    cli->mailbox = w->mailbox;
+    return mailbox_post(w->mailbox, &m->msg);
+}
+
+int ioworker_id(ioworker_t *w) {
+    return w->id;
+}
 
-    return OCTOPUS_OK;
+ioworker_t* ioworker_current() {
+    return current_ioworker;
 }
 
 void ioworker_stop(ioworker_t *w) {
@@ -84,6 +150,7 @@ void ioworker_stop(ioworker_t *w) {
 void ioworker_destroy(ioworker_t *w) {
     if (w == NULL) return;
 
+    mailbox_destroy(w->mailbox);
     aeDeleteEventLoop(w->event_loop);
     free(w);
 }
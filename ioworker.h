@@ -12,8 +12,18 @@
 
 typedef struct ioworker_s ioworker_t;
 
-ioworker_t* ioworker_create();
+ioworker_t* ioworker_create(int id);
 int ioworker_add_client(ioworker_t *w, client_t *cli);
+
+/**
+ * @brief Index of the ioworker in the pool.
+ */
+int ioworker_id(ioworker_t *w);
+
+/**
+ * @brief The ioworker running current thread, or NULL if it's not an ioworker.
+ */
+ioworker_t* ioworker_current();
 void ioworker_stop(ioworker_t *w);
 void ioworker_destroy(ioworker_t *w);
 
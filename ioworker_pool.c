@@ -31,7 +31,7 @@ ioworker_pool_t* ioworker_pool_create(int size) {
 
     pool->worker_count = size;
     for (int i = 0; i < size; i++) {
-        if ((pool->workers[i] = ioworker_create()) == NULL) {
+        if ((pool->workers[i] = ioworker_create(i)) == NULL) {
             OCTOPUS_ERROR_LOG("failed to create ioworker for pool");
             goto failed;
         }
@@ -60,6 +60,10 @@ int ioworker_pool_add_client(ioworker_pool_t *pool, client_t *cli) {
     return ioworker_add_client(w, cli);
 }
 
+int ioworker_pool_size(ioworker_pool_t *pool) {
+    return pool->worker_count;
+}
+
 void ioworker_pool_destroy(ioworker_pool_t *pool) {
     for (int i = 0; i < pool->worker_count; i++) {
         ioworker_destroy(pool->workers[i]);
@@ -14,6 +14,7 @@ typedef struct ioworker_pool_s ioworker_pool_t;
 
 ioworker_pool_t* ioworker_pool_create(int size);
 int ioworker_pool_add_client(ioworker_pool_t *pool, client_t *cli);
+int ioworker_pool_size(ioworker_pool_t *pool);
 void ioworker_pool_destroy(ioworker_pool_t *pool);
 void ioworker_pool_stop(ioworker_pool_t *pool);
 
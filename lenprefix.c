@@ -0,0 +1,392 @@
+/**
+ *
+ * @file    lenprefix
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-05-22 10:48:12
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "lenprefix.h"
+#include "object.h"
+#include "logging.h"
+#include "common.h"
+#include "memory.h"
+
+#define header_decode(p)    \
+    ((uint32_t)(unsigned char)(p)[0] | (uint32_t)(unsigned char)(p)[1] << 8 | \
+     (uint32_t)(unsigned char)(p)[2] << 16 | (uint32_t)(unsigned char)(p)[3] << 24)
+
+typedef struct {
+    protocol_t_implement;
+
+    // payload length of the frame whose header has been consumed, or -1 if the
+    // header of next frame hasn't been parsed. It's kept across reads, so a
+    // partial frame needn't be rescanned.
+    int     frame_len;
+} lenprefix_protocol_t;
+
+static int max_frame_size = LENPREFIX_DEFAULT_MAX_FRAME_SIZE;
+
+void lenprefix_set_max_frame_size(int size) {
+    if (size <= 0) {
+        OCTOPUS_ERROR_LOG("invalid max frame size: %d", size);
+        return;
+    }
+
+    max_frame_size = size;
+}
+
+static void frame_cmd_destroy(command_t *cmd) {
+    frame_cmd_t     *frame;
+
+    frame = (frame_cmd_t *)cmd;
+    if (frame->copy != NULL) {
+        sdsfree(frame->copy);
+    }
+    if (frame->ref != NULL) {
+        bufref_decr(frame->ref);
+    }
+
+    octopus_free(frame);
+}
+
+static frame_cmd_t* frame_cmd_alloc() {
+    frame_cmd_t     *frame;
+
+    if ((frame = octopus_calloc(1, sizeof(frame_cmd_t), OCTOPUS_MEM_COMMAND)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for frame command");
+        return NULL;
+    }
+    frame->destroy = frame_cmd_destroy;
+
+    return frame;
+}
+
+frame_cmd_t* frame_cmd_create(const char *payload, int len) {
+    frame_cmd_t     *frame;
+
+    if ((frame = frame_cmd_alloc()) == NULL) {
+        return NULL;
+    }
+
+    if ((frame->copy = sdsnewlen(payload, len)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for frame payload, len: %d", len);
+        octopus_free(frame);
+        return NULL;
+    }
+    frame->payload = frame->copy;
+    frame->len = len;
+
+    return frame;
+}
+
+frame_cmd_t* frame_cmd_create_ref(bufref_t *ref) {
+    frame_cmd_t     *frame;
+
+    if (ref == NULL) {
+        OCTOPUS_ERROR_LOG("Invalid param, ref is NULL.");
+        return NULL;
+    }
+
+    if ((frame = frame_cmd_alloc()) == NULL) {
+        return NULL;
+    }
+
+    bufref_incr(ref);
+    frame->ref = ref;
+    frame->payload = ref->data;
+    frame->len = ref->len;
+
+    return frame;
+}
+
+static int frame_emit(const char *payload, int len, sds copy, deque_t *output_cmd_objs) {
+    frame_cmd_t     *frame;
+    object_t        *obj;
+
+    if ((frame = frame_cmd_alloc()) == NULL) {
+        sdsfree(copy);
+        return OCTOPUS_ERR;
+    }
+    frame->payload = copy != NULL ? copy : payload;
+    frame->len = len;
+    frame->copy = copy;
+
+    if ((obj = object_create_cmd((command_t *)frame)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create object for frame command");
+        frame_cmd_destroy((command_t *)frame);
+        return OCTOPUS_ERR;
+    }
+
+    if (deque_push_back(output_cmd_objs, obj) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("failed to add frame command to deque");
+        obj->decr(obj);
+        return OCTOPUS_ERR;
+    }
+
+    return OCTOPUS_OK;
+}
+
+/**
+ * Fast path for many small frames which are continuous in the ring. Headers are
+ * read by one load each, and the buffer is advanced once for the whole batch.
+ */
+static int decode_continuous(lenprefix_protocol_t *p, buffer_t *input, deque_t *output_cmd_objs) {
+    const char  *cur, *last;
+    uint32_t    len;
+    int         ret;
+
+    cur = input->buf + input->start;
+    last = input->start <= input->end ? input->buf + input->end : input->buf + input->size;
+
+    ret = OCTOPUS_OK;
+    while (last - cur >= LENPREFIX_HEADER_LEN) {
+        len = header_decode(cur);
+        if (len > (uint32_t)max_frame_size) {
+            OCTOPUS_ERROR_LOG("frame is too large, len: %u, max: %d", len, max_frame_size);
+            ret = OCTOPUS_ERR;
+            break;
+        }
+
+        if (last - cur - LENPREFIX_HEADER_LEN < (long)len) {
+            break;
+        }
+
+        if ((ret = frame_emit(cur + LENPREFIX_HEADER_LEN, len, NULL, output_cmd_objs))
+                == OCTOPUS_ERR) {
+            break;
+        }
+        cur += LENPREFIX_HEADER_LEN + len;
+    }
+
+    buffer_advance_step(input, cur - (input->buf + input->start));
+    p->frame_len = -1;
+
+    return ret;
+}
+
+static int lenprefix_decode(void *state, buffer_t *input, deque_t *output_cmd_objs) {
+    lenprefix_protocol_t    *p;
+    char        header[LENPREFIX_HEADER_LEN];
+    uint32_t    len;
+    sds         copy;
+
+    p = (lenprefix_protocol_t *)state;
+
+    if (p->frame_len < 0 &&
+            decode_continuous(p, input, output_cmd_objs) == OCTOPUS_ERR) {
+        return OCTOPUS_ERR;
+    }
+
+    // The rest frames wrap around the end of the ring.
+    for (;;) {
+        if (p->frame_len < 0) {
+            if (buffer_content_len(input) < LENPREFIX_HEADER_LEN) {
+                break;
+            }
+
+            buffer_read_to(input, header, LENPREFIX_HEADER_LEN);
+            len = header_decode(header);
+            if (len > (uint32_t)max_frame_size) {
+                OCTOPUS_ERROR_LOG("frame is too large, len: %u, max: %d", len, max_frame_size);
+                return OCTOPUS_ERR;
+            }
+            p->frame_len = len;
+        }
+
+        if (buffer_content_len(input) < p->frame_len) {
+            // partial frame, wait for more data
+            break;
+        }
+
+        if (input->start + p->frame_len <= input->size) {
+            // payload is continuous, parse in place
+            if (frame_emit(input->buf + input->start, p->frame_len, NULL, output_cmd_objs)
+                    == OCTOPUS_ERR) {
+                return OCTOPUS_ERR;
+            }
+            buffer_advance_step(input, p->frame_len);
+        } else {
+            if ((copy = sdsempty()) == NULL) {
+                OCTOPUS_ERROR_LOG("failed to alloc mem for frame payload");
+                return OCTOPUS_ERR;
+            }
+            buffer_read_to_sds(input, &copy, p->frame_len);
+            if (frame_emit(NULL, p->frame_len, copy, output_cmd_objs) == OCTOPUS_ERR) {
+                return OCTOPUS_ERR;
+            }
+        }
+        p->frame_len = -1;
+
+        // back to the fast path after wrapping around
+        if (input->start <= input->end &&
+                decode_continuous(p, input, output_cmd_objs) == OCTOPUS_ERR) {
+            return OCTOPUS_ERR;
+        }
+    }
+
+    return OCTOPUS_OK;
+}
+
+static int lenprefix_encode(void *state, object_t *cmd_obj, buffer_t *output) {
+    frame_cmd_t     *frame;
+    char            header[LENPREFIX_HEADER_LEN];
+    int             inline_len;
+
+    OCTOPUS_NOT_USED(state);
+
+    frame = (frame_cmd_t *)cmd_obj->obj.cmd;
+    inline_len = LENPREFIX_HEADER_LEN + (frame->ref == NULL ? frame->len : 0);
+    if (buffer_reserve(output, inline_len) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("no space to encode frame, remaining: %d, frame len: %d",
+                buffer_space_remaining(output), frame->len);
+        return OCTOPUS_ERR;
+    }
+
+    header[0] = frame->len & 0xFF;
+    header[1] = (frame->len >> 8) & 0xFF;
+    header[2] = (frame->len >> 16) & 0xFF;
+    header[3] = (frame->len >> 24) & 0xFF;
+    buffer_write_from(output, header, LENPREFIX_HEADER_LEN);
+
+    if (frame->ref != NULL) {
+        return buffer_attach_ref(output, frame->ref);
+    }
+
+    return buffer_write_from(output, (void *)frame->payload, frame->len);
+}
+
+static void lenprefix_destroy(protocol_t *protocol) {
+    octopus_free(protocol);
+}
+
+protocol_t* lenprefix_protocol_create() {
+    lenprefix_protocol_t    *p;
+
+    if ((p = octopus_calloc(1, sizeof(lenprefix_protocol_t), OCTOPUS_MEM_CLIENT)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for lenprefix protocol");
+        return NULL;
+    }
+
+    p->decode = lenprefix_decode;
+    p->encode = lenprefix_encode;
+    p->destroy = lenprefix_destroy;
+    p->frame_len = -1;
+
+    return (protocol_t *)p;
+}
+
+#ifdef OCTOPUS_TEST_LENPREFIX
+
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_FRAMES     200
+
+static int test_payload(int i, char *payload) {
+    int     len;
+
+    // empty frames and ones longer than a read
+    len = i % 23;
+    for (int j = 0; j < len; j++) {
+        payload[j] = 'a' + (i + j) % 26;
+    }
+
+    return len;
+}
+
+/**
+ * Pop the frames decoded, and count the ones which differ from the expected.
+ */
+static int test_check(deque_t *cmds, int *next) {
+    object_t    *obj;
+    frame_cmd_t *frame;
+    char        payload[32];
+    int         wrong, len;
+
+    wrong = 0;
+    while ((obj = deque_pop_front(cmds)) != NULL) {
+        frame = (frame_cmd_t *)obj->obj.cmd;
+        len = test_payload((*next)++, payload);
+        wrong += frame->len != len || memcmp(frame->payload, payload, len) != 0;
+        obj->decr(obj);
+    }
+
+    return wrong;
+}
+
+int main(int argc, char *argv[])
+{
+    protocol_t  *p;
+    buffer_t    *input;
+    deque_t     *cmds;
+    object_t    *obj;
+    char        stream[TEST_FRAMES * 32], header[LENPREFIX_HEADER_LEN];
+    int         stream_len, len, off, chunk, next, wrong, ret;
+
+    OCTOPUS_NOT_USED(argc);
+    OCTOPUS_NOT_USED(argv);
+
+    stream_len = 0;
+    for (int i = 0; i < TEST_FRAMES; i++) {
+        len = test_payload(i, stream + stream_len + LENPREFIX_HEADER_LEN);
+        memset(stream + stream_len, 0, LENPREFIX_HEADER_LEN);
+        stream[stream_len] = len;
+        stream_len += LENPREFIX_HEADER_LEN + len;
+    }
+
+    // Frames arrive in reads of 1 to 7 bytes, so headers and payloads are split,
+    // and the small ring makes them wrap around its end.
+    p = lenprefix_protocol_create();
+    input = buffer_create(64);
+    cmds = deque_create(16, NULL);
+    next = wrong = 0;
+    for (off = 0, chunk = 1; off < stream_len; off += chunk, chunk = chunk % 7 + 1) {
+        chunk = chunk < stream_len - off ? chunk : stream_len - off;
+        buffer_write_from(input, stream + off, chunk);
+        if (p->decode(p, input, cmds) == OCTOPUS_ERR) {
+            printf("failed to decode at %d\n", off);
+            break;
+        }
+        wrong += test_check(cmds, &next);
+    }
+    printf("partial frames, decoded: %d of %d, wrong: %d, left: %d\n", next, TEST_FRAMES,
+            wrong, buffer_content_len(input));
+    p->destroy(p);
+    buffer_destroy(input);
+
+    // the oversized header is rejected once it's complete, before its payload
+    lenprefix_set_max_frame_size(16);
+    p = lenprefix_protocol_create();
+    input = buffer_create(64);
+    memset(header, 0, sizeof(header));
+    header[0] = 17;
+    buffer_write_from(input, header, 2);
+    ret = p->decode(p, input, cmds);
+    buffer_write_from(input, header + 2, 2);
+    printf("oversized frame, half header: %d, header: %d\n", ret, p->decode(p, input, cmds));
+
+    // the largest one allowed is decoded
+    p->destroy(p);
+    p = lenprefix_protocol_create();
+    buffer_destroy(input);
+    input = buffer_create(64);
+    header[0] = 16;
+    buffer_write_from(input, header, LENPREFIX_HEADER_LEN);
+    buffer_write_from(input, stream, 16);
+    ret = p->decode(p, input, cmds);
+    printf("max frame: %d, frames: %d\n", ret, deque_size(cmds));
+    while ((obj = deque_pop_front(cmds)) != NULL) {
+        obj->decr(obj);
+    }
+
+    deque_destroy(cmds);
+    p->destroy(p);
+    buffer_destroy(input);
+
+    return 0;
+}
+
+#endif
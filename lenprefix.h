@@ -0,0 +1,62 @@
+/**
+ *
+ * @file    lenprefix
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-05-22 10:21:37
+ */
+
+#ifndef OCTOPUS_LENPREFIX_H
+#define OCTOPUS_LENPREFIX_H
+
+#include "sds.h"
+#include "bufref.h"
+#include "command.h"
+#include "protocol.h"
+
+/**
+ * Name of the built-in protocol, which is registered by octopus_create.
+ * A frame is a 4 bytes little-endian length followed by the payload.
+ */
+#define OCTOPUS_PROTOCOL_LENPREFIX  "lenprefix"
+
+#define LENPREFIX_HEADER_LEN            4
+#define LENPREFIX_DEFAULT_MAX_FRAME_SIZE    (512 * 1024)
+
+/**
+ * Command of a frame. For a decoded frame, 'payload' points into the input
+ * buffer if the frame is continuous in it, so it's only valid during the
+ * processing of the command, and a processor must copy it if the payload is
+ * needed later. Otherwise the payload is copied to 'copy'.
+ * For a response, payload can be owned by 'ref' which is attached to the output
+ * without copy.
+ */
+typedef struct {
+    command_t_implement
+
+    const char  *payload;
+    int         len;
+
+    sds         copy;
+    bufref_t    *ref;
+} frame_cmd_t;
+
+/**
+ * Create a frame command, and the payload will be copied.
+ */
+frame_cmd_t* frame_cmd_create(const char *payload, int len);
+
+/**
+ * Create a frame command whose payload is owned by the ref, the command holds a
+ * reference of it.
+ */
+frame_cmd_t* frame_cmd_create_ref(bufref_t *ref);
+
+protocol_t* lenprefix_protocol_create();
+
+/**
+ * Frames larger than 'size' are treated as error, and the client will be closed.
+ * It should be less than the size of input buffer.
+ */
+void lenprefix_set_max_frame_size(int size);
+
+#endif /* ifndef OCTOPUS_LENPREFIX_H */
@@ -40,14 +40,30 @@ int octopus_log_init(const char *logpath) {
     return OCTOPUS_OK;
 }
 
+/**
+ * The timestamp is formatted once per second for each thread, and the second
+ * is read from the coarse clock, which needn't a syscall.
+ */
 int fill_time(char *buf, int buflen) {
-    time_t      now;
-    struct tm   now_tm;
+    static __thread time_t  cached_sec = -1;
+    static __thread char    cached_time[32];
+    static __thread int     cached_len;
+    struct timespec         ts;
+    struct tm               now_tm;
+    int                     len;
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if (ts.tv_sec != cached_sec) {
+        localtime_r(&ts.tv_sec, &now_tm);
+        cached_len = strftime(cached_time, sizeof(cached_time), "%Y-%m-%d %H:%M:%S", &now_tm);
+        cached_sec = ts.tv_sec;
+    }
 
-    now = time(NULL);
-    localtime_r(&now, &now_tm);
+    len = cached_len < buflen - 1 ? cached_len : buflen - 1;
+    memcpy(buf, cached_time, len);
+    buf[len] = '\0';
 
-    return strftime(buf, buflen, "%Y-%m-%d %H:%M:%S", &now_tm);
+    return len;
 }
 
 const char* level_name(octopus_log_level_t lv) {
@@ -0,0 +1,127 @@
+/**
+ *
+ * @file    mailbox
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-12 10:52:08
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "mailbox.h"
+#include "logging.h"
+#include "common.h"
+
+#define MAILBOX_DRAIN_BYTES     64
+
+static void mailbox_handle(struct aeEventLoop *event_loop, int fd, void *data, int mask) {
+    mailbox_t       *mb;
+    mailbox_msg_t   *msg, *next;
+    char            buf[MAILBOX_DRAIN_BYTES];
+
+    OCTOPUS_NOT_USED(event_loop);
+    OCTOPUS_NOT_USED(mask);
+
+    mb = (mailbox_t *)data;
+    while (read(fd, buf, sizeof(buf)) > 0);
+
+    // take all messages at once, so the lock isn't held by handlers
+    pthread_mutex_lock(&mb->mu);
+    msg = mb->head;
+    mb->head = mb->tail = NULL;
+    pthread_mutex_unlock(&mb->mu);
+
+    for (; msg != NULL; msg = next) {
+        next = msg->next;
+        msg->handler(msg->ctx);
+    }
+}
+
+static int set_nonblock(int fd) {
+    int     flags;
+
+    if ((flags = fcntl(fd, F_GETFL)) == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        OCTOPUS_ERROR_LOG_BY_ERRNO("failed to set non-block for mailbox, fd: %d", fd);
+        return OCTOPUS_ERR;
+    }
+
+    return OCTOPUS_OK;
+}
+
+mailbox_t* mailbox_create(aeEventLoop *event_loop) {
+    mailbox_t   *mb;
+
+    if ((mb = calloc(1, sizeof(mailbox_t))) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for mailbox");
+        return NULL;
+    }
+
+    mb->event_loop = event_loop;
+    if (pipe(mb->pipe_fds) == -1) {
+        OCTOPUS_ERROR_LOG_BY_ERRNO("failed to create pipe for mailbox");
+        free(mb);
+        return NULL;
+    }
+    pthread_mutex_init(&mb->mu, NULL);
+
+    if (set_nonblock(mb->pipe_fds[0]) == OCTOPUS_ERR ||
+            set_nonblock(mb->pipe_fds[1]) == OCTOPUS_ERR) {
+        goto failed;
+    }
+
+    if (aeCreateFileEvent(event_loop, mb->pipe_fds[0], AE_READABLE, mailbox_handle, mb)
+            == AE_ERR) {
+        OCTOPUS_ERROR_LOG("failed to add file event for mailbox");
+        goto failed;
+    }
+
+    return mb;
+
+failed:
+    close(mb->pipe_fds[0]);
+    close(mb->pipe_fds[1]);
+    pthread_mutex_destroy(&mb->mu);
+    free(mb);
+
+    return NULL;
+}
+
+int mailbox_post(mailbox_t *mb, mailbox_msg_t *msg) {
+    int     wakeup;
+
+    TWO_PTRS_NULL_CHECK(mb, msg);
+
+    msg->next = NULL;
+    pthread_mutex_lock(&mb->mu);
+    // the loop has been woken up if there are messages already
+    wakeup = mb->head == NULL;
+    if (mb->tail == NULL) {
+        mb->head = msg;
+    } else {
+        mb->tail->next = msg;
+    }
+    mb->tail = msg;
+    pthread_mutex_unlock(&mb->mu);
+
+    // The message has been queued, and it will be handled at the next wakeup
+    // even if the write fails.
+    if (wakeup && write(mb->pipe_fds[1], "", 1) == -1 && errno != EAGAIN) {
+        OCTOPUS_ERROR_LOG_BY_ERRNO("failed to wake up event loop of mailbox");
+    }
+
+    return OCTOPUS_OK;
+}
+
+void mailbox_destroy(mailbox_t *mb) {
+    if (mb == NULL) {
+        return;
+    }
+
+    aeDeleteFileEvent(mb->event_loop, mb->pipe_fds[0], AE_READABLE);
+    close(mb->pipe_fds[0]);
+    close(mb->pipe_fds[1]);
+    pthread_mutex_destroy(&mb->mu);
+    free(mb);
+}
@@ -0,0 +1,53 @@
+/**
+ *
+ * @file    mailbox
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-12 10:31:26
+ */
+
+#ifndef OCTOPUS_MAILBOX_H
+#define OCTOPUS_MAILBOX_H
+
+#include <pthread.h>
+
+#include "libae/ae.h"
+#include "common.h"
+
+typedef void (mailbox_handler_t)(void *ctx);
+
+/**
+ * A message passed to the thread of an event loop. It's embedded in the
+ * context of the message usually, so posting a message needn't allocate.
+ */
+typedef struct _mailbox_msg_t {
+    void                *ctx;
+    mailbox_handler_t   *handler;
+
+    struct _mailbox_msg_t   *next;
+} mailbox_msg_t;
+
+/**
+ * Messages can be posted from any thread, and they are handled by the thread of
+ * the event loop in FIFO order. The loop is woken up by a pipe, and only one byte
+ * is written for a batch of messages.
+ */
+typedef struct {
+    aeEventLoop     *event_loop;
+    int             pipe_fds[2];
+
+    pthread_mutex_t     mu;
+    mailbox_msg_t       *head;
+    mailbox_msg_t       *tail;
+} mailbox_t;
+
+mailbox_t* mailbox_create(aeEventLoop *event_loop);
+
+/**
+ * @brief Post a message to the event loop, the handler is called in the thread
+ *      of the event loop with 'msg->ctx'.
+ */
+int mailbox_post(mailbox_t *mb, mailbox_msg_t *msg);
+
+void mailbox_destroy(mailbox_t *mb);
+
+#endif /* ifndef OCTOPUS_MAILBOX_H */
@@ -0,0 +1,17 @@
+# Allocator of the programs: libc, jemalloc, mimalloc or tcmalloc. The library
+# linked replaces malloc of the whole process, so octopus_malloc, sds, libae and
+# processors all allocate from it. Run 'make clean' after switching it.
+MALLOC?=libc
+
+ifeq ($(MALLOC),jemalloc)
+	MALLOC_CFLAGS=-DUSE_JEMALLOC
+	MALLOC_LIBS=-ljemalloc
+else ifeq ($(MALLOC),mimalloc)
+	MALLOC_CFLAGS=-DUSE_MIMALLOC
+	MALLOC_LIBS=-lmimalloc
+else ifeq ($(MALLOC),tcmalloc)
+	MALLOC_CFLAGS=-DUSE_TCMALLOC
+	MALLOC_LIBS=-ltcmalloc
+else ifneq ($(MALLOC),libc)
+$(error unknown MALLOC '$(MALLOC)', use libc, jemalloc, mimalloc or tcmalloc)
+endif
@@ -0,0 +1,128 @@
+/**
+ *
+ * @file    memory
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-07-02 15:41:08
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "common.h"
+
+// The header before each allocation, it takes 16 bytes so the memory returned
+// keeps the alignment of malloc.
+#define MEM_HEADER_SIZE     16
+
+#if defined(USE_JEMALLOC)
+#define MALLOC_NAME     "jemalloc"
+#elif defined(USE_MIMALLOC)
+#define MALLOC_NAME     "mimalloc"
+#elif defined(USE_TCMALLOC)
+#define MALLOC_NAME     "tcmalloc"
+#else
+#define MALLOC_NAME     "libc"
+#endif
+
+#define header_of(p)    ((mem_header_t *)((char *)(p) - MEM_HEADER_SIZE))
+
+typedef struct {
+    size_t  size;
+    int     category;
+} mem_header_t;
+
+static long long    used[OCTOPUS_MEM_CATEGORIES];
+static long long    limit;
+
+void* octopus_malloc(size_t size, int category) {
+    mem_header_t    *h;
+
+    if ((h = malloc(MEM_HEADER_SIZE + size)) == NULL) {
+        return NULL;
+    }
+    h->size = size;
+    h->category = category;
+    __sync_fetch_and_add(&used[category], (long long)size);
+
+    return (char *)h + MEM_HEADER_SIZE;
+}
+
+void* octopus_calloc(size_t count, size_t size, int category) {
+    void    *p;
+
+    if (size != 0 && count > ((size_t)-1 - MEM_HEADER_SIZE) / size) {
+        return NULL;
+    }
+
+    if ((p = octopus_malloc(count * size, category)) != NULL) {
+        memset(p, 0, count * size);
+    }
+
+    return p;
+}
+
+void* octopus_realloc(void *p, size_t size) {
+    mem_header_t    *h;
+    size_t          old_size;
+
+    if (p == NULL) {
+        return NULL;
+    }
+
+    old_size = header_of(p)->size;
+    if ((h = realloc(header_of(p), MEM_HEADER_SIZE + size)) == NULL) {
+        return NULL;
+    }
+    h->size = size;
+    __sync_fetch_and_add(&used[h->category], (long long)size - (long long)old_size);
+
+    return (char *)h + MEM_HEADER_SIZE;
+}
+
+void octopus_free(void *p) {
+    mem_header_t    *h;
+
+    if (p == NULL) {
+        return;
+    }
+
+    h = header_of(p);
+    __sync_fetch_and_sub(&used[h->category], (long long)h->size);
+    free(h);
+}
+
+void octopus_set_memory_limit(long long l) {
+    limit = l > 0 ? l : 0;
+}
+
+int octopus_memory_over_limit() {
+    long long   total;
+
+    if (limit == 0) {
+        return OCTOPUS_FALSE;
+    }
+
+    // the cache and hash tables aren't shrunk by the limit, so they're left out
+    total = 0;
+    for (int i = 0; i < OCTOPUS_MEM_CATEGORIES; i++) {
+        if (i != OCTOPUS_MEM_CACHE && i != OCTOPUS_MEM_TABLE) {
+            total += __sync_fetch_and_add(&used[i], 0);
+        }
+    }
+
+    return total > limit;
+}
+
+void octopus_memory_stats(memory_stats_t *stats) {
+    stats->total = 0;
+    for (int i = 0; i < OCTOPUS_MEM_CATEGORIES; i++) {
+        stats->used[i] = __sync_fetch_and_add(&used[i], 0);
+        stats->total += stats->used[i];
+    }
+    stats->limit = limit;
+}
+
+const char* octopus_malloc_name() {
+    return MALLOC_NAME;
+}
@@ -0,0 +1,61 @@
+/**
+ *
+ * @file    memory
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-07-02 15:20:41
+ */
+
+#ifndef OCTOPUS_MEMORY_H
+#define OCTOPUS_MEMORY_H
+
+#include <stddef.h>
+
+// categories of memory accounted
+#define OCTOPUS_MEM_BUFFER      0   // input and output buffers
+#define OCTOPUS_MEM_COMMAND     1   // commands decoded by protocols, or in flight
+#define OCTOPUS_MEM_CLIENT      2   // clients and their reorder slots
+#define OCTOPUS_MEM_CACHE       3   // entries and responses of the cache
+#define OCTOPUS_MEM_TABLE       4   // hash tables, such as the keyspaces
+#define OCTOPUS_MEM_CATEGORIES  5
+
+/**
+ * Bytes in use of each category. The limit bounds the memory of connections,
+ * and the cache is bounded by its own budget, see octopus_cache_set_max_bytes.
+ * Hash tables hold the data, which isn't released by the limit either.
+ */
+typedef struct {
+    long long   used[OCTOPUS_MEM_CATEGORIES];
+    long long   total;
+    long long   limit;  // 0 if no limit
+} memory_stats_t;
+
+/**
+ * @brief Allocate memory accounted to the category. The size is kept in a
+ *      header, so it's freed by octopus_free without the size.
+ */
+void* octopus_malloc(size_t size, int category);
+void* octopus_calloc(size_t count, size_t size, int category);
+
+/**
+ * @brief Resize memory allocated by octopus_malloc, which stays in its category.
+ *      'p' mustn't be NULL, since its category is unknown then.
+ */
+void* octopus_realloc(void *p, size_t size);
+void octopus_free(void *p);
+
+/**
+ * @brief Set the limit of memory accounted in bytes, 0 to disable it, which
+ *      leaves the cache and hash tables out. Above the limit, idle buffers are
+ *      shrunk, and then the clients with the largest buffers are disconnected,
+ *      by the thread which they belong to.
+ */
+void octopus_set_memory_limit(long long limit);
+int octopus_memory_over_limit();
+void octopus_memory_stats(memory_stats_t *stats);
+
+/**
+ * @brief Name of the allocator chosen by MALLOC at build time.
+ */
+const char* octopus_malloc_name();
+
+#endif /* ifndef OCTOPUS_MEMORY_H */
@@ -11,6 +11,9 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <assert.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <limits.h>
 
 #include "networking.h"
 #include "logging.h"
@@ -21,9 +24,34 @@
 #include "protocol.h"
 #include "ioworker_pool.h"
 #include "octopus.h"
-
-#define READ_SOCK_UNIT_BYTES    1024
-#define WRITE_SOCK_UNIT_BYTES   1024
+#include "mailbox.h"
+#include "coroutine.h"
+#include "coalesce.h"
+#include "cache.h"
+#include "timewheel.h"
+#include "memory.h"
+
+// cached responses larger than it are attached to the output instead of copied
+#define REPLY_BYTES_COPY_MAX    4096
+// idle output buffers are shrunk to it when memory is over the limit
+#define CLIENT_IDLE_OUTPUT_BUF_LEN  16 * 1024
+// granularity of timeouts of clients
+#define CLIENT_TIMER_TICK_MS    100
+// threads scan their clients over the memory limit once in the interval at most
+#define CLIENT_EVICT_SCAN_MS    10
+// largest clients published earlier than it are out of date
+#define CLIENT_EVICT_STALE_MS   1000
+#define CLIENT_EVICT_THREADS    64
+
+#define CLIENT_TIMEOUT_IDLE     0
+#define CLIENT_TIMEOUT_READ     1
+#define CLIENT_TIMEOUT_WRITE    2
+
+#define client_of_timer(node)   \
+    ((client_t *)((char *)(node) - offsetof(client_t, timer)))
+
+#define client_buffers_size(cli)    \
+    ((long long)(cli)->inbuf->size + (cli)->outbuf->size)
 
 // Implementation of multi-threaded IO:
 // 1) Each thread(worker) has a event loop. Main thread accecpts new connected socket, and
@@ -39,6 +67,60 @@ typedef struct {
     int     mask;
 } event_ctx_t;
 
+/**
+ * Completion of a pending request, which is passed to the thread of the client.
+ */
+typedef struct {
+    mailbox_msg_t   msg;
+
+    client_t    *cli;
+    long long   token;
+    object_t    *result;
+} completion_t;
+
+// client and token of the request being processed by the thread
+static __thread client_t    *current_client;
+static __thread long long   current_token;
+
+// Time wheel of the thread for timeouts of its clients, which is created at the
+// first client with timeouts.
+static __thread timewheel_t *client_wheel;
+// connections closed for each kind of timeouts
+static long long            timeouts_expired[3];
+static const char           *timeout_names[3] = {"idle", "read", "write"};
+
+// clients of the thread whose output is written before the event loop sleeps
+static __thread ilist_t     clients_to_write;
+// clients of the thread which continue reading in the next iteration
+static __thread ilist_t     clients_to_read;
+// Pushed behind the clients to read when the loop wakes up, clients deferred
+// again are pushed after it, and left to the next iteration.
+static __thread ilist_node_t    clients_to_read_end;
+// clients watched by the thread, which release memory over the limit
+static __thread ilist_t     thread_clients;
+// idle output buffers shrunk and clients disconnected over the memory limit
+static long long            memory_shrinks;
+static long long            memory_evictions;
+
+/**
+ * The largest client of a thread, which is published when the thread scans its
+ * clients over the memory limit.
+ */
+typedef struct {
+    long long   size;
+    long long   published_ms;
+} evict_slot_t;
+
+// largest clients of the threads, and the slot of the thread
+static evict_slot_t         evict_slots[CLIENT_EVICT_THREADS];
+static int                  evict_slot_count;
+static __thread int         evict_slot = -1;
+static __thread long long   evict_scan_ms;
+// closed clients waiting for their pending requests, whose memory isn't freed yet
+static int                  clients_closing;
+
+static int slots_flush(client_t *cli);
+
 static inline int socket_set_nonblock(int sockfd) {
     int     flags;
 
@@ -121,22 +203,105 @@ int tcp_nonblk_srv(int sockfd, struct addrinfo *addr, int backlog) {
     return OCTOPUS_OK;
 }
 
+void srv_ctx_destroy(void *ctx) {
+    srv_ctx_t   *srv_ctx;
+
+    if (ctx == NULL) {
+        return;
+    }
+
+    srv_ctx = (srv_ctx_t *)ctx;
+    for (int i = 0; i < srv_ctx->processor_count; i++) {
+        if (srv_ctx->processors[i] != NULL) {
+            srv_ctx->processors[i]->decr(srv_ctx->processors[i]);
+        }
+    }
+    octopus_free(srv_ctx->processors);
+    free(srv_ctx);
+}
+
+static object_t* processor_obj_create(processor_factory_t factory) {
+    processor_t *processor;
+    object_t    *obj;
+
+    if ((processor = factory()) == NULL) {
+        OCTOPUS_ERROR_LOG("faield to create processor");
+        return NULL;
+    }
+
+    if ((obj = object_create(OBJECT_TYPE_PROCESSOR, processor)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create object of processor");
+        processor->destroy(processor);
+        return NULL;
+    }
+
+    return obj;
+}
+
+int client_init_processor(client_t *cli, int thread_idx) {
+    srv_ctx_t   *srv_ctx;
+    object_t    **shared;
+
+    srv_ctx = cli->srv_ctx;
+    if (srv_ctx->processor_scope == OCTOPUS_PROCESSOR_SCOPE_CONNECTION) {
+        cli->processor_obj = processor_obj_create(srv_ctx->processor_factory);
+        return cli->processor_obj == NULL ? OCTOPUS_ERR : OCTOPUS_OK;
+    }
+
+    // Each slot is only written by the thread owning it, and the array is
+    // allocated by the main thread before clients are passed to ioworkers.
+    shared = &srv_ctx->processors[
+        srv_ctx->processor_scope == OCTOPUS_PROCESSOR_SCOPE_GLOBAL ? 0 : thread_idx];
+    if (*shared == NULL) {
+        OCTOPUS_INFO_LOG("create shared processor, scope: %d, ioworker: %d",
+                srv_ctx->processor_scope, thread_idx);
+        if ((*shared = processor_obj_create(srv_ctx->processor_factory)) == NULL) {
+            return OCTOPUS_ERR;
+        }
+    }
+
+    (*shared)->incr(*shared);
+    cli->processor_obj = *shared;
+
+    return OCTOPUS_OK;
+}
+
+/**
+ * Shared processors are created lazily, but the array holding them is allocated
+ * at the first connection by the main thread.
+ */
+static int shared_processors_init(srv_ctx_t *srv_ctx, ioworker_pool_t *pool) {
+    int     count;
+
+    if (srv_ctx->processors != NULL ||
+            srv_ctx->processor_scope == OCTOPUS_PROCESSOR_SCOPE_CONNECTION) {
+        return OCTOPUS_OK;
+    }
+
+    count = srv_ctx->processor_scope == OCTOPUS_PROCESSOR_SCOPE_IOWORKER && pool != NULL ?
+        ioworker_pool_size(pool) : 1;
+    srv_ctx->processors = octopus_calloc(count, sizeof(object_t *), OCTOPUS_MEM_CLIENT);
+    if (srv_ctx->processors == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for shared processors");
+        return OCTOPUS_ERR;
+    }
+    srv_ctx->processor_count = count;
+
+    return OCTOPUS_OK;
+}
+
 void client_connected(struct aeEventLoop *event_loop, int fd, void *cli_data, int mask) {
-    triple_t    *srv_ctx;
+    srv_ctx_t   *srv_ctx;
     int         cli_fd;
     socklen_t   cli_addrlen, sock_addrlen;
     client_t    *cli;
     char        sock_host[OCTOPUS_ADDR_BUF_SIZE];
     uint16_t    sock_port;
     protocol_t  *protocol;
-    processor_t *processor;
 
     ioworker_pool_t     *pool;
     struct sockaddr     cli_addr, sock_addr;
 
-    protocol_factory_t      protocol_factory;
-    processor_factory_t     processor_factory;
-
     OCTOPUS_NOT_USED(mask);
 
     cli_addrlen = sizeof(cli_addr);
@@ -169,13 +334,12 @@ void client_connected(struct aeEventLoop *event_loop, int fd, void *cli_data, in
     OCTOPUS_TRACE_LOG("receive a new connection at %s:%u, cli addr: %s:%u", sock_host, sock_port,
             cli->host, cli->port);
 
-    srv_ctx = (triple_t *)cli_data;
-    protocol_factory = (protocol_factory_t)(srv_ctx->first);
-    processor_factory = (processor_factory_t)(srv_ctx->second);
+    srv_ctx = (srv_ctx_t *)cli_data;
 
     cli->fd = cli_fd;
-    cli->oct = srv_ctx->third;
-    protocol = protocol_factory();
+    cli->oct = srv_ctx->oct;
+    cli->srv_ctx = srv_ctx;
+    protocol = srv_ctx->protocol_factory();
     if (protocol == NULL) {
         OCTOPUS_ERROR_LOG("failed to create protocol for client, cli: %s:%u",
                 cli->host, cli->port);
@@ -186,21 +350,22 @@ void client_connected(struct aeEventLoop *event_loop, int fd, void *cli_data, in
     if (cli->protocol_obj == NULL) {
         OCTOPUS_ERROR_LOG("failed to create object of protocol for client, cli: %s:%u",
                 cli->host, cli->port);
+        protocol->destroy(protocol);
         goto failed;
     }
 
-    processor = processor_factory();
-    if (processor == NULL) {
-        OCTOPUS_ERROR_LOG("faield to create processor for client, cli: %s:%u",
-                cli->host, cli->port);
+    pool = octopus_ioworker_pool(cli->oct);
+    if (shared_processors_init(srv_ctx, pool) == OCTOPUS_ERR) {
         goto failed;
     }
 
-    cli->processor_obj = object_create(OBJECT_TYPE_PROCESSOR, processor);
-    if (cli->processor_obj == NULL) {
-        OCTOPUS_ERROR_LOG("failed to create object of processor for client, cli: %s:%u",
-                cli->host, cli->port);
-        goto failed;
+    // per-ioworker processors are created in the thread of the ioworker
+    if (pool == NULL || srv_ctx->processor_scope != OCTOPUS_PROCESSOR_SCOPE_IOWORKER) {
+        if (client_init_processor(cli, 0) == OCTOPUS_ERR) {
+            OCTOPUS_ERROR_LOG("failed to init processor for client, cli: %s:%u",
+                    cli->host, cli->port);
+            goto failed;
+        }
     }
 
     if (socket_set_nonblock(cli_fd) == OCTOPUS_ERR) {
@@ -208,11 +373,16 @@ void client_connected(struct aeEventLoop *event_loop, int fd, void *cli_data, in
         goto failed;
     }
 
-    pool = octopus_ioworker_pool(cli->oct);
+    // the client belongs to the ioworker once it's added, so it isn't touched
+    // after that
+    OCTOPUS_TRACE_LOG("successful to init client(%s:%u), ready to process request",
+            cli->host, cli->port);
+
     if (pool == NULL) {
-        if (aeCreateFileEvent(event_loop, cli_fd, AE_READABLE, process_input_bytestream, cli)
-                == AE_ERR) {
-            OCTOPUS_ERROR_LOG("failed to add file event for new client");
+        cli->event_loop = event_loop;
+        cli->mailbox = octopus_mailbox(cli->oct);
+        if (client_watch(cli) == OCTOPUS_ERR) {
+            OCTOPUS_ERROR_LOG("failed to watch new client");
             goto failed;
         }
     } else {
@@ -223,51 +393,969 @@ void client_connected(struct aeEventLoop *event_loop, int fd, void *cli_data, in
     }
     OCTOPUS_TRACE_LOG("add file event, fd: %d", cli_fd);
 
-    OCTOPUS_TRACE_LOG("successful to init client(%s:%u), ready to process request",
-            cli->host, cli->port);
-
     return;
 
 failed:
     client_destroy(cli);
 }
 
-void process_input_bytestream(struct aeEventLoop *event_loop, int fd, void *cli_data, int mask) {
+static void output_unschedule(client_t *cli) {
+    if (ilist_linked(&clients_to_write, &cli->write_node)) {
+        ilist_remove(&clients_to_write, &cli->write_node);
+    }
+}
+
+static void read_defer(client_t *cli) {
+    if (!ilist_linked(&clients_to_read, &cli->read_node)) {
+        ilist_push(&clients_to_read, &cli->read_node);
+    }
+}
+
+static void thread_clients_unlink(client_t *cli) {
+    if (ilist_linked(&thread_clients, &cli->thread_node)) {
+        ilist_remove(&thread_clients, &cli->thread_node);
+    }
+}
+
+static void read_undefer(client_t *cli) {
+    if (ilist_linked(&clients_to_read, &cli->read_node)) {
+        ilist_remove(&clients_to_read, &cli->read_node);
+    }
+}
+
+/**
+ * Close the connection. If there are pending requests, the client is destroyed
+ * after all of them complete, since completions refer to it.
+ */
+static void client_close(client_t *cli) {
+    timewheel_cancel(&cli->timer);
+    output_unschedule(cli);
+    read_undefer(cli);
+    thread_clients_unlink(cli);
+
+    if (cli->fd != -1) {
+        aeDeleteFileEvent(cli->event_loop, cli->fd, AE_READABLE | AE_WRITABLE | AE_RECV);
+    }
+
+    if (cli->pending > 0) {
+        OCTOPUS_TRACE_LOG("client closed with %d pending requests, cli: %s:%d",
+                cli->pending, cli->host, cli->port);
+        cli->closing = OCTOPUS_TRUE;
+        __sync_fetch_and_add(&clients_closing, 1);
+        if (cli->fd != -1) {
+            close(cli->fd);
+            cli->fd = -1;
+        }
+        return;
+    }
+
+    client_destroy(cli);
+}
+
+static inline long long client_now_ms(client_t *cli) {
+    return aeGetMonotonicUs(cli->event_loop) / 1000;
+}
+
+/**
+ * The earliest deadline of the timeouts in the current state of the client, and
+ * 'kind' is set to the timeout of it.
+ */
+static long long client_deadline(client_t *cli, int *kind) {
+    srv_ctx_t   *ctx;
+    long long   deadline;
+    int         output_pending;
+
+    ctx = cli->srv_ctx;
+    deadline = LLONG_MAX;
+    output_pending = buffer_has_pending(cli->outbuf);
+
+    if (ctx->idle_timeout_ms > 0 && !output_pending && cli->pending == 0) {
+        deadline = cli->active_ms + ctx->idle_timeout_ms;
+        *kind = CLIENT_TIMEOUT_IDLE;
+    }
+
+    // reading is paused by the client itself, but not the peer
+    if (ctx->read_timeout_ms > 0 && cli->read_start_ms >= 0 && !cli->read_paused &&
+            cli->read_start_ms + ctx->read_timeout_ms < deadline) {
+        deadline = cli->read_start_ms + ctx->read_timeout_ms;
+        *kind = CLIENT_TIMEOUT_READ;
+    }
+
+    if (ctx->write_timeout_ms > 0 && output_pending &&
+            cli->write_ms + ctx->write_timeout_ms < deadline) {
+        deadline = cli->write_ms + ctx->write_timeout_ms;
+        *kind = CLIENT_TIMEOUT_WRITE;
+    }
+
+    return deadline;
+}
+
+/**
+ * Called after the state of the client changes. The timer is only moved if the
+ * deadline becomes earlier, later ones are found when it expires.
+ */
+static void client_timer_update(client_t *cli) {
+    long long   deadline;
+    int         kind;
+
+    if (client_wheel == NULL) {
+        return;
+    }
+
+    if ((deadline = client_deadline(cli, &kind)) == LLONG_MAX) {
+        timewheel_cancel(&cli->timer);
+        return;
+    }
+
+    if (!timewheel_scheduled(&cli->timer) || deadline < cli->timer.expire_ms) {
+        timewheel_schedule(client_wheel, &cli->timer, deadline);
+    }
+}
+
+static void client_timer_expire(timewheel_node_t *node, void *arg) {
     client_t    *cli;
-    int         data_read, read_size;
-    object_t    *result_cmd_obj, *input_cmd_obj;
-    iterator_t  *cmd_obj_iter;
+    long long   deadline;
+    int         kind;
+
+    OCTOPUS_NOT_USED(arg);
+
+    cli = client_of_timer(node);
+    if ((deadline = client_deadline(cli, &kind)) == LLONG_MAX) {
+        return;
+    }
+
+    if (deadline > client_now_ms(cli)) {
+        // extended by activity since it's scheduled
+        timewheel_schedule(client_wheel, node, deadline);
+        return;
+    }
+
+    __sync_fetch_and_add(&timeouts_expired[kind], 1);
+    OCTOPUS_INFO_LOG("%s timeout, close client, cli: %s:%d", timeout_names[kind],
+            cli->host, cli->port);
+    client_close(cli);
+}
+
+static int client_timer_tick(struct aeEventLoop *event_loop, long long id, void *data) {
+    OCTOPUS_NOT_USED(id);
+
+    timewheel_advance((timewheel_t *)data, aeGetMonotonicUs(event_loop) / 1000,
+            client_timer_expire, NULL);
+
+    return CLIENT_TIMER_TICK_MS;
+}
+
+static void client_wheel_finalize(struct aeEventLoop *event_loop, void *data) {
+    OCTOPUS_NOT_USED(event_loop);
+
+    timewheel_destroy((timewheel_t *)data);
+}
+
+static int client_timer_start(client_t *cli) {
+    srv_ctx_t   *ctx;
+
+    ctx = cli->srv_ctx;
+    if (ctx->idle_timeout_ms == 0 && ctx->read_timeout_ms == 0 && ctx->write_timeout_ms == 0) {
+        return OCTOPUS_OK;
+    }
+
+    if (client_wheel == NULL) {
+        if ((client_wheel = timewheel_create(CLIENT_TIMER_TICK_MS, client_now_ms(cli))) == NULL) {
+            OCTOPUS_ERROR_LOG("failed to create time wheel for clients");
+            return OCTOPUS_ERR;
+        }
+
+        // the wheel is destroyed with the event loop
+        if (aeCreateTimeEvent(cli->event_loop, CLIENT_TIMER_TICK_MS, client_timer_tick,
+                    client_wheel, client_wheel_finalize) == AE_ERR) {
+            OCTOPUS_ERROR_LOG("failed to add timer of time wheel for clients");
+            timewheel_destroy(client_wheel);
+            client_wheel = NULL;
+            return OCTOPUS_ERR;
+        }
+    }
+
+    cli->active_ms = client_now_ms(cli);
+    cli->write_ms = cli->active_ms;
+    client_timer_update(cli);
+
+    return OCTOPUS_OK;
+}
+
+void octopus_client_timeout_stats(client_timeout_stats_t *stats) {
+    stats->idle = __sync_fetch_and_add(&timeouts_expired[CLIENT_TIMEOUT_IDLE], 0);
+    stats->read = __sync_fetch_and_add(&timeouts_expired[CLIENT_TIMEOUT_READ], 0);
+    stats->write = __sync_fetch_and_add(&timeouts_expired[CLIENT_TIMEOUT_WRITE], 0);
+}
+
+int client_watch(client_t *cli) {
+    if (cli->srv_ctx->edge_triggered) {
+        if (aeCreateFileEvent(cli->event_loop, cli->fd, AE_READABLE | AE_EDGE | AE_RECV,
+                    process_input_bytestream, cli) == AE_OK &&
+                aeCreateFileEvent(cli->event_loop, cli->fd, AE_WRITABLE | AE_EDGE,
+                    output_response, cli) == AE_OK) {
+            cli->edge_triggered = OCTOPUS_TRUE;
+            cli->writable = OCTOPUS_TRUE;
+        } else {
+            OCTOPUS_DEBUG_LOG("edge-triggered events aren't supported, fall back, cli: %s:%d",
+                    cli->host, cli->port);
+            aeDeleteFileEvent(cli->event_loop, cli->fd, AE_READABLE | AE_WRITABLE);
+        }
+    }
+
+    // The requests are read by aeReadv, so the io_uring event loop receives
+    // them along with the completions.
+    if (!cli->edge_triggered && aeCreateFileEvent(cli->event_loop, cli->fd,
+                AE_READABLE | AE_RECV, process_input_bytestream, cli) == AE_ERR) {
+        OCTOPUS_ERROR_LOG("failed to add read event, cli: %s:%d", cli->host, cli->port);
+        return OCTOPUS_ERR;
+    }
+
+    if (client_timer_start(cli) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("failed to start timer, cli: %s:%d", cli->host, cli->port);
+        aeDeleteFileEvent(cli->event_loop, cli->fd, AE_READABLE | AE_WRITABLE | AE_RECV);
+        return OCTOPUS_ERR;
+    }
+
+    ilist_push(&thread_clients, &cli->thread_node);
+
+    return OCTOPUS_OK;
+}
+
+/**
+ * The output reaches the high watermark. 'unsent' responses which haven't been
+ * encoded yet, pending or held in the slots, count as long as the recent ones.
+ */
+static inline int output_full(client_t *cli, long long unsent) {
+    long long   high;
+
+    high = cli->srv_ctx->output_high_watermark;
+
+    return high > 0 && buffer_content_len(cli->outbuf) + unsent * cli->reply_len_avg >= high;
+}
+
+/**
+ * Write the output until it's drained or the socket is full.
+ *
+ * @return OCTOPUS_ERR if the connection has been reset or the write has failed,
+ *      OCTOPUS_EOF if the last reply has been sent and the client should be
+ *      closed.
+ */
+static int output_flush(client_t *cli) {
+    int         data_written, blocked;
+    long long   sent_seq;
+
+    blocked = OCTOPUS_FALSE;
+    do {
+        while (buffer_has_pending(cli->outbuf)) {
+            // inline bytes and attached refs are written by writev or sendfile
+            if ((data_written = buffer_writev_to_fd(cli->outbuf, cli->fd)) == OCTOPUS_RESET) {
+                OCTOPUS_ERROR_LOG("connection has been reset, close client, client: %s:%d",
+                        cli->host, cli->port);
+                return OCTOPUS_ERR;
+            } else if (data_written == OCTOPUS_ERR) {
+                OCTOPUS_ERROR_LOG("failed to write buffer to socket, close client, endpoint: %s:%d",
+                        cli->host, cli->port);
+                return OCTOPUS_ERR;
+            } else if (data_written == 0) {
+                // send buffer is full, need to wait
+                cli->writable = OCTOPUS_FALSE;
+                blocked = OCTOPUS_TRUE;
+                break;
+            }
+
+            cli->write_ms = client_now_ms(cli);
+        }
+
+        // responses held in the slots by the high watermark are encoded as the
+        // output drains
+        sent_seq = cli->sent_seq;
+        if (slots_flush(cli) == OCTOPUS_ERR) {
+            return OCTOPUS_ERR;
+        }
+    } while (!blocked && cli->sent_seq != sent_seq);
+
+    // the peer has caught up, and the client continues in the next iteration
+    if (cli->output_paused &&
+            buffer_content_len(cli->outbuf) <= cli->srv_ctx->output_low_watermark) {
+        OCTOPUS_DEBUG_LOG("output drops to the low watermark, resume reading, cli: %s:%d",
+                cli->host, cli->port);
+        cli->output_paused = OCTOPUS_FALSE;
+        read_defer(cli);
+    }
+
+    // all output buffer has been send, need remove write event handler
+    if (!buffer_has_pending(cli->outbuf)) {
+        if (!cli->edge_triggered &&
+                (aeGetFileEvents(cli->event_loop, cli->fd) & AE_WRITABLE) != 0) {
+            aeDeleteFileEvent(cli->event_loop, cli->fd, AE_WRITABLE);
+        }
+
+        if (cli->close_after_reply) {
+            OCTOPUS_TRACE_LOG("reply has been sent, close client, cli: %s:%d",
+                    cli->host, cli->port);
+            return OCTOPUS_EOF;
+        }
+        cli->active_ms = client_now_ms(cli);
+    }
+
+    client_timer_update(cli);
+
+    return OCTOPUS_OK;
+}
+
+/**
+ * The output is waiting for the socket to become writable, and it's written by
+ * output_response then.
+ */
+static inline int output_blocked(client_t *cli) {
+    if (cli->edge_triggered) {
+        return !cli->writable;
+    }
+
+    return (aeGetFileEvents(cli->event_loop, cli->fd) & AE_WRITABLE) != 0;
+}
+
+/**
+ * Make the pending output be written before the event loop sleeps, so the
+ * responses encoded in an iteration are sent together, and the socket is only
+ * watched for writability if it's full.
+ */
+static void output_schedule(client_t *cli) {
+    if (!buffer_has_pending(cli->outbuf) || ilist_linked(&clients_to_write, &cli->write_node) ||
+            output_blocked(cli)) {
+        return;
+    }
+
+    // the write timeout counts from the output becoming pending
+    cli->write_ms = client_now_ms(cli);
+
+    ilist_push(&clients_to_write, &cli->write_node);
+}
+
+void octopus_client_eviction_stats(client_eviction_stats_t *stats) {
+    stats->shrinks = __sync_fetch_and_add(&memory_shrinks, 0);
+    stats->evictions = __sync_fetch_and_add(&memory_evictions, 0);
+}
+
+/**
+ * Whether the largest client of the thread is the largest of all the threads,
+ * which have published in time. Ties go to the thread of the lower slot.
+ */
+static int evict_slot_largest(long long now_ms) {
+    long long   size, published_ms;
+    int         i, count;
+
+    count = __sync_fetch_and_add(&evict_slot_count, 0);
+    if (count > CLIENT_EVICT_THREADS) {
+        count = CLIENT_EVICT_THREADS;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (i == evict_slot) {
+            continue;
+        }
+
+        size = __sync_fetch_and_add(&evict_slots[i].size, 0);
+        published_ms = __sync_fetch_and_add(&evict_slots[i].published_ms, 0);
+        if (now_ms - published_ms > CLIENT_EVICT_STALE_MS) {
+            continue;
+        }
+        if (size > evict_slots[evict_slot].size ||
+                (size == evict_slots[evict_slot].size && i < evict_slot)) {
+            return OCTOPUS_FALSE;
+        }
+    }
+
+    return OCTOPUS_TRUE;
+}
+
+/**
+ * Release memory of the clients of the thread, which is over the limit. Idle
+ * output buffers are shrunk first, and then the largest client of all the
+ * threads is disconnected by its thread. No client is disconnected while
+ * closed ones still hold memory for their pending requests, since the memory
+ * isn't reflected yet.
+ */
+static void clients_evict(struct aeEventLoop *event_loop) {
+    client_t        *cli, *largest;
+    ilist_node_t    *node, *nxt;
+    long long       now_ms;
+
+    now_ms = aeGetMonotonicUs(event_loop) / 1000;
+    if (now_ms - evict_scan_ms < CLIENT_EVICT_SCAN_MS) {
+        return;
+    }
+    evict_scan_ms = now_ms;
+
+    if (evict_slot == -1) {
+        evict_slot = __sync_fetch_and_add(&evict_slot_count, 1);
+    }
+
+    largest = NULL;
+    ilist_foreach(&thread_clients, node, nxt) {
+        cli = ilist_entry(node, client_t, thread_node);
+        if (!buffer_has_pending(cli->outbuf) &&
+                buffer_shrink(cli->outbuf, CLIENT_IDLE_OUTPUT_BUF_LEN) == OCTOPUS_OK) {
+            __sync_fetch_and_add(&memory_shrinks, 1);
+        }
+
+        if (largest == NULL || client_buffers_size(cli) > client_buffers_size(largest)) {
+            largest = cli;
+        }
+    }
+
+    // too many threads to publish, the thread evicts by its own clients
+    if (evict_slot < CLIENT_EVICT_THREADS) {
+        __sync_lock_test_and_set(&evict_slots[evict_slot].size,
+                largest != NULL ? client_buffers_size(largest) : 0);
+        __sync_lock_test_and_set(&evict_slots[evict_slot].published_ms, now_ms);
+    }
+
+    if (largest == NULL || !octopus_memory_over_limit() ||
+            __sync_fetch_and_add(&clients_closing, 0) > 0 ||
+            (evict_slot < CLIENT_EVICT_THREADS && !evict_slot_largest(now_ms))) {
+        return;
+    }
+
+    OCTOPUS_WARNING_LOG("memory is over the limit, close the client with buffers of %lld "
+            "bytes, cli: %s:%d", client_buffers_size(largest), largest->host, largest->port);
+    __sync_fetch_and_add(&memory_evictions, 1);
+    // the thread isn't the largest anymore until it scans again
+    if (evict_slot < CLIENT_EVICT_THREADS) {
+        __sync_lock_test_and_set(&evict_slots[evict_slot].size, 0);
+    }
+    client_close(largest);
+}
+
+void client_before_sleep(struct aeEventLoop *event_loop) {
+    client_t    *cli;
+
+    while (!ilist_empty(&clients_to_write)) {
+        cli = ilist_entry(ilist_head(&clients_to_write), client_t, write_node);
+        output_unschedule(cli);
+
+        if (output_flush(cli) != OCTOPUS_OK) {
+            client_close(cli);
+            continue;
+        }
+
+        // the rest is written once the socket drains, edges come by themselves
+        if (buffer_has_pending(cli->outbuf) && !cli->edge_triggered &&
+                aeCreateFileEvent(cli->event_loop, cli->fd, AE_WRITABLE, output_response, cli)
+                == AE_ERR) {
+            OCTOPUS_ERROR_LOG("failed to add write event to event loop");
+        }
+    }
+
+    if (octopus_memory_over_limit()) {
+        clients_evict(event_loop);
+    }
+
+    // no edge will come for the clients left to read, so don't block for them
+    aeSetDontWait(event_loop, !ilist_empty(&clients_to_read));
+}
+
+void client_after_sleep(struct aeEventLoop *event_loop) {
+    ilist_node_t    *node;
+    client_t        *cli;
+
+    if (ilist_empty(&clients_to_read)) {
+        return;
+    }
+
+    // Clients which spend the budget again are pushed after the end, so they
+    // are left to the next iteration. They go before the events, each once per
+    // iteration.
+    ilist_push(&clients_to_read, &clients_to_read_end);
+    while ((node = ilist_pop(&clients_to_read)) != &clients_to_read_end) {
+        cli = ilist_entry(node, client_t, read_node);
+        process_input_bytestream(event_loop, cli->fd, cli, AE_READABLE);
+    }
+}
+
+/**
+ * Write a cached response, small ones are copied, and others are attached.
+ */
+static int bytes_encode(bufref_t *ref, buffer_t *output) {
+    if (ref->len <= REPLY_BYTES_COPY_MAX && buffer_reserve(output, ref->len) == OCTOPUS_OK) {
+        return buffer_write_from(output, (void *)ref->data, ref->len);
+    }
+
+    return buffer_attach_ref(output, ref);
+}
+
+/**
+ * Return the cache fill of request 'seq' if it's missed, fills of requests
+ * before it are dropped since they have no response.
+ */
+static cache_fill_t* cache_fill_of(client_t *cli, long long seq) {
+    cache_fill_t    *fill;
+
+    while (!ilist_empty(&cli->cache_fills)) {
+        fill = ilist_entry(ilist_head(&cli->cache_fills), cache_fill_t, node);
+        if (fill->seq >= seq) {
+            return fill->seq == seq ? fill : NULL;
+        }
+        ilist_pop(&cli->cache_fills);
+        cache_fill_destroy(fill);
+    }
+
+    return NULL;
+}
+
+/**
+ * Encode a response of request 'seq', and the reference of it is released. The
+ * encoded bytes are added to the cache if the request is a cache miss.
+ * @return OCTOPUS_EOF if the connection will be closed after the response.
+ */
+static int reply_encode(client_t *cli, long long seq, object_t *result) {
+    protocol_t      *protocol;
+    cache_fill_t    *fill;
+    long long       produced;
+    int             ret, refs;
+    sds             value;
+
+    fill = cache_fill_of(cli, seq);
+
+    if (result == CLIENT_SLOT_NO_REPLY) {
+        return OCTOPUS_OK;
+    }
+
+    // responses after the last one are dropped
+    if (cli->close_after_reply) {
+        result->decr(result);
+        return OCTOPUS_EOF;
+    }
+
+    if (result->type == OBJECT_TYPE_BYTES) {
+        if ((ret = bytes_encode(result->obj.ref, cli->outbuf)) == OCTOPUS_ERR) {
+            OCTOPUS_ERROR_LOG("failed to write cached response, endpoint: %s:%d",
+                    cli->host, cli->port);
+        }
+        result->decr(result);
+        return ret;
+    }
+
+    produced = cli->outbuf->produced;
+    refs = buffer_ref_count(cli->outbuf);
+    protocol = cli->protocol_obj->obj.protocol;
+    if ((ret = protocol->encode(protocol, result, cli->outbuf)) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("failed to encode command, endpoint: %s:%d", cli->host, cli->port);
+    } else {
+        cli->reply_len_avg = (cli->reply_len_avg * 7 + cli->outbuf->produced - produced) / 8;
+    }
+    result->decr(result);
+
+    if (fill != NULL && ret == OCTOPUS_OK) {
+        if ((value = sdsempty()) != NULL &&
+                buffer_copy_produced(cli->outbuf, produced, refs, &value) == OCTOPUS_OK) {
+            cache_fill(fill, value);
+        } else if (value != NULL) {
+            sdsfree(value);
+        }
+        ilist_remove(&cli->cache_fills, &fill->node);
+        cache_fill_destroy(fill);
+    }
+
+    if (ret == OCTOPUS_EOF) {
+        // the rest commands are dropped, and the client is closed once the
+        // response has been sent
+        OCTOPUS_TRACE_LOG("close client after reply, cli: %s:%d", cli->host, cli->port);
+        cli->close_after_reply = OCTOPUS_TRUE;
+        aeDeleteFileEvent(cli->event_loop, cli->fd, AE_READABLE);
+    }
+
+    return ret;
+}
+
+/**
+ * Encode responses in the front of slots which have completed. They are held in
+ * the slots while the output is above the high watermark, and encoded by
+ * output_flush as it drains.
+ * @return OCTOPUS_ERR if a response fails to be encoded, and the client should
+ *      be closed, since the responses after it would be out of order.
+ */
+static int slots_flush(client_t *cli) {
+    object_t    **slot, *result;
+
+    while (cli->sent_seq < cli->next_seq) {
+        slot = &cli->slots[cli->sent_seq & (CLIENT_MAX_INFLIGHT - 1)];
+        if (*slot == NULL || output_full(cli, 0)) {
+            break;
+        }
+
+        result = *slot;
+        *slot = NULL;
+        if (reply_encode(cli, cli->sent_seq++, result) == OCTOPUS_ERR) {
+            return OCTOPUS_ERR;
+        }
+    }
+
+    return OCTOPUS_OK;
+}
+
+/**
+ * Add the result of next request. It's encoded directly if there is no response
+ * in front of it and the output is below the high watermark, otherwise it waits
+ * in the slot. The reference of the result is
+ * taken, and it's released if it fails.
+ */
+static int reply_add(client_t *cli, object_t *result) {
+    long long   seq;
+
+    if (result == NULL) {
+        result = CLIENT_SLOT_NO_REPLY;
+    }
+
+    if (result != OCTOPUS_PENDING && cli->sent_seq == cli->next_seq && !output_full(cli, 0)) {
+        cli->next_seq++;
+        cli->sent_seq++;
+        return reply_encode(cli, cli->sent_seq - 1, result);
+    }
+
+    if (cli->slots == NULL &&
+            (cli->slots = octopus_calloc(CLIENT_MAX_INFLIGHT, sizeof(object_t *),
+                OCTOPUS_MEM_CLIENT)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for reorder slots, cli: %s:%d",
+                cli->host, cli->port);
+        // the client is kept until the request completes, and it's closed then
+        if (result == OCTOPUS_PENDING) {
+            cli->pending++;
+        } else if (result != CLIENT_SLOT_NO_REPLY) {
+            result->decr(result);
+        }
+        return OCTOPUS_ERR;
+    }
+
+    seq = cli->next_seq++;
+    if (result == OCTOPUS_PENDING) {
+        cli->pending++;
+        result = NULL;
+    }
+    cli->slots[seq & (CLIENT_MAX_INFLIGHT - 1)] = result;
+
+    return OCTOPUS_OK;
+}
+
+/**
+ * A command running on a coroutine.
+ */
+typedef struct {
+    client_t    *cli;
+    long long   token;
+    processor_t *processor;
+    object_t    *cmd_obj;
+    object_t    *result;
+    // the coroutine has yielded, and the request is pending
+    int         suspended;
+} co_task_t;
+
+static void co_task_run(void *arg) {
+    co_task_t   *task;
+    client_t    *cli;
+
+    task = (co_task_t *)arg;
+    task->result = task->processor->process(task->processor, task->cmd_obj);
+    if (!task->suspended) {
+        // finished without yielding, the result is taken by commands_process
+        return;
+    }
+
+    cli = task->cli;
+    cli->coroutines--;
+    // a processor returning OCTOPUS_PENDING completes the request by itself
+    if (task->result != OCTOPUS_PENDING) {
+        octopus_complete(cli, task->token, task->result);
+    }
+
+    task->cmd_obj->decr(task->cmd_obj);
+    octopus_free(task);
+}
+
+/**
+ * Run the command on a coroutine. If it yields, the request is pending, and it's
+ * completed when the coroutine finishes.
+ */
+static object_t* command_run_coroutine(client_t *cli, processor_t *processor,
+        object_t *cmd_obj) {
+
+    co_task_t   *task;
+    coroutine_t *co;
+    object_t    *result;
+    int         ret;
+
+    if ((task = octopus_calloc(1, sizeof(co_task_t), OCTOPUS_MEM_COMMAND)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for coroutine task");
+        return NULL;
+    }
+    task->cli = cli;
+    task->token = cli->next_seq;
+    task->processor = processor;
+    task->cmd_obj = cmd_obj;
+
+    if ((co = coroutine_create(cli->event_loop, co_task_run, task)) == NULL) {
+        octopus_free(task);
+        return NULL;
+    }
+
+    cmd_obj->incr(cmd_obj);
+    if ((ret = coroutine_resume(co)) == OCTOPUS_AGAIN) {
+        task->suspended = OCTOPUS_TRUE;
+        cli->coroutines++;
+        return OCTOPUS_PENDING;
+    }
+
+    result = ret == OCTOPUS_OK ? task->result : NULL;
+    cmd_obj->decr(cmd_obj);
+    octopus_free(task);
+
+    return result;
+}
+
+/**
+ * Look up the response of the command in the cache. If it's missed, a fill is
+ * recorded, and the response is added to the cache once it's encoded.
+ */
+static object_t* cache_check(client_t *cli, protocol_t *protocol, processor_t *processor,
+        object_t *cmd_obj) {
+
+    cache_fill_t    *fill;
+    object_t        *hit;
+    long long       ttl_ms;
+    sds             key, tag;
+
+    hit = NULL;
+    tag = NULL;
+    if ((ttl_ms = processor->cache_ttl(processor, cmd_obj, &tag)) <= 0 ||
+            (key = protocol->cmd_key(protocol, cmd_obj)) == NULL) {
+        goto done;
+    }
+
+    if ((hit = cache_lookup(cli->mailbox, processor, key)) != NULL) {
+        sdsfree(key);
+        goto done;
+    }
+
+    // the key and tag are owned by the fill
+    if ((fill = cache_fill_create(cli->next_seq, processor, key, tag, ttl_ms)) != NULL) {
+        ilist_push(&cli->cache_fills, &fill->node);
+    }
+
+    return NULL;
+
+done:
+    if (tag != NULL) {
+        sdsfree(tag);
+    }
+
+    return hit;
+}
+
+/**
+ * Process a command. The response is taken from the cache if it's enabled and
+ * hit. Identical commands in flight are coalesced if it's enabled, the command
+ * joins the pending one instead of being processed, or it becomes the one
+ * others can join if it's pending.
+ */
+static object_t* command_run(client_t *cli, processor_t *processor, object_t *cmd_obj) {
     protocol_t  *protocol;
+    object_t    *result;
+    int         coalesce;
+    sds         tag;
+
+    protocol = cli->protocol_obj->obj.protocol;
+    if (cli->srv_ctx->processor_cache && processor->cache_ttl != NULL &&
+            protocol->cmd_key != NULL &&
+            (result = cache_check(cli, protocol, processor, cmd_obj)) != NULL) {
+        return result;
+    }
+
+    tag = NULL;
+    coalesce = cli->srv_ctx->processor_coalesce &&
+        (processor->coalescable == NULL || processor->coalescable(processor, cmd_obj, &tag));
+    if (coalesce &&
+            coalesce_join(protocol, processor, cmd_obj, cli, cli->next_seq) == OCTOPUS_OK) {
+        if (tag != NULL) {
+            sdsfree(tag);
+        }
+        return OCTOPUS_PENDING;
+    }
+
+    if (cli->srv_ctx->processor_coroutine) {
+        result = command_run_coroutine(cli, processor, cmd_obj);
+    } else {
+        result = processor->process(processor, cmd_obj);
+    }
+
+    // it's processed without coalescing if failed
+    if (coalesce && result == OCTOPUS_PENDING) {
+        coalesce_lead(protocol, processor, cmd_obj, tag, cli, cli->next_seq);
+    } else if (tag != NULL) {
+        sdsfree(tag);
+    }
+
+    return result;
+}
+
+static void read_pause(client_t *cli) {
+    if (cli->read_paused) {
+        return;
+    }
+
+    // events are just ignored in edge-triggered mode
+    if (!cli->edge_triggered) {
+        aeDeleteFileEvent(cli->event_loop, cli->fd, AE_READABLE);
+    }
+    cli->read_paused = OCTOPUS_TRUE;
+}
+
+/**
+ * Process the decoded commands. If the slots are full, the rest commands are
+ * left in the deque, and reading is paused until responses in front complete,
+ * since the commands may point into the input buffer. It's paused while commands
+ * are suspended on coroutines too. Commands beyond the budget of the turn are
+ * left to the next iteration.
+ */
+static int commands_process(client_t *cli) {
+    object_t    *result_cmd_obj, *input_cmd_obj;
     processor_t *processor;
 
+    processor = cli->processor_obj->obj.processor;
+
+    while (!deque_empty(cli->input_cmd_objs)) {
+        if (cli->close_after_reply) {
+            return OCTOPUS_OK;
+        }
+
+        if (cli->commands_budget == 0) {
+            // the socket may have been drained, so it's queued in any mode
+            read_defer(cli);
+            return OCTOPUS_OK;
+        }
+
+        // the peer doesn't read fast enough, output_flush resumes it
+        if (output_full(cli, cli->next_seq - cli->sent_seq)) {
+            OCTOPUS_DEBUG_LOG("output reaches the high watermark, pause reading, cli: %s:%d",
+                    cli->host, cli->port);
+            cli->output_paused = OCTOPUS_TRUE;
+            read_pause(cli);
+            return OCTOPUS_OK;
+        }
+
+        if (cli->next_seq - cli->sent_seq == CLIENT_MAX_INFLIGHT) {
+            OCTOPUS_DEBUG_LOG("too many inflight requests, pause reading, cli: %s:%d",
+                    cli->host, cli->port);
+            read_pause(cli);
+            return OCTOPUS_OK;
+        }
+
+        // the reference held by the deque is taken over
+        input_cmd_obj = (object_t *)deque_pop_front(cli->input_cmd_objs);
+        if (cli->commands_budget > 0) {
+            cli->commands_budget--;
+        }
+
+        current_client = cli;
+        current_token = cli->next_seq;
+        result_cmd_obj = command_run(cli, processor, input_cmd_obj);
+        current_client = NULL;
+
+        if (result_cmd_obj == NULL) {
+            OCTOPUS_ERROR_LOG("a null command for response, cli: %s:%d", cli->host, cli->port);
+        }
+
+        input_cmd_obj->decr(input_cmd_obj);
+
+        // 4. encode response, or wait for the responses in front of it, the
+        // result is released by reply_add even if it fails
+        if (reply_add(cli, result_cmd_obj) == OCTOPUS_ERR) {
+            return OCTOPUS_ERR;
+        }
+    }
+
+    if (cli->coroutines > 0) {
+        read_pause(cli);
+    } else if (cli->read_paused && !cli->close_after_reply && !cli->output_paused) {
+        OCTOPUS_DEBUG_LOG("resume reading, cli: %s:%d", cli->host, cli->port);
+        if (!cli->edge_triggered && aeCreateFileEvent(cli->event_loop, cli->fd, AE_READABLE,
+                    process_input_bytestream, cli) == AE_ERR) {
+            OCTOPUS_ERROR_LOG("failed to resume reading, cli: %s:%d", cli->host, cli->port);
+            return OCTOPUS_ERR;
+        }
+        cli->read_paused = OCTOPUS_FALSE;
+    }
+
+    return OCTOPUS_OK;
+}
+
+void process_input_bytestream(struct aeEventLoop *event_loop, int fd, void *cli_data, int mask) {
+    client_t    *cli;
+    srv_ctx_t   *ctx;
+    int         data_read, read_size, decoded, bytes_read;
+    protocol_t  *protocol;
+
+    OCTOPUS_NOT_USED(event_loop);
+    OCTOPUS_NOT_USED(mask);
+
     cli = (client_t *)cli_data;
+    ctx = cli->srv_ctx;
+    bytes_read = 0;
 
     assert(cli != NULL);
     assert(cli->processor_obj != NULL);
     assert(cli->protocol_obj != NULL);
 
     protocol = cli->protocol_obj->obj.protocol;
-    processor = cli->processor_obj->obj.processor;
+    cli->commands_budget = ctx->read_budget_commands > 0 ? ctx->read_budget_commands : -1;
+
+    // Commands left by the budget of the last turn go first, and reading is
+    // resumed there if it can be.
+    if (!deque_empty(cli->input_cmd_objs) || cli->read_paused) {
+        if (commands_process(cli) == OCTOPUS_ERR) {
+            client_close(cli);
+            return;
+        }
+        output_schedule(cli);
+        client_timer_update(cli);
+    }
+
+    // Edge-triggered events come while reading is paused. More input isn't read
+    // before the commands left run.
+    if (cli->read_paused || cli->close_after_reply || !deque_empty(cli->input_cmd_objs)) {
+        return;
+    }
 
     do {
-        read_size = buffer_space_remaining(cli->inbuf) > READ_SOCK_UNIT_BYTES ?
-                READ_SOCK_UNIT_BYTES : buffer_space_remaining(cli->inbuf);
+        // All the free space is offered to the read, which takes whatever has
+        // arrived, so decoding runs once per batch instead of once per unit.
+        read_size = buffer_space_remaining(cli->inbuf);
 
         if (read_size == 0) {
-            OCTOPUS_DEBUG_LOG("client buffer is full, cli: %s:%d", cli->host, cli->port);
+            // commands have been processed, so it's a request which can't fit
+            OCTOPUS_ERROR_LOG("request exceeds the input buffer, client will be closed, cli: %s:%d",
+                    cli->host, cli->port);
+            client_close(cli);
             return;
         }
 
+        // a read never goes beyond the budget
+        if (ctx->read_budget_bytes > 0 && read_size > ctx->read_budget_bytes - bytes_read) {
+            read_size = ctx->read_budget_bytes - bytes_read;
+        }
+
         // 1. read data from socket to buffer
-        if ((data_read = buffer_write_from_fd(cli->inbuf, fd, read_size)) == OCTOPUS_ERR) {
+        if ((data_read = buffer_write_from_event_loop(cli->inbuf, cli->event_loop, fd,
+                        read_size)) == OCTOPUS_ERR) {
+            // the error is reported again by each read, or never again by the
+            // edge-triggered and io_uring events
             OCTOPUS_ERROR_LOG("failed to read data from socket, endpoint: %s:%d", cli->host, cli->port);
+            client_close(cli);
             return;
         } else if (data_read == OCTOPUS_EOF) {
             // client has closed
             OCTOPUS_TRACE_LOG("client has closed, cli: %s:%d", cli->host, cli->port);
-            client_destroy(cli);
-            OCTOPUS_TRACE_LOG("rm file event, fd: %d", fd);
-            aeDeleteFileEvent(event_loop, fd, mask);
+            client_close(cli);
             return;
         } else if (data_read == 0) {
             // EAGAIN, no data to read
@@ -276,87 +1364,182 @@ void process_input_bytestream(struct aeEventLoop *event_loop, int fd, void *cli_
         }
 
         // data_read > 0 means there is data need to read
+        bytes_read += data_read;
+        cli->active_ms = client_now_ms(cli);
+        if (cli->read_start_ms < 0) {
+            cli->read_start_ms = cli->active_ms;
+        }
 
         // 2. call protocol decoder to decode the buffer, and generate commands
+        decoded = deque_size(cli->input_cmd_objs);
         if (protocol->decode(protocol, cli->inbuf, cli->input_cmd_objs) == OCTOPUS_ERR) {
             OCTOPUS_ERROR_LOG("failed to decode, client will be closed, endpoint: %s:%d",
                     cli->host, cli->port);
-            client_destroy(cli);
+            client_close(cli);
             return;
         }
 
+        // bytes left are a partial request, which starts after the last one decoded
+        if (buffer_content_len(cli->inbuf) == 0) {
+            cli->read_start_ms = -1;
+        } else if (deque_size(cli->input_cmd_objs) > decoded) {
+            cli->read_start_ms = cli->active_ms;
+        }
+
         // 3. process commands
-        OCTOPUS_DEBUG_LOG("decode %d commands", list_size(cli->input_cmd_objs));
-
-        cmd_obj_iter = cli->input_cmd_objs_iter;
-        for (list_iter_init(cli->input_cmd_objs, cmd_obj_iter); cmd_obj_iter->has_next(cmd_obj_iter);) {
-            input_cmd_obj = cmd_obj_iter->next(cmd_obj_iter);
-            // increase refcnt for iterator
-            input_cmd_obj->incr(input_cmd_obj);
-            result_cmd_obj = processor->process(processor, input_cmd_obj);
-            if (result_cmd_obj == NULL) {
-                OCTOPUS_ERROR_LOG("a null command for response, cli: %s:%d", cli->host, cli->port);
-                continue;
-            }
+        OCTOPUS_DEBUG_LOG("decode %d commands", deque_size(cli->input_cmd_objs));
+        if (commands_process(cli) == OCTOPUS_ERR) {
+            client_close(cli);
+            return;
+        }
 
-            // 4. encode response
-            if (protocol->encode(protocol, result_cmd_obj, cli->outbuf) == OCTOPUS_ERR) {
-                OCTOPUS_ERROR_LOG("failed to encode command, endpoint: %s:%d", cli->host, cli->port);
-                continue;
-            }
+        // 5. the output is written before the event loop sleeps
+        output_schedule(cli);
+        client_timer_update(cli);
 
-            result_cmd_obj->decr(result_cmd_obj);
+        if (cli->close_after_reply || cli->read_paused ||
+                !deque_empty(cli->input_cmd_objs)) {
+            return;
+        }
 
-            // remote the output command that has been processed
-            cmd_obj_iter->remove(cmd_obj_iter);
-            // decrease refcnt for iterator
-            input_cmd_obj->decr(input_cmd_obj);
+        // A short read has drained the socket, so the read only returning
+        // EAGAIN is saved. More data raises the event again, edge as well.
+        if (data_read < read_size) {
+            break;
         }
 
-        // 5. add write event to event loop
-        if (buffer_content_len(cli->outbuf) > 0) {
-            if (aeCreateFileEvent(event_loop, fd, AE_WRITABLE, output_response, cli) == AE_ERR) {
-                OCTOPUS_ERROR_LOG("failed to add write event to event loop");
-                return;
+        // The rest is left to the next iteration, so other clients of the thread
+        // aren't starved. Level-triggered events just fire again.
+        if (ctx->read_budget_bytes > 0 && bytes_read >= ctx->read_budget_bytes) {
+            if (cli->edge_triggered) {
+                read_defer(cli);
             }
+            return;
         }
     } while (1);
 }
 
 void output_response(struct aeEventLoop *event_loop, int fd, void *cli_data, int mask) {
     client_t    *cli;
-    int         write_size, data_written;
 
+    OCTOPUS_NOT_USED(event_loop);
+    OCTOPUS_NOT_USED(fd);
     OCTOPUS_NOT_USED(mask);
 
     cli = (client_t *)cli_data;
-    while (buffer_content_len(cli->outbuf) > 0) {
-        write_size = WRITE_SOCK_UNIT_BYTES;
-        if (buffer_content_len(cli->outbuf) < WRITE_SOCK_UNIT_BYTES) {
-            write_size = buffer_content_len(cli->outbuf);
-        }
+    cli->writable = OCTOPUS_TRUE;
 
-        if ((data_written = buffer_read_to_fd(cli->outbuf, fd, write_size)) == OCTOPUS_ERR) {
-            OCTOPUS_ERROR_LOG("failed to read buffer to socket, endpoint: %s:%d",
-                    cli->host, cli->port);
-            return;
-        } else if (data_written < write_size) {
-            // send buffer is full, need to wait
-            break;
-        } else if (data_written == OCTOPUS_RESET) {
-            OCTOPUS_ERROR_LOG("connection has been reset, close client, client: %s:%d",
-                    cli->host, cli->port);
-            aeDeleteFileEvent(event_loop, fd, AE_WRITABLE | AE_READABLE);
+    // edges are reported without output pending, e.g. along with reads
+    if (cli->edge_triggered && !buffer_has_pending(cli->outbuf)) {
+        return;
+    }
+
+    if (output_flush(cli) != OCTOPUS_OK) {
+        client_close(cli);
+    }
+}
+
+/**
+ * Put the response of a pending request into its slot.
+ */
+static void completion_deliver(client_t *cli, long long token, object_t *result) {
+    int     resumed;
+
+    cli->pending--;
+
+    if (cli->closing) {
+        if (result != NULL) {
+            result->decr(result);
+        }
+        if (cli->pending == 0) {
+            __sync_fetch_and_sub(&clients_closing, 1);
             client_destroy(cli);
+        }
+        return;
+    }
 
-            return;
+    cli->slots[token & (CLIENT_MAX_INFLIGHT - 1)] =
+        result != NULL ? result : CLIENT_SLOT_NO_REPLY;
+
+    if (slots_flush(cli) == OCTOPUS_ERR) {
+        client_close(cli);
+        return;
+    }
+
+    // commands left by the full slots can be processed now
+    resumed = cli->read_paused;
+    if (cli->read_paused && commands_process(cli) == OCTOPUS_ERR) {
+        client_close(cli);
+        return;
+    }
+    resumed = resumed && !cli->read_paused;
+
+    output_schedule(cli);
+
+    // the client is idle from the completion of the last request
+    if (cli->pending == 0) {
+        cli->active_ms = client_now_ms(cli);
+    }
+    client_timer_update(cli);
+
+    // Bytes which arrived while reading was paused raise no new edge, so they
+    // are read now. It's the last step, since the client may be closed.
+    if (resumed && cli->edge_triggered) {
+        process_input_bytestream(cli->event_loop, cli->fd, cli, AE_READABLE);
+    }
+}
+
+/**
+ * Run in the thread of the client, after the request has completed. Requests
+ * coalesced with it share the response, each holds a reference of it.
+ */
+static void completion_handle(void *ctx) {
+    completion_t        *c;
+    coalesce_waiter_t   *waiters, *w;
+    object_t            *result;
+
+    c = (completion_t *)ctx;
+    result = c->result;
+    waiters = coalesce_finish(c->cli, c->token);
+    for (w = waiters; w != NULL; w = w->next) {
+        if (result != NULL) {
+            result->incr(result);
         }
     }
 
-    // all output buffer has been send, need remove write event handler
-    if (buffer_content_len(cli->outbuf) == 0) {
-        aeDeleteFileEvent(event_loop, fd, AE_WRITABLE);
+    completion_deliver(c->cli, c->token, result);
+    octopus_free(c);
+
+    while ((w = waiters) != NULL) {
+        waiters = w->next;
+        completion_deliver(w->cli, w->token, result);
+        octopus_free(w);
     }
+}
 
-    return;
+client_t* octopus_current_client() {
+    return current_client;
+}
+
+long long octopus_current_token() {
+    return current_token;
+}
+
+int octopus_complete(client_t *cli, long long token, object_t *result) {
+    completion_t    *c;
+
+    ONE_PTR_NULL_CHECK(cli);
+
+    if ((c = octopus_malloc(sizeof(completion_t), OCTOPUS_MEM_COMMAND)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for completion, token: %lld", token);
+        return OCTOPUS_ERR;
+    }
+    c->msg.ctx = c;
+    c->msg.handler = completion_handle;
+    c->cli = cli;
+    c->token = token;
+    c->result = result;
+
+    // the client is only touched by its own thread
+    return mailbox_post(cli->mailbox, &c->msg);
 }
@@ -14,6 +14,66 @@
 #include <libae/ae.h>
 
 #include "common.h"
+#include "protocol.h"
+#include "processor.h"
+
+/**
+ * Context of a listening socket, passed to client_connected.
+ */
+typedef struct srv_ctx_s {
+    protocol_factory_t      protocol_factory;
+    processor_factory_t     processor_factory;
+    int                     processor_scope;
+    // run commands on coroutines
+    int                     processor_coroutine;
+    // coalesce identical commands in flight
+    int                     processor_coalesce;
+    // cache encoded responses
+    int                     processor_cache;
+    // timeouts of connections in milliseconds, 0 means no timeout
+    long long               idle_timeout_ms;
+    long long               read_timeout_ms;
+    long long               write_timeout_ms;
+    // register events of connections edge-triggered if possible
+    int                     edge_triggered;
+    // bytes and commands a connection can read in an iteration, 0 if unlimited
+    int                     read_budget_bytes;
+    int                     read_budget_commands;
+    // reading pauses once the pending output reaches the high watermark, and
+    // resumes below the low one, 0 if disabled
+    int                     output_high_watermark;
+    int                     output_low_watermark;
+    octopus_t               *oct;
+
+    // Processors shared by clients, which are created at the first connection
+    // of each scope: one for OCTOPUS_PROCESSOR_SCOPE_GLOBAL, or one for each
+    // ioworker.
+    object_t    **processors;
+    int         processor_count;
+} srv_ctx_t;
+
+void srv_ctx_destroy(void *ctx);
+
+/**
+ * @brief Create or share the processor of a client, 'thread_idx' is the index of
+ *      the ioworker owning the client. For OCTOPUS_PROCESSOR_SCOPE_IOWORKER, it
+ *      must be called in the thread of the ioworker.
+ */
+int client_init_processor(client_t *cli, int thread_idx);
+
+/**
+ * @brief Hooks of event loops serving clients. Before sleeping, the output
+ *      encoded in the iteration is written. After sleeping, clients which have
+ *      spent their read budget continue.
+ */
+void client_before_sleep(struct aeEventLoop *event_loop);
+void client_after_sleep(struct aeEventLoop *event_loop);
+
+/**
+ * @brief Register events of a client and start tracking its timeouts, which must
+ *      be called in the thread owning the client.
+ */
+int client_watch(client_t *cli);
 
 int tcp_nonblk_srv(int sockfd, struct addrinfo *addr, int backlog);
 int addr_parse(struct sockaddr *addr, char *ipbuf, int ipbuf_size, uint16_t *port);
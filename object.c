@@ -19,7 +19,7 @@ object_t* object_create(int type, void *obj) {
     object_t    *o;
 
     if (type != OBJECT_TYPE_COMMAND && type != OBJECT_TYPE_PROCESSOR &&
-            type != OBJECT_TYPE_PROTOCOL) {
+            type != OBJECT_TYPE_PROTOCOL && type != OBJECT_TYPE_BYTES) {
         OCTOPUS_ERROR_LOG("not support object type, type: %d", type);
         return NULL;
     }
@@ -41,6 +41,9 @@ object_t* object_create(int type, void *obj) {
         case OBJECT_TYPE_PROCESSOR:
             o->obj.processor = (processor_t *)obj;
             break;
+        case OBJECT_TYPE_BYTES:
+            o->obj.ref = (bufref_t *)obj;
+            break;
     }
     o->incr = object_incr;
     o->decr = object_decr;
@@ -50,17 +53,19 @@ object_t* object_create(int type, void *obj) {
 }
 
 void object_incr(object_t *obj) {
-    obj->refcnt++;
+    // objects can be passed to other threads by asynchronous processors
+    __sync_fetch_and_add(&obj->refcnt, 1);
 }
 
 void object_decr(object_t *obj) {
-    if (obj->refcnt <= 0) {
+    int     refcnt;
+
+    if ((refcnt = __sync_sub_and_fetch(&obj->refcnt, 1)) < 0) {
         OCTOPUS_ERROR_LOG("fatal error: obj->refcnt <= 0");
         return;
     }
 
-    obj->refcnt--;
-    if (obj->refcnt == 0) {
+    if (refcnt == 0) {
         switch (obj->type) {
         case OBJECT_TYPE_COMMAND:
             if (obj->obj.cmd != NULL) {
@@ -77,6 +82,11 @@ void object_decr(object_t *obj) {
                 obj->obj.processor->destroy(obj->obj.processor);
             }
             break;
+        case OBJECT_TYPE_BYTES:
+            if (obj->obj.ref != NULL) {
+                bufref_decr(obj->obj.ref);
+            }
+            break;
         }
 
         free(obj);
@@ -12,10 +12,13 @@
 #include "protocol.h"
 #include "processor.h"
 #include "command.h"
+#include "bufref.h"
 
 #define OBJECT_TYPE_COMMAND     1
 #define OBJECT_TYPE_PROCESSOR   2
 #define OBJECT_TYPE_PROTOCOL    3
+// encoded bytes of a response, which are written without encoding
+#define OBJECT_TYPE_BYTES       4
 
 #define object_inspect(obj, tag)    \
     OCTOPUS_INFO_LOG("refcnt: %d@%s", (obj)->refcnt, tag)
@@ -23,6 +26,7 @@
 #define object_create_cmd(c)        object_create(OBJECT_TYPE_COMMAND, c)
 #define object_create_protocol(p)   object_create(OBJECT_TYPE_PROTOCOL, p)
 #define object_create_processor(p)  object_create(OBJECT_TYPE_PROCESSOR, p)
+#define object_create_bytes(r)      object_create(OBJECT_TYPE_BYTES, r)
 
 /**
  * A object container used to hold object, which will automatically manage memory based on
@@ -38,6 +42,7 @@ struct object_s {
         command_t   *cmd;
         protocol_t  *protocol;
         processor_t *processor;
+        bufref_t    *ref;
     } obj;
 };
 
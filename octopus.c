@@ -22,26 +22,46 @@
 #include "common.h"
 #include "ioworker_pool.h"
 
+// pending output of a client to pause and resume reading by default
+#define DEFAULT_OUTPUT_HIGH_WATERMARK   (512 * 1024)
+#define DEFAULT_OUTPUT_LOW_WATERMARK    (128 * 1024)
+
 struct octopus_s {
     ioworker_pool_t *ioworker_pool;
 
     array_t         *listening_sockets;
     list_t          *clients;
 
-    // hash: listening socket =>
-    //      triple{protocol_decoder_factory_t, protocol_encoder_factory_t, octopus_t}
+    // hash: listening socket => srv_ctx_t
     // used to destory protocol context, to avoid memory leak.
     hash_t          *srv_contexts;
 
     aeEventLoop     *event_loop;
+    // messages to the main event loop, such as completions of requests
+    mailbox_t       *mailbox;
 
     // hash: protocol name => protocol_factory_t
     hash_t          *protocol_factories;
 
-    // hash: protocol name => processor_factory_t
+    // hash: protocol name => processor_reg_t
     hash_t          *processor_factories;
+
+    // timeouts of connections accepted by sockets added later
+    long long       idle_timeout_ms;
+    long long       read_timeout_ms;
+    long long       write_timeout_ms;
+    int             edge_triggered;
+    int             read_budget_bytes;
+    int             read_budget_commands;
+    int             output_high_watermark;
+    int             output_low_watermark;
 };
 
+typedef struct {
+    processor_factory_t     factory;
+    int                     scope;
+} processor_reg_t;
+
 void cli_dealloc(void *cli) {
     client_t    *client;
 
@@ -49,7 +69,6 @@ void cli_dealloc(void *cli) {
 
     client = (client_t *)cli;
     client_destroy(client);
-    free(cli);
 }
 
 octopus_t* octopus_create() {
@@ -61,6 +80,8 @@ octopus_t* octopus_create() {
         OCTOPUS_ERROR_LOG("failed to alloc mem for octopus");
         return NULL;
     }
+    oct->output_high_watermark = DEFAULT_OUTPUT_HIGH_WATERMARK;
+    oct->output_low_watermark = DEFAULT_OUTPUT_LOW_WATERMARK;
 
     oct->listening_sockets = array_create(10, sizeof(int), NULL);
     if (oct->listening_sockets == NULL) {
@@ -80,13 +101,31 @@ octopus_t* octopus_create() {
         goto failed;
     }
 
-    oct->srv_contexts = hash_int_key_create(free_deallocator);
+    if (octopus_register_protocol_factory(oct, OCTOPUS_PROTOCOL_LENPREFIX,
+                lenprefix_protocol_create) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("failed to register built-in protocol '%s'", OCTOPUS_PROTOCOL_LENPREFIX);
+        goto failed;
+    }
+
+    if (octopus_register_protocol_factory(oct, OCTOPUS_PROTOCOL_RESP,
+                resp_protocol_create) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("failed to register built-in protocol '%s'", OCTOPUS_PROTOCOL_RESP);
+        goto failed;
+    }
+
+    if (octopus_register_protocol_factory(oct, OCTOPUS_PROTOCOL_HTTP,
+                http_protocol_create) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("failed to register built-in protocol '%s'", OCTOPUS_PROTOCOL_HTTP);
+        goto failed;
+    }
+
+    oct->srv_contexts = hash_int_key_create(srv_ctx_destroy);
     if (oct->srv_contexts == NULL) {
         OCTOPUS_ERROR_LOG("failed to create protocol context hash");
         goto failed;
     }
 
-    oct->processor_factories = hash_str_key_create(NULL, NULL);
+    oct->processor_factories = hash_str_key_create(NULL, free_deallocator);
     if (oct->processor_factories == NULL) {
         OCTOPUS_ERROR_LOG("failed to create command processor factory hash");
         goto failed;
@@ -98,6 +137,13 @@ octopus_t* octopus_create() {
         OCTOPUS_ERROR_LOG("failed to create event loop");
         goto failed;
     }
+    aeSetBeforeSleepProc(oct->event_loop, client_before_sleep);
+    aeSetAfterSleepProc(oct->event_loop, client_after_sleep);
+
+    if ((oct->mailbox = mailbox_create(oct->event_loop)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create mailbox of event loop");
+        goto failed;
+    }
 
     return oct;
 
@@ -116,6 +162,10 @@ ioworker_pool_t* octopus_ioworker_pool(octopus_t *oct) {
     return oct->ioworker_pool;
 }
 
+mailbox_t* octopus_mailbox(octopus_t *oct) {
+    return oct->mailbox;
+}
+
 int octopus_register_protocol_factory(
         octopus_t *oct,
         const char *protocol_name,
@@ -141,16 +191,45 @@ int octopus_register_processor_factory(
         const char *protocol_name,
         processor_factory_t processor_factory) {
 
+    return octopus_register_processor_factory_with_scope(oct, protocol_name,
+            processor_factory, OCTOPUS_PROCESSOR_SCOPE_CONNECTION);
+}
+
+int octopus_register_processor_factory_with_scope(
+        octopus_t *oct,
+        const char *protocol_name,
+        processor_factory_t processor_factory,
+        int scope) {
+
+    processor_reg_t     *reg;
+
     THREE_PTRS_NULL_CHECK(oct, protocol_name, processor_factory);
 
+    if ((scope & ~(OCTOPUS_PROCESSOR_SCOPE_MASK | OCTOPUS_PROCESSOR_COROUTINE |
+                    OCTOPUS_PROCESSOR_COALESCE | OCTOPUS_PROCESSOR_CACHE)) != 0 ||
+            ((scope & OCTOPUS_PROCESSOR_SCOPE_MASK) != OCTOPUS_PROCESSOR_SCOPE_CONNECTION &&
+             (scope & OCTOPUS_PROCESSOR_SCOPE_MASK) != OCTOPUS_PROCESSOR_SCOPE_IOWORKER &&
+             (scope & OCTOPUS_PROCESSOR_SCOPE_MASK) != OCTOPUS_PROCESSOR_SCOPE_GLOBAL)) {
+        OCTOPUS_ERROR_LOG("invalid scope of processor: %d", scope);
+        return OCTOPUS_ERR;
+    }
+
     if (hash_exists(oct->processor_factories, protocol_name)) {
         OCTOPUS_ERROR_LOG("command processor factory named '%s' already exist", protocol_name);
         return OCTOPUS_ERR;
     }
 
-    if (hash_put(oct->processor_factories, protocol_name, processor_factory) == OCTOPUS_ERR) {
+    if ((reg = malloc(sizeof(processor_reg_t))) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for processor factory");
+        return OCTOPUS_ERR;
+    }
+    reg->factory = processor_factory;
+    reg->scope = scope;
+
+    if (hash_put(oct->processor_factories, protocol_name, reg) == OCTOPUS_ERR) {
         OCTOPUS_ERROR_LOG("failed to register command processor factory, protocol name: %s",
                 protocol_name);
+        free(reg);
         return OCTOPUS_ERR;
     }
 
@@ -165,14 +244,15 @@ void octopus_add_listening_socket(
 
     struct addrinfo     hint, *res, *res0;
     int                 errno, s, added, ret;
-    void                *protocol_factory, *processor_factory;
-    triple_t            *srv_ctx;
+    void                *protocol_factory;
+    processor_reg_t     *processor_reg;
+    srv_ctx_t           *srv_ctx;
 
     if ((protocol_factory = hash_get(oct->protocol_factories, protocol_name)) == NULL) {
         OCTOPUS_ERROR_LOG("no protocol factory for protocol named '%s'", protocol_name);
         return;
     }
-    if ((processor_factory = hash_get(oct->processor_factories, protocol_name)) == NULL) {
+    if ((processor_reg = hash_get(oct->processor_factories, protocol_name)) == NULL) {
         OCTOPUS_ERROR_LOG("no command processor factory for protocol named '%s'", protocol_name);
         return;
     }
@@ -201,13 +281,25 @@ void octopus_add_listening_socket(
             continue;
         }
 
-        if ((srv_ctx = (triple_t *)malloc(sizeof(triple_t))) == NULL) {
+        if ((srv_ctx = (srv_ctx_t *)calloc(1, sizeof(srv_ctx_t))) == NULL) {
             OCTOPUS_ERROR_LOG("failed to alloc mem for protocol context");
             return;
         }
-        srv_ctx->first = protocol_factory;
-        srv_ctx->second = processor_factory;
-        srv_ctx->third = oct;
+        srv_ctx->protocol_factory = (protocol_factory_t)protocol_factory;
+        srv_ctx->processor_factory = processor_reg->factory;
+        srv_ctx->processor_scope = processor_reg->scope & OCTOPUS_PROCESSOR_SCOPE_MASK;
+        srv_ctx->processor_coroutine = (processor_reg->scope & OCTOPUS_PROCESSOR_COROUTINE) != 0;
+        srv_ctx->processor_coalesce = (processor_reg->scope & OCTOPUS_PROCESSOR_COALESCE) != 0;
+        srv_ctx->processor_cache = (processor_reg->scope & OCTOPUS_PROCESSOR_CACHE) != 0;
+        srv_ctx->idle_timeout_ms = oct->idle_timeout_ms;
+        srv_ctx->read_timeout_ms = oct->read_timeout_ms;
+        srv_ctx->write_timeout_ms = oct->write_timeout_ms;
+        srv_ctx->edge_triggered = oct->edge_triggered;
+        srv_ctx->read_budget_bytes = oct->read_budget_bytes;
+        srv_ctx->read_budget_commands = oct->read_budget_commands;
+        srv_ctx->output_high_watermark = oct->output_high_watermark;
+        srv_ctx->output_low_watermark = oct->output_low_watermark;
+        srv_ctx->oct = oct;
 
         ret = OCTOPUS_OK;
         do {
@@ -234,7 +326,7 @@ void octopus_add_listening_socket(
         } while (0);
 
         if (ret == OCTOPUS_ERR) {
-            free(srv_ctx);
+            srv_ctx_destroy(srv_ctx);
             continue;
         }
 
@@ -244,6 +336,28 @@ void octopus_add_listening_socket(
     OCTOPUS_INFO_LOG("%d sockets added for %s:%s", added, host, port);
 }
 
+void octopus_set_client_timeouts(octopus_t *oct, long long idle_ms, long long read_ms,
+        long long write_ms) {
+
+    oct->idle_timeout_ms = idle_ms > 0 ? idle_ms : 0;
+    oct->read_timeout_ms = read_ms > 0 ? read_ms : 0;
+    oct->write_timeout_ms = write_ms > 0 ? write_ms : 0;
+}
+
+void octopus_set_edge_triggered(octopus_t *oct, int enabled) {
+    oct->edge_triggered = enabled ? OCTOPUS_TRUE : OCTOPUS_FALSE;
+}
+
+void octopus_set_read_budget(octopus_t *oct, int bytes, int commands) {
+    oct->read_budget_bytes = bytes > 0 ? bytes : 0;
+    oct->read_budget_commands = commands > 0 ? commands : 0;
+}
+
+void octopus_set_output_watermarks(octopus_t *oct, int high, int low) {
+    oct->output_high_watermark = high > 0 ? high : 0;
+    oct->output_low_watermark = low < 0 ? 0 : (low > high ? high : low);
+}
+
 int octopus_srv_start(octopus_t *oct) {
     if (hash_empty(oct->processor_factories)) {
         OCTOPUS_ERROR_LOG("protocol decoder and encoder must be both set");
@@ -256,7 +370,7 @@ int octopus_srv_start(octopus_t *oct) {
         return OCTOPUS_ERR;
     }
 
-    OCTOPUS_INFO_LOG("octopus starts to run...");
+    OCTOPUS_INFO_LOG("octopus starts to run, event loop: %s...", aeGetApiName());
     aeMain(oct->event_loop);
 
     return OCTOPUS_OK;
@@ -280,6 +394,7 @@ void octopus_destroy(octopus_t *oct) {
     failed_destroy(oct->processor_factories, hash);
     failed_destroy(oct->protocol_factories, hash);
     failed_destroy(oct->ioworker_pool, ioworker_pool);
+    failed_destroy(oct->mailbox, mailbox);
 
     if (oct->event_loop != NULL) {
         aeDeleteEventLoop(oct->event_loop);
@@ -11,6 +11,31 @@
 #include "protocol.h"
 #include "processor.h"
 #include "ioworker_pool.h"
+#include "mailbox.h"
+#include "coroutine.h"
+#include "cache.h"
+#include "coalesce.h"
+#include "lenprefix.h"
+#include "resp.h"
+#include "http.h"
+#include "memory.h"
+
+/**
+ * Connections closed for timeouts.
+ */
+typedef struct {
+    long long   idle;
+    long long   read;
+    long long   write;
+} client_timeout_stats_t;
+
+/**
+ * Memory released since it's over the limit.
+ */
+typedef struct {
+    long long   shrinks;    // idle output buffers shrunk
+    long long   evictions;  // clients disconnected
+} client_eviction_stats_t;
 
 octopus_t* octopus_create();
 
@@ -18,26 +43,110 @@ void octopus_set_ioworker_count(octopus_t *oct, int worker_count);
 
 ioworker_pool_t* octopus_ioworker_pool(octopus_t *oct);
 
+mailbox_t* octopus_mailbox(octopus_t *oct);
+
 int octopus_register_protocol_factory(
         octopus_t *oct,
         const char *protocol_name,
         protocol_factory_t protocol_factory);
 
+/**
+ * @brief Register a factory creating a processor for each connection.
+ */
 int octopus_register_processor_factory(
         octopus_t *oct,
         const char *protocol_name,
         processor_factory_t processor_factory);
 
+/**
+ * @brief Register a factory with the scope of processors, which is one of
+ *      OCTOPUS_PROCESSOR_SCOPE_*, optionally or'ed with OCTOPUS_PROCESSOR_COROUTINE,
+ *      OCTOPUS_PROCESSOR_COALESCE and OCTOPUS_PROCESSOR_CACHE.
+ *      Processors of ioworker or global scope are shared by connections, and
+ *      created at the first connection.
+ */
+int octopus_register_processor_factory_with_scope(
+        octopus_t *oct,
+        const char *protocol_name,
+        processor_factory_t processor_factory,
+        int scope);
+
 void octopus_add_listening_socket(
         octopus_t *oct,
         const char *host,
         const char *port,
         const char *protocol_name);
 
+/**
+ * @brief Set timeouts of connections in milliseconds, 0 disables each of them.
+ *      They apply to listening sockets added after the call.
+ * @param [in]idle_ms, no request is being read or processed, and no response is
+ *      being sent.
+ * @param [in]read_ms, a request has been partially read for longer than it.
+ * @param [in]write_ms, pending output makes no progress for longer than it.
+ */
+void octopus_set_client_timeouts(octopus_t *oct, long long idle_ms, long long read_ms,
+        long long write_ms);
+
+void octopus_client_timeout_stats(client_timeout_stats_t *stats);
+
+void octopus_client_eviction_stats(client_eviction_stats_t *stats);
+
+/**
+ * @brief Register each connection once for both directions, edge-triggered, so
+ *      the interest set isn't changed for every response. Connections fall back
+ *      to level-triggered if the event loop doesn't support it. It applies to
+ *      listening sockets added after the call.
+ */
+void octopus_set_edge_triggered(octopus_t *oct, int enabled);
+
+/**
+ * @brief Limit what a connection reads and decodes in an iteration of the event
+ *      loop, so a busy connection can't starve others of its thread. The rest
+ *      is read in the next iteration. It applies to listening sockets added
+ *      after the call.
+ *
+ * @param [in]bytes, bytes read, 0 if unlimited.
+ * @param [in]commands, commands decoded, 0 if unlimited.
+ */
+void octopus_set_read_budget(octopus_t *oct, int bytes, int commands);
+
+/**
+ * @brief Stop reading from a client whose pending output reaches 'high' bytes,
+ *      until it's written below 'low', so slow consumers take bounded memory.
+ *      Responses of requests in flight count toward it by the average length
+ *      of recent ones, and responses completed above it are held until the
+ *      output drains. They're 512KB and 128KB by default. The watermarks
+ *      apply to listening sockets added after the call.
+ *
+ * @param [in]high, 0 to disable it.
+ */
+void octopus_set_output_watermarks(octopus_t *oct, int high, int low);
+
 int octopus_srv_start(octopus_t *oct);
 
 void octopus_srv_stop(octopus_t *oct);
 
 void octopus_destroy(octopus_t *oct);
 
+/**
+ * @brief Client of the request being processed, only valid in process_t.
+ */
+client_t* octopus_current_client();
+
+/**
+ * @brief Token of the request being processed, only valid in process_t.
+ */
+long long octopus_current_token();
+
+/**
+ * @brief Complete a request for which process_t has returned OCTOPUS_PENDING. It
+ *      can be called from any thread, and responses are still sent in the order
+ *      of requests. The client can't be closed until all its pending requests
+ *      complete.
+ * @param [in]result, object holder of output command, the client takes the
+ *      ownership of it. NULL means the request has no response.
+ */
+int octopus_complete(client_t *cli, long long token, object_t *result);
+
 #endif /* ifndef OCTOPUS_H */
@@ -8,30 +8,99 @@
 #ifndef OCTOPUS_PROCESSOR_H
 #define OCTOPUS_PROCESSOR_H
 
+#include "sds.h"
 #include "common.h"
 
 #define processor_t_implement     \
     process_t   process;    \
-    processor_destroy_t     destroy
+    processor_destroy_t     destroy; \
+    coalescable_t   coalescable; \
+    cache_ttl_t     cache_ttl
+
+/**
+ * Scope of processors created by a factory. A processor shared by clients is
+ * called by all of them, so a global one must be thread-safe, and a per-ioworker
+ * one is only called in the thread of the ioworker, whose factory is called in
+ * that thread too, so thread-local state can be built in it.
+ */
+#define OCTOPUS_PROCESSOR_SCOPE_CONNECTION  0
+#define OCTOPUS_PROCESSOR_SCOPE_IOWORKER    1
+#define OCTOPUS_PROCESSOR_SCOPE_GLOBAL      2
+
+/**
+ * Or'ed with the scope to run each command on a coroutine of the ioworker. The
+ * processor can block by octopus_yield_until_readable or octopus_sleep, and
+ * returns the response directly after being resumed. Reading of the connection
+ * is paused while its commands are suspended, so the data of the commands
+ * stays valid until they finish.
+ */
+#define OCTOPUS_PROCESSOR_COROUTINE         0x100
+
+/**
+ * Or'ed with the scope to coalesce identical commands in flight. While a command
+ * is pending, the identical commands of clients in the same ioworker wait for
+ * it instead of being processed, and the response is shared by all of them.
+ * The protocol must support cmd_hash, cmd_equal and cmd_dup, and commands can be
+ * filtered by 'coalescable' of the processor, such as commands with side effect.
+ */
+#define OCTOPUS_PROCESSOR_COALESCE          0x200
+
+/**
+ * Or'ed with the scope to cache encoded responses of the commands accepted by
+ * 'cache_ttl' of the processor. The cache is keyed by cmd_key of the protocol
+ * and the processor, so it's only shared by clients of ioworker or global
+ * scope processors. A hit skips both processing and encoding.
+ */
+#define OCTOPUS_PROCESSOR_CACHE             0x400
+#define OCTOPUS_PROCESSOR_SCOPE_MASK        0xFF
 
 typedef struct processor_s processor_t;
 
 typedef processor_t* (*processor_factory_t)();
 
+/**
+ * Returned by process_t if the response will be completed later, by
+ * octopus_complete with the client and token of the request, which are got by
+ * octopus_current_client and octopus_current_token in process_t.
+ */
+#define OCTOPUS_PENDING     ((object_t *)1)
+
 /**
  * A function used to process input commands.
  * @param [IN]processor, the processor instance.
- * @param [IN]cmd_obj, object holder of input command need to process.
- * @return object_t*, object holder of output command.
+ * @param [IN]cmd_obj, object holder of input command need to process. Data of
+ *      the command may point into the input buffer, so it must be copied if it's
+ *      used after returning OCTOPUS_PENDING.
+ * @return object_t*, object holder of output command, or OCTOPUS_PENDING.
  */
 typedef object_t* (*process_t)(processor_t *processor, object_t *cmd);
 
 typedef void (*processor_destroy_t)(processor_t *processor);
 
+/**
+ * Optional, return OCTOPUS_TRUE if the command can share the response of an
+ * identical one. All commands are coalesced if it's NULL. 'tag' can be set to a
+ * new sds, such as the key read by it, and octopus_coalesce_forget with the tag
+ * stops identical commands from joining it. A command without a tag stops being
+ * joined by any octopus_coalesce_forget.
+ */
+typedef int (*coalescable_t)(processor_t *processor, object_t *cmd, sds *tag);
+
+/**
+ * Optional, TTL in milliseconds of the response of the command, or 0 if it
+ * can't be cached. 'tag' can be set to a new sds, and the entry can be removed
+ * by octopus_cache_invalidate with the tag, such as the key read by it.
+ */
+typedef long long (*cache_ttl_t)(processor_t *processor, object_t *cmd, sds *tag);
+
 struct processor_s {
     process_t   process;
 
     processor_destroy_t     destroy;
+
+    coalescable_t   coalescable;
+
+    cache_ttl_t     cache_ttl;
 };
 
 #endif /* ifndef OCTOPUS_PROCESSOR_H */
@@ -9,13 +9,17 @@
 #define OCTOPUS_PROTOCOL_H
 
 #include "buffer.h"
-#include "list.h"
+#include "deque.h"
 #include "common.h"
 
 #define protocol_t_implement    \
     decode_t    decode; \
     encode_t    encode; \
-    protocol_destroy_t  destroy
+    protocol_destroy_t  destroy; \
+    cmd_hash_t  cmd_hash; \
+    cmd_equal_t cmd_equal; \
+    cmd_dup_t   cmd_dup; \
+    cmd_key_t   cmd_key
 
 typedef struct protocol_s protocol_t;
 
@@ -33,12 +37,12 @@ typedef protocol_t* (*protocol_factory_t)();
  *  @param [in]state, state of the decoder. Different protocols have different
  *          state, so the type of state is void*.
  *  @param [in]input, byte stream read from the socket.
- *  @param [out]output_cmd_objs, a linked list used to store the objects of command
- *          decoded, and the type of the element is object_t*. In object_t*, a user
- *          customed command_t* is holded.
+ *  @param [out]output_cmd_objs, a deque used to store the objects of command
+ *          decoded, which are pushed back, and the type of the element is
+ *          object_t*. In object_t*, a user customed command_t* is holded.
  *  @return int, OCTOPUS_OK if succeed, or OCTOPUS_ERR if failed.
  */
-typedef int (*decode_t)(void *state, buffer_t *input, list_t *output_cmd_objs);
+typedef int (*decode_t)(void *state, buffer_t *input, deque_t *output_cmd_objs);
 
 /**
  * command => byte stream
@@ -47,18 +51,50 @@ typedef int (*decode_t)(void *state, buffer_t *input, list_t *output_cmd_objs);
  *  @param [in]state, state of the decoder. Different protocols have different
  *          state, so the type of state is void*.
  *  @param [in]cmd_obj, a object holder of command need to be encoded.
- *  @param [out]output, a buffer to store the bytes of the command.
- *  @return int, OCTOPUS_OK if succeed, or OCTOPUS_ERR if failed.
+ *  @param [out]output, a buffer to store the bytes of the command. Large payload
+ *          owned by others can be attached by 'buffer_attach_ref' instead of being
+ *          copied, and it will be written right after the bytes before it.
+ *  @return int, OCTOPUS_OK if succeed, or OCTOPUS_ERR if failed. OCTOPUS_EOF means
+ *          the command has been encoded, and the connection should be closed after
+ *          the output is sent, such as a response of HTTP without keep-alive.
  */
 typedef int (*encode_t)(void *state, object_t *cmd_obj, buffer_t *output);
 
 typedef void (*protocol_destroy_t)(protocol_t *protocol);
 
+/**
+ * Optional functions used to coalesce identical commands in flight, see
+ * OCTOPUS_PROCESSOR_COALESCE. They only depend on the commands, and a protocol
+ * not supporting coalescing leaves them NULL.
+ *  cmd_hash, hash value of a command, equal commands must have the same hash.
+ *  cmd_equal, return OCTOPUS_TRUE if two commands are identical.
+ *  cmd_dup, copy a command which doesn't point into the input buffer, since
+ *          it's kept as the key until the response completes.
+ */
+typedef unsigned int (*cmd_hash_t)(object_t *cmd_obj);
+typedef int (*cmd_equal_t)(object_t *a, object_t *b);
+typedef object_t* (*cmd_dup_t)(object_t *cmd_obj);
+
+/**
+ * Optional, canonical key of a command used by the response cache, see
+ * OCTOPUS_PROCESSOR_CACHE. Commands having the same key must be encoded to the
+ * same bytes, so the key covers the state of the connection the encoding
+ * depends on, such as the version of RESP.
+ *  @return a new sds, or NULL if the command can't be cached.
+ */
+typedef sds (*cmd_key_t)(void *state, object_t *cmd_obj);
+
 struct protocol_s {
     decode_t    decode;
     encode_t    encode;
 
     protocol_destroy_t  destroy;
+
+    cmd_hash_t  cmd_hash;
+    cmd_equal_t cmd_equal;
+    cmd_dup_t   cmd_dup;
+
+    cmd_key_t   cmd_key;
 };
 
 #endif /* ifndef OCTOPUS_PROTOCOL_H */
@@ -0,0 +1,135 @@
+/**
+ *
+ * @file    admin_processor
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-10 11:12:47
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "admin_processor.h"
+#include "redis_processor.h"
+#include "http.h"
+#include "cache.h"
+#include "octopus.h"
+#include "object.h"
+#include "logging.h"
+#include "common.h"
+
+#define ADMIN_PATH_HEALTH   "/health"
+#define ADMIN_PATH_METRICS  "/metrics"
+
+static int target_is(const http_request_t *req, const char *path) {
+    int     len;
+
+    // query string is ignored
+    for (len = 0; len < req->target_len && req->target[len] != '?'; len++);
+
+    return len == (int)strlen(path) && memcmp(req->target, path, len) == 0;
+}
+
+static http_response_t* admin_dispatch(http_request_t *req) {
+    http_response_t         *resp;
+    cache_stats_t           stats;
+    client_timeout_stats_t  timeouts;
+    client_eviction_stats_t evictions;
+    memory_stats_t          memory;
+    char                    body[1024];
+    int                     status, len;
+
+    len = 0;
+    if (!http_request_method_is(req, "GET") && !http_request_method_is(req, "HEAD")) {
+        status = 405;
+    } else if (target_is(req, ADMIN_PATH_HEALTH)) {
+        status = 200;
+        len = snprintf(body, sizeof(body), "OK\n");
+    } else if (target_is(req, ADMIN_PATH_METRICS)) {
+        status = 200;
+        octopus_cache_stats(&stats);
+        octopus_client_timeout_stats(&timeouts);
+        octopus_client_eviction_stats(&evictions);
+        octopus_memory_stats(&memory);
+        len = snprintf(body, sizeof(body),
+                "redis_shards %d\n"
+                "redis_commands_processed %lld\n"
+                "cache_hits %lld\n"
+                "cache_misses %lld\n"
+                "cache_evictions %lld\n"
+                "cache_invalidations %lld\n"
+                "cache_entries %lld\n"
+                "cache_bytes %lld\n"
+                "client_timeouts_idle %lld\n"
+                "client_timeouts_read %lld\n"
+                "client_timeouts_write %lld\n"
+                "memory_used_buffers %lld\n"
+                "memory_used_commands %lld\n"
+                "memory_used_clients %lld\n"
+                "memory_used_cache %lld\n"
+                "memory_used_tables %lld\n"
+                "memory_used %lld\n"
+                "memory_limit %lld\n"
+                "memory_buffers_shrunk %lld\n"
+                "memory_clients_evicted %lld\n",
+                redis_processor_shard_count(), redis_processor_commands_processed(),
+                stats.hits, stats.misses, stats.evictions, stats.invalidations,
+                stats.entries, stats.bytes, timeouts.idle, timeouts.read, timeouts.write,
+                memory.used[OCTOPUS_MEM_BUFFER], memory.used[OCTOPUS_MEM_COMMAND],
+                memory.used[OCTOPUS_MEM_CLIENT], memory.used[OCTOPUS_MEM_CACHE],
+                memory.used[OCTOPUS_MEM_TABLE], memory.total, memory.limit,
+                evictions.shrinks, evictions.evictions);
+    } else {
+        status = 404;
+    }
+
+    if ((resp = http_response_create(req, status)) == NULL) {
+        return NULL;
+    }
+
+    if (http_response_add_header(resp, "Content-Type", "text/plain") == OCTOPUS_ERR ||
+            http_response_set_body(resp, body, len) == OCTOPUS_ERR) {
+        http_response_destroy(resp);
+        return NULL;
+    }
+
+    return resp;
+}
+
+static object_t* admin_process(processor_t *processor, object_t *cmd_obj) {
+    http_response_t *resp;
+    object_t        *obj;
+
+    OCTOPUS_NOT_USED(processor);
+
+    if ((resp = admin_dispatch((http_request_t *)cmd_obj->obj.cmd)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create http response");
+        return NULL;
+    }
+
+    if ((obj = object_create_cmd((command_t *)resp)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create object for http response");
+        http_response_destroy(resp);
+        return NULL;
+    }
+
+    return obj;
+}
+
+static void admin_processor_destroy(processor_t *processor) {
+    free(processor);
+}
+
+processor_t* admin_processor_create() {
+    processor_t     *p;
+
+    if ((p = calloc(1, sizeof(processor_t))) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for admin processor");
+        return NULL;
+    }
+
+    p->process = admin_process;
+    p->destroy = admin_processor_destroy;
+
+    return p;
+}
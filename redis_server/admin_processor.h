@@ -0,0 +1,18 @@
+/**
+ *
+ * @file    admin_processor
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-10 11:05:32
+ */
+
+#ifndef REDIS_SERVER_ADMIN_PROCESSOR_H
+#define REDIS_SERVER_ADMIN_PROCESSOR_H
+
+#include "processor.h"
+
+/**
+ * @brief Processor of the HTTP admin port, which serves '/health' and '/metrics'.
+ */
+processor_t* admin_processor_create();
+
+#endif /* ifndef REDIS_SERVER_ADMIN_PROCESSOR_H */
@@ -0,0 +1,184 @@
+/**
+ *
+ * @file    keyspace
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-03 11:20:15
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "keyspace.h"
+#include "hash.h"
+#include "logging.h"
+#include "common.h"
+
+/**
+ * Keys are binary safe, so they are compared by length and bytes. The lookup
+ * key is a slice on the stack, which avoids allocation for reads.
+ */
+typedef struct {
+    const char  *ptr;
+    int         len;
+} slice_t;
+
+typedef struct {
+    slice_t     key;
+    sds         val;
+    long long   expire_ms;
+} kv_entry_t;
+
+struct keyspace_s {
+    // hash: slice_t* => kv_entry_t*, the slice is a member of the entry
+    hash_t      *dict;
+};
+
+static int slice_hash_func(const void *k) {
+    const slice_t   *s;
+
+    s = (const slice_t *)k;
+
+    return hash_bytes(s->ptr, s->len);
+}
+
+static int slice_equal_func(const void *a, const void *b) {
+    const slice_t   *sa, *sb;
+
+    sa = (const slice_t *)a;
+    sb = (const slice_t *)b;
+
+    return sa->len == sb->len && memcmp(sa->ptr, sb->ptr, sa->len) == 0;
+}
+
+static void entry_deallocator(void *p) {
+    kv_entry_t  *e;
+
+    e = (kv_entry_t *)p;
+    sdsfree(e->val);
+    free(e);
+}
+
+// TTLs are relative, so the monotonic clock keeps them from stepping of wall time
+long long keyspace_mstime() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+keyspace_t* keyspace_create() {
+    keyspace_t  *ks;
+
+    if ((ks = calloc(1, sizeof(keyspace_t))) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for keyspace");
+        return NULL;
+    }
+
+    ks->dict = hash_create(slice_hash_func, slice_equal_func, NULL, entry_deallocator);
+    if (ks->dict == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create dict for keyspace");
+        free(ks);
+        return NULL;
+    }
+
+    return ks;
+}
+
+/**
+ * Find the entry of the key, and an expired entry is deleted lazily.
+ */
+static kv_entry_t* lookup(keyspace_t *ks, const char *key, int keylen) {
+    kv_entry_t  *e;
+    slice_t     k;
+
+    k.ptr = key;
+    k.len = keylen;
+    if ((e = hash_get(ks->dict, &k)) == NULL) {
+        return NULL;
+    }
+
+    if (e->expire_ms != KEYSPACE_NO_EXPIRE && e->expire_ms <= keyspace_mstime()) {
+        hash_remove(ks->dict, &k);
+        return NULL;
+    }
+
+    return e;
+}
+
+sds keyspace_get(keyspace_t *ks, const char *key, int keylen) {
+    kv_entry_t  *e;
+
+    e = lookup(ks, key, keylen);
+
+    return e == NULL ? NULL : e->val;
+}
+
+int keyspace_set(keyspace_t *ks, const char *key, int keylen, sds val) {
+    kv_entry_t  *e;
+
+    if ((e = lookup(ks, key, keylen)) != NULL) {
+        sdsfree(e->val);
+        e->val = val;
+        e->expire_ms = KEYSPACE_NO_EXPIRE;
+        return OCTOPUS_OK;
+    }
+
+    // The key bytes are stored right after the entry.
+    if ((e = malloc(sizeof(kv_entry_t) + keylen)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for keyspace entry");
+        return OCTOPUS_ERR;
+    }
+    memcpy(e + 1, key, keylen);
+    e->key.ptr = (const char *)(e + 1);
+    e->key.len = keylen;
+    e->val = val;
+    e->expire_ms = KEYSPACE_NO_EXPIRE;
+
+    if (hash_put(ks->dict, &e->key, e) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("failed to put entry to keyspace");
+        free(e);
+        return OCTOPUS_ERR;
+    }
+
+    return OCTOPUS_OK;
+}
+
+int keyspace_del(keyspace_t *ks, const char *key, int keylen) {
+    slice_t     k;
+
+    if (lookup(ks, key, keylen) == NULL) {
+        return OCTOPUS_FALSE;
+    }
+
+    k.ptr = key;
+    k.len = keylen;
+    hash_remove(ks->dict, &k);
+
+    return OCTOPUS_TRUE;
+}
+
+int keyspace_expire(keyspace_t *ks, const char *key, int keylen, long long when_ms) {
+    kv_entry_t  *e;
+
+    if ((e = lookup(ks, key, keylen)) == NULL) {
+        return OCTOPUS_FALSE;
+    }
+    e->expire_ms = when_ms;
+
+    return OCTOPUS_TRUE;
+}
+
+int keyspace_size(keyspace_t *ks) {
+    return hash_size(ks->dict);
+}
+
+void keyspace_destroy(keyspace_t *ks) {
+    if (ks == NULL) {
+        return;
+    }
+
+    hash_destroy(ks->dict);
+    free(ks);
+}
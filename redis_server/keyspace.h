@@ -0,0 +1,52 @@
+/**
+ *
+ * @file    keyspace
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-03 11:02:47
+ */
+
+#ifndef REDIS_SERVER_KEYSPACE_H
+#define REDIS_SERVER_KEYSPACE_H
+
+#include "sds.h"
+
+#define KEYSPACE_NO_EXPIRE  -1
+
+/**
+ * A shard of the keyspace. It's only accessed by the thread owning it, so
+ * there is no lock.
+ */
+typedef struct keyspace_s keyspace_t;
+
+keyspace_t* keyspace_create();
+
+/**
+ * @return value of the key, or NULL if the key doesn't exist or has expired.
+ *      The value is owned by the keyspace.
+ */
+sds keyspace_get(keyspace_t *ks, const char *key, int keylen);
+
+/**
+ * @brief Set value of the key, and the expire time is cleared.
+ * @param [in]val, the keyspace takes the ownership of it.
+ */
+int keyspace_set(keyspace_t *ks, const char *key, int keylen, sds val);
+
+/**
+ * @return OCTOPUS_TRUE if the key existed and has been deleted.
+ */
+int keyspace_del(keyspace_t *ks, const char *key, int keylen);
+
+/**
+ * @brief Set the expire time of the key, in milliseconds of unix time.
+ * @return OCTOPUS_TRUE if the key exists.
+ */
+int keyspace_expire(keyspace_t *ks, const char *key, int keylen, long long when_ms);
+
+int keyspace_size(keyspace_t *ks);
+
+void keyspace_destroy(keyspace_t *ks);
+
+long long keyspace_mstime();
+
+#endif /* ifndef REDIS_SERVER_KEYSPACE_H */
@@ -0,0 +1,601 @@
+/**
+ *
+ * @file    redis_processor
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-03 14:45:33
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "redis_processor.h"
+#include "keyspace.h"
+#include "resp.h"
+#include "object.h"
+#include "worker_pool.h"
+#include "octopus.h"
+#include "logging.h"
+#include "common.h"
+
+#define REDIS_OP_GET        1
+#define REDIS_OP_SET        2
+#define REDIS_OP_DEL        3
+#define REDIS_OP_MGET       4
+#define REDIS_OP_INCR       5
+#define REDIS_OP_EXPIRE     6
+
+typedef struct redis_req_s redis_req_t;
+
+/**
+ * A message sent to the owner of a shard. Keys of the command belonging to the
+ * shard are listed in 'keys', as indexes of argv.
+ */
+typedef struct {
+    job_t           job;
+
+    redis_req_t     *req;
+    keyspace_t      *ks;
+
+    int             *keys;
+    int             nkeys;
+    // result of DEL
+    long long       count;
+} shard_job_t;
+
+/**
+ * A command passed to the shards. Arguments are copied, since the input buffer
+ * is reused once the command is pending. The last shard finishing its job
+ * completes the request.
+ */
+struct redis_req_s {
+    client_t        *cli;
+    long long       token;
+
+    int             op;
+    long long       when_ms;
+    int             argc;
+    resp_arg_t      *argv;
+
+    // shard jobs which haven't finished
+    int             pending;
+    // result of single key commands, or array of MGET
+    resp_reply_t    *reply;
+
+    // one job for each shard, followed by argv, key indexes and the arguments
+    shard_job_t     *jobs;
+    int             *keys;
+};
+
+static worker_pool_t    *shard_workers;
+static keyspace_t       **shards;
+static int              shard_count;
+static long long        commands_processed;
+// TTL of cached GET responses, caching is disabled if it's 0
+static long long        cache_ttl_ms;
+
+static int shard_of(const char *key, int keylen) {
+    unsigned int    h;
+
+    // Different from the hash of keyspace, so keys are spread evenly in a shard.
+    h = 5381;
+    for (int i = 0; i < keylen; i++) {
+        h = (h << 5) + h + (unsigned char)key[i];
+    }
+
+    return h % shard_count;
+}
+
+int redis_processor_init(int count) {
+    if (count <= 0) {
+        OCTOPUS_ERROR_LOG("invalid shard count: %d", count);
+        return OCTOPUS_ERR;
+    }
+
+    if ((shards = calloc(count, sizeof(keyspace_t *))) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for shards");
+        return OCTOPUS_ERR;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if ((shards[i] = keyspace_create()) == NULL) {
+            OCTOPUS_ERROR_LOG("failed to create keyspace for shard %d", i);
+            return OCTOPUS_ERR;
+        }
+    }
+
+    if ((shard_workers = worker_pool_create(count)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create workers for shards");
+        return OCTOPUS_ERR;
+    }
+    shard_count = count;
+
+    return OCTOPUS_OK;
+}
+
+static int parse_ll(const char *s, int len, long long *v) {
+    char    buf[32], *end;
+
+    if (len <= 0 || len >= (int)sizeof(buf)) {
+        return OCTOPUS_ERR;
+    }
+
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    errno = 0;
+    *v = strtoll(buf, &end, 10);
+    if (errno != 0 || *end != '\0') {
+        return OCTOPUS_ERR;
+    }
+
+    return OCTOPUS_OK;
+}
+
+static resp_reply_t* shard_incr(keyspace_t *ks, const resp_arg_t *key) {
+    sds         val;
+    long long   v;
+
+    v = 0;
+    if ((val = keyspace_get(ks, key->ptr, key->len)) != NULL &&
+            parse_ll(val, sdslen(val), &v) == OCTOPUS_ERR) {
+        return resp_reply_error("ERR value is not an integer or out of range");
+    }
+
+    if (v == __LONG_LONG_MAX__) {
+        return resp_reply_error("ERR increment or decrement would overflow");
+    }
+    v++;
+
+    if ((val = sdsfromlonglong(v)) == NULL) {
+        return resp_reply_error("ERR out of memory");
+    }
+    // the keyspace owns the value only if it's set
+    if (keyspace_set(ks, key->ptr, key->len, val) == OCTOPUS_ERR) {
+        sdsfree(val);
+        return resp_reply_error("ERR out of memory");
+    }
+
+    return resp_reply_integer(v);
+}
+
+static void redis_req_complete(redis_req_t *req) {
+    object_t    *obj;
+    long long   count;
+
+    if (req->op == REDIS_OP_DEL) {
+        count = 0;
+        for (int i = 0; i < shard_count; i++) {
+            count += req->jobs[i].count;
+        }
+        req->reply = resp_reply_integer(count);
+    }
+
+    obj = NULL;
+    if (req->reply == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create reply");
+    } else if ((obj = object_create_cmd((command_t *)req->reply)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create object for reply");
+        resp_reply_destroy(req->reply);
+    }
+
+    octopus_complete(req->cli, req->token, obj);
+    free(req);
+}
+
+/**
+ * Run in the worker owning the shard.
+ */
+static int shard_job_run(void *ctx) {
+    shard_job_t         *j;
+    redis_req_t         *req;
+    const resp_arg_t    *argv, *key;
+    sds                 val;
+
+    j = (shard_job_t *)ctx;
+    req = j->req;
+    argv = req->argv;
+    key = &argv[j->keys[0]];
+
+    switch (req->op) {
+    case REDIS_OP_GET:
+        val = keyspace_get(j->ks, key->ptr, key->len);
+        req->reply = val == NULL ? resp_reply_null() : resp_reply_bulk(val, sdslen(val));
+        break;
+    case REDIS_OP_SET:
+        if ((val = sdsnewlen(argv[2].ptr, argv[2].len)) == NULL) {
+            req->reply = resp_reply_error("ERR out of memory");
+            break;
+        }
+        if (keyspace_set(j->ks, key->ptr, key->len, val) == OCTOPUS_ERR) {
+            sdsfree(val);
+            req->reply = resp_reply_error("ERR out of memory");
+            break;
+        }
+        if (req->when_ms != KEYSPACE_NO_EXPIRE) {
+            keyspace_expire(j->ks, key->ptr, key->len, req->when_ms);
+        }
+        req->reply = resp_reply_status("OK");
+        break;
+    case REDIS_OP_INCR:
+        req->reply = shard_incr(j->ks, key);
+        break;
+    case REDIS_OP_EXPIRE:
+        req->reply = resp_reply_integer(keyspace_expire(j->ks, key->ptr, key->len, req->when_ms));
+        break;
+    case REDIS_OP_DEL:
+        for (int i = 0; i < j->nkeys; i++) {
+            key = &argv[j->keys[i]];
+            j->count += keyspace_del(j->ks, key->ptr, key->len);
+        }
+        break;
+    case REDIS_OP_MGET:
+        for (int i = 0; i < j->nkeys; i++) {
+            key = &argv[j->keys[i]];
+            val = keyspace_get(j->ks, key->ptr, key->len);
+            resp_reply_set_element(req->reply, j->keys[i] - 1,
+                    val == NULL ? resp_reply_null() : resp_reply_bulk(val, sdslen(val)));
+        }
+        break;
+    }
+
+    // the request may be freed by the last job, so 'j' isn't touched after it
+    if (__sync_sub_and_fetch(&req->pending, 1) == 0) {
+        redis_req_complete(req);
+    }
+
+    return OCTOPUS_OK;
+}
+
+/**
+ * Create a request with the arguments copied, in a single allocation.
+ */
+static redis_req_t* redis_req_create(int op, resp_cmd_t *cmd, long long when_ms) {
+    redis_req_t     *req;
+    size_t          size, data_len;
+    char            *data;
+
+    data_len = 0;
+    for (int i = 0; i < cmd->argc; i++) {
+        data_len += cmd->argv[i].len;
+    }
+
+    size = sizeof(redis_req_t) + sizeof(shard_job_t) * shard_count +
+        sizeof(resp_arg_t) * cmd->argc + sizeof(int) * cmd->argc * 2 + data_len;
+    if ((req = calloc(1, size)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for request, argc: %d", cmd->argc);
+        return NULL;
+    }
+
+    req->cli = octopus_current_client();
+    req->token = octopus_current_token();
+    req->op = op;
+    req->when_ms = when_ms;
+    req->argc = cmd->argc;
+    req->jobs = (shard_job_t *)(req + 1);
+    req->argv = (resp_arg_t *)(req->jobs + shard_count);
+    req->keys = (int *)(req->argv + cmd->argc);
+
+    data = (char *)(req->keys + cmd->argc * 2);
+    for (int i = 0; i < cmd->argc; i++) {
+        memcpy(data, cmd->argv[i].ptr, cmd->argv[i].len);
+        req->argv[i].ptr = data;
+        req->argv[i].len = cmd->argv[i].len;
+        data += cmd->argv[i].len;
+    }
+
+    for (int i = 0; i < shard_count; i++) {
+        req->jobs[i].job.ctx = &req->jobs[i];
+        req->jobs[i].job.runnable = shard_job_run;
+        req->jobs[i].req = req;
+        req->jobs[i].ks = shards[i];
+    }
+
+    return req;
+}
+
+/**
+ * Pass the jobs which have keys to the owners of shards, the request is
+ * completed by the last one.
+ */
+static object_t* redis_req_run(redis_req_t *req) {
+    int     pending;
+
+    // The dispatcher holds one count, so the request isn't completed by the
+    // shards before all jobs have been passed.
+    pending = 1;
+    for (int i = 0; i < shard_count; i++) {
+        pending += req->jobs[i].nkeys > 0;
+    }
+    req->pending = pending;
+
+    for (int i = 0; i < shard_count; i++) {
+        if (req->jobs[i].nkeys > 0) {
+            worker_pool_do(shard_workers, &req->jobs[i].job, i);
+        }
+    }
+
+    if (__sync_sub_and_fetch(&req->pending, 1) == 0) {
+        redis_req_complete(req);
+    }
+
+    return OCTOPUS_PENDING;
+}
+
+/**
+ * Reads of the keys written are invalidated before the write is passed to the
+ * shards. Reads after it don't join the ones in flight. Cached responses are
+ * removed at once from the cache of this ioworker, and asynchronously from the
+ * others, and a read filling the cache after it is dropped.
+ */
+static void keys_invalidate(int op, redis_req_t *req, int last) {
+    if (op == REDIS_OP_GET || op == REDIS_OP_MGET) {
+        return;
+    }
+
+    for (int i = 1; i <= last; i++) {
+        octopus_coalesce_forget(req->argv[i].ptr, req->argv[i].len);
+        if (cache_ttl_ms != 0) {
+            octopus_cache_invalidate(req->argv[i].ptr, req->argv[i].len);
+        }
+    }
+}
+
+static object_t* single_key_command(int op, resp_cmd_t *cmd, long long when_ms) {
+    redis_req_t     *req;
+    shard_job_t     *j;
+
+    if ((req = redis_req_create(op, cmd, when_ms)) == NULL) {
+        return NULL;
+    }
+
+    j = &req->jobs[shard_of(req->argv[1].ptr, req->argv[1].len)];
+    req->keys[0] = 1;
+    j->keys = req->keys;
+    j->nkeys = 1;
+
+    keys_invalidate(op, req, 1);
+
+    return redis_req_run(req);
+}
+
+/**
+ * Keys are grouped by shard, and each shard gets one job for all its keys.
+ */
+static object_t* multi_key_command(int op, resp_cmd_t *cmd) {
+    redis_req_t     *req;
+    int             *shard_ids, offset, s;
+
+    if ((req = redis_req_create(op, cmd, KEYSPACE_NO_EXPIRE)) == NULL) {
+        return NULL;
+    }
+
+    shard_ids = req->keys + req->argc;
+    for (int i = 1; i < req->argc; i++) {
+        shard_ids[i] = shard_of(req->argv[i].ptr, req->argv[i].len);
+        req->jobs[shard_ids[i]].nkeys++;
+    }
+
+    offset = 0;
+    for (int i = 0; i < shard_count; i++) {
+        req->jobs[i].keys = req->keys + offset;
+        offset += req->jobs[i].nkeys;
+        req->jobs[i].nkeys = 0;
+    }
+    for (int i = 1; i < req->argc; i++) {
+        s = shard_ids[i];
+        req->jobs[s].keys[req->jobs[s].nkeys++] = i;
+    }
+
+    if (op == REDIS_OP_MGET &&
+            (req->reply = resp_reply_array(RESP_REPLY_ARRAY, req->argc - 1)) == NULL) {
+        free(req);
+        return NULL;
+    }
+
+    keys_invalidate(op, req, req->argc - 1);
+
+    return redis_req_run(req);
+}
+
+static resp_reply_t* hello_command(resp_cmd_t *cmd) {
+    resp_reply_t    *reply;
+    long long       proto;
+
+    proto = RESP_VERSION_2;
+    if (cmd->argc > 1 && (parse_ll(cmd->argv[1].ptr, cmd->argv[1].len, &proto) == OCTOPUS_ERR ||
+                (proto != RESP_VERSION_2 && proto != RESP_VERSION_3))) {
+        return resp_reply_error("NOPROTO unsupported protocol version");
+    }
+
+    if ((reply = resp_reply_array(RESP_REPLY_MAP, 2)) == NULL) {
+        return NULL;
+    }
+    resp_reply_set_element(reply, 0, resp_reply_bulk("server", 6));
+    resp_reply_set_element(reply, 1, resp_reply_bulk("octopus", 7));
+    resp_reply_set_element(reply, 2, resp_reply_bulk("proto", 5));
+    resp_reply_set_element(reply, 3, resp_reply_integer(proto));
+    reply->proto = proto;
+
+    return reply;
+}
+
+static object_t* reply_obj(resp_reply_t *reply) {
+    object_t    *obj;
+
+    if (reply == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create reply");
+        return NULL;
+    }
+
+    if ((obj = object_create_cmd((command_t *)reply)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create object for reply");
+        resp_reply_destroy(reply);
+        return NULL;
+    }
+
+    return obj;
+}
+
+/**
+ * Absolute time in ms, which is 'v' units of 'unit_ms' from now.
+ * @return OCTOPUS_ERR if it overflows, as the client can send any 'v'.
+ */
+static int expire_time(long long v, long long unit_ms, long long *when_ms) {
+    long long   now;
+
+    now = keyspace_mstime();
+    if (v > (LLONG_MAX - now) / unit_ms || v < LLONG_MIN / unit_ms) {
+        return OCTOPUS_ERR;
+    }
+    *when_ms = now + v * unit_ms;
+
+    return OCTOPUS_OK;
+}
+
+static object_t* set_command(resp_cmd_t *cmd) {
+    long long   when_ms, v;
+
+    when_ms = KEYSPACE_NO_EXPIRE;
+    if (cmd->argc == 5) {
+        if (parse_ll(cmd->argv[4].ptr, cmd->argv[4].len, &v) == OCTOPUS_ERR || v <= 0) {
+            return reply_obj(resp_reply_error("ERR invalid expire time in 'set' command"));
+        }
+
+        if (!resp_arg_equal(&cmd->argv[3], "EX") && !resp_arg_equal(&cmd->argv[3], "PX")) {
+            return reply_obj(resp_reply_error("ERR syntax error"));
+        }
+        if (expire_time(v, resp_arg_equal(&cmd->argv[3], "EX") ? 1000 : 1, &when_ms)
+                == OCTOPUS_ERR) {
+            return reply_obj(resp_reply_error("ERR invalid expire time in 'set' command"));
+        }
+    } else if (cmd->argc != 3) {
+        return reply_obj(resp_reply_error("ERR wrong number of arguments for 'set' command"));
+    }
+
+    return single_key_command(REDIS_OP_SET, cmd, when_ms);
+}
+
+/**
+ * Commands on keys are pending until the shards finish them, others are
+ * replied synchronously.
+ */
+static object_t* dispatch(resp_cmd_t *cmd) {
+    const resp_arg_t    *name;
+    long long           v, when_ms;
+
+    if (cmd->argc == 0) {
+        return reply_obj(resp_reply_error("ERR empty command"));
+    }
+
+    name = &cmd->argv[0];
+    if (resp_arg_equal(name, "GET") && cmd->argc == 2) {
+        return single_key_command(REDIS_OP_GET, cmd, KEYSPACE_NO_EXPIRE);
+    } else if (resp_arg_equal(name, "SET")) {
+        return set_command(cmd);
+    } else if (resp_arg_equal(name, "DEL") && cmd->argc >= 2) {
+        return multi_key_command(REDIS_OP_DEL, cmd);
+    } else if (resp_arg_equal(name, "MGET") && cmd->argc >= 2) {
+        return multi_key_command(REDIS_OP_MGET, cmd);
+    } else if (resp_arg_equal(name, "INCR") && cmd->argc == 2) {
+        return single_key_command(REDIS_OP_INCR, cmd, KEYSPACE_NO_EXPIRE);
+    } else if (resp_arg_equal(name, "EXPIRE") && cmd->argc == 3) {
+        if (parse_ll(cmd->argv[2].ptr, cmd->argv[2].len, &v) == OCTOPUS_ERR) {
+            return reply_obj(resp_reply_error("ERR value is not an integer or out of range"));
+        }
+        if (expire_time(v, 1000, &when_ms) == OCTOPUS_ERR) {
+            return reply_obj(resp_reply_error("ERR invalid expire time in 'expire' command"));
+        }
+        return single_key_command(REDIS_OP_EXPIRE, cmd, when_ms);
+    } else if (resp_arg_equal(name, "PING")) {
+        return reply_obj(cmd->argc > 1 ? resp_reply_bulk(cmd->argv[1].ptr, cmd->argv[1].len) :
+            resp_reply_status("PONG"));
+    } else if (resp_arg_equal(name, "HELLO")) {
+        return reply_obj(hello_command(cmd));
+    } else if (resp_arg_equal(name, "COMMAND")) {
+        return reply_obj(resp_reply_array(RESP_REPLY_ARRAY, 0));
+    }
+
+    return reply_obj(resp_reply_error("ERR unknown command or wrong number of arguments"));
+}
+
+int redis_processor_shard_count() {
+    return shard_count;
+}
+
+long long redis_processor_commands_processed() {
+    return __sync_fetch_and_add(&commands_processed, 0);
+}
+
+static object_t* redis_process(processor_t *processor, object_t *cmd_obj) {
+    OCTOPUS_NOT_USED(processor);
+
+    __sync_fetch_and_add(&commands_processed, 1);
+
+    return dispatch((resp_cmd_t *)cmd_obj->obj.cmd);
+}
+
+/**
+ * Only reads are coalesced, commands with side effect must be applied once
+ * for each request. GET is tagged with the key, and MGET stops being joined by
+ * any write.
+ */
+static int redis_coalescable(processor_t *processor, object_t *cmd_obj, sds *tag) {
+    resp_cmd_t  *cmd;
+
+    OCTOPUS_NOT_USED(processor);
+
+    cmd = (resp_cmd_t *)cmd_obj->obj.cmd;
+    if (cmd->argc == 2 && resp_arg_equal(&cmd->argv[0], "GET")) {
+        *tag = sdsnewlen(cmd->argv[1].ptr, cmd->argv[1].len);
+        return *tag != NULL;
+    }
+
+    return cmd->argc >= 2 && resp_arg_equal(&cmd->argv[0], "MGET");
+}
+
+/**
+ * GET responses are cached, and tagged with the key for invalidation.
+ */
+static long long redis_cache_ttl(processor_t *processor, object_t *cmd_obj, sds *tag) {
+    resp_cmd_t  *cmd;
+
+    OCTOPUS_NOT_USED(processor);
+
+    cmd = (resp_cmd_t *)cmd_obj->obj.cmd;
+    if (cache_ttl_ms == 0 || cmd->argc != 2 || !resp_arg_equal(&cmd->argv[0], "GET")) {
+        return 0;
+    }
+
+    if ((*tag = sdsnewlen(cmd->argv[1].ptr, cmd->argv[1].len)) == NULL) {
+        return 0;
+    }
+
+    return cache_ttl_ms;
+}
+
+void redis_processor_set_cache_ttl(long long ttl_ms) {
+    cache_ttl_ms = ttl_ms;
+}
+
+static void redis_processor_destroy(processor_t *processor) {
+    free(processor);
+}
+
+processor_t* redis_processor_create() {
+    processor_t     *p;
+
+    // Processors keep no state of connections, since commands are completed
+    // by the shards asynchronously.
+    if ((p = calloc(1, sizeof(processor_t))) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for redis processor");
+        return NULL;
+    }
+
+    p->process = redis_process;
+    p->destroy = redis_processor_destroy;
+    p->coalescable = redis_coalescable;
+    p->cache_ttl = redis_cache_ttl;
+
+    return p;
+}
@@ -0,0 +1,35 @@
+/**
+ *
+ * @file    redis_processor
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-03 14:31:09
+ */
+
+#ifndef REDIS_SERVER_REDIS_PROCESSOR_H
+#define REDIS_SERVER_REDIS_PROCESSOR_H
+
+#include "processor.h"
+
+/**
+ * @brief Create the shards of keyspace, each shard is owned by a worker thread,
+ *      and commands are passed to the owner of the key as jobs. Commands are
+ *      pending until the shards finish them, so ioworkers are never blocked.
+ */
+int redis_processor_init(int shard_count);
+
+processor_t* redis_processor_create();
+
+/**
+ * @brief Cache responses of GET for 'ttl_ms', which are invalidated by writes
+ *      of the key. It must be called before the server starts.
+ */
+void redis_processor_set_cache_ttl(long long ttl_ms);
+
+int redis_processor_shard_count();
+
+/**
+ * @brief Count of commands processed by all connections.
+ */
+long long redis_processor_commands_processed();
+
+#endif /* ifndef REDIS_SERVER_REDIS_PROCESSOR_H */
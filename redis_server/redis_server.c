@@ -0,0 +1,136 @@
+/**
+ *
+ * @file    redis_server
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-04 10:12:26
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "octopus.h"
+#include "logging.h"
+#include "common.h"
+#include "redis_processor.h"
+#include "admin_processor.h"
+
+#define DEFAULT_PORT        "6379"
+#define DEFAULT_IOWORKERS   4
+#define DEFAULT_SHARDS      4
+
+static void usage(const char *prog) {
+    fprintf(stderr, "USAGE: %s [-h host] [-p port] [-t ioworkers] [-s shards] [-m admin port] [-c] [-C cache ttl ms]"
+            " [-I idle timeout ms] [-R read timeout ms] [-W write timeout ms] [-e]"
+            " [-b read budget bytes] [-B read budget commands]"
+            " [-H output high watermark] [-L output low watermark] [-M memory limit]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    octopus_t   *oct;
+    const char  *host, *port, *admin_port;
+    int         ioworkers, shard_count, opt, flags, edge_triggered;
+    int         budget_bytes, budget_commands, high_watermark, low_watermark;
+    long long   idle_timeout_ms, read_timeout_ms, write_timeout_ms, memory_limit;
+
+    host = "0.0.0.0";
+    port = DEFAULT_PORT;
+    admin_port = NULL;
+    ioworkers = DEFAULT_IOWORKERS;
+    shard_count = DEFAULT_SHARDS;
+    flags = OCTOPUS_PROCESSOR_SCOPE_GLOBAL;
+    idle_timeout_ms = read_timeout_ms = write_timeout_ms = 0;
+    edge_triggered = 0;
+    budget_bytes = budget_commands = 0;
+    high_watermark = low_watermark = -1;
+    memory_limit = 0;
+    while ((opt = getopt(argc, argv, "h:p:t:s:m:cC:I:R:W:eb:B:H:L:M:")) != -1) {
+        switch (opt) {
+        case 'h': host = optarg; break;
+        case 'p': port = optarg; break;
+        case 't': ioworkers = atoi(optarg); break;
+        case 's': shard_count = atoi(optarg); break;
+        case 'm': admin_port = optarg; break;
+        // identical reads in flight share the response
+        case 'c': flags |= OCTOPUS_PROCESSOR_COALESCE; break;
+        case 'C':
+            flags |= OCTOPUS_PROCESSOR_CACHE;
+            redis_processor_set_cache_ttl(atoll(optarg));
+            break;
+        // slow or stalled clients are closed
+        case 'I': idle_timeout_ms = atoll(optarg); break;
+        case 'R': read_timeout_ms = atoll(optarg); break;
+        case 'W': write_timeout_ms = atoll(optarg); break;
+        // connections are registered once, edge-triggered
+        case 'e': edge_triggered = 1; break;
+        // a busy connection yields to others of its ioworker
+        case 'b': budget_bytes = atoi(optarg); break;
+        case 'B': budget_commands = atoi(optarg); break;
+        // slow readers are paused, 0 to disable
+        case 'H': high_watermark = atoi(optarg); break;
+        case 'L': low_watermark = atoi(optarg); break;
+        // clients with the largest buffers are closed above it
+        case 'M': memory_limit = atoll(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    octopus_set_log_level(OCTOPUS_LOGGING_LEVEL_INFO);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (redis_processor_init(shard_count) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("failed to init shards of keyspace");
+        return 1;
+    }
+
+    if ((oct = octopus_create()) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create octopus");
+        return 1;
+    }
+
+    if (ioworkers > 0) {
+        octopus_set_ioworker_count(oct, ioworkers);
+    }
+    octopus_set_client_timeouts(oct, idle_timeout_ms, read_timeout_ms, write_timeout_ms);
+    octopus_set_edge_triggered(oct, edge_triggered);
+    octopus_set_read_budget(oct, budget_bytes, budget_commands);
+    octopus_set_memory_limit(memory_limit);
+    if (high_watermark >= 0) {
+        octopus_set_output_watermarks(oct, high_watermark,
+                low_watermark >= 0 ? low_watermark : high_watermark / 4);
+    }
+
+    // the processor keeps no state, so it's shared by all connections
+    if (octopus_register_processor_factory_with_scope(oct, OCTOPUS_PROTOCOL_RESP,
+                redis_processor_create, flags) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("failed to register redis processor");
+        return 1;
+    }
+
+    octopus_add_listening_socket(oct, host, port, OCTOPUS_PROTOCOL_RESP);
+
+    // health and metrics are served by HTTP on the admin port
+    if (admin_port != NULL) {
+        if (octopus_register_processor_factory_with_scope(oct, OCTOPUS_PROTOCOL_HTTP,
+                    admin_processor_create, OCTOPUS_PROCESSOR_SCOPE_GLOBAL) == OCTOPUS_ERR) {
+            OCTOPUS_ERROR_LOG("failed to register admin processor");
+            return 1;
+        }
+        octopus_add_listening_socket(oct, host, admin_port, OCTOPUS_PROTOCOL_HTTP);
+    }
+
+    OCTOPUS_INFO_LOG("redis server listens on %s:%s, ioworkers: %d, shards: %d, malloc: %s",
+            host, port, ioworkers, shard_count, octopus_malloc_name());
+    if (octopus_srv_start(oct) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("failed to start redis server");
+        octopus_destroy(oct);
+        return 1;
+    }
+
+    octopus_destroy(oct);
+
+    return 0;
+}
@@ -0,0 +1,1055 @@
+/**
+ *
+ * @file    resp
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-05-27 15:40:18
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "resp.h"
+#include "object.h"
+#include "logging.h"
+#include "common.h"
+#include "scan.h"
+#include "memory.h"
+
+#define RESP_REQ_NONE       0
+#define RESP_REQ_MULTIBULK  1
+#define RESP_REQ_INLINE     2
+
+#define RESP_ARGV_INIT_SIZE     8
+#define RESP_NUMBER_MAX_LEN     21
+
+// Replies of small integers and headers of short bulk strings and arrays are
+// precomputed.
+#define RESP_SHARED_INTEGERS    10000
+#define RESP_SHARED_HDR_COUNT   32
+
+#define ring_offset(b, off)     (((b)->start + (off)) % (b)->size)
+
+typedef struct {
+    char            s[15];
+    unsigned char   len;
+} shared_str_t;
+
+typedef struct {
+    protocol_t_implement;
+
+    int     version;
+
+    // State of the request being parsed, which is kept across reads. The input
+    // buffer isn't advanced until the whole request has been parsed, so the
+    // arguments can point into it. Offsets are relative to input->start.
+    int         req_type;
+    int         pos;        // start of the next line or bulk to parse
+    int         scan;       // position to continue searching the line end
+    int         multibulk_len;
+    long        bulk_len;
+    resp_cmd_t  *cmd;
+} resp_protocol_t;
+
+static shared_str_t shared_integers[RESP_SHARED_INTEGERS];
+static shared_str_t shared_bulkhdr[RESP_SHARED_HDR_COUNT];
+static shared_str_t shared_mbulkhdr[RESP_SHARED_HDR_COUNT];
+static shared_str_t shared_maphdr[RESP_SHARED_HDR_COUNT];
+static pthread_once_t shared_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Convert a long long to string, return the length of the string.
+ */
+static int ll2str(char *s, long long v) {
+    char                buf[RESP_NUMBER_MAX_LEN];
+    unsigned long long  uv;
+    int                 len, i;
+
+    uv = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+    len = 0;
+    do {
+        buf[len++] = '0' + uv % 10;
+        uv /= 10;
+    } while (uv > 0);
+
+    i = 0;
+    if (v < 0) {
+        s[i++] = '-';
+    }
+    while (len > 0) {
+        s[i++] = buf[--len];
+    }
+    s[i] = '\0';
+
+    return i;
+}
+
+static void shared_str_init(shared_str_t *shared, char prefix, long long v) {
+    shared->s[0] = prefix;
+    shared->len = 1 + ll2str(shared->s + 1, v);
+    shared->s[shared->len++] = '\r';
+    shared->s[shared->len++] = '\n';
+}
+
+static void shared_init() {
+    for (int i = 0; i < RESP_SHARED_INTEGERS; i++) {
+        shared_str_init(&shared_integers[i], ':', i);
+    }
+
+    for (int i = 0; i < RESP_SHARED_HDR_COUNT; i++) {
+        shared_str_init(&shared_bulkhdr[i], '$', i);
+        shared_str_init(&shared_mbulkhdr[i], '*', i);
+        shared_str_init(&shared_maphdr[i], '%', i);
+    }
+}
+
+/**
+ * Find 'c' in range [from, to) of the buffer, which are relative offsets.
+ * @return relative offset of 'c', or -1 if not found.
+ */
+static int find_char(buffer_t *input, int from, int to, char c) {
+    int     idx, first_part_len, ret;
+
+    if (from >= to) {
+        return -1;
+    }
+
+    idx = ring_offset(input, from);
+    first_part_len = input->size - idx;
+    if (first_part_len >= to - from) {
+        ret = scan_char(input->buf + idx, to - from, c);
+        return ret == -1 ? -1 : from + ret;
+    }
+
+    if ((ret = scan_char(input->buf + idx, first_part_len, c)) != -1) {
+        return from + ret;
+    }
+    ret = scan_char(input->buf, to - from - first_part_len, c);
+
+    return ret == -1 ? -1 : from + first_part_len + ret;
+}
+
+/**
+ * Parse a number in range [from, to) of the buffer.
+ */
+static int parse_number(buffer_t *input, int from, int to, long long *v) {
+    long long   n;
+    int         neg;
+    char        c;
+
+    if (from >= to || to - from > RESP_NUMBER_MAX_LEN) {
+        return OCTOPUS_ERR;
+    }
+
+    neg = buffer_at(input, from) == '-';
+    if (neg && ++from == to) {
+        return OCTOPUS_ERR;
+    }
+
+    n = 0;
+    for (int i = from; i < to; i++) {
+        c = buffer_at(input, i);
+        if (c < '0' || c > '9') {
+            return OCTOPUS_ERR;
+        }
+        n = n * 10 + (c - '0');
+    }
+    *v = neg ? -n : n;
+
+    return OCTOPUS_OK;
+}
+
+static void resp_cmd_destroy(command_t *c) {
+    resp_cmd_t  *cmd;
+
+    cmd = (resp_cmd_t *)c;
+    for (int i = 0; i < cmd->argc; i++) {
+        if (cmd->argv[i].copy != NULL) {
+            sdsfree(cmd->argv[i].copy);
+        }
+    }
+
+    octopus_free(cmd->argv);
+    octopus_free(cmd);
+}
+
+static resp_cmd_t* resp_cmd_create(int argv_size) {
+    resp_cmd_t  *cmd;
+
+    if ((cmd = octopus_calloc(1, sizeof(resp_cmd_t), OCTOPUS_MEM_COMMAND)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for resp command");
+        return NULL;
+    }
+
+    cmd->argv_size = argv_size > RESP_ARGV_INIT_SIZE ? argv_size : RESP_ARGV_INIT_SIZE;
+    if ((cmd->argv = octopus_malloc(sizeof(resp_arg_t) * cmd->argv_size,
+                    OCTOPUS_MEM_COMMAND)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for argv of resp command, argc: %d", argv_size);
+        octopus_free(cmd);
+        return NULL;
+    }
+    cmd->destroy = resp_cmd_destroy;
+
+    return cmd;
+}
+
+/**
+ * Add range [off, off + len) of the buffer as the next argument. It points into
+ * the buffer if the range is continuous.
+ */
+static int resp_cmd_add_arg(resp_cmd_t *cmd, buffer_t *input, int off, int len) {
+    resp_arg_t  *arg, *argv;
+    int         idx, first_part_len;
+
+    if (cmd->argc == cmd->argv_size) {
+        if ((argv = octopus_realloc(cmd->argv, sizeof(resp_arg_t) * cmd->argv_size * 2)) == NULL) {
+            OCTOPUS_ERROR_LOG("failed to expand argv of resp command, argc: %d", cmd->argc);
+            return OCTOPUS_ERR;
+        }
+        cmd->argv = argv;
+        cmd->argv_size *= 2;
+    }
+
+    arg = &cmd->argv[cmd->argc];
+    idx = ring_offset(input, off);
+    first_part_len = input->size - idx;
+    if (first_part_len >= len) {
+        arg->ptr = input->buf + idx;
+        arg->copy = NULL;
+    } else {
+        if ((arg->copy = sdsnewlen(input->buf + idx, first_part_len)) == NULL ||
+                (arg->copy = sdscatlen(arg->copy, input->buf, len - first_part_len)) == NULL) {
+            OCTOPUS_ERROR_LOG("failed to alloc mem for resp argument, len: %d", len);
+            return OCTOPUS_ERR;
+        }
+        arg->ptr = arg->copy;
+    }
+    arg->len = len;
+    cmd->argc++;
+
+    return OCTOPUS_OK;
+}
+
+int resp_arg_equal(const resp_arg_t *arg, const char *s) {
+    return (int)strlen(s) == arg->len && strncasecmp(arg->ptr, s, arg->len) == 0;
+}
+
+// Command name is case-insensitive, and other arguments are compared exactly.
+static unsigned int resp_cmd_hash(object_t *cmd_obj) {
+    resp_cmd_t      *cmd;
+    unsigned int    h;
+
+    cmd = (resp_cmd_t *)cmd_obj->obj.cmd;
+    // FNV-1a
+    h = 2166136261u ^ (unsigned int)cmd->argc;
+    for (int i = 0; i < cmd->argc; i++) {
+        for (int j = 0; j < cmd->argv[i].len; j++) {
+            h = (h ^ (i == 0 ? (unsigned char)tolower(cmd->argv[i].ptr[j]) :
+                        (unsigned char)cmd->argv[i].ptr[j])) * 16777619u;
+        }
+        h = (h ^ (unsigned int)cmd->argv[i].len) * 16777619u;
+    }
+
+    return h;
+}
+
+static int resp_cmd_equal(object_t *a, object_t *b) {
+    resp_cmd_t  *x, *y;
+
+    x = (resp_cmd_t *)a->obj.cmd;
+    y = (resp_cmd_t *)b->obj.cmd;
+    if (x->argc != y->argc) {
+        return OCTOPUS_FALSE;
+    }
+
+    for (int i = 0; i < x->argc; i++) {
+        if (x->argv[i].len != y->argv[i].len) {
+            return OCTOPUS_FALSE;
+        }
+
+        if (i == 0 ? strncasecmp(x->argv[i].ptr, y->argv[i].ptr, x->argv[i].len) != 0 :
+                memcmp(x->argv[i].ptr, y->argv[i].ptr, x->argv[i].len) != 0) {
+            return OCTOPUS_FALSE;
+        }
+    }
+
+    return OCTOPUS_TRUE;
+}
+
+static object_t* resp_cmd_dup(object_t *cmd_obj) {
+    resp_cmd_t  *cmd, *copy;
+    object_t    *obj;
+
+    cmd = (resp_cmd_t *)cmd_obj->obj.cmd;
+    if ((copy = resp_cmd_create(cmd->argc)) == NULL) {
+        return NULL;
+    }
+
+    for (int i = 0; i < cmd->argc; i++) {
+        if ((copy->argv[i].copy = sdsnewlen(cmd->argv[i].ptr, cmd->argv[i].len)) == NULL) {
+            OCTOPUS_ERROR_LOG("failed to alloc mem for copy of resp argument, len: %d",
+                    cmd->argv[i].len);
+            resp_cmd_destroy((command_t *)copy);
+            return NULL;
+        }
+        copy->argv[i].ptr = copy->argv[i].copy;
+        copy->argv[i].len = cmd->argv[i].len;
+        copy->argc++;
+    }
+
+    if ((obj = object_create_cmd((command_t *)copy)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create object for copy of resp command");
+        resp_cmd_destroy((command_t *)copy);
+        return NULL;
+    }
+
+    return obj;
+}
+
+/**
+ * Key of a command for the response cache, the version is included since the
+ * encoding depends on it. Arguments are prefixed by their length, so it's
+ * unambiguous.
+ */
+static sds resp_cmd_key(void *state, object_t *cmd_obj) {
+    resp_protocol_t *p;
+    resp_cmd_t      *cmd;
+    char            hdr[RESP_NUMBER_MAX_LEN + 2];
+    sds             key;
+    int             len;
+
+    p = (resp_protocol_t *)state;
+    cmd = (resp_cmd_t *)cmd_obj->obj.cmd;
+
+    len = snprintf(hdr, sizeof(hdr), "%d", p->version);
+    if ((key = sdsnewlen(hdr, len)) == NULL) {
+        return NULL;
+    }
+
+    for (int i = 0; i < cmd->argc && key != NULL; i++) {
+        len = snprintf(hdr, sizeof(hdr), "$%d:", cmd->argv[i].len);
+        if ((key = sdscatlen(key, hdr, len)) == NULL ||
+                (key = sdscatlen(key, cmd->argv[i].ptr, cmd->argv[i].len)) == NULL) {
+            break;
+        }
+
+        // command name is case-insensitive
+        if (i == 0) {
+            for (int j = sdslen(key) - cmd->argv[i].len; j < (int)sdslen(key); j++) {
+                key[j] = tolower(key[j]);
+            }
+        }
+    }
+
+    if (key == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for key of resp command");
+    }
+
+    return key;
+}
+
+static void request_reset(resp_protocol_t *p) {
+    p->req_type = RESP_REQ_NONE;
+    p->pos = 0;
+    p->scan = 0;
+    p->multibulk_len = 0;
+    p->bulk_len = -1;
+    p->cmd = NULL;
+}
+
+/**
+ * Emit the command parsed, and advance the input buffer over the request.
+ */
+static int request_done(resp_protocol_t *p, buffer_t *input, deque_t *output_cmd_objs) {
+    object_t    *obj;
+    resp_cmd_t  *cmd;
+
+    cmd = p->cmd;
+    buffer_advance_step(input, p->pos);
+    request_reset(p);
+
+    if (cmd == NULL) {
+        // empty request
+        return OCTOPUS_OK;
+    }
+
+    if ((obj = object_create_cmd((command_t *)cmd)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to create object for resp command");
+        resp_cmd_destroy((command_t *)cmd);
+        return OCTOPUS_ERR;
+    }
+
+    if (deque_push_back(output_cmd_objs, obj) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("failed to add resp command to deque");
+        obj->decr(obj);
+        return OCTOPUS_ERR;
+    }
+
+    return OCTOPUS_OK;
+}
+
+/**
+ * Find the '\r\n' of the line starting at p->pos.
+ * @return relative offset of '\r', OCTOPUS_AGAIN if more data is needed, or
+ *      OCTOPUS_ERR if '\r' isn't followed by '\n'.
+ */
+static int find_line_end(resp_protocol_t *p, buffer_t *input) {
+    int     content_len, idx;
+
+    content_len = buffer_content_len(input);
+    if ((idx = find_char(input, p->scan, content_len, '\r')) == -1) {
+        p->scan = content_len;
+        return OCTOPUS_AGAIN;
+    }
+
+    if (idx + 1 == content_len) {
+        // '\n' hasn't arrived yet
+        p->scan = idx;
+        return OCTOPUS_AGAIN;
+    }
+
+    if (buffer_at(input, idx + 1) != '\n') {
+        OCTOPUS_ERROR_LOG("protocol error, expect '\\n' after '\\r'");
+        return OCTOPUS_ERR;
+    }
+
+    return idx;
+}
+
+static int parse_inline(resp_protocol_t *p, buffer_t *input) {
+    int     content_len, idx, end, from;
+
+    content_len = buffer_content_len(input);
+    if ((idx = find_char(input, p->scan, content_len, '\n')) == -1) {
+        if (content_len > RESP_MAX_INLINE_LEN) {
+            OCTOPUS_ERROR_LOG("protocol error, too big inline request, len: %d", content_len);
+            return OCTOPUS_ERR;
+        }
+        p->scan = content_len;
+        return OCTOPUS_AGAIN;
+    }
+
+    end = idx;
+    if (end > 0 && buffer_at(input, end - 1) == '\r') {
+        end--;
+    }
+
+    for (from = 0; from < end;) {
+        while (from < end && (buffer_at(input, from) == ' ' || buffer_at(input, from) == '\t')) {
+            from++;
+        }
+        if (from == end) {
+            break;
+        }
+
+        if (p->cmd == NULL && (p->cmd = resp_cmd_create(RESP_ARGV_INIT_SIZE)) == NULL) {
+            return OCTOPUS_ERR;
+        }
+
+        for (idx = from; idx < end && buffer_at(input, idx) != ' ' &&
+                buffer_at(input, idx) != '\t'; idx++);
+
+        if (resp_cmd_add_arg(p->cmd, input, from, idx - from) == OCTOPUS_ERR) {
+            return OCTOPUS_ERR;
+        }
+        from = idx;
+    }
+
+    // skip '\n'
+    p->pos = (end < content_len && buffer_at(input, end) == '\r') ? end + 2 : end + 1;
+
+    return OCTOPUS_OK;
+}
+
+static int parse_multibulk(resp_protocol_t *p, buffer_t *input) {
+    int         idx;
+    long long   v;
+
+    if (p->cmd == NULL) {
+        // '*<count>\r\n'
+        if ((idx = find_line_end(p, input)) < 0) {
+            return idx;
+        }
+
+        if (parse_number(input, p->pos + 1, idx, &v) == OCTOPUS_ERR ||
+                v > RESP_MAX_MULTIBULK_LEN) {
+            OCTOPUS_ERROR_LOG("protocol error, invalid multibulk length");
+            return OCTOPUS_ERR;
+        }
+
+        p->pos = p->scan = idx + 2;
+        if (v <= 0) {
+            // '*0' and '*-1' are empty requests
+            return OCTOPUS_OK;
+        }
+
+        if ((p->cmd = resp_cmd_create(v < 1024 ? v : 1024)) == NULL) {
+            return OCTOPUS_ERR;
+        }
+        p->multibulk_len = v;
+    }
+
+    while (p->multibulk_len > 0) {
+        if (p->bulk_len < 0) {
+            // '$<len>\r\n'
+            if ((idx = find_line_end(p, input)) < 0) {
+                return idx;
+            }
+
+            if (buffer_at(input, p->pos) != '$') {
+                OCTOPUS_ERROR_LOG("protocol error, expect '$', got '%c'", buffer_at(input, p->pos));
+                return OCTOPUS_ERR;
+            }
+
+            if (parse_number(input, p->pos + 1, idx, &v) == OCTOPUS_ERR || v < 0 ||
+                    idx + 2 + v + 2 > input->size - 1) {
+                OCTOPUS_ERROR_LOG("protocol error, invalid bulk length");
+                return OCTOPUS_ERR;
+            }
+
+            p->pos = p->scan = idx + 2;
+            p->bulk_len = v;
+        }
+
+        // The length is known, so a partial bulk needn't be scanned.
+        if (buffer_content_len(input) - p->pos < p->bulk_len + 2) {
+            return OCTOPUS_AGAIN;
+        }
+
+        if (resp_cmd_add_arg(p->cmd, input, p->pos, p->bulk_len) == OCTOPUS_ERR) {
+            return OCTOPUS_ERR;
+        }
+
+        p->pos = p->scan = p->pos + p->bulk_len + 2;
+        p->bulk_len = -1;
+        p->multibulk_len--;
+    }
+
+    return OCTOPUS_OK;
+}
+
+static int resp_decode(void *state, buffer_t *input, deque_t *output_cmd_objs) {
+    resp_protocol_t     *p;
+    int                 ret;
+
+    p = (resp_protocol_t *)state;
+    while (buffer_content_len(input) > p->pos) {
+        if (p->req_type == RESP_REQ_NONE) {
+            p->req_type = buffer_current(input) == '*' ? RESP_REQ_MULTIBULK : RESP_REQ_INLINE;
+        }
+
+        if (p->req_type == RESP_REQ_MULTIBULK) {
+            ret = parse_multibulk(p, input);
+        } else {
+            ret = parse_inline(p, input);
+        }
+
+        if (ret == OCTOPUS_AGAIN) {
+            break;
+        } else if (ret == OCTOPUS_ERR) {
+            return OCTOPUS_ERR;
+        }
+
+        if (request_done(p, input, output_cmd_objs) == OCTOPUS_ERR) {
+            return OCTOPUS_ERR;
+        }
+    }
+
+    return OCTOPUS_OK;
+}
+
+static void resp_reply_cmd_destroy(command_t *cmd) {
+    resp_reply_destroy((resp_reply_t *)cmd);
+}
+
+static resp_reply_t* reply_create(int type) {
+    resp_reply_t    *r;
+
+    if ((r = octopus_calloc(1, sizeof(resp_reply_t), OCTOPUS_MEM_COMMAND)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for resp reply");
+        return NULL;
+    }
+    r->type = type;
+    r->destroy = resp_reply_cmd_destroy;
+
+    return r;
+}
+
+static resp_reply_t* reply_create_str(int type, const char *s, int len) {
+    resp_reply_t    *r;
+
+    if ((r = reply_create(type)) == NULL) {
+        return NULL;
+    }
+
+    if ((r->str = sdsnewlen(s, len)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for resp reply string, len: %d", len);
+        octopus_free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+resp_reply_t* resp_reply_status(const char *status) {
+    return reply_create_str(RESP_REPLY_STATUS, status, strlen(status));
+}
+
+resp_reply_t* resp_reply_error(const char *err) {
+    return reply_create_str(RESP_REPLY_ERROR, err, strlen(err));
+}
+
+resp_reply_t* resp_reply_integer(long long v) {
+    resp_reply_t    *r;
+
+    if ((r = reply_create(RESP_REPLY_INTEGER)) != NULL) {
+        r->integer = v;
+    }
+
+    return r;
+}
+
+resp_reply_t* resp_reply_double(double v) {
+    resp_reply_t    *r;
+
+    if ((r = reply_create(RESP_REPLY_DOUBLE)) != NULL) {
+        r->dval = v;
+    }
+
+    return r;
+}
+
+resp_reply_t* resp_reply_bool(int v) {
+    resp_reply_t    *r;
+
+    if ((r = reply_create(RESP_REPLY_BOOL)) != NULL) {
+        r->integer = v ? 1 : 0;
+    }
+
+    return r;
+}
+
+resp_reply_t* resp_reply_bulk(const char *s, int len) {
+    return reply_create_str(RESP_REPLY_BULK, s, len);
+}
+
+resp_reply_t* resp_reply_bulk_ref(bufref_t *ref) {
+    resp_reply_t    *r;
+
+    if ((r = reply_create(RESP_REPLY_BULK)) != NULL) {
+        bufref_incr(ref);
+        r->ref = ref;
+    }
+
+    return r;
+}
+
+resp_reply_t* resp_reply_null() {
+    return reply_create(RESP_REPLY_NULL);
+}
+
+resp_reply_t* resp_reply_array(int type, int elements) {
+    resp_reply_t    *r;
+    int             count;
+
+    if (type != RESP_REPLY_ARRAY && type != RESP_REPLY_MAP) {
+        OCTOPUS_ERROR_LOG("not an aggregate type of resp reply, type: %d", type);
+        return NULL;
+    }
+
+    if ((r = reply_create(type)) == NULL) {
+        return NULL;
+    }
+
+    count = type == RESP_REPLY_MAP ? elements * 2 : elements;
+    if (count > 0 && (r->element = octopus_calloc(count, sizeof(resp_reply_t *),
+                    OCTOPUS_MEM_COMMAND)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for elements of resp reply, count: %d", count);
+        octopus_free(r);
+        return NULL;
+    }
+    r->elements = elements;
+
+    return r;
+}
+
+void resp_reply_set_element(resp_reply_t *array, int idx, resp_reply_t *e) {
+    array->element[idx] = e;
+}
+
+void resp_reply_destroy(resp_reply_t *reply) {
+    int     count;
+
+    if (reply == NULL) {
+        return;
+    }
+
+    if (reply->str != NULL) {
+        sdsfree(reply->str);
+    }
+    if (reply->ref != NULL) {
+        bufref_decr(reply->ref);
+    }
+
+    count = reply->type == RESP_REPLY_MAP ? reply->elements * 2 : reply->elements;
+    for (int i = 0; i < count; i++) {
+        resp_reply_destroy(reply->element[i]);
+    }
+    octopus_free(reply->element);
+    octopus_free(reply);
+}
+
+/**
+ * Format '<prefix><v>\r\n', precomputed tables are used for small values.
+ */
+static inline int format_hdr(char *buf, char prefix, long long v) {
+    shared_str_t    *shared;
+    int             len;
+
+    shared = NULL;
+    if (prefix == ':' && v >= 0 && v < RESP_SHARED_INTEGERS) {
+        shared = &shared_integers[v];
+    } else if (v >= 0 && v < RESP_SHARED_HDR_COUNT) {
+        if (prefix == '$') {
+            shared = &shared_bulkhdr[v];
+        } else if (prefix == '*') {
+            shared = &shared_mbulkhdr[v];
+        } else if (prefix == '%') {
+            shared = &shared_maphdr[v];
+        }
+    }
+
+    if (shared != NULL) {
+        memcpy(buf, shared->s, shared->len);
+        return shared->len;
+    }
+
+    buf[0] = prefix;
+    len = 1 + ll2str(buf + 1, v);
+    buf[len++] = '\r';
+    buf[len++] = '\n';
+
+    return len;
+}
+
+/**
+ * Length of inline bytes of the encoded reply, refs are excluded.
+ */
+static long reply_encoded_len(int version, resp_reply_t *r) {
+    char    buf[64];
+    long    len;
+    int     count;
+
+    switch (r->type) {
+    case RESP_REPLY_STATUS:
+    case RESP_REPLY_ERROR:
+        return sdslen(r->str) + 3;
+    case RESP_REPLY_INTEGER:
+        return format_hdr(buf, ':', r->integer);
+    case RESP_REPLY_BOOL:
+        return version == RESP_VERSION_3 ? 4 : format_hdr(buf, ':', r->integer);
+    case RESP_REPLY_DOUBLE:
+        len = snprintf(buf, sizeof(buf), "%.17g", r->dval);
+        return version == RESP_VERSION_3 ? len + 3 : format_hdr(buf, '$', len) + len + 2;
+    case RESP_REPLY_NULL:
+        return version == RESP_VERSION_3 ? 3 : 5;
+    case RESP_REPLY_BULK:
+        len = r->ref != NULL ? r->ref->len : (long)sdslen(r->str);
+        return format_hdr(buf, '$', len) + (r->ref != NULL ? 0 : len) + 2;
+    case RESP_REPLY_ARRAY:
+    case RESP_REPLY_MAP:
+        count = r->type == RESP_REPLY_MAP ? r->elements * 2 : r->elements;
+        len = format_hdr(buf, '*', count);
+        for (int i = 0; i < count; i++) {
+            len += reply_encoded_len(version, r->element[i]);
+        }
+        return len;
+    }
+
+    return 0;
+}
+
+static int reply_write(int version, resp_reply_t *r, buffer_t *output) {
+    char    buf[64];
+    int     len, count;
+
+    switch (r->type) {
+    case RESP_REPLY_STATUS:
+    case RESP_REPLY_ERROR:
+        buffer_write_from(output, r->type == RESP_REPLY_STATUS ? "+" : "-", 1);
+        buffer_write_from(output, r->str, sdslen(r->str));
+        return buffer_write_from(output, "\r\n", 2);
+    case RESP_REPLY_INTEGER:
+        return buffer_write_from(output, buf, format_hdr(buf, ':', r->integer));
+    case RESP_REPLY_BOOL:
+        if (version == RESP_VERSION_3) {
+            return buffer_write_from(output, r->integer ? "#t\r\n" : "#f\r\n", 4);
+        }
+        return buffer_write_from(output, buf, format_hdr(buf, ':', r->integer));
+    case RESP_REPLY_DOUBLE:
+        if (version == RESP_VERSION_3) {
+            buf[0] = ',';
+            len = 1 + snprintf(buf + 1, sizeof(buf) - 3, "%.17g", r->dval);
+        } else {
+            char    d[32];
+            int     dlen;
+
+            dlen = snprintf(d, sizeof(d), "%.17g", r->dval);
+            len = format_hdr(buf, '$', dlen);
+            memcpy(buf + len, d, dlen);
+            len += dlen;
+        }
+        buf[len++] = '\r';
+        buf[len++] = '\n';
+        return buffer_write_from(output, buf, len);
+    case RESP_REPLY_NULL:
+        if (version == RESP_VERSION_3) {
+            return buffer_write_from(output, "_\r\n", 3);
+        }
+        return buffer_write_from(output, "$-1\r\n", 5);
+    case RESP_REPLY_BULK:
+        if (r->ref != NULL) {
+            buffer_write_from(output, buf, format_hdr(buf, '$', r->ref->len));
+            if (buffer_attach_ref(output, r->ref) == OCTOPUS_ERR) {
+                return OCTOPUS_ERR;
+            }
+        } else {
+            buffer_write_from(output, buf, format_hdr(buf, '$', sdslen(r->str)));
+            buffer_write_from(output, r->str, sdslen(r->str));
+        }
+        return buffer_write_from(output, "\r\n", 2);
+    case RESP_REPLY_ARRAY:
+    case RESP_REPLY_MAP:
+        if (r->type == RESP_REPLY_MAP && version == RESP_VERSION_3) {
+            buffer_write_from(output, buf, format_hdr(buf, '%', r->elements));
+            count = r->elements * 2;
+        } else {
+            count = r->type == RESP_REPLY_MAP ? r->elements * 2 : r->elements;
+            buffer_write_from(output, buf, format_hdr(buf, '*', count));
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (reply_write(version, r->element[i], output) == OCTOPUS_ERR) {
+                return OCTOPUS_ERR;
+            }
+        }
+        return OCTOPUS_OK;
+    }
+
+    OCTOPUS_ERROR_LOG("unknown type of resp reply, type: %d", r->type);
+    return OCTOPUS_ERR;
+}
+
+static int resp_encode(void *state, object_t *cmd_obj, buffer_t *output) {
+    resp_protocol_t     *p;
+    resp_reply_t        *reply;
+    long                len;
+
+    p = (resp_protocol_t *)state;
+    reply = (resp_reply_t *)cmd_obj->obj.cmd;
+
+    // HELLO replies in the version switched to.
+    if (reply->proto == RESP_VERSION_2 || reply->proto == RESP_VERSION_3) {
+        p->version = reply->proto;
+    }
+
+    // Check the space first, so a reply is never written partially.
+    len = reply_encoded_len(p->version, reply);
+    if (len > INT_MAX || buffer_reserve(output, (int)len) == OCTOPUS_ERR) {
+        OCTOPUS_ERROR_LOG("no space to encode resp reply, remaining: %d, reply len: %ld",
+                buffer_space_remaining(output), len);
+        return OCTOPUS_ERR;
+    }
+
+    return reply_write(p->version, reply, output);
+}
+
+static void resp_destroy(protocol_t *protocol) {
+    resp_protocol_t     *p;
+
+    p = (resp_protocol_t *)protocol;
+    if (p->cmd != NULL) {
+        resp_cmd_destroy((command_t *)p->cmd);
+    }
+
+    octopus_free(p);
+}
+
+protocol_t* resp_protocol_create() {
+    resp_protocol_t     *p;
+
+    pthread_once(&shared_once, shared_init);
+
+    if ((p = octopus_calloc(1, sizeof(resp_protocol_t), OCTOPUS_MEM_CLIENT)) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for resp protocol");
+        return NULL;
+    }
+
+    p->decode = resp_decode;
+    p->encode = resp_encode;
+    p->destroy = resp_destroy;
+    p->cmd_hash = resp_cmd_hash;
+    p->cmd_equal = resp_cmd_equal;
+    p->cmd_dup = resp_cmd_dup;
+    p->cmd_key = resp_cmd_key;
+    p->version = RESP_VERSION_2;
+    request_reset(p);
+
+    return (protocol_t *)p;
+}
+
+#ifdef OCTOPUS_TEST_RESP
+
+#include <stdio.h>
+
+/**
+ * Pop the commands decoded, and count the ones which differ from 'expected',
+ * whose arguments are separated by ' '.
+ */
+static int test_check(deque_t *cmds, const char **expected, int *next) {
+    object_t    *obj;
+    resp_cmd_t  *cmd;
+    sds         args;
+    int         wrong;
+
+    wrong = 0;
+    while ((obj = deque_pop_front(cmds)) != NULL) {
+        cmd = (resp_cmd_t *)obj->obj.cmd;
+        args = sdsempty();
+        for (int i = 0; i < cmd->argc; i++) {
+            args = sdscatlen(args, " ", i > 0);
+            args = sdscatlen(args, cmd->argv[i].ptr, cmd->argv[i].len);
+        }
+        if (strcmp(args, expected[*next]) != 0) {
+            printf("command %d, expected: '%.20s', got: '%.20s'\n", *next, expected[*next], args);
+            wrong++;
+        }
+        (*next)++;
+        sdsfree(args);
+        obj->decr(obj);
+    }
+
+    return wrong;
+}
+
+static void test_encode(protocol_t *p, resp_reply_t *reply, buffer_t *output) {
+    object_t    *obj;
+
+    obj = object_create_cmd((command_t *)reply);
+    p->encode(p, obj, output);
+    obj->decr(obj);
+}
+
+/**
+ * Replies of each type, RESP3 types are encoded as RESP2 ones before HELLO 3.
+ */
+static sds test_replies(protocol_t *p, buffer_t *output, int proto) {
+    resp_reply_t    *r;
+    sds             s;
+
+    r = resp_reply_status("OK");
+    r->proto = proto;
+    test_encode(p, r, output);
+    test_encode(p, resp_reply_integer(42), output);
+    test_encode(p, resp_reply_null(), output);
+    test_encode(p, resp_reply_bool(1), output);
+    test_encode(p, resp_reply_double(1.5), output);
+    r = resp_reply_array(RESP_REPLY_MAP, 1);
+    resp_reply_set_element(r, 0, resp_reply_bulk("a", 1));
+    resp_reply_set_element(r, 1, resp_reply_integer(1));
+    test_encode(p, r, output);
+    r = resp_reply_array(RESP_REPLY_ARRAY, 2);
+    resp_reply_set_element(r, 0, resp_reply_bulk("x", 1));
+    resp_reply_set_element(r, 1, resp_reply_null());
+    test_encode(p, r, output);
+
+    s = sdsempty();
+    buffer_read_to_sds(output, &s, buffer_content_len(output));
+
+    return s;
+}
+
+int main(int argc, char *argv[])
+{
+    protocol_t  *p;
+    buffer_t    *input, *output;
+    deque_t     *cmds;
+    sds         stream, bulk, replies;
+    int         off, chunk, next, wrong;
+    const char  *expected[64];
+    int         expected_count;
+
+    OCTOPUS_NOT_USED(argc);
+    OCTOPUS_NOT_USED(argv);
+
+    // multibulk and inline requests, with a bulk longer than the reads
+    bulk = sdsempty();
+    for (int i = 0; i < 100; i++) {
+        bulk = sdscatlen(bulk, "0123456789" + i % 10, 1);
+    }
+    stream = sdsempty();
+    expected_count = 0;
+    for (int round = 0; round < 8; round++) {
+        stream = sdscat(stream, "*3\r\n$3\r\nSET\r\n$3\r\nkey\r\n$100\r\n");
+        stream = sdscatsds(stream, bulk);
+        stream = sdscat(stream, "\r\n");
+        expected[expected_count++] = NULL;
+        stream = sdscat(stream, "PING  hello\r\n*2\r\n$5\r\nHELLO\r\n$1\r\n3\r\n*0\r\nGET k\n");
+        expected[expected_count++] = "PING hello";
+        expected[expected_count++] = "HELLO 3";
+        expected[expected_count++] = "GET k";
+    }
+    replies = sdscatsds(sdsnew("SET key "), bulk);
+    for (int i = 0; i < expected_count; i++) {
+        if (expected[i] == NULL) {
+            expected[i] = replies;
+        }
+    }
+
+    // The requests arrive in reads of 1 to 7 bytes, and the ring wraps around
+    // its end many times.
+    p = resp_protocol_create();
+    input = buffer_create(256);
+    cmds = deque_create(16, NULL);
+    next = wrong = 0;
+    for (off = 0, chunk = 1; off < (int)sdslen(stream); off += chunk, chunk = chunk % 7 + 1) {
+        chunk = chunk < (int)sdslen(stream) - off ? chunk : (int)sdslen(stream) - off;
+        buffer_write_from(input, stream + off, chunk);
+        if (p->decode(p, input, cmds) == OCTOPUS_ERR) {
+            printf("failed to decode at %d\n", off);
+            break;
+        }
+        wrong += test_check(cmds, expected, &next);
+    }
+    printf("split requests, decoded: %d of %d, wrong: %d, left: %d\n", next, expected_count,
+            wrong, buffer_content_len(input));
+    sdsfree(replies);
+
+    // replies in RESP2, and in RESP3 after the reply switching to it
+    output = buffer_create(1024);
+    replies = test_replies(p, output, 0);
+    printf("resp2 replies: %d\n", strcmp(replies,
+                "+OK\r\n:42\r\n$-1\r\n:1\r\n$3\r\n1.5\r\n*2\r\n$1\r\na\r\n:1\r\n"
+                "*2\r\n$1\r\nx\r\n$-1\r\n") == 0);
+    sdsfree(replies);
+    replies = test_replies(p, output, RESP_VERSION_3);
+    printf("resp3 replies: %d\n", strcmp(replies,
+                "+OK\r\n:42\r\n_\r\n#t\r\n,1.5\r\n%1\r\n$1\r\na\r\n:1\r\n"
+                "*2\r\n$1\r\nx\r\n_\r\n") == 0);
+    sdsfree(replies);
+
+    sdsfree(stream);
+    sdsfree(bulk);
+    deque_destroy(cmds);
+    p->destroy(p);
+    buffer_destroy(input);
+    buffer_destroy(output);
+
+    return 0;
+}
+
+#endif
@@ -0,0 +1,118 @@
+/**
+ *
+ * @file    resp
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-05-27 15:06:52
+ */
+
+#ifndef OCTOPUS_RESP_H
+#define OCTOPUS_RESP_H
+
+#include "sds.h"
+#include "bufref.h"
+#include "command.h"
+#include "protocol.h"
+
+/**
+ * Name of the built-in redis protocol(RESP2 and RESP3), which is registered by
+ * octopus_create.
+ */
+#define OCTOPUS_PROTOCOL_RESP   "resp"
+
+#define RESP_VERSION_2      2
+#define RESP_VERSION_3      3
+
+// Max args of a command and max length of an inline command.
+#define RESP_MAX_MULTIBULK_LEN  (1024 * 1024)
+#define RESP_MAX_INLINE_LEN     (64 * 1024)
+
+#define RESP_REPLY_STATUS   1
+#define RESP_REPLY_ERROR    2
+#define RESP_REPLY_INTEGER  3
+#define RESP_REPLY_BULK     4
+#define RESP_REPLY_NULL     5
+#define RESP_REPLY_ARRAY    6
+// RESP3 types, which are encoded as the nearest RESP2 types for RESP2 clients.
+#define RESP_REPLY_DOUBLE   7
+#define RESP_REPLY_BOOL     8
+#define RESP_REPLY_MAP      9
+
+/**
+ * An argument of a command. 'ptr' points into the input buffer if the argument is
+ * continuous in it, otherwise it points to 'copy'. So it's only valid during
+ * the processing of the command.
+ */
+typedef struct {
+    const char  *ptr;
+    int         len;
+    sds         copy;
+} resp_arg_t;
+
+/**
+ * Command decoded from a multibulk request or an inline request.
+ */
+typedef struct {
+    command_t_implement
+
+    int         argc;
+    int         argv_size;
+    resp_arg_t  *argv;
+} resp_cmd_t;
+
+typedef struct resp_reply_s resp_reply_t;
+
+/**
+ * Reply of a command, which is returned by processors.
+ * For RESP_REPLY_MAP, 'element' holds key and value alternately.
+ */
+struct resp_reply_s {
+    command_t_implement
+
+    int         type;
+    long long   integer;
+    double      dval;
+
+    // status, error and bulk string
+    sds         str;
+    // bulk string owned by others, which is written without copy
+    bufref_t    *ref;
+
+    int             elements;
+    resp_reply_t    **element;
+
+    // If it's set, the connection switches to the version from this reply on,
+    // which is used by HELLO.
+    int         proto;
+};
+
+/**
+ * @brief Compare argument with a string case-insensitively, used to dispatch
+ *      command names.
+ */
+int resp_arg_equal(const resp_arg_t *arg, const char *s);
+
+resp_reply_t* resp_reply_status(const char *status);
+resp_reply_t* resp_reply_error(const char *err);
+resp_reply_t* resp_reply_integer(long long v);
+resp_reply_t* resp_reply_double(double v);
+resp_reply_t* resp_reply_bool(int v);
+resp_reply_t* resp_reply_bulk(const char *s, int len);
+resp_reply_t* resp_reply_bulk_ref(bufref_t *ref);
+resp_reply_t* resp_reply_null();
+
+/**
+ * @brief Create an array reply(or a map reply with 'elements' key-value pairs),
+ *      whose elements are set by resp_reply_set_element.
+ */
+resp_reply_t* resp_reply_array(int type, int elements);
+
+/**
+ * @brief The array takes the ownership of 'e'.
+ */
+void resp_reply_set_element(resp_reply_t *array, int idx, resp_reply_t *e);
+
+void resp_reply_destroy(resp_reply_t *reply);
+
+protocol_t* resp_protocol_create();
+
+#endif /* ifndef OCTOPUS_RESP_H */
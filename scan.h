@@ -0,0 +1,84 @@
+/**
+ *
+ * @file    scan
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-06 16:02:47
+ */
+
+#ifndef OCTOPUS_SCAN_H
+#define OCTOPUS_SCAN_H
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/**
+ * Byte scanning used by protocol parsers, 16 bytes are compared at a time if SSE2
+ * is available.
+ */
+
+/**
+ * Index of the first 'c' in p[0, len), or -1 if not found.
+ */
+static inline int scan_char(const char *p, int len, char c) {
+    int     i;
+
+    i = 0;
+#ifdef __SSE2__
+    __m128i     target, chunk;
+    int         mask;
+
+    target = _mm_set1_epi8(c);
+    for (; i + 16 <= len; i += 16) {
+        chunk = _mm_loadu_si128((const __m128i *)(p + i));
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, target));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (p[i] == c) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Index of the first byte in p[0, len) which isn't a visible ascii char(0x21 ~ 0x7E),
+ * or -1 if not found. It's used to find the end of a token.
+ */
+static inline int scan_nonvisible(const char *p, int len) {
+    int     i;
+    unsigned char   c;
+
+    i = 0;
+#ifdef __SSE2__
+    __m128i     chunk, low, del;
+    int         mask;
+
+    // bytes >= 0x80 are negative, so they are less than 0x21 as signed chars
+    low = _mm_set1_epi8(0x21);
+    del = _mm_set1_epi8(0x7F);
+    for (; i + 16 <= len; i += 16) {
+        chunk = _mm_loadu_si128((const __m128i *)(p + i));
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(chunk, low),
+                    _mm_cmpeq_epi8(chunk, del)));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        c = (unsigned char)p[i];
+        if (c < 0x21 || c >= 0x7F) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+#endif /* ifndef OCTOPUS_SCAN_H */
@@ -0,0 +1,192 @@
+/**
+ *
+ * @file    timewheel
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-20 10:31:05
+ */
+
+#include <stdlib.h>
+
+#include "timewheel.h"
+#include "logging.h"
+#include "common.h"
+
+#define slot_of(tick)   ((tick) & (TIMEWHEEL_SLOTS - 1))
+
+struct timewheel_s {
+    long long           tick_ms;
+    // the last tick which has been advanced over
+    long long           tick;
+
+    timewheel_node_t    *slots[TIMEWHEEL_SLOTS];
+};
+
+static inline void node_link(timewheel_node_t **head, timewheel_node_t *node) {
+    node->next = *head;
+    if (node->next != NULL) {
+        node->next->pprev = &node->next;
+    }
+    *head = node;
+    node->pprev = head;
+}
+
+timewheel_t* timewheel_create(long long tick_ms, long long now_ms) {
+    timewheel_t     *tw;
+
+    if (tick_ms <= 0) {
+        OCTOPUS_ERROR_LOG("invalid tick of time wheel: %lld", tick_ms);
+        return NULL;
+    }
+
+    if ((tw = calloc(1, sizeof(timewheel_t))) == NULL) {
+        OCTOPUS_ERROR_LOG("failed to alloc mem for time wheel");
+        return NULL;
+    }
+    tw->tick_ms = tick_ms;
+    tw->tick = now_ms / tick_ms;
+
+    return tw;
+}
+
+void timewheel_destroy(timewheel_t *tw) {
+    timewheel_node_t    *node;
+
+    if (tw == NULL) {
+        return;
+    }
+
+    // nodes are owned by others, they are just unlinked
+    for (int i = 0; i < TIMEWHEEL_SLOTS; i++) {
+        while ((node = tw->slots[i]) != NULL) {
+            timewheel_cancel(node);
+        }
+    }
+    free(tw);
+}
+
+void timewheel_schedule(timewheel_t *tw, timewheel_node_t *node, long long expire_ms) {
+    long long   tick;
+
+    timewheel_cancel(node);
+
+    tick = expire_ms / tw->tick_ms;
+    if (tick <= tw->tick) {
+        tick = tw->tick + 1;
+    }
+
+    node->expire_ms = expire_ms;
+    node_link(&tw->slots[slot_of(tick)], node);
+}
+
+void timewheel_cancel(timewheel_node_t *node) {
+    if (node->pprev == NULL) {
+        return;
+    }
+
+    *node->pprev = node->next;
+    if (node->next != NULL) {
+        node->next->pprev = node->pprev;
+    }
+    node->next = NULL;
+    node->pprev = NULL;
+}
+
+void timewheel_advance(timewheel_t *tw, long long now_ms, timewheel_expire_t expire,
+        void *arg) {
+
+    timewheel_node_t    *pending, *node;
+    long long           now_tick, steps;
+
+    now_tick = now_ms / tw->tick_ms;
+    // every slot is visited once at most, however long the loop has stalled
+    steps = now_tick - tw->tick;
+    if (steps > TIMEWHEEL_SLOTS) {
+        steps = TIMEWHEEL_SLOTS;
+    }
+
+    for (; steps > 0; steps--) {
+        tw->tick++;
+
+        // The slot is detached first, so nodes scheduled into it again by the
+        // callbacks are not visited twice. Nodes detached can still be
+        // cancelled, since they are linked from 'pending'.
+        pending = tw->slots[slot_of(tw->tick)];
+        tw->slots[slot_of(tw->tick)] = NULL;
+        if (pending != NULL) {
+            pending->pprev = &pending;
+        }
+
+        while ((node = pending) != NULL) {
+            timewheel_cancel(node);
+
+            if (node->expire_ms > now_ms) {
+                // due in a later revolution
+                timewheel_schedule(tw, node, node->expire_ms);
+                continue;
+            }
+
+            expire(node, arg);
+        }
+    }
+    tw->tick = now_tick;
+}
+
+#ifdef OCTOPUS_TEST_TIMEWHEEL
+
+#include <stdio.h>
+
+typedef struct {
+    timewheel_node_t    node;
+    int                 id;
+    long long           fired_ms;
+} tmp_timer_t;
+
+static long long current_ms;
+
+static void tmp_expire(timewheel_node_t *node, void *arg) {
+    tmp_timer_t     *t;
+
+    OCTOPUS_NOT_USED(arg);
+
+    t = (tmp_timer_t *)node;
+    t->fired_ms = current_ms;
+    printf("timer %d expires at %lld, fired at %lld\n", t->id, node->expire_ms, current_ms);
+}
+
+int main(int argc, char *argv[]) {
+    timewheel_t     *tw;
+    tmp_timer_t     timers[5];
+    long long       delays[5] = {0, 50, 350, 200000, 1000};
+
+    OCTOPUS_NOT_USED(argc);
+    OCTOPUS_NOT_USED(argv);
+
+    current_ms = 1000;
+    tw = timewheel_create(100, current_ms);
+
+    for (int i = 0; i < 5; i++) {
+        timers[i].node.pprev = NULL;
+        timers[i].id = i;
+        timers[i].fired_ms = -1;
+        timewheel_schedule(tw, &timers[i].node, current_ms + delays[i]);
+    }
+
+    // moved earlier, and cancelled
+    timewheel_schedule(tw, &timers[4].node, current_ms + 150);
+    timewheel_cancel(&timers[2].node);
+
+    for (; current_ms <= 1000 + 200000; current_ms += 100) {
+        timewheel_advance(tw, current_ms, tmp_expire, NULL);
+    }
+
+    for (int i = 0; i < 5; i++) {
+        printf("timer %d, scheduled: %d, fired at: %lld\n", i,
+                timewheel_scheduled(&timers[i].node), timers[i].fired_ms);
+    }
+
+    timewheel_destroy(tw);
+
+    return 0;
+}
+
+#endif
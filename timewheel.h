@@ -0,0 +1,59 @@
+/**
+ *
+ * @file    timewheel
+ * @author  chosen0ne(louzhenlin86@126.com)
+ * @date    2019-06-20 10:12:36
+ */
+
+#ifndef OCTOPUS_TIMEWHEEL_H
+#define OCTOPUS_TIMEWHEEL_H
+
+#include "common.h"
+
+// slots of a wheel, a power of 2
+#define TIMEWHEEL_SLOTS     1024
+
+/**
+ * Hashed timing wheel. Nodes are embedded in their owners and linked into the
+ * slot of their tick, so scheduling and cancelling are O(1). A node due beyond
+ * one revolution stays in its slot, and is checked again when the slot comes
+ * round.
+ */
+
+typedef struct timewheel_node_s {
+    long long   expire_ms;
+
+    struct timewheel_node_s     *next;
+    // NULL if the node isn't scheduled
+    struct timewheel_node_s     **pprev;
+} timewheel_node_t;
+
+typedef struct timewheel_s timewheel_t;
+
+/**
+ * @brief Called for each expired node, which has been unlinked. It can schedule
+ *      or cancel any node of the wheel.
+ */
+typedef void (*timewheel_expire_t)(timewheel_node_t *node, void *arg);
+
+#define timewheel_scheduled(node)   ((node)->pprev != NULL)
+
+timewheel_t* timewheel_create(long long tick_ms, long long now_ms);
+void timewheel_destroy(timewheel_t *tw);
+
+/**
+ * @brief Schedule the node to expire at 'expire_ms', it's moved if it has been
+ *      scheduled. Nodes in the past expire at the next tick.
+ */
+void timewheel_schedule(timewheel_t *tw, timewheel_node_t *node, long long expire_ms);
+
+void timewheel_cancel(timewheel_node_t *node);
+
+/**
+ * @brief Advance the wheel to 'now_ms', and call 'expire' for each node whose
+ *      time has come.
+ */
+void timewheel_advance(timewheel_t *tw, long long now_ms, timewheel_expire_t expire,
+        void *arg);
+
+#endif /* ifndef OCTOPUS_TIMEWHEEL_H */
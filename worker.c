@@ -15,6 +15,7 @@
 void* worker_run(void *arg) {
     job_t       *job;
     worker_t    *w;
+    deallocator_t   dealloc;
 
     w = (worker_t *)arg;
     while (w->stopped == OCTOPUS_FALSE) {
@@ -27,17 +28,24 @@ void* worker_run(void *arg) {
 
         job = w->job_queue.next;
         w->job_queue.next = job->next;
+        if (w->job_tail == job) {
+            w->job_tail = &w->job_queue;
+        }
         w->job_count--;
 
         pthread_mutex_unlock(&w->mu);
 
+        // The job may be reused by its owner once it has run, so 'dealloc' is
+        // read first.
+        dealloc = job->dealloc;
+
         // Run the job
         if (job->runnable(job->ctx) == OCTOPUS_ERR) {
             OCTOPUS_ERROR_LOG("failed to run a job");
         }
 
-        if (job->dealloc != NULL) {
-            job->dealloc(job);
+        if (dealloc != NULL) {
+            dealloc(job);
         }
     }
 
@@ -53,27 +61,30 @@ worker_t* worker_create() {
 
     bzero(w, sizeof(worker_t));
     w->stopped = OCTOPUS_FALSE;
+    w->job_tail = &w->job_queue;
 
-    if (pthread_create(&w->thread, NULL, worker_run, w) != 0) {
-        OCTOPUS_ERROR_LOG_BY_ERRNO("failed to create thread");
-        goto failed;
-    }
-
+    // The queue must be ready before the thread starts to run.
     if (pthread_mutex_init(&w->mu, NULL) != 0) {
         OCTOPUS_ERROR_LOG_BY_ERRNO("failed to init mutex");
-        goto failed;
+        free(w);
+        return NULL;
     }
 
     if (pthread_cond_init(&w->wait, NULL) != 0) {
         OCTOPUS_ERROR_LOG_BY_ERRNO("failed to init condition");
+        pthread_mutex_destroy(&w->mu);
+        free(w);
+        return NULL;
+    }
+
+    if (pthread_create(&w->thread, NULL, worker_run, w) != 0) {
+        OCTOPUS_ERROR_LOG_BY_ERRNO("failed to create thread");
         goto failed;
     }
 
     return w;
 
 failed:
-    // Ignore the error here.
-    pthread_cancel(w->thread);
     pthread_mutex_destroy(&w->mu);
     pthread_cond_destroy(&w->wait);
     free(w);
@@ -84,9 +95,10 @@ failed:
 void worker_add_job(worker_t *w, job_t *job) {
     pthread_mutex_lock(&w->mu);
 
-    // TODO: add the tail of the queue
-    job->next = w->job_queue.next;
-    w->job_queue.next = job;
+    job->next = NULL;
+    w->job_tail->next = job;
+    w->job_tail = job;
+    w->job_count++;
 
     pthread_mutex_unlock(&w->mu);
     pthread_cond_signal(&w->wait);
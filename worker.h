@@ -25,6 +25,8 @@ typedef struct _job_t {
 
 typedef struct {
     job_t           job_queue;
+    // last job of the queue, jobs are run in FIFO order
+    job_t           *job_tail;
     volatile int    stopped;
     volatile int    job_count;
 